@@ -320,17 +320,16 @@ printf("error body = %s, prompt = %s, error = %s\n", node->request.body.c_str(),
         fastllm::GenerationConfig config;
         config.output_token_limit = node->config["max_tokens"].is_null() ? 200 : node->config["max_tokens"].int_value();
         int handleId = model->LaunchResponseTokens(tokens, config);
-        std::vector<float> results;
+        fastllm::StreamDecoder decoder(&model->weight.tokenizer);
         while (true) {
             int result = model->FetchResponseTokens(handleId);
             if (result == -1) {
                 break;
             } else {
-                results.clear();
-                results.push_back(result);
-                output += model->weight.tokenizer.Decode(fastllm::Data (fastllm::DataType::FLOAT32, {(int)results.size()}, results));
+                output += decoder.Push(result);
             }
         }
+        output += decoder.Flush();
 
         message += output;
         int ret = write(node->client, message.c_str(), message.length()); //返回message
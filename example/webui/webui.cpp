@@ -57,10 +57,9 @@ void ParseArgs(int argc, char **argv, WebConfig &config) {
 }
 
 struct ChatSession {
-    std::string history = "";
+    int sessionId = -1; // 模型中的会话, 多轮对话之间保留kv cache
     std::string input = "";
     std::string output = "";
-    int round = 0;
     int status = 0; // 0: 空闲 1: 结果生成好了 2: 已经写回了
 };
 
@@ -78,35 +77,29 @@ int main(int argc, char** argv) {
     httplib::Server svr;
     auto chat = [&](ChatSession *session, const std::string input) {
         if (input == "reset" || input == "stop") {
-            session->history = "";
-            session->round = 0;
+            if (session->sessionId != -1) {
+                model->CloseSession(session->sessionId);
+                session->sessionId = -1;
+            }
             session->output = "<eop>\n";
             session->status = 2;
         } else {
-            auto prompt = model->MakeInput(session->history, session->round, input);
-            auto inputs = model->weight.tokenizer.Encode(prompt);
-
-            std::vector<int> tokens;
-            for (int i = 0; i < inputs.Count(0); i++) {
-                tokens.push_back(((float *) inputs.cpuData)[i]);
+            if (session->sessionId == -1) {
+                session->sessionId = model->CreateSession();
             }
-
-            int handleId = model->LaunchResponseTokens(tokens);
-            std::vector<float> results;
+            // 只有新的一轮输入需要prefill
+            model->AppendSessionInput(session->sessionId, input);
+            int handleId = model->LaunchSessionResponse(session->sessionId);
+            fastllm::StreamDecoder decoder(&model->weight.tokenizer);
             while (true) {
                 int result = model->FetchResponseTokens(handleId);
                 if (result == -1) {
                     break;
                 } else {
-                    results.clear();
-                    results.push_back(result);
-                    session->output += model->weight.tokenizer.Decode(fastllm::Data (fastllm::DataType::FLOAT32, {(int)results.size()}, results));
-                }
-                if (session->status == 2) {
-                    break;
+                    session->output += decoder.Push(result);
                 }
             }
-            session->history = model->MakeHistory(session->history, session->round++, input, session->output);
+            session->output += decoder.Flush();
             session->output += "<eop>\n";
             session->status = 2;
         }
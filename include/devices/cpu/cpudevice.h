@@ -6,6 +6,7 @@
 #define FASTLLM_CPUDEVICE_H
 
 #include "device.h"
+#include "devices/cpu/cpumemory.h"
 #include "cputhreadpool.h"
 
 namespace fastllm {
@@ -49,6 +50,11 @@ namespace fastllm {
         void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     };
 
+    class CpuAddToRMSNormOp : BaseOperator {
+        void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+        void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+    };
+
     class CpuLinearOp : BaseOperator {
         void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
         void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
@@ -197,6 +203,10 @@ namespace fastllm {
         void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
         void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     };
+
+    // Linear的后处理 (激活, 乘silu(gate)), 结果在CPU内存中的其他设备 (如TFACC) 做完矩阵乘法后也用它
+    // input为Linear的结果[n, k], Swiglu时output为[n, k / 2], 否则output可以和input相同
+    void LinearEpilogue(float *input, float *gate, float *output, int n, int k, int activation);
 }
 
 #endif //FASTLLM_CPUDEVICE_H
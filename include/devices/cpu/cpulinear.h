@@ -0,0 +1,53 @@
+#ifndef FASTLLM_CPULINEAR_H
+#define FASTLLM_CPULINEAR_H
+
+#include "fastllm.h"
+
+namespace fastllm {
+    int GetLinearGrain(int k, int threadNum); // 按输出通道切分Linear时每块的大小, 所有Linear的实现都要用同样的切分
+
+    // 多行输入 (prefill或batch解码) 的Linear: 分块计算, 每次用一小块权重 (NR个输出通道) 和MR行输入做寄存器分块的乘法,
+    // 同一块权重在L1中被所有输入行复用, 输入按行块放在L2中被所有权重块复用
+    // 输入在计算前被重新打包成int16 (量化权重) 的格式, 按输出通道切分给各个线程
+    // 权重可以保持原有的逐行格式, 也可以在加载时预排成panel格式: 每gemmNR个输出通道一组, 沿输入维度每段
+    // (浮点8个, 量化32个元素) 交错存放, 微内核每次读一块连续的内存; 重排只在panel内进行, 按输出通道的切分不受影响
+    bool CanRunLinearGemm(const Data &weight, int n); // 当前平台和权重类型是否支持分块计算
+
+    bool CanPackLinearWeight(const Data &weight); // 当前平台是否支持把这个权重预排成panel格式
+
+    void PackLinearWeight(Data &weight); // 预排成panel格式, 之后这个权重只能用于CPU上的float32 Linear
+
+    void UnpackLinearWeight(Data &weight); // 还原成逐行存放 (上传到其他设备, 保存模型等需要原始格式时调用)
+
+    enum LinearInputFormat {
+        LinearInputInt8 = 0, // Int8权重的逐行计算使用的uint8输入
+        LinearInputInt4 = 1, // Int4权重的逐行计算使用的uint8输入
+        LinearInputInt16 = 2 // 分块计算使用的int16输入
+    };
+
+    // Linear输入的量化缓存: 同一个输入被连续多个Linear使用时 (例如q/k/v, gate/up) 只量化一次
+    // 通过输入Data的地址, 数据指针, 形状和版本号判断缓存是否有效
+    struct LinearInputCache {
+        const Data *input = nullptr;
+        uint8_t *cpuData = nullptr;
+        uint64_t version = 0;
+        std::vector <int> dims;
+        int format = -1, groupCnt = -1;
+
+        std::vector <uint8_t> uinput;
+        std::vector <int16_t> qinput;
+        std::vector <LowBitConfig> configs; // 每行输入的量化参数
+        std::vector <int> inputSums; // 每行 (或每组) 量化后输入的和
+
+        bool Find(const Data &input, int format, int groupCnt = -1);
+
+        void Set(const Data &input, int format, int groupCnt = -1);
+    };
+
+    LinearInputCache &GetLinearInputCache(); // 每个线程一份
+
+    void LinearGemmMultiThread(const Data &input, Data &weight, float *biasData, float *outputData,
+                               int n, int m, int k, int threadNum);
+}
+
+#endif //FASTLLM_CPULINEAR_H
@@ -0,0 +1,35 @@
+#ifndef FASTLLM_CPUMEMORY_H
+#define FASTLLM_CPUMEMORY_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace fastllm {
+    // CPU上的缓存分配器: 64字节对齐, 按size class缓存释放的内存块
+    // 小块优先放在线程本地缓存中, 大块放在全局缓存中, 稳定解码阶段不再向系统申请内存
+    void *FastllmCpuMalloc(size_t size);
+
+    void FastllmCpuFree(void *ret); // ret必须来自FastllmCpuMalloc或FastllmCpuMallocPages
+
+    // 直接向系统申请全新的页 (不经过缓存, 也不写入数据), 页面在第一次写入时才分配到写入线程所在的NUMA节点
+    void *FastllmCpuMallocPages(size_t size);
+
+    void FastllmCpuClearBuffer(); // 把全局缓存中的内存块还给系统
+
+    void SetCpuMemoryPool(bool enable); // 是否启用缓存 (关闭后每次都直接向系统申请/释放)
+
+    bool GetCpuMemoryPool();
+
+    struct CpuMemoryStats {
+        uint64_t mallocCalls = 0, freeCalls = 0; // FastllmCpuMalloc / FastllmCpuFree的调用次数
+        uint64_t systemMallocs = 0, systemFrees = 0; // 实际向系统申请 / 释放的次数
+        uint64_t inUseBytes = 0, peakInUseBytes = 0; // 正在使用的字节数 (按size class计)
+        uint64_t cachedBytes = 0; // 缓存中空闲的字节数
+    };
+
+    CpuMemoryStats GetCpuMemoryStats();
+
+    void PrintCpuMemoryStats();
+}
+
+#endif //FASTLLM_CPUMEMORY_H
@@ -7,11 +7,26 @@
 
 #include <mutex>
 #include <queue>
+#include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <future>
 #include <thread>
 #include <utility>
 #include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(_WIN32) or defined(_WIN64)
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace fastllm {
     template <typename T>
@@ -50,57 +65,301 @@ namespace fastllm {
         }
     };
 
+    static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // 线程池: 调用线程也参与计算, 所以t个线程的池只会创建t - 1个worker
+    // ParallelFor是主要的接口: 任务按块静态分给各线程, 每个线程的块区间是一个无锁的双端队列,
+    // 线程从自己区间的头部取块, 做完后从其他线程区间的尾部窃取; worker空闲时先自旋一小段时间再休眠
+    // NUMA模式下创建t个worker, 按顺序平均分到各个节点上并绑定到该节点的核, 调用线程只负责分发,
+    // 窃取也只在同一个节点的线程之间进行, 这样第i个线程处理的数据始终在它所在的节点上
     class ThreadPool {
     private:
-        class ThreadWorker
-        {
-        private:
-            int id;
-            ThreadPool *pool;
-        public:
-            ThreadWorker(ThreadPool *pool, const int id) : pool(pool), id(id) {}
-
-            void operator()() {
-                std::function<void()> func;
-                bool dequeued;
+        // 每个线程的块区间[begin, end), 打包成一个64位整数以便CAS
+        struct alignas(64) BlockRange {
+            std::atomic <uint64_t> range;
+        };
 
-                while (!pool->shutdown) {
-                    {
-                        std::unique_lock<std::mutex> lock(pool->locker);
-                        if (pool->queue.Empty()) {
-                            pool->cv.wait(lock);
-                        }
+        static const int maxThreads = 256;
+        static const int spinCount = 1 << 12;
+
+        int threadCnt;
+        bool pinned;
+        bool callerJoins = true; // 调用线程是否参与计算 (NUMA模式下不参与)
+        std::vector <int> workerNode; // 每个worker所在的NUMA节点
+        std::vector <std::thread> workers;
+        BlockRange ranges[maxThreads];
+
+        // 当前任务: (epoch << 16) | 参与线程数, 一次原子读就能得到一致的版本和线程数
+        std::atomic <uint64_t> jobWord;
+        std::atomic <int> remainingWorkers;
+        void (*jobCall)(void *ctx, int st, int end) = nullptr;
+        void *jobCtx = nullptr;
+        int jobN = 0, jobGrain = 1;
+
+        std::atomic <bool> shutdown;
+        std::atomic <int> sleeping;
+        std::mutex locker;
+        std::condition_variable cv;
+        std::mutex dispatchLocker;
+        TaskQueue <std::function<void()> > queue; // Submit提交的普通任务
+        std::atomic <int> pendingTasks;
+
+        static bool &IsWorker() {
+            static thread_local bool isWorker = false;
+            return isWorker;
+        }
+
+        static bool &IsDispatching() { // 当前线程是否正在分发ParallelFor (持有dispatchLocker)
+            static thread_local bool isDispatching = false;
+            return isDispatching;
+        }
+
+        static int TakeFront(std::atomic <uint64_t> &range) {
+            uint64_t r = range.load(std::memory_order_acquire);
+            while (true) {
+                uint32_t st = (uint32_t)(r >> 32), end = (uint32_t)r;
+                if (st >= end) {
+                    return -1;
+                }
+                if (range.compare_exchange_weak(r, ((uint64_t)(st + 1) << 32) | end, std::memory_order_acq_rel)) {
+                    return (int)st;
+                }
+            }
+        }
+
+        static int StealBack(std::atomic <uint64_t> &range) {
+            uint64_t r = range.load(std::memory_order_acquire);
+            while (true) {
+                uint32_t st = (uint32_t)(r >> 32), end = (uint32_t)r;
+                if (st >= end) {
+                    return -1;
+                }
+                if (range.compare_exchange_weak(r, ((uint64_t)st << 32) | (end - 1), std::memory_order_acq_rel)) {
+                    return (int)(end - 1);
+                }
+            }
+        }
+
+        void RunBlock(int block) {
+            int st = block * jobGrain;
+            jobCall(jobCtx, st, std::min(jobN, st + jobGrain));
+        }
 
-                        dequeued = pool->queue.Pop(func);
+        void RunParticipant(int id, int participants) {
+            int block;
+            while ((block = TakeFront(ranges[id].range)) >= 0) {
+                RunBlock(block);
+            }
+            for (int i = 1; i < participants; i++) {
+                int victimId = (id + i) % participants;
+                if (!callerJoins && workerNode[victimId] != workerNode[id]) {
+                    continue;
+                }
+                auto &victim = ranges[victimId].range;
+                while ((block = StealBack(victim)) >= 0) {
+                    RunBlock(block);
+                }
+            }
+        }
+
+        bool HasWork(uint64_t seen) {
+            return jobWord.load() != seen || shutdown.load() || pendingTasks.load() > 0;
+        }
+
+        void WorkerLoop(int id, std::vector <int> cpus) {
+            IsWorker() = true;
+            if (cpus.size() > 0) {
+                PinCurrentThread(cpus);
+            }
+            int participantId = (callerJoins ? id + 1 : id);
+            uint64_t seen = 0; // 和构造时jobWord的初值一致, worker启动前发布的任务也不会漏掉
+            while (true) {
+                // 先自旋, 等不到任务再休眠
+                bool ready = false;
+                for (int i = 0; i < spinCount && !ready; i++) {
+                    ready = (jobWord.load(std::memory_order_acquire) != seen || shutdown.load(std::memory_order_relaxed) ||
+                             pendingTasks.load(std::memory_order_relaxed) > 0);
+                    if (!ready) {
+                        if (i < 64) {
+                            CpuRelax();
+                        } else {
+                            std::this_thread::yield();
+                        }
                     }
-                    if (dequeued) {
-                        func();
+                }
+                if (!ready) {
+                    std::unique_lock <std::mutex> lock(locker);
+                    sleeping++;
+                    cv.wait(lock, [this, seen]() { return HasWork(seen); });
+                    sleeping--;
+                }
+                if (shutdown) {
+                    break;
+                }
+                uint64_t word = jobWord.load(std::memory_order_acquire);
+                if (word != seen) {
+                    seen = word;
+                    int participants = (int)(word & 0xFFFF);
+                    if (participantId < participants) {
+                        RunParticipant(participantId, participants);
+                        remainingWorkers.fetch_sub(1, std::memory_order_release);
                     }
                 }
+                std::function<void()> func;
+                while (queue.Pop(func)) {
+                    pendingTasks--;
+                    func();
+                }
             }
-        };
+        }
 
-        bool shutdown = false;
-        TaskQueue<std::function<void()>> queue;
-        std::vector<std::thread> threads;
-        std::mutex locker;
-        std::condition_variable cv;
+        void Notify() {
+            if (sleeping.load() > 0) {
+                std::lock_guard <std::mutex> lock(locker);
+                cv.notify_all();
+            }
+        }
+
+        template <typename F>
+        static void CallRange(void *ctx, int st, int end) {
+            (*(F*)ctx)(st, end);
+        }
     public:
-        ThreadPool(const int t = 4) : threads(std::vector<std::thread>(t)) {
-            for (int i = 0; i < threads.size(); ++i) {
-                threads[i] = std::thread(ThreadWorker(this, i));
+        // numaCpus[i]是第i个NUMA节点上的核, 有多个节点时启用NUMA模式
+        ThreadPool(const int t = 4, bool pin = false, const std::vector <std::vector <int> > &numaCpus = {}) {
+            this->threadCnt = std::max(1, std::min(t, maxThreads));
+            this->pinned = pin;
+            this->callerJoins = (numaCpus.size() <= 1);
+            jobWord = 0;
+            remainingWorkers = 0;
+            shutdown = false;
+            sleeping = 0;
+            pendingTasks = 0;
+            int workerCnt = callerJoins ? threadCnt - 1 : threadCnt;
+            int hw = std::max(1, (int)std::thread::hardware_concurrency());
+            std::vector <int> nodeUsed(numaCpus.size(), 0);
+            workerNode.reserve(workerCnt);
+            for (int i = 0; i < workerCnt; i++) {
+                std::vector <int> cpus;
+                int node = 0;
+                if (!callerJoins) {
+                    // 绑定到节点上的所有核, pin时再具体到其中一个核
+                    node = (int)((long long)i * numaCpus.size() / workerCnt);
+                    cpus = numaCpus[node];
+                    if (pin && cpus.size() > 0) {
+                        cpus = {numaCpus[node][nodeUsed[node]++ % numaCpus[node].size()]};
+                    }
+                } else if (pin) {
+                    cpus = {(i + 1) % hw};
+                }
+                workerNode.push_back(node);
+                workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i, cpus));
             }
         }
+
+        ~ThreadPool() {
+            Shutdown();
+        }
+
         void Shutdown() {
-            shutdown = true;
-            cv.notify_all();
-            for (int i = 0; i < threads.size(); ++i) {
-                if (threads[i].joinable()) {
-                    threads[i].join();
+            {
+                std::lock_guard <std::mutex> lock(locker);
+                shutdown = true;
+                cv.notify_all();
+            }
+            for (int i = 0; i < (int)workers.size(); ++i) {
+                if (workers[i].joinable()) {
+                    workers[i].join();
+                }
+            }
+        }
+
+        int GetThreadCnt() {
+            return threadCnt;
+        }
+
+        // 把当前线程绑到cpus中的核上 (目前只支持Linux和Windows)
+        static void PinCurrentThread(const std::vector <int> &cpus) {
+#if defined(_WIN32) or defined(_WIN64)
+            DWORD_PTR mask = 0;
+            for (int core : cpus) {
+                mask |= (DWORD_PTR)1 << (core % (sizeof(DWORD_PTR) * 8));
+            }
+            SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__) && !defined(__ANDROID__)
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            for (int core : cpus) {
+                CPU_SET(core, &cpuset);
+            }
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+#endif
+        }
+
+        int GetNumaNodes() {
+            return callerJoins ? 1 : workerNode.back() + 1;
+        }
+
+        // 并行执行func(st, end): [0, n)按grain切块 (grain <= 0时每个线程一块), 块按顺序平分给threadNum个线程
+        // (threadNum <= 0时用全部线程, 调用线程是其中之一); 返回时所有块都已经执行完
+        // 嵌套调用 (在worker或者正在分发的线程中调用) 时直接在当前线程串行执行
+        // 其他线程正在使用线程池时排队等它的ParallelFor结束, 同一时刻只有一个ParallelFor在分发
+        // worker正在执行Submit的长任务时, 它的块会被其他线程窃取, 但调用线程要自旋等到它结束任务后确认完成
+        // 所以不要在Submit的任务中做长时间的计算
+        template <typename F>
+        void ParallelFor(int n, const F &func, int grain = 0, int threadNum = 0) {
+            if (n <= 0) {
+                return;
+            }
+            int participants = (threadNum <= 0 ? threadCnt : std::min(threadNum, threadCnt));
+            participants = std::min(participants, n);
+            if (grain <= 0) {
+                grain = (n - 1) / participants + 1;
+            }
+            int blocks = (n - 1) / grain + 1;
+            participants = std::min(participants, blocks);
+            if ((participants <= 1 && callerJoins) || IsWorker() || IsDispatching()) {
+                func(0, n);
+                return;
+            }
+            dispatchLocker.lock();
+            IsDispatching() = true;
+
+            jobCall = CallRange <F>;
+            jobCtx = (void*)&func;
+            jobN = n;
+            jobGrain = grain;
+            for (int i = 0; i < participants; i++) {
+                uint64_t st = (uint64_t)blocks * i / participants, end = (uint64_t)blocks * (i + 1) / participants;
+                ranges[i].range.store((st << 32) | end, std::memory_order_relaxed);
+            }
+            remainingWorkers.store(callerJoins ? participants - 1 : participants, std::memory_order_relaxed);
+            uint64_t epoch = (jobWord.load() >> 16) + 1;
+            jobWord.store((epoch << 16) | (uint64_t)participants);
+            Notify();
+
+            if (callerJoins) {
+                RunParticipant(0, participants);
+            }
+            for (int i = 0; remainingWorkers.load(std::memory_order_acquire) > 0; i++) {
+                if (i < 64) {
+                    CpuRelax();
+                } else {
+                    std::this_thread::yield();
                 }
             }
+            IsDispatching() = false;
+            dispatchLocker.unlock();
         }
 
+        // 提交一个独立的任务, 通过future等待结果
+        // 任务由空闲的worker在两次ParallelFor之间执行, 执行期间这个worker不参与ParallelFor (见ParallelFor的说明)
         template<typename F, typename... Args>
         auto Submit(F &&f, Args &&...args) -> std::future<decltype(f(args...))> {
             std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
@@ -108,8 +367,13 @@ namespace fastllm {
             std::function<void()> warpper_func = [task_ptr]() {
                 (*task_ptr)();
             };
-            queue.Push(warpper_func);
-            cv.notify_one();
+            if (workers.empty()) {
+                warpper_func();
+            } else {
+                queue.Push(warpper_func);
+                pendingTasks++;
+                Notify();
+            }
             return task_ptr->get_future();
         }
     };
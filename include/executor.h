@@ -26,6 +26,8 @@ namespace fastllm {
 
         std::vector <int> GetDeviceIds(const std::string &device); // 获取指定device的deviceIds
 
+        std::string GetFirstDeviceType(); // 当前优先的device类型
+
         // 运行一个op
         void Run(const std::string &opType, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
                  const fastllm::IntDict &intParams);
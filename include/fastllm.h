@@ -18,6 +18,8 @@
 #include <functional>
 #include <memory>
 #include "devices/cpu/cputhreadpool.h"
+#include "kvcache.h"
+#include "devices/cpu/cpumemory.h"
 
 #ifdef USE_TFACC40T
 #include "Data.h"  
@@ -32,11 +34,25 @@ namespace fastllm {
     std::map <std::string, int> GetDeviceMap();
     void PrintInstructionInfo();
     void SetThreads(int t);
+    void SetThreadAffinity(bool pin); // 是否把线程池中的worker绑定到固定的核上
+    bool GetThreadAffinity();
+    void SetNumaNodes(int nodes); // 按NUMA节点划分线程池, Linear权重按输出通道切分到各节点上 (<= 1代表不使用; 定义USE_MMAP时只划分线程, 权重不重排)
+    int GetNumaNodes();
     void SetLowMemMode(bool m);
     void SetKVCacheInCPU(bool kvCacheInCPU);
     bool GetLowMemMode();
     int GetThreads();
     bool GetKVCacheInCPU();
+    void SetPagedKVCache(bool paged); // 是否使用分页KV cache (仅CPU)
+    bool GetPagedKVCache();
+    void SetKVCacheBlockLen(int len); // 分页KV cache中每个block存放的token数
+    int GetKVCacheBlockLen();
+    void SetMmapWeights(bool m); // 权重直接使用只读共享映射的模型文件 (需要versionId >= 3的对齐格式), 多个进程通过page cache共享同一份权重
+    bool GetMmapWeights();
+    void SetMmapWarmUp(int mode); // 映射权重的预热: 0 首次访问时才载入, 1 加载时并行预取所有页, 2 预取并mlock锁定在内存中
+    int GetMmapWarmUp();
+    void SetLinearWeightPrepack(bool prepack); // 加载时是否把Linear权重预排成CPU分块矩阵乘法的格式 (只在所有层都在CPU上计算时生效)
+    bool GetLinearWeightPrepack();
     ThreadPool *GetPool();
 
     struct GenerationConfig {
@@ -48,12 +64,23 @@ namespace fastllm {
         float temperature = 1.0; // 温度参数，一般在0.1 ~ 1.0之间，设大这个参数可以带来结果的多样性
         bool output_logits = false; // 是否返回logits
 		bool enable_hash_id = false; // 给会话添加hash id
+        int priority = 0; // 调度优先级, 越大越优先; 开启抢占时KV cache不够可以换出优先级不高于它的请求
+        int speculative_tokens = 0; // 投机解码每步最多提出的token数, 0代表不使用 (需要SetDraftModel或者设置prompt_lookup_ngram)
+        int prompt_lookup_ngram = 0; // > 0时不用draft模型, 用最后n个token在prompt和已生成内容中匹配, 把后续token作为投机的token
+        float min_p = 0.0f; // 去掉概率低于min_p * 最大概率的token, 0代表不使用
+        float typical_p = 1.0f; // typical采样: 保留信息量最接近熵的token直到累计概率达到typical_p, 1.0代表不使用
+        float frequency_penalty = 0.0f; // 末尾last_n个token中每出现一次, logit减去frequency_penalty
+        float presence_penalty = 0.0f; // 末尾last_n个token中出现过的token, logit减去presence_penalty
+        int seed = -1; // 采样的随机种子, >= 0时同样的输入得到同样的输出; < 0代表使用全局随机数
         std::multiset <int> stop_token_ids;
 
         bool IsSimpleGreedy() const {
             if (fabs(repeat_penalty - 1) > 1e-8) {
                 return false;
             }
+            if (frequency_penalty != 0.0f || presence_penalty != 0.0f) {
+                return false;
+            }
             if (top_k > 1) {
                 return false;
             }
@@ -63,7 +90,8 @@ namespace fastllm {
 
     struct LastTokensUnit {
         int tot = 0;
-        std::multiset <int> tokenSet;
+        int count = 0; // 一共Push过的token数
+        std::map <int, int> tokenCounts; // 末尾tot个token中每个token出现的次数
         std::queue <int> tokenQueue;
 
         LastTokensUnit () {}
@@ -74,7 +102,8 @@ namespace fastllm {
 
         void Init(int tot) {
             this->tot = tot;
-            tokenSet.clear();
+            this->count = 0;
+            tokenCounts.clear();
             while (tokenQueue.size() > 0) {
                 tokenQueue.pop();
             }
@@ -82,11 +111,15 @@ namespace fastllm {
 
         void Push(int id) {
             if (tokenQueue.size() == tot) {
-                tokenSet.erase(tokenSet.find(tokenQueue.front()));
+                auto it = tokenCounts.find(tokenQueue.front());
+                if (--it->second == 0) {
+                    tokenCounts.erase(it);
+                }
                 tokenQueue.pop();
             }
             tokenQueue.push(id);
-            tokenSet.insert(id);
+            tokenCounts[id]++;
+            count++;
         }
     };
 
@@ -175,9 +208,14 @@ namespace fastllm {
     enum DataType {
         FLOAT32 = 0, BFLOAT16 = 1, INT16 = 2, INT8 = 3, INT4 = 4, INT2 = 5, BIT = 6, FLOAT16 = 7,
         INT4_NOZERO = 8, // 不用zeroPoint的int4, floatValue = min + uint4Value * scale
+        INT4_GROUP = 9, // 分组量化的int4, 每行沿输入维度每groupCnt个元素一组, floatValue = min[组] + uint4Value * scale[组]
+        INT8_GROUP = 10, // 分组量化的int8, floatValue = min[组] + uint8Value * scale[组]
         INT32PARAM = 100 // int32的参数，这种类型的数据永远存在CPU上
     };
 
+    void SetKVCacheType(DataType type); // 分页KV cache的存储类型: FLOAT32, FLOAT16或INT8 (每个token每个head一个scale)
+    DataType GetKVCacheType();
+
     enum DataDevice {
         CPU = 0, CUDA = 1
     };
@@ -191,8 +229,12 @@ namespace fastllm {
         FileMmap(const std::string &path);
         ~FileMmap();
 
+        void PreFault(uint64_t offset, uint64_t bytes); // 读一遍[offset, offset + bytes)中的每一页, 提前载入
+        bool Lock(); // mlock整个映射, 失败时返回false (例如超过RLIMIT_MEMLOCK)
+
         char *data;
         size_t size;
+        bool locked = false;
     };
 
     struct ModelLoader {
@@ -212,6 +254,7 @@ namespace fastllm {
         std::string ReadString();
         int ReadInt();
         float ReadFloat();
+        uint64_t ReadUInt64();
         uint8_t* ReadBytes(uint64_t bytes);
 
         const char *const data;
@@ -250,16 +293,25 @@ namespace fastllm {
         std::vector <float> scales, mins;
         std::vector <int> zeros;
         std::vector <int> weightSum; // 作为权重时，有时候需要存一些和加速计算
+        int group = -1, groupCnt = -1; // 分组量化时每行的组数, 以及每组的元素个数 (perChannelsConfigs, scales, mins按[通道, 组]存放)
 #ifdef USE_TFACC40T
         tfdl::PerChannelConfig tfWeightConfig;
 #endif
 
         std::string fileName;
         long long filePos;
-        std::shared_ptr<FileMmap> m_file;
+        std::shared_ptr<FileMmap> m_file; // 非空时cpuData指向映射的模型文件 (只读), 不能写入或释放
 
         bool directMemory = false; // 直接分配/释放Memory，不经过缓存
 
+        std::shared_ptr <PagedKVCache> pagedKVCache; // 非空时数据按block分页存放, 不使用cpuData
+
+        bool linearPacked = false; // 作为Linear权重时, cpuData已经预排成CPU分块矩阵乘法使用的panel格式 (见cpulinear.h)
+
+        int numaNodes = 0; // 作为Linear权重时, 已经按几个NUMA节点处理过 (0代表没有处理; 不能按行切分的权重只做标记, 不重排)
+
+        uint64_t version = 0; // 数据的版本号, 重新分配或者被op写入后更新, 用于判断依赖这份数据的缓存是否还有效
+
         Data () {};
 
         Data (DataType type);
@@ -286,6 +338,8 @@ namespace fastllm {
 
         void MallocSpace(uint64_t size); // 在设备上分配
 
+        void UpdateVersion(); // 数据内容发生变化, 更新版本号
+
         void FreeSpace(); // 回收设备上的内存
 
         void UpdateUnitSize(); // 更新unitSize
@@ -315,6 +369,8 @@ namespace fastllm {
         void set_file(std::shared_ptr<FileMmap> file) {
             m_file = file;
         }
+
+        void ReleaseCpuData(); // 释放cpuData; 如果数据映射自模型文件 (m_file非空) 则只解除引用
     };
 
     struct Tokenizer {
@@ -369,6 +425,45 @@ namespace fastllm {
 
         TrieNode *root;
 
+        // 扁平trie: 由root构建, 节点和边都存在连续数组里, 编码时不需要在std::map之间跳转
+        struct FlatTrie {
+            std::vector <int> tokenIds; // 每个节点的token, -999999代表不是token
+            std::vector <float> scores;
+            std::vector <int> edgeStart; // 节点i的边为[edgeStart[i], edgeStart[i + 1]), 按字节从小到大排列
+            std::vector <uint8_t> edgeLabels;
+            std::vector <int> edgeNext;
+            int rootNext[256]; // 根节点的边直接查表
+            int byteFallback[256]; // 未识别的字节对应的<0xXX> token, -1代表没有
+
+            int Next(int node, uint8_t c) const {
+                if (node == 0) {
+                    return rootNext[c];
+                }
+                int l = edgeStart[node], r = edgeStart[node + 1];
+                while (r - l > 8) {
+                    int mid = (l + r) / 2;
+                    if (edgeLabels[mid] <= c) {
+                        l = mid;
+                    } else {
+                        r = mid;
+                    }
+                }
+                for (int i = l; i < r; i++) {
+                    if (edgeLabels[i] == c) {
+                        return edgeNext[i];
+                    }
+                }
+                return -1;
+            }
+        };
+
+        FlatTrie flatTrie;
+        bool flatTrieDirty = true; // Insert之后需要重新构建flatTrie
+        bool useFlatTrie = true; // BPE, GPT2, QWEN类型使用flatTrie编码 (结果和逐节点查找的实现一致)
+
+        std::vector <std::string> tokenPieces; // 每个token单独解码得到的字节串, 流式解码时直接查表 (不加锁)
+        bool tokenPiecesDirty = true; // Insert之后需要重新构建tokenPieces
+
         TokenizerType type = TokenizerType::BPE;
 
         std::unordered_map <int, std::string> tokenToStringDict;
@@ -390,11 +485,34 @@ namespace fastllm {
 
         void Insert(const std::string &s, int tokenId, float score = 1.0f); // 插入一个token
 
+        void BuildFlatTrie(); // 由root构建flatTrie
+
+        void BuildTokenPieces(); // 构建tokenPieces, 和flatTrie一起在加载时构建
+
         Data Encode(const std::string &s); // 编码
 
+        void FlatEncode(const std::string &s, std::vector <float> &v); // 用flatTrie编码, 只支持BPE, GPT2, QWEN
+
+        std::vector <std::vector <float> > EncodeBatch(const std::vector <std::string> &s); // 在线程池上并行编码多个输入
+
         std::string Decode(const Data &data); // 解码
 
         std::string DecodeTokens(const std::vector <int> &tokens); // 解码
+
+        std::string DecodePiece(int tokenId); // 单个token解码得到的字节串, 结果和DecodeTokens({tokenId})一致
+    };
+
+    // 流式解码器, 每个输出流一个: 每次输入一个token, 返回新增的完整UTF-8文本
+    // 被<0xXX>等字节token拆开的多字节字符会暂存, 等后续字节到齐再一起输出
+    struct StreamDecoder {
+        Tokenizer *tokenizer;
+        std::string pending; // 还没有组成完整字符的字节
+
+        StreamDecoder (Tokenizer *tokenizer);
+
+        std::string Push(int tokenId); // 输入一个token, 返回可以输出的文本
+
+        std::string Flush(); // 流结束时返回剩余的字节
     };
 
     std::string GetModelTypeFromFile(const std::string &fileName);
@@ -412,9 +530,15 @@ namespace fastllm {
 
         std::set <std::string> embeddingNames;
 
+        std::set <std::string> linearNames; // 模型定义中所有Linear层的权重名, 流式量化按它决定哪些权重要量化
+
         void LoadFromFile(const std::string &fileName); // 从文件读取
 
-        void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型, bit = 0代表直接存
+        void LoadHeaderFromFile(const std::string &fileName); // 只读取文件头 (key-value表, peft配置和词表), 不读权重
+
+        void SaveLowBitModel(const std::string &fileName, int bit, int groupCnt = -1); // 存储成量化模型, bit = 0代表直接存, groupCnt > 0时按每组groupCnt个元素分组量化
+
+        void ConvertLowBitModel(const std::string &input, const std::string &output, int bit, int groupCnt = -1); // 流式量化: 从模型文件input中逐个读出权重, 量化后立即写入output, 只占用几个权重大小的内存; 需要先填好embeddingNames和linearNames
 
         void AddTokenizerWord(const std::string &key, int value, float score); // 增加一个词
 
@@ -427,6 +551,8 @@ namespace fastllm {
 
         void ReleaseWeight(); // 释放所有权重占用的空间
 
+        void PrepackLinearWeights(); // 把linearNames中的权重预排成CPU分块矩阵乘法的格式; Embedding (包括共享的lm_head) 和要上传到其他设备的权重保持原样
+
         void AddQLinearWeight(const std::string &key, const std::vector <int> &dims,
                               int bit, float *scales, uint8_t *oriData); // 插入一个Qlinear层的权重，量化规则为float value = scales * oriData
 
@@ -442,13 +568,41 @@ namespace fastllm {
     int LLMSampling(Data &logits, int outerOffset,
                     const GenerationConfig &config, const LastTokensUnit &tokens); // 对logits里[outerOffset * vocabSize, (outerOffset + 1) * vocabSize]做Sampling
 
+    // 对多个请求同时做Sampling, 第i个请求使用logits的第outerOffsets[i]行, 在线程池上并行
+    std::vector <int> LLMSamplingBatch(Data &logits, const std::vector <int> &outerOffsets,
+                                       const std::vector <GenerationConfig> &configs,
+                                       const std::vector <const LastTokensUnit*> &tokens);
+
+    // 按惩罚, 温度, top_k, typical_p, top_p, min_p计算采样分布, probs为<token, 概率>, 按概率从大到小排列且和为1
+    void LLMSamplingProbs(const float *logits, int vocabSize, const GenerationConfig &config,
+                          const LastTokensUnit &tokens, std::vector <std::pair <int, float> > &probs);
+
+    // 按分布probs采样第step个token; 设置了config.seed时结果只由(seed, step, stream)决定
+    int LLMSamplingFromProbs(const std::vector <std::pair <int, float> > &probs, const GenerationConfig &config,
+                             int step, int stream = 0);
+
+    // 投机解码的采样验证: draft按分布q提出draftToken, 目标模型的分布为p
+    // 以min(1, p / q)的概率接受draftToken, 否则从max(0, p - q)归一化后的分布中重新采样, 返回最终的token
+    // 随机数同LLMSampling由(config.seed, step)决定
+    int SpeculativeSampling(const std::vector <std::pair <int, float> > &p, const std::vector <std::pair <int, float> > &q,
+                            int draftToken, const GenerationConfig &config, int step);
+
     void ToDataType(const Data &input, DataType dataType);
 
     void CopyKVCache(Data &oldCache, Data &newCache, int oldBsStart, int newBsStart, int bs, int offset);
 
+    bool PreparePagedKVCache(Data &cache, const Data &input); // 如果可以, 把cache转成分页KV cache; 返回cache是否分页
+
+    void PrepareKVCache(Data &cache, const Data &input, bool allowPaged = true); // 为把input追加到cache中准备空间
+
     void Attention(const Data &q, const Data &k, const Data &v, const Data &mask, Data &output,
                    int group, float scale, int attentionType);
 
+    // 融合attention: 不生成完整的score矩阵, mask的语义同AttentionMask
+    // alibi非空时同AlibiMask: 加上alibi偏置并按位置做因果mask, 此时忽略mask
+    void FusedAttention(const Data &q, const Data &k, const Data &v, const Data &mask, const Data &alibi, Data &output,
+                        int group, float scale);
+
     void AttentionBatch(std::vector <Data*> &q, std::vector <Data*> &k, std::vector <Data*> &v,
                         std::vector <Data*> &mask, std::vector <Data*> &output,
                         int group, float scale, int attentionType);
@@ -457,9 +611,22 @@ namespace fastllm {
 
     void RMSNorm(const Data &input, const Data &weight, float eps, Data &output);
 
+    // input0 += input1 * alpha, output = RMSNorm(input0), 一次遍历完成残差相加和归一化
+    void AddToRMSNorm(Data &input0, const Data &input1, const Data &weight, float eps, Data &output, float alpha = 1.0);
+
     void LayerNorm(Data &input, Data &gamma, Data &beta, int axis, Data &output);
 
-    void Linear(Data &input, Data &weight, const Data &bias, Data &output);
+    enum LinearActivation {
+        LinearActivationNone = 0, LinearActivationSilu = 1, LinearActivationGeluNew = 2,
+        LinearActivationSwiglu = 3 // 输出的前一半做silu后乘后一半, 输出宽度减半
+    };
+
+    // activation在Linear计算完后直接作用在输出上, 不再单独调用激活函数
+    void Linear(Data &input, Data &weight, const Data &bias, Data &output,
+                LinearActivation activation = LinearActivationNone);
+
+    // output = silu(gate) * (input * weight^T + bias), 用于gate/up结构的FFN, 代替Silu + MulTo
+    void LinearSiluMul(Data &input, Data &weight, const Data &bias, const Data &gate, Data &output);
 
     void Split(const Data &input, int axis, int start, int end, Data &output);
 
@@ -0,0 +1,101 @@
+#ifndef FASTLLM_KVCACHE_H
+#define FASTLLM_KVCACHE_H
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+namespace fastllm {
+    // KV cache的block池: 按chunk预分配大块内存, 切成固定大小的block
+    // 释放的block直接放回空闲链表, 下一个请求立刻复用, 已分配的block地址永不移动
+    class KVCacheBlockPool {
+    public:
+        KVCacheBlockPool (uint64_t blockBytes, int blocksPerChunk = 64);
+
+        ~KVCacheBlockPool ();
+
+        uint8_t *AllocBlock(); // 取一个空闲block
+
+        void FreeBlock(uint8_t *block); // 归还一个block (被共享的block只减少引用计数)
+
+        void ShareBlock(uint8_t *block); // 增加block的引用计数, 之后每个持有者各自FreeBlock一次
+
+        bool IsShared(uint8_t *block); // block是否还有其他持有者
+
+        void Reserve(int blocks); // 预分配到至少blocks个block
+
+        int GetTotalBlocks(); // 池中block总数
+
+        int GetFreeBlocks(); // 空闲block数
+
+        uint64_t blockBytes; // 单个block的字节数
+        int blocksPerChunk; // 每次向系统申请多少个block
+    private:
+        void AddChunk();
+
+        std::mutex locker;
+        std::vector <uint8_t*> chunks;
+        std::vector <uint8_t*> freeBlocks;
+        std::unordered_map <uint8_t*, int> sharedRefs; // 被共享的block的额外引用数, 不在表中的block只有一个持有者
+        int totalBlocks = 0;
+    };
+
+    // 获取block大小为blockBytes的池 (不同head数/维度的模型各用一个池)
+    KVCacheBlockPool *GetKVCacheBlockPool(uint64_t blockBytes);
+
+    // 分页KV cache中每个token的存储类型
+    enum PagedKVStoreType {
+        PAGED_KV_FLOAT32 = 0,
+        PAGED_KV_FLOAT16 = 1,
+        PAGED_KV_INT8 = 2 // 每个token每个head对称量化, 一行为dim个int8加一个float scale
+    };
+
+    // 分页存储的KV cache, 逻辑形状为[heads, len, dim]
+    // 每个block存放blockLen个token的全部head, 布局为[heads, blockLen, row], 每行rowBytes字节
+    struct PagedKVCache {
+        int heads, dim, unitSize; // unitSize为逻辑数据 (追加的输入) 的单位大小
+        int blockLen;
+        int storeType = PAGED_KV_FLOAT32;
+        uint64_t rowBytes; // 一个head一个token占用的字节数
+        int len = 0; // 当前已存放的token数
+        KVCacheBlockPool *pool;
+        std::vector <uint8_t*> blockTable; // 第i个block存放[i * blockLen, (i + 1) * blockLen)的token
+
+        PagedKVCache (int heads, int dim, int unitSize, int blockLen, int storeType = PAGED_KV_FLOAT32);
+
+        PagedKVCache (const PagedKVCache &ori); // 深拷贝, 申请新的block
+
+        ~PagedKVCache (); // 所有block归还到池中
+
+        // 追加inputLen个token, input[h]的第t个token位于input + (h * headStride + t * dim) * unitSize
+        // storeType不是FLOAT32时输入必须是float, 写入时转换成存储类型
+        void Append(const uint8_t *input, int inputLen, uint64_t headStride);
+
+        // 追加已经是存储格式的inputLen个token, 第h个head的第t个token位于rows + (h * inputLen + t) * rowBytes
+        void AppendRows(const uint8_t *rows, int inputLen);
+
+        void Clear(); // 清空并归还所有block
+
+        // 只保留前len个token, 多余的block归还到池中 (投机解码回滚, 会话复用kv)
+        // 截断位置所在的block被共享时 (例如已经插入了前缀缓存) 先复制一份, 之后追加的token写入副本, 不会改动共享的block
+        void Truncate(int len);
+
+        // 在末尾接上其他cache中已经写满的block (只增加引用计数, 不拷贝), 要求当前的block都已写满
+        // 共享的block之后不会再被写入, 新token追加到新申请的block中
+        void ShareBlocks(const std::vector <uint8_t*> &blocks);
+
+        int GetCapacity() const { // 不申请新block时最多能存放的token数
+            return (int)blockTable.size() * blockLen;
+        }
+
+        uint8_t *GetToken(int head, int token) const {
+            return blockTable[token / blockLen] + ((uint64_t)head * blockLen + token % blockLen) * rowBytes;
+        }
+
+        static uint64_t GetRowBytes(int dim, int unitSize, int storeType);
+    };
+}
+
+#endif //FASTLLM_KVCACHE_H
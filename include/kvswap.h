@@ -0,0 +1,53 @@
+#ifndef FASTLLM_KVSWAP_H
+#define FASTLLM_KVSWAP_H
+
+#include "fastllm.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace fastllm {
+    // 换出到临时文件的KV cache
+    // 按token block顺序写出, 恢复时每次读回一个block, 不需要额外申请整份cache大小的内存
+    class SwappedKVCache {
+    public:
+        SwappedKVCache () {};
+
+        ~SwappedKVCache ();
+
+        SwappedKVCache (const SwappedKVCache &) = delete;
+
+        // 把pastKeyValues写入临时文件, 之后pastKeyValues被替换成空的Data, 内存 (或分页cache的block) 立即释放
+        void SwapOut(std::vector <std::pair <Data, Data> > &pastKeyValues);
+
+        // 从临时文件读回到空的pastKeyValues中, 之后关闭并删除临时文件
+        void SwapIn(std::vector <std::pair <Data, Data> > &pastKeyValues);
+
+        void Clear(); // 丢弃换出的数据
+
+        bool IsSwapped() {return file != nullptr;}
+
+        long long GetBytes() {return bytes;}
+
+        int GetLen() {return entries.size() > 0 ? entries[0].len : 0;} // 换出的token数
+    private:
+        struct Entry {
+            DataType dataType;
+            bool paged;
+            int heads, len, dim, unitSize;
+            int storeType; // 分页cache的存储类型, 按存储格式原样写出
+            uint64_t rowBytes;
+            int chunkLen; // 文件中每chunkLen个token的全部head连续存放, 布局为[heads, chunkLen, dim]
+        };
+
+        void Write(Data &data);
+
+        void Read(const Entry &entry, Data &data);
+
+        FILE *file = nullptr;
+        std::vector <Entry> entries; // 每层key和value各一个, 顺序为k0, v0, k1, v1, ...
+        long long bytes = 0;
+    };
+}
+
+#endif //FASTLLM_KVSWAP_H
@@ -1,8 +1,12 @@
 #pragma once
 #include "fastllm.h"
+#include "prefixcache.h"
+#include "kvswap.h"
 
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 #ifdef PY_API
 #include "Python.h"
@@ -26,11 +30,49 @@ namespace fastllm {
 
         int preTokens = 0;
         int curTokens = 0;
+        int cachedTokens = 0; // 从前缀缓存中复用的token数
+        std::vector <int> allTokens; // prompt和已经生成的token, 前preTokens个token的kv在pastKeyValues中
         std::map <std::string, int> intParams;
 
+        int sessionId = -1; // 所属的会话, -1代表不属于任何会话
+        SwappedKVCache swappedKV; // 被抢占时kv cache换出到磁盘, 换回之前不参与调度
+        bool swappingIn = false; // 正在 (不持有dictLocker) 从磁盘换回kv cache
+        long long arrivalId = 0; // 到达的顺序
+        long long lastStep = -1; // 上一次被调度的步数
+
+        std::vector <std::pair <Data, Data> > draftKeyValues; // 投机解码时draft模型的kv cache
+        int draftLen = 0; // draftKeyValues中的token数, 对应allTokens的前draftLen个
+
+        bool IsPrompt() {return preTokens == 0 || preTokens < (int)currentTokens.size();} // prompt还没有算完 (分块prefill时可能算了一部分)
+        std::condition_variable cond; // 有新的输出或者结束时通知等待的Fetch
+
         void Init(int blocks);
     };
 
+    struct SessionConfig {
+        int idleTimeout = 600; // 空闲超过这么多秒的会话释放kv cache, <= 0代表不超时
+        long long maxBytes = 4LL << 30; // 所有空闲会话kv cache的内存上限, 超出时释放最久没用的, <= 0代表不限制
+        bool swapToDisk = true; // 超时或者超出内存上限时把kv cache换出到磁盘 (下一轮换回), 否则直接释放 (下一轮重新prefill)
+    };
+
+    // 多轮对话的会话: 在两轮之间保留kv cache, 每一轮只需要prefill新输入的部分
+    struct LLMSession {
+        std::vector <std::pair <Data, Data> > pastKeyValues;
+        std::vector <int> tokens; // 会话中的所有token, 前kvLen个token的kv在pastKeyValues中 (或者被换出到swappedKV中)
+        int kvLen = 0;
+        SwappedKVCache swappedKV;
+        bool swappingIn = false; // 正在 (不持有dictLocker) 从磁盘换回kv cache, 期间会话不能被使用或释放
+
+        std::string history; // MakeInput/MakeHistory使用的对话历史
+        std::string input; // 本轮的输入, 为空时 (直接追加token) 不更新history
+        int round = 0;
+        int outputStart = -1; // 本轮输出的第一个token在tokens中的位置
+
+        int handleId = -1; // 正在生成时对应的handle
+        bool closed = false; // 生成过程中被关闭, 生成结束后释放
+        std::chrono::steady_clock::time_point lastActive;
+    };
+
     struct ResponseContextDict {
         std::mutex locker;
         std::map <int, ResponseContext*> dicts;
@@ -42,11 +84,40 @@ namespace fastllm {
         void RemoveHandle(int handleId);
     };
 
+    enum SchedulePolicy {
+        ScheduleFCFS = 0, // 按到达顺序接纳新请求
+        ScheduleShortestPromptFirst = 1 // 优先接纳prompt短的请求
+    };
+
+    struct ScheduleConfig {
+        int policy = ScheduleFCFS;
+        int maxBatch = -1; // 每步最多计算的请求数, <= 0代表不限制
+        int maxPrefillTokens = 4096; // 每步接纳的prompt的总token数 (至少接纳一个请求), <= 0代表不限制
+        int prefillChunkSize = 512; // 分块prefill时每段prompt的长度, <= 0或者模型不支持时整段prefill
+        bool preempt = false; // kv cache超出tokensLimit时, 换出优先级不高于新请求的解码中请求, 而不是让新请求等待
+    };
+
+    struct ScheduleMetrics {
+        int queueDepth = 0; // 等待接纳的请求数
+        int running = 0; // 正在解码的请求数
+        long long steps = 0, prefillSteps = 0, decodeSteps = 0;
+        long long batchSum = 0; // 每步batch大小的和, batchSum / steps为平均batch大小
+        long long prefillTokens = 0, decodeTokens = 0;
+        int swapped = 0; // 当前被换出的请求数
+        long long swapOuts = 0, swapIns = 0, swapBytes = 0; // 换出次数, 换入次数, 累计换出的字节数
+        long long draftTokens = 0, acceptedTokens = 0; // 投机解码中draft提出的token数, 被目标模型接受的token数
+    };
+
     class basellm {
     public:
         basellm() {};
 
-        ~basellm() {
+        virtual ~basellm() {
+            // 先停止调度线程, 它可能还在访问会话和请求
+            StopMainLoop();
+            for (auto &it : sessions) {
+                delete it.second;
+            }
             this->weight.ReleaseWeight();
         };
 
@@ -54,6 +125,8 @@ namespace fastllm {
 
         virtual void InitParams(); // 初始化参数信息
 
+        virtual void InitLinearNames() {}; // 按层数填写weight.linearNames, 在InitParams中调用
+
         // 推理
         virtual int Forward(
                 const Data &inputIds,
@@ -111,10 +184,92 @@ namespace fastllm {
 
         virtual int FetchResponseLogits(int handleId, std::vector <float> &logits); // 获取指定handle的输出Logits
 
-        virtual void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型
+        // 按调度策略挑选下一步要计算的请求, 返回<handleId, 本步计算的token数>, 调用时需持有dictLock
+        // 整段prefill时返回的请求要么都是prompt (isPrompt = true), 要么都在解码中
+        // 分块prefill时返回所有解码中的请求加上一段prompt
+        // 从磁盘换回被抢占的请求时会暂时释放dictLock
+        virtual std::vector <std::pair <int, int> > PickScheduleBatch(bool &isPrompt, std::unique_lock <std::mutex> &dictLock);
+
+        // 是否支持分块prefill: FillLLMInputs的params中带有chunkStart时, 生成接在前chunkStart个token的kv cache后面的输入
+        virtual bool SupportChunkedPrefill() {return false;}
+
+        // 同ForwardBatch的多请求版本, 但不采样, logits[b][i]为第b个请求第i个位置的logits
+        // 投机解码一次验证所有请求的draft token, 支持时需要同时重载SupportSpeculative
+        virtual void ForwardBatchAllLogits(int batch, const Data &inputIds, const std::vector <Data*> &attentionMask,
+                                           const std::vector <Data*> &positionIds, const std::vector <int> &seqLens,
+                                           std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                           std::vector <std::vector <std::vector <float> > > &logits);
+
+        virtual bool SupportSpeculative() {return false;} // 是否可以作为投机解码的目标模型
+
+        // 设置投机解码的draft模型 (需要和当前模型使用同样的词表), nullptr代表不使用
+        // draft模型只在当前模型的调度线程中调用, 不能同时用来生成
+        void SetDraftModel(basellm *model);
+
+        bool UseSpeculative(const GenerationConfig &generationConfig); // 这个请求是否使用投机解码
+
+        // 对解码中的请求做一步投机解码: 每个请求由draft模型 (或prompt lookup) 提出若干token, 目标模型一次ForwardBatchAllLogits验证所有请求, 回滚未被接受的kv
+        // 返回每个请求本步生成的token (至少一个), logits非空时返回每个token对应的目标模型logits; 调用时不持有dictLocker
+        std::vector <std::vector <int> > SpeculativeStep(const std::vector <ResponseContext*> &contexts,
+                                                         std::vector <std::vector <std::vector <float> > > *logits);
+
+        // 处理请求新生成的token (结束判断, 输出队列, 长度限制), 需持有dictLocker
+        void PushResponseToken(ResponseContext *context, int token);
+
+        // 通过调度线程 (LaunchResponseTokens) 完成Response, 投机解码的请求使用
+        std::string SpeculativeResponse(const std::string &input, RuntimeResult retCb,
+                                        const GenerationConfig &generationConfig = GenerationConfig());
+
+        std::string StreamResponse(int handleId, RuntimeResult retCb); // 取出handle的全部输出, 每个token回调一次retCb
+
+        void SetScheduleConfig(const ScheduleConfig &config);
+
+        ScheduleConfig GetScheduleConfig();
+
+        ScheduleMetrics GetScheduleMetrics();
+
+        int CreateSession(); // 创建一个多轮对话的会话, 返回sessionId
+
+        void CloseSession(int sessionId); // 关闭会话并释放kv cache
+
+        void AppendSessionTokens(int sessionId, const std::vector <int> &tokens); // 在会话末尾追加token
+
+        // 按MakeInput的格式在会话末尾追加一轮输入, 本轮生成结束后用MakeHistory更新会话历史
+        void AppendSessionInput(int sessionId, const std::string &input);
+
+        // 接着会话已有的kv cache生成, 返回handleId, 用FetchResponseTokens获取输出
+        int LaunchSessionResponse(int sessionId, const GenerationConfig &generationConfig = GenerationConfig());
+
+        // 追加一轮输入并生成回复
+        std::string SessionResponse(int sessionId, const std::string &input, RuntimeResult retCb,
+                                    const GenerationConfig &generationConfig = GenerationConfig());
+
+        void SetSessionConfig(const SessionConfig &config);
+
+        SessionConfig GetSessionConfig();
+
+        // 前缀缓存依赖分块prefill: 命中的前缀作为已经算完的chunk, 只计算剩余的token
+        bool UsePrefixCache();
+
+        void StartMainLoop(); // 启动后台的调度线程
+
+        void StopMainLoop(); // 通知调度线程退出并等待它结束
+
+        void FinishResponseContext(ResponseContext *context); // 请求结束时调用, 需持有dictLocker
+
+        void EvictSessions(); // 换出或释放超时, 超出内存上限的会话的kv cache, 需持有dictLocker
+
+        // 为新请求抢占解码中的请求: 按优先级从低到高, 同优先级后到的先换出, 能腾出need个token的空间时才换出
+        bool PreemptForPrompt(ResponseContext *prompt, int need, int limit, int &lenSum,
+                              std::vector <std::pair <std::pair <long long, long long>, int> > &decodes);
+
+        virtual void SaveLowBitModel(const std::string &fileName, int bit, int groupCnt = -1); // 存储成量化模型, groupCnt > 0时分组量化
 
         virtual void SaveModel(const std::string &fileName); // 直接导出
 
+        // 流式量化模型文件, 不加载权重; 按模型定义中的Linear层和Embedding层决定每个权重的量化方式
+        void ConvertLowBitModel(const std::string &input, const std::string &output, int bit, int groupCnt = -1);
+
         virtual void WarmUp() {}; // 预热
 
         virtual std::string MakeInput(const std::string &history, int round, const std::string &input) = 0; // 根据历史信息和当前输入生成prompt
@@ -149,7 +304,22 @@ namespace fastllm {
         ResponseContextDict responseContextDict;
 
         std::thread *mainLoop = nullptr;
+        bool mainLoopStop = false; // 为true时mainLoop在当前这一步结束后退出
         std::mutex mainLoopLocker, dictLocker;
+        std::condition_variable mainLoopCond; // 有新请求或者有请求释放时唤醒mainLoop
+
+        ScheduleConfig scheduleConfig;
+        ScheduleMetrics scheduleMetrics;
+        long long requestCounter = 0;
+        bool lastStepPrefill = false;
+
+        PrefixCache prefixCache; // 请求之间共享的前缀KV cache
+
+        basellm *draftModel = nullptr; // 投机解码的draft模型
+
+        std::map <int, LLMSession*> sessions;
+        int sessionCounter = 0;
+        SessionConfig sessionConfig;
 
         std::map <std::string, int> deviceMap;
 
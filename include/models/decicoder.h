@@ -55,10 +55,38 @@ namespace fastllm {
                                         const std::vector <std::map <std::string, int> > &params,
                                         Data &inputIds, Data &attentionMask, Data &positionIds);
         
+        virtual bool SupportChunkedPrefill();
+
+        // 计算每个请求每个位置的logits, 投机解码一次验证多个请求的draft token
+        virtual void ForwardBatchAllLogits(int batch,
+                                           const Data &inputIds,
+                                           const std::vector <Data*> &attentionMask,
+                                           const std::vector <Data*> &positionIds,
+                                           const std::vector <int> &seqLens,
+                                           std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                           std::vector <std::vector <std::vector <float> > > &logits);
+
+        virtual bool SupportSpeculative();
+
         virtual void WarmUp();
 
+        virtual void InitLinearNames(); // 填写所有Linear层的权重名
+
         int num_key_value_heads;
         int num_key_value_groups;
+    private:
+        // 计算inputIds中所有位置的logits, 单请求的ForwardBatch使用
+        void ForwardLogits(const Data &inputIds, const Data &attentionMask, const Data &positionIds,
+                           std::vector <std::pair <Data, Data> > &pastKeyValues, Data &logits);
+
+        // 多请求版本, 多请求的ForwardBatch和ForwardBatchAllLogits共用
+        void ForwardBatchLogits(int batch,
+                                const Data &inputIds,
+                                const std::vector <Data*> &attentionMask,
+                                const std::vector <Data*> &positionIds,
+                                const std::vector <int> &seqLens,
+                                std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                Data &logits);
     };
 }
 
@@ -43,6 +43,8 @@ namespace fastllm {
         virtual void InitParams();
 		virtual void WarmUp(); // 预热
 
+        virtual void InitLinearNames(); // 填写所有Linear层的权重名
+
         virtual std::string MakeInput(const std::string &history, int round, const std::string &input); // 根据历史信息和当前输入生成prompt
 
         virtual std::string MakeHistory(const std::string &history, int round, const std::string &input, const std::string &output); // 根据当前回复更新history
@@ -15,6 +15,8 @@ namespace fastllm {
     public:
         LlamaModel (); // 构造函数
 
+        virtual void InitParams(); // 初始化参数信息
+
         // 推理
         virtual int Forward(
                 const Data &inputIds,
@@ -55,16 +57,42 @@ namespace fastllm {
                                    RuntimeResultBatch retCb,
                                    const GenerationConfig &generationConfig = GenerationConfig());
 
-        virtual int LaunchResponseTokens(const std::vector <int> &inputTokens,
-                                         const GenerationConfig &generationConfig = GenerationConfig()); // 启动一个response任务，返回分配的handleId
+        // 根据输入的tokens生成LLM推理的输入
+        virtual void FillLLMInputs(std::vector <std::vector <float> > &inputTokens,
+                                   const std::map <std::string, int> &params,
+                                   Data &inputIds, Data &attentionMask, Data &positionIds);
+
+        virtual bool SupportChunkedPrefill(); // alibi模型在CUDA上的mask只支持完整的prompt
+
+        // 计算每个请求每个位置的logits, 投机解码一次验证多个请求的draft token
+        virtual void ForwardBatchAllLogits(int batch,
+                                           const Data &inputIds,
+                                           const std::vector <Data*> &attentionMask,
+                                           const std::vector <Data*> &positionIds,
+                                           const std::vector <int> &seqLens,
+                                           std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                           std::vector <std::vector <std::vector <float> > > &logits);
 
-        virtual int FetchResponseTokens(int handelId); // 获取指定handle的输出, -1代表输出结束了
+        virtual bool SupportSpeculative(); // 同分块prefill, 验证时接在已有的kv cache后面
 
         virtual void WarmUp(); // 预热
 
+        virtual void InitLinearNames(); // 填写所有Linear层的权重名
+
         virtual std::string MakeInput(const std::string &history, int round, const std::string &input); // 根据历史信息和当前输入生成prompt
 
         virtual std::string MakeHistory(const std::string &history, int round, const std::string &input, const std::string &output); // 根据当前回复更新history
+
+        int num_key_value_heads = 32; // GQA/MQA时k, v的head数, KV cache中只存这么多head
+    private:
+        // 计算inputIds中所有位置的logits, ForwardBatch和ForwardBatchAllLogits共用
+        void ForwardBatchLogits(int batch,
+                                const Data &inputIds,
+                                const std::vector <Data*> &attentionMask,
+                                const std::vector <Data*> &positionIds,
+                                const std::vector <int> &seqLens,
+                                std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                Data &logits);
     };
 }
 
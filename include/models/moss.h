@@ -35,6 +35,8 @@ namespace fastllm {
                                          Data &inputIds, Data &attentionMask, Data &positionIds);
 
         virtual void WarmUp();
+
+        virtual void InitLinearNames(); // 填写所有Linear层的权重名
     private:
 		virtual void RotatePosition2D(Data &data, const Data &positionIds); // 二维位置编码
 
@@ -57,6 +57,8 @@ namespace fastllm {
         
         virtual void WarmUp();
 
+        virtual void InitLinearNames(); // 填写所有Linear层的权重名
+
         void UpdateRotaryPosEmb(float ntk_alpha);
 
         int seq_length;
@@ -0,0 +1,78 @@
+#ifndef FASTLLM_PREFIXCACHE_H
+#define FASTLLM_PREFIXCACHE_H
+
+#include "fastllm.h"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+
+namespace fastllm {
+    struct PrefixCacheMetrics {
+        long long lookups = 0, hits = 0; // 查询次数, 命中(至少复用一个block)的次数
+        long long lookupTokens = 0, hitTokens = 0; // 查询的token数, 复用的token数
+        long long insertedBlocks = 0, evictedBlocks = 0;
+        int nodes = 0; // 当前缓存的block数
+        long long usedBytes = 0, budgetBytes = 0;
+    };
+
+    // 前缀树上的一个节点, 对应blockLen个token
+    struct PrefixCacheNode {
+        std::vector <int> tokens;
+        PrefixCacheNode *parent = nullptr;
+        std::map <std::vector <int>, PrefixCacheNode*> children;
+        std::vector <uint8_t*> blocks; // 每层key和value的block, 顺序为k0, v0, k1, v1, ...
+        int depth = 0;
+        long long lastAccess = 0;
+    };
+
+    // 多个请求共享的前缀KV cache
+    // 以token序列为key, 按分页KV cache的block组织成基数树, 节点直接引用KV block (block池中引用计数)
+    // 命中时新请求的KV cache共享这些block, 只需要计算剩余的token; 超出内存预算时按LRU淘汰叶子
+    class PrefixCache {
+    public:
+        PrefixCache ();
+
+        ~PrefixCache ();
+
+        // 查找tokens最长的已缓存前缀 (不超过maxLen个token), 命中的block接到空的pastKeyValues上, 返回复用的token数
+        int Match(const std::vector <int> &tokens, int maxLen, std::vector <std::pair <Data, Data> > &pastKeyValues);
+
+        // 把pastKeyValues中前len个token (对应tokens)的完整block加入缓存, KV cache不是分页存放时忽略
+        void Insert(const std::vector <int> &tokens, int len, std::vector <std::pair <Data, Data> > &pastKeyValues);
+
+        void SetBudget(long long bytes); // 内存预算, <= 0时关闭并清空缓存
+
+        long long GetBudget();
+
+        bool Enabled();
+
+        void Clear();
+
+        PrefixCacheMetrics GetMetrics();
+    private:
+        struct Layout {
+            int heads, dim, unitSize, storeType;
+            DataType dataType;
+            KVCacheBlockPool *pool;
+        };
+
+        void RemoveNode(PrefixCacheNode *node);
+
+        void Touch(PrefixCacheNode *node);
+
+        void Evict();
+
+        std::mutex locker;
+        PrefixCacheNode root;
+        std::vector <Layout> layouts; // 每层key和value的布局, 和PrefixCacheNode::blocks一一对应
+        int blockLen = 0;
+        long long nodeBytes = 0;
+        long long clock = 0;
+        std::set <std::pair <std::pair <long long, int>, PrefixCacheNode*> > lru; // <<lastAccess, -depth>, node>, 最前面的总是叶子
+        PrefixCacheMetrics metrics;
+    };
+}
+
+#endif //FASTLLM_PREFIXCACHE_H
@@ -5,6 +5,8 @@ struct RunConfig {
 	int threads = 4; // 使用的线程数
 	bool lowMemMode = false; // 是否使用低内存模式
     int historySize = 1024; // 最大历史记录长度
+    bool mmapWeights = false; // 是否直接映射模型文件
+    int mmapWarmUp = 0; // 映射时的预热方式: 0 按需载入, 1 预取, 2 预取并mlock
 };
 
 void Usage() {
@@ -14,6 +16,8 @@ void Usage() {
 	std::cout << "<-t|--threads> <args>:        使用的线程数量" << std::endl;
 	std::cout << "<-l|--low>:                   使用低内存模式" << std::endl;
     std::cout << "<-s|--history><args>          最大历史记录长度" << std::endl;
+    std::cout << "<--mmap>:                     只读映射模型文件 (flm版本3), 权重按需载入" << std::endl;
+    std::cout << "<--mmap_warm_up> <args>:      映射时的预热方式: 0 按需载入, 1 预取, 2 预取并mlock" << std::endl;
     std::cout << "<--top_p> <args>:             采样参数top_p" << std::endl;
     std::cout << "<--top_k> <args>:             采样参数top_k" << std::endl;
     std::cout << "<--temperature> <args>:       采样参数温度，越高结果越不固定" << std::endl;
@@ -37,6 +41,10 @@ void ParseArgs(int argc, char **argv, RunConfig &config, fastllm::GenerationConf
 			config.lowMemMode = true;
 		} else if (sargv[i] == "-s" || sargv[i] == "--history") {
             config.historySize = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "--mmap") {
+            config.mmapWeights = true;
+        } else if (sargv[i] == "--mmap_warm_up") {
+            config.mmapWarmUp = atoi(sargv[++i].c_str());
         } else if (sargv[i] == "-m" || sargv[i] == "--model") {
             i++;
         } else if (sargv[i] == "--top_p") {
@@ -65,6 +73,8 @@ int main(int argc, char **argv) {
     fastllm::PrintInstructionInfo();
     fastllm::SetThreads(config.threads);
     fastllm::SetLowMemMode(config.lowMemMode);
+    fastllm::SetMmapWeights(config.mmapWeights);
+    fastllm::SetMmapWarmUp(config.mmapWarmUp);
     auto model = fastllm::CreateLLMModelFromFile(config.path);
 
     static std::string modelType = model->model_type;
@@ -4,6 +4,7 @@
 
 #include "utils.h"
 #include "device.h"
+#include "devices/cpu/cpumemory.h"
 
 namespace fastllm {
     bool BaseDevice::Malloc(void **ret, Data &data) {
@@ -15,15 +16,14 @@ namespace fastllm {
         AssertInFastLLM(data.deviceData == nullptr, "Copy data to " + this->deviceName + " from cpu failed: device's data is not null.\n");
         Malloc(&data.deviceData, data.expansionBytes);
         bool ret = CopyDataFromCPU(data.cudaData, data.cpuData, data.expansionBytes);
-        delete[] data.cpuData;
-        data.cpuData = nullptr;
+        data.ReleaseCpuData();
         return ret;
     }
 
     bool BaseDevice::CopyDataToCPU(Data &data) {
         AssertInFastLLM(data.cpuData == nullptr, "Copy data from " + this->deviceName + " to cpu failed: cpu's data is not null.\n");
         AssertInFastLLM(data.deviceData != nullptr, "Copy data from " + this->deviceName + " to cpu failed: device's data is null.\n");
-        data.cpuData = new uint8_t [data.expansionBytes];
+        data.cpuData = (uint8_t*)FastllmCpuMalloc(data.expansionBytes);
         bool ret = CopyDataToCPU(data.cpuData, data.deviceData, data.expansionBytes);
         this->Free(data.deviceData);
         data.deviceData = nullptr;
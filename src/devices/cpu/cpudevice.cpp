@@ -3,6 +3,7 @@
 //
 
 #include "devices/cpu/cpudevice.h"
+#include "devices/cpu/cpulinear.h"
 
 #include <cstring>
 #include <thread>
@@ -27,6 +28,7 @@ namespace fastllm {
         this->ops["Embedding"] = (BaseOperator*)(new CpuEmbedding());
         this->ops["LayerNorm"] = (BaseOperator*)(new CpuLayerNormOp());
         this->ops["RMSNorm"] = (BaseOperator*)(new CpuRMSNormOp());
+        this->ops["AddToRMSNorm"] = (BaseOperator*)(new CpuAddToRMSNormOp());
         this->ops["Linear"] = (BaseOperator*)(new CpuLinearOp());
         this->ops["Split"] = (BaseOperator*)(new CpuSplitOp());
         this->ops["Cat"] = (BaseOperator*)(new CpuCatOp());
@@ -63,12 +65,12 @@ namespace fastllm {
     }
 
     bool CpuDevice::Malloc(void **ret, size_t size) {
-        *ret = (void*)new uint8_t [size];
+        *ret = FastllmCpuMalloc(size);
         return true;
     }
 
     bool CpuDevice::Free(void *ret) {
-        delete[] (uint8_t*)ret;
+        FastllmCpuFree(ret);
         return true;
     }
 
@@ -148,7 +150,7 @@ namespace fastllm {
             acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(by, bx), ones));
         }
         for (; i < n; i++) {
-            ans += a[i] * b[i];
+            ans += ((i % 2) ? (a[i / 2] & 0xF) : (a[i / 2] >> 4)) * b[i];
         }
 
         return ans + I32sum(acc);
@@ -174,13 +176,13 @@ namespace fastllm {
         if (data.dataType == DataType::FLOAT32) {
             float *old = (float*)data.cpuData;
             data.dataType = DataType::FLOAT16;
-            data.cpuData = new uint8_t[data.GetBytes()];
-            uint16_t *cur = (uint16_t*)data.cpuData;
+            uint16_t *cur = (uint16_t*)FastllmCpuMalloc(data.GetBytes());
             int len = data.Count(0);
             for (int i = 0; i < len; i++) {
                 cur[i] = float_to_half(old[i]);
             }
-            delete[] old;
+            data.ReleaseCpuData();
+            data.cpuData = (uint8_t*)cur;
         } else {
             ErrorInFastLLM("ToFloat16: unsupport dataType.\n");
         }
@@ -196,13 +198,13 @@ namespace fastllm {
             uint16_t *old = (uint16_t*)data.cpuData;
             data.dataType = DataType::FLOAT32;
             data.UpdateUnitSize();
-            data.cpuData = new uint8_t[data.GetBytes()];
-            float *cur = (float*)data.cpuData;
+            float *cur = (float*)FastllmCpuMalloc(data.GetBytes());
             int len = data.Count(0);
             for (int i = 0; i < len; i++) {
                 cur[i] = fp16tofp32.dict[old[i]];
             }
-            delete[] old;
+            data.ReleaseCpuData();
+            data.cpuData = (uint8_t*)cur;
         } else {
             ErrorInFastLLM("ToFloat32: unsupport dataType.\n");
         }
@@ -231,40 +233,199 @@ namespace fastllm {
         output.Resize(dims);
     }
 
-    void SingleAttention(float *qd, float *kd, float *vd, float *maskd, float *od,
-                         float scale, int q1, int q2, int k1, int v2) {
-        float *qk = new float[k1];
-        float *temp = new float[k1];
-        for (int i = 0; i < q1; i++) {
-            float maxValue = -10000, sum = 0.0;
-            for (int j = 0; j < k1; j++) {
-                if (maskd && maskd[i * k1 + j] > 0.99) {
-                    qk[j] = -10000;
+    static inline float AttentionDot(const float *a, const float *b, int n) {
+        int i = 0;
+        float ret = 0.0f;
+#ifdef __aarch64__
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        for (; i + 3 < n; i += 4) {
+            sum = vfmaq_f32(sum, vld1q_f32(a + i), vld1q_f32(b + i));
+        }
+        ret = vaddvq_f32(sum);
+#else
+#ifdef __AVX2__
+        __m256 vsum = _mm256_setzero_ps();
+        for (; i + 7 < n; i += 8) {
+            vsum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), vsum);
+        }
+        ret = Floatsum(vsum);
+#endif
+#endif
+        for (; i < n; i++) {
+            ret += a[i] * b[i];
+        }
+        return ret;
+    }
+
+    // o = o * scale + p * v
+    static inline void AttentionAxpy(float *o, float scale, float p, const float *v, int n) {
+        int i = 0;
+#ifdef __aarch64__
+        float32x4_t vs = vdupq_n_f32(scale), vp = vdupq_n_f32(p);
+        for (; i + 3 < n; i += 4) {
+            vst1q_f32(o + i, vfmaq_f32(vmulq_f32(vld1q_f32(o + i), vs), vld1q_f32(v + i), vp));
+        }
+#else
+#ifdef __AVX2__
+        __m256 vs = _mm256_set1_ps(scale), vp = _mm256_set1_ps(p);
+        for (; i + 7 < n; i += 8) {
+            _mm256_storeu_ps(o + i, _mm256_fmadd_ps(_mm256_loadu_ps(v + i), vp, _mm256_mul_ps(_mm256_loadu_ps(o + i), vs)));
+        }
+#endif
+#endif
+        for (; i < n; i++) {
+            o[i] = o[i] * scale + p * v[i];
+        }
+    }
+
+    // 把分页KV cache中一行量化存储的数据 (FLOAT16或INT8 + scale) 还原成n个float
+    static inline void DequantKVRow(const uint8_t *row, float *out, int n, int storeType) {
+        int i = 0;
+        if (storeType == PAGED_KV_FLOAT16) {
+            const uint16_t *h = (const uint16_t*)row;
+#ifdef __F16C__
+            for (; i + 7 < n; i += 8) {
+                _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h + i))));
+            }
+#endif
+            for (; i < n; i++) {
+                out[i] = fp16tofp32.dict[h[i]];
+            }
+        } else {
+            const int8_t *q = (const int8_t*)row;
+            float scale;
+            memcpy(&scale, row + n, sizeof(float));
+#ifdef __aarch64__
+            float32x4_t vs = vdupq_n_f32(scale);
+            for (; i + 7 < n; i += 8) {
+                int16x8_t w = vmovl_s8(vld1_s8(q + i));
+                vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(w))), vs));
+                vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(w))), vs));
+            }
+#else
+#ifdef __AVX2__
+            __m256 vs = _mm256_set1_ps(scale);
+            for (; i + 7 < n; i += 8) {
+                __m256i w = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(q + i)));
+                _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(w), vs));
+            }
+#endif
+#endif
+            for (; i < n; i++) {
+                out[i] = q[i] * scale;
+            }
+        }
+    }
+
+    // 单个head的融合attention: 沿k方向分块, 用online softmax直接累加到输出, 不生成[q1, k1]的score矩阵
+    // kRows[j], vRows[j]为第j个token的k, v, 按storeType (PagedKVStoreType) 存储
+    // qd, od中连续存放共享这组k, v的heads个q head (GQA), 每个k, v的tile只读取(反量化)一次
+    // maskd非空时mask中 > 0.99的位置被屏蔽; causal时第i个query只看前k1 - q1 + i + 1个token
+    // alibiSlope != 0时score加上alibiSlope * j
+    // 同原来的softmax (被屏蔽的位置为-10000), 整行都被屏蔽时输出可见范围内所有v的平均值
+    void FusedAttentionSingleHead(float *qd, uint8_t **kRows, uint8_t **vRows, int storeType, float *maskd, float *od,
+                                  float scale, float alibiSlope, bool causal, int q1, int q2, int k1, int v2, int heads) {
+        const int kBlock = 64;
+        int rows = q1 * heads;
+        float scores[kBlock];
+        float *kTile[kBlock], *vTile[kBlock];
+        thread_local std::vector <float> maxs, sums, kBuffer, vBuffer;
+        maxs.assign(rows, -FLT_MAX);
+        sums.assign(rows, 0.0f);
+        if (storeType != PAGED_KV_FLOAT32) {
+            kBuffer.resize(kBlock * q2);
+            vBuffer.resize(kBlock * v2);
+        }
+        for (int st = 0; st < k1; st += kBlock) {
+            int end = std::min(k1, st + kBlock);
+            // 量化存储时每个tile只反量化一次, 所有query共用
+            for (int j = st; j < end; j++) {
+                if (storeType == PAGED_KV_FLOAT32) {
+                    kTile[j - st] = (float*)kRows[j];
+                    vTile[j - st] = (float*)vRows[j];
+                } else {
+                    kTile[j - st] = kBuffer.data() + (j - st) * q2;
+                    vTile[j - st] = vBuffer.data() + (j - st) * v2;
+                    DequantKVRow(kRows[j], kTile[j - st], q2, storeType);
+                    DequantKVRow(vRows[j], vTile[j - st], v2, storeType);
+                }
+            }
+            for (int i = 0; i < rows; i++) {
+                int row = i % q1;
+                int limit = causal ? std::min(end, k1 - q1 + row + 1) : end;
+                if (limit <= st) {
                     continue;
                 }
-                float sum = 0.0f;
-                for (int l = 0; l < q2; l++) {
-                    sum += qd[i * q2 + l] * kd[j * q2 + l];
+                float *qi = qd + (uint64_t)i * q2;
+                float *maski = maskd ? maskd + (uint64_t)row * k1 : nullptr;
+                float tileMax = -FLT_MAX;
+                for (int j = st; j < limit; j++) {
+                    if (maski && maski[j] > 0.99) {
+                        scores[j - st] = -FLT_MAX;
+                        continue;
+                    }
+                    float now = AttentionDot(qi, kTile[j - st], q2) * scale + alibiSlope * j;
+                    scores[j - st] = now;
+                    tileMax = std::max(tileMax, now);
+                }
+                if (tileMax == -FLT_MAX) {
+                    continue;
+                }
+
+                float *oi = od + (uint64_t)i * v2;
+                float curMax = std::max(maxs[i], tileMax);
+                float rescale = (maxs[i] == -FLT_MAX) ? 0.0f : expf(maxs[i] - curMax);
+                sums[i] *= rescale;
+                maxs[i] = curMax;
+                for (int j = st; j < limit; j++) {
+                    if (scores[j - st] == -FLT_MAX) {
+                        continue;
+                    }
+                    float p = expf(scores[j - st] - curMax);
+                    sums[i] += p;
+                    AttentionAxpy(oi, rescale, p, vTile[j - st], v2);
+                    rescale = 1.0f;
                 }
-                qk[j] = sum * scale;
-                maxValue = std::max(maxValue, sum * scale);
-            }
-            for (int j = 0; j < k1; j++) {
-                temp[j] = expf(qk[j] - maxValue);
-                sum += temp[j];
             }
-            sum = std::max(sum, 0.1f);
-            for (int j = 0; j < k1; j++) {
-                qk[j] = temp[j] / sum;
+        }
+        for (int i = 0; i < rows; i++) {
+            float *oi = od + (uint64_t)i * v2;
+            if (sums[i] > 0) {
+                AttentionAxpy(oi, 1.0f / sums[i], 0.0f, oi, v2);
+                continue;
             }
-            for (int j = 0; j < k1; j++) {
-                for (int l = 0; l < v2; l++) {
-                    od[i * v2 + l] += qk[j] * vd[j * v2 + l];
+            int limit = causal ? std::min(k1, k1 - q1 + i % q1 + 1) : k1;
+            for (int j = 0; j < limit; j++) {
+                float *vj = (float*)vRows[j];
+                if (storeType != PAGED_KV_FLOAT32) {
+                    DequantKVRow(vRows[j], vBuffer.data(), v2, storeType);
+                    vj = vBuffer.data();
                 }
+                AttentionAxpy(oi, 1.0f, 1.0f / limit, vj, v2);
+            }
+        }
+    }
+
+    // 计算使用第kvHead个k, v head的连续heads个q head, k, v可以是连续存储或分页KV cache
+    void FusedAttentionHead(float *qd, Data *k, Data *v, int kvHead, float *maskd, float *od,
+                            float scale, float alibiSlope, bool causal, int q1, int q2, int k1, int v2, int heads) {
+        thread_local std::vector <uint8_t*> kRows, vRows;
+        kRows.resize(k1);
+        vRows.resize(k1);
+        int storeType = PAGED_KV_FLOAT32;
+        for (int j = 0; j < k1; j++) {
+            if (k->pagedKVCache != nullptr) {
+                kRows[j] = k->pagedKVCache->GetToken(kvHead, j);
+                vRows[j] = v->pagedKVCache->GetToken(kvHead, j);
+            } else {
+                kRows[j] = (uint8_t*)((float*)k->cpuData + kvHead * k->strides[0] + j * k->strides[1]);
+                vRows[j] = (uint8_t*)((float*)v->cpuData + kvHead * v->strides[0] + j * v->strides[1]);
             }
         }
-        delete[] qk;
-        delete[] temp;
+        if (k->pagedKVCache != nullptr) {
+            storeType = k->pagedKVCache->storeType;
+        }
+        FusedAttentionSingleHead(qd, kRows.data(), vRows.data(), storeType, maskd, od, scale, alibiSlope, causal, q1, q2, k1, v2, heads);
     }
 
     void CpuAttention::Run(const std::string &opType, const fastllm::DataDict &datas,
@@ -274,29 +435,38 @@ namespace fastllm {
         Data &v = *(datas.find("v")->second);
         Data &mask = *(datas.find("mask")->second);
         Data &output = *(datas.find("output")->second);
+        Data *alibi = datas.find("alibi") != datas.end() ? datas.find("alibi")->second : nullptr;
         int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
         float scale = floatParams.find("scale") != floatParams.end() ? floatParams.find("scale")->second : 1.0;
         output.Allocate();
+        AssertInFastLLM((k.pagedKVCache == nullptr) == (v.pagedKVCache == nullptr),
+                        "Attention error: k and v should both be paged or both be contiguous.\n");
         int q0 = q.dims[0], q1 = q.dims[1], q2 = q.dims[2], k0 = k.dims[0], k1 = k.dims[1], v2 = v.dims[2];
         float *qd = (float*)q.cpuData;
-        float *kd = (float*)k.cpuData;
-        float *vd = (float*)v.cpuData;
-        float *maskd = (datas.find("mask")->second && mask.dims.size() > 0) ? (float*)mask.cpuData : nullptr;
+        float *alibid = (alibi != nullptr && alibi->dims.size() > 0) ? (float*)alibi->cpuData : nullptr;
+        // 同AlibiMask: alibi模型按位置做因果mask, 不再使用传入的mask
+        float *maskd = (alibid == nullptr && datas.find("mask")->second && mask.dims.size() > 0) ? (float*)mask.cpuData : nullptr;
         float *od = (float*)output.cpuData;
         int batch = (mask.dims.size() == 3 ? mask.dims[0] : 1);
         int maskStride = (mask.dims.size() == 3 ? mask.strides[0] : mask.Count(0));
         std::fill(od, od + output.Count(0), 0.0f);
-        auto pool = GetPool();
-        std::vector<std::future<void> > futures;
-        for (int o = 0; o < q0; o++) {
-            futures.push_back(pool->Submit(SingleAttention,
-                            qd + o * q.strides[0], kd + (o / group) * k.strides[0], vd + (o / group) * v.strides[0],
-                            maskd + (o / (q0 / batch)) * maskStride, od + o * output.strides[0], scale,
-                            q1, q2, k1, v2));
-        }
-        for (int o = 0; o < futures.size(); o++) {
-            futures[o].get();
+        // 共享同一个k, v head的q head一起计算; k, v head不够分给所有线程时把一组再拆开
+        // alibi的每个head斜率不同, 仍然逐个head计算
+        int span = (alibid != nullptr || q.strides[0] != q1 * q2) ? 1 : group;
+        while (span > 1 && k0 * ((group + span - 1) / span) < GetThreads()) {
+            span = (span + 1) / 2;
         }
+        int parts = (group + span - 1) / span;
+        GetPool()->ParallelFor(k0 * parts, [&](int st, int end) {
+            for (int u = st; u < end; u++) {
+                int kvHead = u / parts, o = kvHead * group + (u % parts) * span;
+                int heads = std::min(span, (kvHead + 1) * group - o);
+                float alibiSlope = alibid ? alibid[o % alibi->dims[0]] : 0.0f;
+                FusedAttentionHead(qd + o * q.strides[0], &k, &v, kvHead,
+                                   maskd ? maskd + (o / (q0 / batch)) * maskStride : nullptr, od + o * output.strides[0],
+                                   scale, alibiSlope, alibid != nullptr, q1, q2, k1, v2, heads);
+            }
+        }, 1);
     }
 
     void CpuCopyKVCacheOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
@@ -618,6 +788,85 @@ namespace fastllm {
         }
     }
 
+    void CpuAddToRMSNormOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
+                                    const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input0 = *(datas.find("input0")->second);
+        Data &output = *(datas.find("output")->second);
+        if (&input0 == &output) {
+            return;
+        }
+        output.dataType = input0.dataType;
+        output.Resize(input0.dims);
+    }
+
+    void CpuAddToRMSNormOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                                const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input0 = *(datas.find("input0")->second);
+        Data &input1 = *(datas.find("input1")->second);
+        Data &weight = *(datas.find("weight")->second);
+        Data &output = *(datas.find("output")->second);
+        output.Allocate();
+
+        float eps = floatParams.find("eps") != floatParams.end() ? floatParams.find("eps")->second : 1e-5;
+        float alpha = floatParams.find("alpha") != floatParams.end() ? floatParams.find("alpha")->second : 1.0;
+        AssertInFastLLM(input0.dataType == DataType::FLOAT32 && input1.dataType == DataType::FLOAT32,
+                        "AddToRMSNorm error: Data's type should be float32.\n");
+        AssertInFastLLM(input0.dims == input1.dims, "AddToRMSNorm error: input's shape should be same.\n");
+
+        int channels = input0.dims.back();
+        int outer = input0.Count(0) / channels;
+        float *input0Data = (float *) input0.cpuData;
+        float *input1Data = (float *) input1.cpuData;
+        float *weightData = (float *) weight.cpuData;
+        float *outputData = (float *) output.cpuData;
+        // 每行先相加并累计平方和, 再用还在cache中的结果做归一化
+        GetPool()->ParallelFor(outer, [&](int st, int end) {
+            for (int i = st; i < end; i++) {
+                float *x = input0Data + (uint64_t) i * channels, *y = input1Data + (uint64_t) i * channels;
+                float *o = outputData + (uint64_t) i * channels;
+                int j = 0;
+                float sum = 0.0f;
+#ifdef __AVX2__
+                __m256 va = _mm256_set1_ps(alpha), vs = _mm256_setzero_ps();
+                for (; j + 7 < channels; j += 8) {
+                    __m256 vx = _mm256_fmadd_ps(_mm256_loadu_ps(y + j), va, _mm256_loadu_ps(x + j));
+                    _mm256_storeu_ps(x + j, vx);
+                    vs = _mm256_fmadd_ps(vx, vx, vs);
+                }
+                sum = Floatsum(vs);
+#elif defined(__aarch64__)
+                float32x4_t vs = vdupq_n_f32(0.0f);
+                for (; j + 3 < channels; j += 4) {
+                    float32x4_t vx = vfmaq_n_f32(vld1q_f32(x + j), vld1q_f32(y + j), alpha);
+                    vst1q_f32(x + j, vx);
+                    vs = vfmaq_f32(vs, vx, vx);
+                }
+                sum = vaddvq_f32(vs);
+#endif
+                for (; j < channels; j++) {
+                    x[j] += y[j] * alpha;
+                    sum += x[j] * x[j];
+                }
+                float scale = 1.0 / sqrt(sum / channels + eps);
+                j = 0;
+#ifdef __AVX2__
+                __m256 vscale = _mm256_set1_ps(scale);
+                for (; j + 7 < channels; j += 8) {
+                    _mm256_storeu_ps(o + j, _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(x + j), vscale),
+                                                          _mm256_loadu_ps(weightData + j)));
+                }
+#elif defined(__aarch64__)
+                for (; j + 3 < channels; j += 4) {
+                    vst1q_f32(o + j, vmulq_f32(vmulq_n_f32(vld1q_f32(x + j), scale), vld1q_f32(weightData + j)));
+                }
+#endif
+                for (; j < channels; j++) {
+                    o[j] = x[j] * scale * weightData[j];
+                }
+            }
+        }, 1);
+    }
+
     void CpuLinearOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
@@ -630,6 +879,9 @@ namespace fastllm {
         weight.weightType = WeightType::LINEAR;
         std::vector <int> dims = input.dims;
         dims.back() = weight.dims[0];
+        if (intParams.find("activation") != intParams.end() && intParams.find("activation")->second == LinearActivationSwiglu) {
+            dims.back() /= 2;
+        }
 
         output.dataType = input.dataType;
         output.Resize(dims);
@@ -1085,112 +1337,140 @@ namespace fastllm {
         }
     }
 
+    // 把Linear权重重新放到新申请的页上, 每一行由之后计算它的线程来拷贝 (first-touch),
+    // 这样每个NUMA节点上的线程只会访问本节点内存中的那一段权重
+    // 只在没有定义USE_MMAP时生效: USE_MMAP时权重都映射自模型文件, 保持原样
+    // 只处理每行占整数个字节的逐通道权重; 分组量化的权重和m为奇数的INT4权重不做重排
+    static void SpreadWeightToNumaNodes(Data &weight, int k, int m, int threadNum) {
+#ifndef USE_MMAP
+        static std::mutex locker;
+        std::lock_guard <std::mutex> guard(locker);
+        int nodes = GetPool()->GetNumaNodes();
+        if (weight.numaNodes == nodes || weight.cpuData == nullptr || weight.m_file != nullptr) {
+            // 映射自模型文件的权重不复制, 保持和其他进程共享
+            return;
+        }
+        if (weight.dataType == DataType::INT4_GROUP || weight.dataType == DataType::INT8_GROUP ||
+            (uint64_t)m * weight.unitSize % weight.unitSizeDiv != 0) {
+            // 行不能按字节切开, 保持原样; 同样标记为已处理, 以后不再检查
+            weight.numaNodes = nodes;
+            return;
+        }
+        uint64_t bytes = weight.GetBytes(), rowBytes = (uint64_t)m * weight.unitSize / weight.unitSizeDiv;
+        AssertInFastLLM(rowBytes * k == bytes, "SpreadWeightToNumaNodes error: weight should be [k, m].\n");
+        uint8_t *oldData = weight.cpuData;
+        uint8_t *newData = (uint8_t*)FastllmCpuMallocPages(bytes);
+        GetPool()->ParallelFor(k, [&](int st, int end) {
+            memcpy(newData + st * rowBytes, oldData + st * rowBytes, (end - st) * rowBytes);
+        }, GetLinearGrain(k, threadNum), threadNum);
+        weight.cpuData = newData;
+        weight.numaNodes = nodes;
+        FastllmCpuFree(oldData);
+#endif
+    }
+
     //a = [n, m], b = [k, m], c = aT(b') = [n, k]
     void MultiplyMultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int threadNum) {
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            Multiply(a, b + cur * m, c + cur, n, m, k - cur, k);
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < k);
-                if (i == threadNum - 1) {
-                    end = k;
-                }
-                futures.push_back(pool->Submit(Multiply, a, b + cur * m, c + cur, n, m, end - cur, k));
-                cur = end;
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
-            }
-        }
+        GetPool()->ParallelFor(k, [&](int st, int end) {
+            Multiply(a, b + st * m, c + st, n, m, end - st, k);
+        }, GetLinearGrain(k, threadNum), threadNum);
     }
 
     //a = [n, m], b = [k, m], c = aT(b') = [n, k]
     void MultiplyInt4MultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k,
-                                 int *weightSums, int *weightZeros, float *scales, float *bias, std::vector <LowBitConfig> &configs, int threadNum) {
-        std::vector <int> inputSums;
-        for (int i = 0; i < n; i++) {
-            int sum = 0;
-            for (int j = 0; j < m; j++) {
-                sum += a[i * m + j];
-            }
-            inputSums.push_back(sum);
-        }
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            MultiplyInt4(a, b + cur * m / 2, c + cur, n, m, k - cur, k,
-                         weightSums + cur, weightZeros + cur, scales + cur,
-                         (bias == nullptr ? (float*)nullptr : bias + cur), configs.data(), inputSums.data());
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = (i == threadNum - 1 ? k : cur + per + (cur + per * (threadNum - i) < k));
-                futures.push_back(pool->Submit(MultiplyInt4, a, b + cur * m / 2, c + cur, n, m, end - cur, k,
-                                               weightSums + cur, weightZeros + cur, scales + cur,
-                                               (bias == nullptr ? (float *) nullptr : bias + cur), configs.data(),
-                                               inputSums.data()));
-                cur = end;
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
-            }
-        }
+                                 int *weightSums, int *weightZeros, float *scales, float *bias, std::vector <LowBitConfig> &configs,
+                                 std::vector <int> &inputSums, int threadNum) {
+        GetPool()->ParallelFor(k, [&](int st, int end) {
+            MultiplyInt4(a, b + st * m / 2, c + st, n, m, end - st, k,
+                         weightSums + st, weightZeros + st, scales + st,
+                         (bias == nullptr ? (float*)nullptr : bias + st), configs.data(), inputSums.data());
+        }, GetLinearGrain(k, threadNum), threadNum);
     }
 
     //a = [n, m], b = [k, m], c = aT(b') = [n, k]
     void MultiplyInt4NoZeroMultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k,
                                  int *weightSums, float *weightMins, float *scales, float *bias,
-                                 std::vector <LowBitConfig> &configs, int threadNum) {
-        std::vector <int> inputSums;
-        for (int i = 0; i < n; i++) {
-            int sum = 0;
-            for (int j = 0; j < m; j++) {
-                sum += a[i * m + j];
-            }
-            inputSums.push_back(sum);
-        }
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            MultiplyInt4NoZero(a, b + cur * m / 2, c + cur, n, m, k - cur, k,
-                         weightSums + cur, weightMins + cur, scales + cur,
-                         (bias == nullptr ? (float*)nullptr : bias + cur), configs.data(), inputSums.data());
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = (i == threadNum - 1 ? k : cur + per + (cur + per * (threadNum - i) < k));
-                futures.push_back(pool->Submit(MultiplyInt4NoZero, a, b + cur * m / 2, c + cur, n, m, end - cur, k,
-                                               weightSums + cur, weightMins + cur, scales + cur,
-                                               (bias == nullptr ? (float *) nullptr : bias + cur), configs.data(),
-                                               inputSums.data()));
-                cur = end;
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
+                                 std::vector <LowBitConfig> &configs, std::vector <int> &inputSums, int threadNum) {
+        GetPool()->ParallelFor(k, [&](int st, int end) {
+            MultiplyInt4NoZero(a, b + st * m / 2, c + st, n, m, end - st, k,
+                               weightSums + st, weightMins + st, scales + st,
+                               (bias == nullptr ? (float*)nullptr : bias + st), configs.data(), inputSums.data());
+        }, GetLinearGrain(k, threadNum), threadNum);
+    }
+
+    void FloatSiluPart(float *inputData, float *outputData, int len);
+    void FloatGeluNewPart(float *inputData, float *outputData, int len);
+
+    // Linear的后处理: 在输出还在cache中的时候做激活 (gate不为空时乘上silu(gate))
+    void LinearEpilogue(float *input, float *gate, float *output, int n, int k, int activation) {
+        int outK = activation == LinearActivationSwiglu ? k / 2 : k;
+        int len = n * outK;
+        GetPool()->ParallelFor(len, [&](int st, int end) {
+            while (st < end) {
+                int row = st / outK, col = st % outK, cur = std::min(end - st, outK - col);
+                float *in = input + (uint64_t) row * k + col, *out = output + (uint64_t) row * outK + col;
+                if (activation == LinearActivationSilu) {
+                    FloatSiluPart(in, out, cur);
+                } else if (activation == LinearActivationGeluNew) {
+                    FloatGeluNewPart(in, out, cur);
+                } else if (activation == LinearActivationSwiglu) {
+                    FloatSiluPart(in, out, cur);
+                    for (int i = 0; i < cur; i++) {
+                        out[i] *= in[i + outK];
+                    }
+                } else if (in != out) {
+                    memcpy(out, in, cur * sizeof(float));
+                }
+                if (gate != nullptr) {
+                    float *g = gate + (uint64_t) row * outK + col;
+                    for (int i = 0; i < cur; i++) {
+                        out[i] *= g[i] / (1.0f + expf(-g[i]));
+                    }
+                }
+                st += cur;
             }
-        }
+        }, std::max(4096, (len - 1) / GetThreads() + 1));
     }
 
     void CpuLinearOp::Run(const std::string &opType, const fastllm::DataDict &datas,
                           const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
 //auto st = std::chrono::system_clock::now();
         Data &input = *(datas.find("input")->second);
-        Data &output = *(datas.find("output")->second);
+        Data &result = *(datas.find("output")->second);
         Data &weight = *(datas.find("weight")->second);
         Data &bias = *(datas.find("bias")->second);
+        Data *gate = datas.find("gate") != datas.end() ? datas.find("gate")->second : nullptr;
+        int activation = intParams.find("activation") != intParams.end() ? intParams.find("activation")->second : LinearActivationNone;
+
+        // Swiglu的输出宽度减半, 先算到临时的缓冲区中
+        Data swigluBuffer(result.dataType);
+        if (activation == LinearActivationSwiglu) {
+            std::vector <int> dims = result.dims;
+            dims.back() *= 2;
+            swigluBuffer.Resize(dims);
+        }
+        Data &output = activation == LinearActivationSwiglu ? swigluBuffer : result;
+        AssertInFastLLM((activation == LinearActivationNone && gate == nullptr) || output.dataType == DataType::FLOAT32,
+                        "Linear error: activation only support float32 output.\n");
+        AssertInFastLLM(gate == nullptr || gate->dims == result.dims, "Linear error: gate's shape should be same as output.\n");
 
         output.Allocate(0.0f);
         int n = input.Count(0) / input.dims.back();
         int m = input.dims.back();
         int k = output.dims.back();
+        if (GetNumaNodes() > 1 && weight.numaNodes != GetPool()->GetNumaNodes()) {
+            SpreadWeightToNumaNodes(weight, k, m, GetThreads());
+        }
+        if (weight.linearPacked && (input.dataType != DataType::FLOAT32 || output.dataType != DataType::FLOAT32)) {
+            // 预排过的权重只有float32的分块计算能用, 其余情况先还原成逐行存放
+            UnpackLinearWeight(weight);
+        }
 
-        if (input.dataType == DataType::FLOAT32 && output.dataType == DataType::FLOAT32) {
+        if (input.dataType == DataType::FLOAT32 && output.dataType == DataType::FLOAT32 && CanRunLinearGemm(weight, n)) {
+            // 多行输入时用分块的矩阵乘法
+            float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
+            LinearGemmMultiThread(input, weight, biasData, (float *) output.cpuData, n, m, k, GetThreads());
+        } else if (input.dataType == DataType::FLOAT32 && output.dataType == DataType::FLOAT32) {
             if (weight.dataType == DataType::FLOAT32) {
                 float *inputData = (float *) input.cpuData;
                 float *weightData = (float *) weight.cpuData;
@@ -1198,21 +1478,9 @@ namespace fastllm {
                 float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
 
                 int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                auto pool = GetPool();
-                std::vector<std::future<void> > futures;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    futures.push_back(pool->Submit(FloatLinearPart, inputData, weightData, biasData, outputData,
-                                                   n, m, k, cur, end));
-                    cur = end;
-                }
-
-                FloatLinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-                for (int i = 0; i < futures.size(); i++) {
-                    futures[i].get();
-                }
+                GetPool()->ParallelFor(k, [&](int st, int end) {
+                    FloatLinearPart(inputData, weightData, biasData, outputData, n, m, k, st, end);
+                }, GetLinearGrain(k, threadNum), threadNum);
             } else if (weight.dataType == DataType::FLOAT16) {
                 float *inputData = (float *) input.cpuData;
                 uint16_t *weightData = (uint16_t *) weight.cpuData;
@@ -1226,21 +1494,9 @@ namespace fastllm {
                 inputData = (float*)temp;
 #endif
                 int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                auto pool = GetPool();
-                std::vector<std::future<void> > futures;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    futures.push_back(pool->Submit(Float16LinearPart, inputData, weightData, biasData, outputData,
-                                                   n, m, k, cur, end));
-                    cur = end;
-                }
-
-                Float16LinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-                for (int i = 0; i < futures.size(); i++) {
-                    futures[i].get();
-                }
+                GetPool()->ParallelFor(k, [&](int st, int end) {
+                    Float16LinearPart(inputData, weightData, biasData, outputData, n, m, k, st, end);
+                }, GetLinearGrain(k, threadNum), threadNum);
 #ifdef __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
                 delete[] temp;
 #endif
@@ -1251,36 +1507,46 @@ namespace fastllm {
                 float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
                 weight.CalcWeightSum();
 
-                std::vector<LowBitConfig> inputConfigs;
-                for (int i = 0; i < n; i++) {
-                    float minValue = 1e9, maxValue = -1e9;
-                    for (int j = 0; j < m; j++) {
-                        minValue = std::min(minValue, inputData[i * m + j]);
-                        maxValue = std::max(maxValue, inputData[i * m + j]);
+                LinearInputCache &cache = GetLinearInputCache();
+                std::vector<LowBitConfig> &inputConfigs = cache.configs;
+                std::vector<uint8_t> &uinput = cache.uinput;
+                if (!cache.Find(input, LinearInputInt8)) {
+                    inputConfigs.clear();
+                    for (int i = 0; i < n; i++) {
+                        float minValue = 1e9, maxValue = -1e9;
+                        for (int j = 0; j < m; j++) {
+                            minValue = std::min(minValue, inputData[i * m + j]);
+                            maxValue = std::max(maxValue, inputData[i * m + j]);
+                        }
+                        inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
                     }
-                    inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
-                }
-                std::vector<uint8_t> uinput;
-                uinput.resize(n * m);
-                for (int i = 0; i < n * m; i++) {
+                    uinput.resize(n * m);
+                    for (int i = 0; i < n * m; i++) {
 #ifdef __AVX2__
-                    uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
-                    uinput[i] = (uinput[i] + !uinput[i]) ^ 128;
+                        uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
+                        uinput[i] = (uinput[i] + !uinput[i]) ^ 128;
 #else
-                    uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
+                        uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
 #endif
-                }
-
-                MultiplyMultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k, GetThreads());
-                for (int i = 0; i < n; i++) {
-                    uint32_t inputSum = 0;
-                    for (int j = 0; j < m; j++) {
+                    }
+                    cache.inputSums.resize(n);
+                    for (int i = 0; i < n; i++) {
+                        uint32_t inputSum = 0;
+                        for (int j = 0; j < m; j++) {
 #ifdef __AVX2__
-                        inputSum += uinput[i * m + j] ^ 128;
+                            inputSum += uinput[i * m + j] ^ 128;
 #else
-                        inputSum += uinput[i * m + j];
+                            inputSum += uinput[i * m + j];
 #endif
+                        }
+                        cache.inputSums[i] = inputSum;
                     }
+                    cache.Set(input, LinearInputInt8);
+                }
+
+                MultiplyMultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k, GetThreads());
+                for (int i = 0; i < n; i++) {
+                    uint32_t inputSum = cache.inputSums[i];
 
                     for (int j = 0; j < k; j++) {
                         int value = ((int32_t *) outputData)[i * k + j];
@@ -1322,43 +1588,56 @@ namespace fastllm {
                 float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
                 weight.CalcWeightSum();
 
-                std::vector<LowBitConfig> inputConfigs;
-                for (int i = 0; i < n; i++) {
-                    float minValue = 1e9, maxValue = -1e9;
-                    for (int j = 0; j < m; j++) {
-                        minValue = std::min(minValue, inputData[i * m + j]);
-                        maxValue = std::max(maxValue, inputData[i * m + j]);
+                LinearInputCache &cache = GetLinearInputCache();
+                std::vector<LowBitConfig> &inputConfigs = cache.configs;
+                std::vector<uint8_t> &uinput = cache.uinput;
+                if (!cache.Find(input, LinearInputInt4)) {
+                    inputConfigs.clear();
+                    for (int i = 0; i < n; i++) {
+                        float minValue = 1e9, maxValue = -1e9;
+                        for (int j = 0; j < m; j++) {
+                            minValue = std::min(minValue, inputData[i * m + j]);
+                            maxValue = std::max(maxValue, inputData[i * m + j]);
+                        }
+                        inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
+                    }
+                    uinput.resize(n * m);
+                    for (int i = 0; i < n * m; i++) {
+                        uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
+                    }
+                    cache.inputSums.resize(n);
+                    for (int i = 0; i < n; i++) {
+                        int sum = 0;
+                        for (int j = 0; j < m; j++) {
+                            sum += uinput[i * m + j];
+                        }
+                        cache.inputSums[i] = sum;
                     }
-                    inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
-                }
-                std::vector<uint8_t> uinput;
-                uinput.resize(n * m);
-                for (int i = 0; i < n * m; i++) {
-                    uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
-                }
 #ifdef __AVX__
-                uint8_t *temp = new uint8_t[32];
-                for (int i = 0; i < n; i++) {
-                    for (int j = 0; j + 31 < m; j += 32) {
-                        memcpy(temp, uinput.data() + i * m + j, 32);
-                        for (int k = 0; k < 16; k++) {
-                            uinput[i * m + j + k] = temp[k * 2 + 1];
-                            uinput[i * m + j + k + 16] = temp[k * 2];
+                    uint8_t *temp = new uint8_t[32];
+                    for (int i = 0; i < n; i++) {
+                        for (int j = 0; j + 31 < m; j += 32) {
+                            memcpy(temp, uinput.data() + i * m + j, 32);
+                            for (int k = 0; k < 16; k++) {
+                                uinput[i * m + j + k] = temp[k * 2 + 1];
+                                uinput[i * m + j + k + 16] = temp[k * 2];
+                            }
                         }
                     }
-                }
-                delete[] temp;
+                    delete[] temp;
 #endif
+                    cache.Set(input, LinearInputInt4);
+                }
                 if (weight.dataType == DataType::INT4) {
                     MultiplyInt4MultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k,
                                             weight.weightSum.data(), weight.zeros.data(), weight.scales.data(),
                                             biasData,
-                                            inputConfigs, GetThreads());
+                                            inputConfigs, cache.inputSums, GetThreads());
                 } else {
                     MultiplyInt4NoZeroMultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k,
                                                   weight.weightSum.data(), weight.mins.data(), weight.scales.data(),
                                                   biasData,
-                                                  inputConfigs, GetThreads());
+                                                  inputConfigs, cache.inputSums, GetThreads());
                 }
 
 /*
@@ -1389,27 +1668,20 @@ namespace fastllm {
                 uint16_t *outputData = (uint16_t *) output.cpuData;
                 float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
                 int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                auto pool = GetPool();
-                std::vector<std::future<void> > futures;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    futures.push_back(pool->Submit(Float16xFloat16LinearPart, inputData, weightData, biasData, outputData,
-                                                   n, m, k, cur, end));
-                    cur = end;
-                }
-
-                Float16xFloat16LinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-                for (int i = 0; i < futures.size(); i++) {
-                    futures[i].get();
-                }
+                GetPool()->ParallelFor(k, [&](int st, int end) {
+                    Float16xFloat16LinearPart(inputData, weightData, biasData, outputData, n, m, k, st, end);
+                }, GetLinearGrain(k, threadNum), threadNum);
             } else {
                 ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
             }
         } else {
             ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
         }
+        if (activation != LinearActivationNone || gate != nullptr) {
+            result.Allocate();
+            LinearEpilogue((float *) output.cpuData, gate ? (float *) gate->cpuData : nullptr,
+                           (float *) result.cpuData, n, k, activation);
+        }
 //float spend = GetSpan(st, std::chrono::system_clock::now());
 //float gops = (float)n * m * k / spend / 1e9;
 // printf("n = %d, m = %d, k = %d, spend %f s, gops = %f\n", n, m, k, spend, gops);
@@ -1566,6 +1838,17 @@ namespace fastllm {
                         "CatDirect's input's type should be float32.\n");
         AssertInFastLLM(input0.dataDevice == input1.dataDevice, "CatDirect error: inputs should use same device.\n");
 
+        if (input0.pagedKVCache != nullptr) {
+            // 分页KV cache: 新token直接写入block, 历史数据不移动
+            PagedKVCache &cache = *input0.pagedKVCache;
+            AssertInFastLLM(input1.dims.size() == 3 && (axis == 1 || axis == -2) &&
+                            input1.dims[0] == cache.heads && input1.dims[2] == cache.dim,
+                            "CatDirect error: paged kv cache only supports [heads, len, dim] along axis 1.\n");
+            cache.Append(input1.cpuData, input1.dims[1], input1.strides[0]);
+            input0.Resize({cache.heads, cache.len, cache.dim});
+            return;
+        }
+
         if (input0.dims.size() == 0) {
             input0.Resize(input1.dims);
             AssertInFastLLM(input0.expansionDims.size() == input1.dims.size() &&
@@ -1796,40 +2079,18 @@ namespace fastllm {
         }
         threadNum = std::min(threadNum, 4);
         // TODO: 汇编优化
-        int per = batch0 / threadNum;
-        int cur = 0;
-        auto pool = GetPool();
-        std::vector <std::future <void> > futures;
         if (input0.dataType == DataType::FLOAT32) {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulSingle,
-                                               (float *) input0.cpuData, (float *) input1.cpuData,
-                                               (float *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulSingle((float *) input0.cpuData, (float *) input1.cpuData, (float *) output.cpuData,
+            GetPool()->ParallelFor(batch0, [&](int st, int end) {
+                MatMulSingle((float *) input0.cpuData, (float *) input1.cpuData, (float *) output.cpuData,
                          input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                         n, m, k, alpha, cur, batch0);
+                         n, m, k, alpha, st, end);
+            }, 0, threadNum);
         } else if (input0.dataType == DataType::FLOAT16) {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulFloat16Single,
-                                               (uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData,
-                                               (uint16_t *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulFloat16Single((uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData, (uint16_t *) output.cpuData,
+            GetPool()->ParallelFor(batch0, [&](int st, int end) {
+                MatMulFloat16Single((uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData, (uint16_t *) output.cpuData,
                          input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                         n, m, k, alpha, cur, batch0);
-        }
-
-        for (int i = 0; i < futures.size(); i++) {
-            futures[i].get();
+                         n, m, k, alpha, st, end);
+            }, 0, threadNum);
         }
     }
 
@@ -1900,40 +2161,18 @@ namespace fastllm {
             threadNum = 1;
         }
         threadNum = std::min(threadNum, 4);
-        int per = batch0 / threadNum;
-        int cur = 0;
-        auto pool = GetPool();
-        std::vector <std::future <void> > futures;
         if (input0.dataType == DataType::FLOAT32) {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulTransBSingle,
-                                               (float *) input0.cpuData, (float *) input1.cpuData,
-                                               (float *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulTransBSingle((float *) input0.cpuData, (float *) input1.cpuData, (float *) output.cpuData,
-                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                               n, m, k, alpha, cur, batch0);
+            GetPool()->ParallelFor(batch0, [&](int st, int end) {
+                MatMulTransBSingle((float *) input0.cpuData, (float *) input1.cpuData, (float *) output.cpuData,
+                         input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
+                         n, m, k, alpha, st, end);
+            }, 0, threadNum);
         } else {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulTransBFloat16Single,
-                                               (uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData,
-                                               (uint16_t *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulTransBFloat16Single((uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData, (uint16_t *) output.cpuData,
-                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                               n, m, k, alpha, cur, batch0);
-        }
-
-        for (int i = 0; i < futures.size(); i++) {
-            futures[i].get();
+            GetPool()->ParallelFor(batch0, [&](int st, int end) {
+                MatMulTransBFloat16Single((uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData, (uint16_t *) output.cpuData,
+                         input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
+                         n, m, k, alpha, st, end);
+            }, 0, threadNum);
         }
     }
 
@@ -2090,21 +2329,9 @@ namespace fastllm {
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int threadNum = GetThreads();
-        int per = len / threadNum;
-        int last = len - (threadNum - 1) * per;
-        
-        auto pool = GetPool();
-        std::vector <std::future <void> > futures;
-        int start = 0;
-        for (int i = 0; i < threadNum - 1; i++) {
-            futures.push_back(pool->Submit(FloatSiluPart, inputData + start, outputData + start, per));
-            start += per;
-        }
-        FloatSiluPart(inputData + start, outputData + start, last);
-        for (int i = 0; i < futures.size(); i++) {
-            futures[i].get();
-        }
+        GetPool()->ParallelFor(len, [&](int st, int end) {
+            FloatSiluPart(inputData + st, outputData + st, end - st);
+        }, std::max(4096, (len - 1) / GetThreads() + 1));
     }
 
     void FloatGeluNewPart(float *inputData, float *outputData, int len) {
@@ -2191,21 +2418,9 @@ namespace fastllm {
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int threadNum = GetThreads();
-        int per = len / threadNum;
-        int last = len - (threadNum - 1) * per;
-
-        auto pool = GetPool();
-        std::vector <std::future <void> > futures;
-        int start = 0;
-        for (int i = 0; i < threadNum - 1; i++) {
-            futures.push_back(pool->Submit(FloatGeluNewPart, inputData + start, outputData + start, per));
-            start += per;
-        }
-        FloatGeluNewPart(inputData + start, outputData + start, last);
-        for (int i = 0; i < futures.size(); i++) {
-            futures[i].get();
-        }
+        GetPool()->ParallelFor(len, [&](int st, int end) {
+            FloatGeluNewPart(inputData + st, outputData + st, end - st);
+        }, std::max(4096, (len - 1) / GetThreads() + 1));
     }
 
     void CpuSwigluOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
@@ -2564,20 +2779,7 @@ namespace fastllm {
             int n = input.dims[0];
             int m = input.Count(1);
 
-            int threadNum = 1;
-            int per = m / threadNum;
-            int cur = 0;
-            auto pool = GetPool();
-            std::vector <std::future <void> > futures;
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < m);
-                futures.push_back(pool->Submit(Transpose, ((float*)tmpData) + cur * n, ((float*)curData) + cur, n, m, n, end - cur));
-                cur = end;
-            }
-            Transpose(((float*)tmpData) + cur * n, ((float*)curData) + cur, n, m, n, m - cur);
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
-            }
+            Transpose((float*)tmpData, (float*)curData, n, m, n, m);
         } else if (axis == std::vector <int> {1, 0, 2}) {
             int n = input.dims[0];
             int m = input.dims[1];
@@ -0,0 +1,797 @@
+#include "devices/cpu/cpulinear.h"
+#include "utils.h"
+
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+
+#ifdef __AVX2__
+#include "immintrin.h"
+#endif
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
+
+namespace fastllm {
+    // 按列切分Linear时每块的大小: 每个线程分4块方便窃取, 按8对齐
+    int GetLinearGrain(int k, int threadNum) {
+        int grain = (k - 1) / (threadNum * 4) + 1;
+        return (grain + 7) / 8 * 8;
+    }
+
+    bool LinearInputCache::Find(const Data &input, int format, int groupCnt) {
+        return this->input == &input && this->cpuData == input.cpuData && this->version == input.version &&
+               this->dims == input.dims && this->format == format && this->groupCnt == groupCnt;
+    }
+
+    void LinearInputCache::Set(const Data &input, int format, int groupCnt) {
+        this->input = &input;
+        this->cpuData = input.cpuData;
+        this->version = input.version;
+        this->dims = input.dims;
+        this->format = format;
+        this->groupCnt = groupCnt;
+    }
+
+    LinearInputCache &GetLinearInputCache() {
+        static thread_local LinearInputCache cache;
+        return cache;
+    }
+
+    static const int gemmMR = 4; // 每次计算的输入行数
+    static const int gemmNR = 2; // 每次计算的输出通道数, 也是预排时一个panel中的输出通道数
+    static const int gemmRowBlockBytes = 256 * 1024; // 一个输入行块的大小, 需要能放进L2
+
+    // 微内核用到的向量运算: 量化权重每次处理32个元素 (两个GemmIntVec), 浮点权重每次处理8个元素
+#ifdef __AVX2__
+    // AVX2: 输入和权重都展开成int16, 用madd (或VNNI) 累加
+    typedef __m256i GemmIntVec;
+    typedef __m256i GemmIntAcc;
+
+    static inline GemmIntAcc GemmIntZero() {
+        return _mm256_setzero_si256();
+    }
+
+    static inline GemmIntVec GemmIntOnes() {
+        return _mm256_set1_epi16(1);
+    }
+
+    static inline void GemmLoadInput(const int16_t *a, GemmIntVec &x0, GemmIntVec &x1) {
+        x0 = _mm256_loadu_si256((const __m256i *) a);
+        x1 = _mm256_loadu_si256((const __m256i *) (a + 16));
+    }
+
+    static inline GemmIntAcc GemmIntDot(GemmIntAcc acc, GemmIntVec a, GemmIntVec b) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        return _mm256_dpwssd_epi32(acc, a, b);
+#else
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+#endif
+    }
+
+    static inline int GemmIntSum(GemmIntAcc acc) {
+        return I32sum(acc);
+    }
+
+    typedef __m256 GemmFloatVec;
+
+    static inline GemmFloatVec GemmFloatZero() {
+        return _mm256_setzero_ps();
+    }
+
+    static inline GemmFloatVec GemmLoadFloat(const float *a) {
+        return _mm256_loadu_ps(a);
+    }
+
+    static inline GemmFloatVec GemmFloatFma(GemmFloatVec acc, GemmFloatVec a, GemmFloatVec b) {
+        return _mm256_fmadd_ps(a, b, acc);
+    }
+
+    static inline float GemmFloatSum(GemmFloatVec acc) {
+        return Floatsum(acc);
+    }
+#elif defined(__aarch64__)
+    // NEON: 输入 (量化值减128) 和权重都在[-128, 127]内, 收窄成int8后用sdot累加, 没有dotprod扩展时用vmull + vpadal
+    typedef int8x16_t GemmIntVec;
+    typedef int32x4_t GemmIntAcc;
+
+    static inline GemmIntAcc GemmIntZero() {
+        return vdupq_n_s32(0);
+    }
+
+    static inline GemmIntVec GemmIntOnes() {
+        return vdupq_n_s8(1);
+    }
+
+    static inline void GemmLoadInput(const int16_t *a, GemmIntVec &x0, GemmIntVec &x1) {
+        x0 = vcombine_s8(vmovn_s16(vld1q_s16(a)), vmovn_s16(vld1q_s16(a + 8)));
+        x1 = vcombine_s8(vmovn_s16(vld1q_s16(a + 16)), vmovn_s16(vld1q_s16(a + 24)));
+    }
+
+    static inline GemmIntAcc GemmIntDot(GemmIntAcc acc, GemmIntVec a, GemmIntVec b) {
+#ifdef __ARM_FEATURE_DOTPROD
+        return vdotq_s32(acc, a, b);
+#else
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(a), vget_low_s8(b)));
+        return vpadalq_s16(acc, vmull_high_s8(a, b));
+#endif
+    }
+
+    static inline int GemmIntSum(GemmIntAcc acc) {
+        return vaddvq_s32(acc);
+    }
+
+    struct GemmFloatVec {
+        float32x4_t v0, v1;
+    };
+
+    static inline GemmFloatVec GemmFloatZero() {
+        return GemmFloatVec {vdupq_n_f32(0.0f), vdupq_n_f32(0.0f)};
+    }
+
+    static inline GemmFloatVec GemmLoadFloat(const float *a) {
+        return GemmFloatVec {vld1q_f32(a), vld1q_f32(a + 4)};
+    }
+
+    static inline GemmFloatVec GemmFloatFma(GemmFloatVec acc, GemmFloatVec a, GemmFloatVec b) {
+        return GemmFloatVec {vfmaq_f32(acc.v0, a.v0, b.v0), vfmaq_f32(acc.v1, a.v1, b.v1)};
+    }
+
+    static inline float GemmFloatSum(GemmFloatVec acc) {
+        return vaddvq_f32(vaddq_f32(acc.v0, acc.v1));
+    }
+#endif
+
+    // 量化权重的读取: Load一次展开一段 (KB = 32个元素) 成两个向量, Get读取单个元素
+    // Load的结果是w - Offset - Shift, 内核最后再加回Shift * sum(a) (只有NEON上的INT8_GROUP需要)
+    // int8权重: 每个元素减去128 (Offset = 128) 或保持原值 (Offset = 0)
+    template <int Offset>
+    struct Int8GemmWeight {
+        typedef int Value;
+        static const int KB = 32;
+
+        static uint64_t RowBytes(int m) {
+            return m;
+        }
+#ifdef __AVX2__
+        static const int Shift = 0;
+
+        static inline void Load(const uint8_t *p, GemmIntVec &v0, GemmIntVec &v1) {
+            const __m256i offset = _mm256_set1_epi16(Offset);
+            __m256i x = _mm256_loadu_si256((const __m256i *) p);
+            v0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(x)), offset);
+            v1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1)), offset);
+        }
+#elif defined(__aarch64__)
+        static const int Shift = 128 - Offset;
+
+        static inline void Load(const uint8_t *p, GemmIntVec &v0, GemmIntVec &v1) {
+            const uint8x16_t sign = vdupq_n_u8(0x80);
+            v0 = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(p), sign));
+            v1 = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(p + 16), sign));
+        }
+#else
+        static const int Shift = 0;
+#endif
+        static inline int Get(const uint8_t *row, int l) {
+            return (int)row[l] - Offset;
+        }
+    };
+
+    // int4权重: 每个字节的高4位是偶数位置的元素, 低4位是奇数位置的元素
+    struct Int4GemmWeight {
+        typedef int Value;
+        static const int KB = 32;
+        static const int Shift = 0;
+
+        static uint64_t RowBytes(int m) {
+            return m / 2;
+        }
+#ifdef __AVX2__
+        static inline void Load(const uint8_t *p, GemmIntVec &v0, GemmIntVec &v1) {
+            __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+            __m256i hi = _mm256_srli_epi16(x, 4), lo = _mm256_and_si256(x, _mm256_set1_epi16(0xF));
+            __m256i a = _mm256_unpacklo_epi16(hi, lo), b = _mm256_unpackhi_epi16(hi, lo);
+            v0 = _mm256_permute2x128_si256(a, b, 0x20);
+            v1 = _mm256_permute2x128_si256(a, b, 0x31);
+        }
+#elif defined(__aarch64__)
+        static inline void Load(const uint8_t *p, GemmIntVec &v0, GemmIntVec &v1) {
+            uint8x16_t x = vld1q_u8(p);
+            uint8x16x2_t v = vzipq_u8(vshrq_n_u8(x, 4), vandq_u8(x, vdupq_n_u8(0xF)));
+            v0 = vreinterpretq_s8_u8(v.val[0]);
+            v1 = vreinterpretq_s8_u8(v.val[1]);
+        }
+#endif
+        static inline int Get(const uint8_t *row, int l) {
+            return (l % 2) ? (row[l / 2] & 0xF) : (row[l / 2] >> 4);
+        }
+    };
+
+    // 浮点权重: 一段为8个元素
+    struct Float32GemmWeight {
+        typedef float Value;
+        static const int KB = 8;
+
+        static uint64_t RowBytes(int m) {
+            return (uint64_t)m * 4;
+        }
+#ifdef __AVX2__
+        static inline GemmFloatVec Load(const uint8_t *p) {
+            return _mm256_loadu_ps((const float *) p);
+        }
+#elif defined(__aarch64__)
+        static inline GemmFloatVec Load(const uint8_t *p) {
+            return GemmLoadFloat((const float *) p);
+        }
+#endif
+        static inline float Get(const uint8_t *row, int l) {
+            return ((const float *) row)[l];
+        }
+    };
+
+    struct Float16GemmWeight {
+        typedef float Value;
+        static const int KB = 8;
+
+        static uint64_t RowBytes(int m) {
+            return (uint64_t)m * 2;
+        }
+#ifdef __AVX2__
+        static inline GemmFloatVec Load(const uint8_t *p) {
+            return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) p));
+        }
+#elif defined(__aarch64__)
+        static inline GemmFloatVec Load(const uint8_t *p) {
+            float16x8_t h = vreinterpretq_f16_u16(vld1q_u16((const uint16_t *) p));
+            return GemmFloatVec {vcvt_f32_f16(vget_low_f16(h)), vcvt_high_f32_f16(h)};
+        }
+#endif
+        static inline float Get(const uint8_t *row, int l) {
+            return half_to_float(((const uint16_t *) row)[l]);
+        }
+    };
+
+    // NR个输出通道的权重. 逐行存放时第j行从b + j * ldb开始;
+    // 预排过 (Packed) 时NR行按段交错存放: [段0: 行0, 行1, ...][段1: 行0, 行1, ...]..., 每段KB个元素,
+    // 末尾不足一段的部分再按行依次存放, 这样内核每读一段都是连续的NR * RowBytes(KB)字节
+    template <typename W, int NR, bool Packed>
+    struct GemmPanel {
+        const uint8_t *b;
+        uint64_t ldb;
+        int full; // 完整的段覆盖的元素个数
+
+        GemmPanel(const uint8_t *b, uint64_t ldb, int m) : b(b), ldb(ldb), full(m / W::KB * W::KB) {}
+
+        // 第j行从第l个元素开始的一段; Packed时l必须是KB的倍数并且l < full
+        inline const uint8_t *Chunk(int j, int l) const {
+            if (Packed) {
+                return b + ((uint64_t)(l / W::KB) * NR + j) * W::RowBytes(W::KB);
+            }
+            return b + j * ldb + W::RowBytes(l);
+        }
+
+        inline typename W::Value Get(int j, int l) const {
+            if (!Packed) {
+                return W::Get(b + j * ldb, l);
+            }
+            if (l < full) {
+                return W::Get(Chunk(j, l / W::KB * W::KB), l % W::KB);
+            }
+            uint64_t fullBytes = W::RowBytes(full);
+            return W::Get(b + NR * fullBytes + j * (ldb - fullBytes), l - full);
+        }
+    };
+
+    // 分组量化: c[r * ldc + j] = sum_g(scales[j][g] * sum_{l in g}(a[r][l] * b[j][l])), r < MR, j < NR
+    template <typename W, int MR, int NR, bool Packed>
+    static inline void GroupGemmKernel(const int16_t *a, int m, const GemmPanel <W, NR, Packed> &b,
+                                       int group, int groupCnt, const float *scales, float *c, int ldc) {
+        float sum[MR][NR];
+        for (int r = 0; r < MR; r++) {
+            for (int j = 0; j < NR; j++) {
+                sum[r][j] = 0.0f;
+            }
+        }
+        for (int g = 0; g < group; g++) {
+            int st = g * groupCnt, end = std::min(m, st + groupCnt);
+            int value[MR][NR];
+            int l = st;
+#if defined(__AVX2__) || defined(__aarch64__)
+            GemmIntAcc acc[MR][NR], inputAcc[MR];
+            const GemmIntVec ones = GemmIntOnes();
+            for (int r = 0; r < MR; r++) {
+                inputAcc[r] = GemmIntZero();
+                for (int j = 0; j < NR; j++) {
+                    acc[r][j] = GemmIntZero();
+                }
+            }
+            if (st % 2 == 0) {
+                for (; l + W::KB <= end; l += W::KB) {
+                    GemmIntVec w[NR][2];
+                    for (int j = 0; j < NR; j++) {
+                        W::Load(b.Chunk(j, l), w[j][0], w[j][1]);
+                    }
+                    for (int r = 0; r < MR; r++) {
+                        GemmIntVec x0, x1;
+                        GemmLoadInput(a + r * m + l, x0, x1);
+                        for (int j = 0; j < NR; j++) {
+                            acc[r][j] = GemmIntDot(GemmIntDot(acc[r][j], x0, w[j][0]), x1, w[j][1]);
+                        }
+                        if (W::Shift != 0) {
+                            inputAcc[r] = GemmIntDot(GemmIntDot(inputAcc[r], x0, ones), x1, ones);
+                        }
+                    }
+                }
+            }
+            for (int r = 0; r < MR; r++) {
+                int inputSum = W::Shift != 0 ? W::Shift * GemmIntSum(inputAcc[r]) : 0;
+                for (int j = 0; j < NR; j++) {
+                    value[r][j] = GemmIntSum(acc[r][j]) + inputSum;
+                }
+            }
+#else
+            for (int r = 0; r < MR; r++) {
+                for (int j = 0; j < NR; j++) {
+                    value[r][j] = 0;
+                }
+            }
+#endif
+            for (; l < end; l++) {
+                int w[NR];
+                for (int j = 0; j < NR; j++) {
+                    w[j] = b.Get(j, l);
+                }
+                for (int r = 0; r < MR; r++) {
+                    for (int j = 0; j < NR; j++) {
+                        value[r][j] += a[r * m + l] * w[j];
+                    }
+                }
+            }
+            for (int r = 0; r < MR; r++) {
+                for (int j = 0; j < NR; j++) {
+                    sum[r][j] += scales[j * group + g] * value[r][j];
+                }
+            }
+        }
+        for (int r = 0; r < MR; r++) {
+            for (int j = 0; j < NR; j++) {
+                c[r * ldc + j] = sum[r][j];
+            }
+        }
+    }
+
+    template <typename W, int NR, bool Packed>
+    static void GroupGemmRows(const int16_t *a, int r0, int r1, int m, const GemmPanel <W, NR, Packed> &b,
+                              int group, int groupCnt, const float *scales, float *c, int k) {
+        int r = r0;
+        for (; r + gemmMR <= r1; r += gemmMR) {
+            GroupGemmKernel <W, gemmMR, NR, Packed> (a + (uint64_t)r * m, m, b, group, groupCnt, scales, c + (uint64_t)r * k, k);
+        }
+        if (r1 - r == 3) {
+            GroupGemmKernel <W, 3, NR, Packed> (a + (uint64_t)r * m, m, b, group, groupCnt, scales, c + (uint64_t)r * k, k);
+        } else if (r1 - r == 2) {
+            GroupGemmKernel <W, 2, NR, Packed> (a + (uint64_t)r * m, m, b, group, groupCnt, scales, c + (uint64_t)r * k, k);
+        } else if (r1 - r == 1) {
+            GroupGemmKernel <W, 1, NR, Packed> (a + (uint64_t)r * m, m, b, group, groupCnt, scales, c + (uint64_t)r * k, k);
+        }
+    }
+
+    // 预排过的权重中, 凑不满一个panel的最后几个输出通道仍然逐行存放
+    template <typename W, bool Packed>
+    static void GroupGemmPart(const int16_t *a, const uint8_t *b, int group, int groupCnt, const float *scales,
+                              float *c, int n, int m, int k, int st, int end) {
+        uint64_t ldb = W::RowBytes(m);
+        int rowBlock = std::max(gemmMR, gemmRowBlockBytes / (m * 2) / gemmMR * gemmMR);
+        for (int r0 = 0; r0 < n; r0 += rowBlock) {
+            int r1 = std::min(n, r0 + rowBlock);
+            int j = st;
+            for (; j + gemmNR <= end; j += gemmNR) {
+                GroupGemmRows (a, r0, r1, m, GemmPanel <W, gemmNR, Packed> (b + j * ldb, ldb, m),
+                               group, groupCnt, scales + (uint64_t)j * group, c + j, k);
+            }
+            for (; j < end; j++) {
+                GroupGemmRows (a, r0, r1, m, GemmPanel <W, 1, false> (b + j * ldb, ldb, m),
+                               group, groupCnt, scales + (uint64_t)j * group, c + j, k);
+            }
+        }
+    }
+
+    // 输入逐行按[min, max]量化成uint8, 再减去128存成int16, inputSums为每行量化值(减去128后)的和
+    // groupCnt > 0时inputSums按[行, 组]存放每组的和; 结果放在线程的输入缓存中, 输入没有变化时直接复用
+    static LinearInputCache &QuantizeGemmInput(const Data &input, int n, int m, int threadNum, int groupCnt = -1) {
+        LinearInputCache &cache = GetLinearInputCache();
+        if (cache.Find(input, LinearInputInt16, groupCnt)) {
+            return cache;
+        }
+        float *inputData = (float *) input.cpuData;
+        std::vector <int16_t> &qinput = cache.qinput;
+        std::vector <LowBitConfig> &configs = cache.configs;
+        std::vector <int> &inputSums = cache.inputSums;
+        int group = groupCnt > 0 ? (m - 1) / groupCnt + 1 : 1;
+        qinput.resize((uint64_t)n * m);
+        configs.resize(n);
+        inputSums.resize((uint64_t)n * group);
+        GetPool()->ParallelFor(n, [&](int st, int end) {
+            for (int i = st; i < end; i++) {
+                float *row = inputData + (uint64_t)i * m;
+                float minValue = 1e9, maxValue = -1e9;
+                for (int j = 0; j < m; j++) {
+                    minValue = std::min(minValue, row[j]);
+                    maxValue = std::max(maxValue, row[j]);
+                }
+                configs[i] = LowBitConfig(minValue, maxValue, 8, 0);
+                int16_t *q = qinput.data() + (uint64_t)i * m;
+                int *sums = inputSums.data() + (uint64_t)i * group;
+                for (int g = 0; g < group; g++) {
+                    sums[g] = 0;
+                }
+                for (int j = 0; j < m; j++) {
+                    q[j] = (int16_t)configs[i].quantization(row[j]) - 128;
+                    sums[groupCnt > 0 ? j / groupCnt : 0] += q[j];
+                }
+            }
+        }, 0, threadNum);
+        cache.Set(input, LinearInputInt16, groupCnt);
+        return cache;
+    }
+
+#if defined(__AVX2__) || defined(__aarch64__)
+
+    // c[r * ldc + j] = sum(a[r][l] * b[j][l]), r < MR, j < NR
+    template <typename W, int MR, int NR, bool Packed>
+    static inline void QuantGemmKernel(const int16_t *a, int m, const GemmPanel <W, NR, Packed> &b, int *c, int ldc) {
+        GemmIntAcc acc[MR][NR], inputAcc[MR];
+        const GemmIntVec ones = GemmIntOnes();
+        for (int r = 0; r < MR; r++) {
+            inputAcc[r] = GemmIntZero();
+            for (int j = 0; j < NR; j++) {
+                acc[r][j] = GemmIntZero();
+            }
+        }
+        int l = 0;
+        for (; l + W::KB <= m; l += W::KB) {
+            GemmIntVec w[NR][2];
+            for (int j = 0; j < NR; j++) {
+                W::Load(b.Chunk(j, l), w[j][0], w[j][1]);
+            }
+            for (int r = 0; r < MR; r++) {
+                GemmIntVec x0, x1;
+                GemmLoadInput(a + r * m + l, x0, x1);
+                for (int j = 0; j < NR; j++) {
+                    acc[r][j] = GemmIntDot(GemmIntDot(acc[r][j], x0, w[j][0]), x1, w[j][1]);
+                }
+                if (W::Shift != 0) {
+                    inputAcc[r] = GemmIntDot(GemmIntDot(inputAcc[r], x0, ones), x1, ones);
+                }
+            }
+        }
+        for (int r = 0; r < MR; r++) {
+            int inputSum = W::Shift != 0 ? W::Shift * GemmIntSum(inputAcc[r]) : 0;
+            for (int j = 0; j < NR; j++) {
+                int value = GemmIntSum(acc[r][j]) + inputSum;
+                for (int t = l; t < m; t++) {
+                    value += a[r * m + t] * b.Get(j, t);
+                }
+                c[r * ldc + j] = value;
+            }
+        }
+    }
+
+    template <typename W, int NR, bool Packed>
+    static void QuantGemmRows(const int16_t *a, int r0, int r1, int m, const GemmPanel <W, NR, Packed> &b, int *c, int k) {
+        int r = r0;
+        for (; r + gemmMR <= r1; r += gemmMR) {
+            QuantGemmKernel <W, gemmMR, NR, Packed> (a + (uint64_t)r * m, m, b, c + (uint64_t)r * k, k);
+        }
+        if (r1 - r == 3) {
+            QuantGemmKernel <W, 3, NR, Packed> (a + (uint64_t)r * m, m, b, c + (uint64_t)r * k, k);
+        } else if (r1 - r == 2) {
+            QuantGemmKernel <W, 2, NR, Packed> (a + (uint64_t)r * m, m, b, c + (uint64_t)r * k, k);
+        } else if (r1 - r == 1) {
+            QuantGemmKernel <W, 1, NR, Packed> (a + (uint64_t)r * m, m, b, c + (uint64_t)r * k, k);
+        }
+    }
+
+    // 计算输出通道[st, end)上的c = a * b^T, a = [n, m]的int16, c = [n, k]的int32
+    template <typename W, bool Packed>
+    static void QuantGemmPart(const int16_t *a, const uint8_t *b, int *c, int n, int m, int k, int st, int end) {
+        uint64_t ldb = W::RowBytes(m);
+        int rowBlock = std::max(gemmMR, gemmRowBlockBytes / (m * 2) / gemmMR * gemmMR);
+        for (int r0 = 0; r0 < n; r0 += rowBlock) {
+            int r1 = std::min(n, r0 + rowBlock);
+            int j = st;
+            for (; j + gemmNR <= end; j += gemmNR) {
+                QuantGemmRows (a, r0, r1, m, GemmPanel <W, gemmNR, Packed> (b + j * ldb, ldb, m), c + j, k);
+            }
+            for (; j < end; j++) {
+                QuantGemmRows (a, r0, r1, m, GemmPanel <W, 1, false> (b + j * ldb, ldb, m), c + j, k);
+            }
+        }
+    }
+
+    template <typename W, int MR, int NR, bool Packed>
+    static inline void FloatGemmKernel(const float *a, int m, const GemmPanel <W, NR, Packed> &b,
+                                       const float *bias, float *c, int ldc) {
+        GemmFloatVec acc[MR][NR];
+        for (int r = 0; r < MR; r++) {
+            for (int j = 0; j < NR; j++) {
+                acc[r][j] = GemmFloatZero();
+            }
+        }
+        int l = 0;
+        for (; l + W::KB <= m; l += W::KB) {
+            GemmFloatVec w[NR];
+            for (int j = 0; j < NR; j++) {
+                w[j] = W::Load(b.Chunk(j, l));
+            }
+            for (int r = 0; r < MR; r++) {
+                GemmFloatVec x = GemmLoadFloat(a + r * m + l);
+                for (int j = 0; j < NR; j++) {
+                    acc[r][j] = GemmFloatFma(acc[r][j], x, w[j]);
+                }
+            }
+        }
+        for (int r = 0; r < MR; r++) {
+            for (int j = 0; j < NR; j++) {
+                float value = GemmFloatSum(acc[r][j]) + (bias ? bias[j] : 0.0f);
+                for (int t = l; t < m; t++) {
+                    value += a[r * m + t] * b.Get(j, t);
+                }
+                c[r * ldc + j] = value;
+            }
+        }
+    }
+
+    template <typename W, int NR, bool Packed>
+    static void FloatGemmRows(const float *a, int r0, int r1, int m, const GemmPanel <W, NR, Packed> &b,
+                              const float *bias, float *c, int k) {
+        int r = r0;
+        for (; r + gemmMR <= r1; r += gemmMR) {
+            FloatGemmKernel <W, gemmMR, NR, Packed> (a + (uint64_t)r * m, m, b, bias, c + (uint64_t)r * k, k);
+        }
+        if (r1 - r == 3) {
+            FloatGemmKernel <W, 3, NR, Packed> (a + (uint64_t)r * m, m, b, bias, c + (uint64_t)r * k, k);
+        } else if (r1 - r == 2) {
+            FloatGemmKernel <W, 2, NR, Packed> (a + (uint64_t)r * m, m, b, bias, c + (uint64_t)r * k, k);
+        } else if (r1 - r == 1) {
+            FloatGemmKernel <W, 1, NR, Packed> (a + (uint64_t)r * m, m, b, bias, c + (uint64_t)r * k, k);
+        }
+    }
+
+    template <typename W, bool Packed>
+    static void FloatGemmPart(const float *a, const uint8_t *b, const float *bias, float *c,
+                              int n, int m, int k, int st, int end) {
+        uint64_t ldb = W::RowBytes(m);
+        int rowBlock = std::max(gemmMR, gemmRowBlockBytes / (m * 4) / gemmMR * gemmMR);
+        for (int r0 = 0; r0 < n; r0 += rowBlock) {
+            int r1 = std::min(n, r0 + rowBlock);
+            int j = st;
+            for (; j + gemmNR <= end; j += gemmNR) {
+                FloatGemmRows (a, r0, r1, m, GemmPanel <W, gemmNR, Packed> (b + j * ldb, ldb, m),
+                               bias ? bias + j : nullptr, c + j, k);
+            }
+            for (; j < end; j++) {
+                FloatGemmRows (a, r0, r1, m, GemmPanel <W, 1, false> (b + j * ldb, ldb, m),
+                               bias ? bias + j : nullptr, c + j, k);
+            }
+        }
+    }
+#endif
+
+    // 预排时每段的元素个数, 和对应权重类型的W::KB一致
+    static int GetLinearPackChunk(const Data &weight) {
+        return (weight.dataType == DataType::FLOAT32 || weight.dataType == DataType::FLOAT16) ? 8 : 32;
+    }
+
+    bool CanPackLinearWeight(const Data &weight) {
+#if defined(__AVX2__) || defined(__aarch64__)
+        if (weight.linearPacked || weight.dims.size() != 2 || weight.cpuData == nullptr ||
+            weight.m_file != nullptr || weight.dataDevice != DataDevice::CPU || weight.dims[0] < gemmNR) {
+            // 映射自模型文件的权重是只读的, 保持原样
+            return false;
+        }
+        int m = weight.dims[1];
+        if (weight.dataType == DataType::INT4_GROUP || weight.dataType == DataType::INT8_GROUP) {
+            // 分组量化的内核按组的起点分段, 每组要由整数个段组成
+            return weight.groupCnt % 32 == 0 && (weight.dataType == DataType::INT8_GROUP || m % 2 == 0);
+        }
+        if (weight.dataType == DataType::INT4 || weight.dataType == DataType::INT4_NOZERO) {
+            return m % 2 == 0;
+        }
+        return weight.dataType == DataType::FLOAT32 || weight.dataType == DataType::FLOAT16 ||
+               weight.dataType == DataType::INT8;
+#else
+        return false;
+#endif
+    }
+
+    // 在每个panel内部做逐行存放和交错存放之间的转换, panel的起点和大小不变
+    static void PermuteLinearPanels(Data &weight, bool pack) {
+        int k = weight.dims[0], m = weight.dims[1], kb = GetLinearPackChunk(weight);
+        uint64_t rowBytes = (uint64_t)m * weight.unitSize / weight.unitSizeDiv;
+        uint64_t chunkBytes = (uint64_t)kb * weight.unitSize / weight.unitSizeDiv;
+        int full = m / kb;
+        uint64_t tailBytes = rowBytes - full * chunkBytes, panelBytes = rowBytes * gemmNR;
+        GetPool()->ParallelFor(k / gemmNR, [&](int st, int end) {
+            std::vector <uint8_t> temp(panelBytes);
+            for (int p = st; p < end; p++) {
+                uint8_t *panel = weight.cpuData + p * panelBytes;
+                memcpy(temp.data(), panel, panelBytes);
+                for (int r = 0; r < gemmNR; r++) {
+                    for (int c = 0; c < full; c++) {
+                        uint64_t rowPos = r * rowBytes + c * chunkBytes, packedPos = (c * gemmNR + r) * chunkBytes;
+                        memcpy(panel + (pack ? packedPos : rowPos), temp.data() + (pack ? rowPos : packedPos), chunkBytes);
+                    }
+                    uint64_t rowPos = r * rowBytes + full * chunkBytes, packedPos = full * gemmNR * chunkBytes + r * tailBytes;
+                    memcpy(panel + (pack ? packedPos : rowPos), temp.data() + (pack ? rowPos : packedPos), tailBytes);
+                }
+            }
+        });
+    }
+
+    void PackLinearWeight(Data &weight) {
+        AssertInFastLLM(CanPackLinearWeight(weight), "PackLinearWeight error: unsupport weight.\n");
+        if (weight.dataType != DataType::FLOAT32 && weight.dataType != DataType::FLOAT16) {
+            // weightSum按行求和, 要在重排之前算好
+            weight.CalcWeightSum();
+        }
+        PermuteLinearPanels(weight, true);
+        weight.linearPacked = true;
+    }
+
+    void UnpackLinearWeight(Data &weight) {
+        static std::mutex locker;
+        std::lock_guard <std::mutex> guard(locker);
+        if (!weight.linearPacked) {
+            return;
+        }
+        PermuteLinearPanels(weight, false);
+        weight.linearPacked = false;
+    }
+
+    bool CanRunLinearGemm(const Data &weight, int n) {
+        if (weight.linearPacked) {
+            // 预排过的权重只能用分块计算, 单行输入也一样
+            return true;
+        }
+        if (weight.dataType == DataType::INT4_GROUP || weight.dataType == DataType::INT8_GROUP) {
+            // 分组量化的权重只有这一种实现
+            return weight.dataType == DataType::INT8_GROUP || weight.dims[1] % 2 == 0;
+        }
+#if defined(__AVX2__) || defined(__aarch64__)
+        if (n <= 1 || weight.dims.size() != 2) {
+            return false;
+        }
+        if (weight.dataType == DataType::INT4 || weight.dataType == DataType::INT4_NOZERO) {
+            return weight.dims[1] % 2 == 0;
+        }
+        return weight.dataType == DataType::FLOAT32 || weight.dataType == DataType::FLOAT16 ||
+               weight.dataType == DataType::INT8;
+#else
+        return false;
+#endif
+    }
+
+    // 分组量化: 设输入 q = Q + 128, 权重 = min[g] + w * scale[g], 则
+    // sum((q - zq) * weight) = sum_g(scale[g] * (D[g] + (128 - zq) * W[g]) + min[g] * (SQ[g] + (128 - zq) * cnt[g]))
+    // 其中D[g] = sum(Q * w), W[g]和SQ[g]分别为组内w和Q的和
+    static void GroupLinearGemmMultiThread(const Data &input, Data &weight, float *biasData, float *outputData,
+                                           int n, int m, int k, int threadNum) {
+        weight.CalcWeightSum();
+        int group = weight.group, groupCnt = weight.groupCnt;
+        LinearInputCache &cache = QuantizeGemmInput(input, n, m, threadNum, groupCnt);
+        std::vector <int16_t> &qinput = cache.qinput;
+        std::vector <LowBitConfig> &configs = cache.configs;
+        std::vector <int> &inputSums = cache.inputSums;
+        float *scales = weight.scales.data(), *mins = weight.mins.data();
+        GetPool()->ParallelFor(k, [&](int st, int end) {
+            if (weight.dataType == DataType::INT4_GROUP) {
+                auto part = weight.linearPacked ? GroupGemmPart <Int4GemmWeight, true> : GroupGemmPart <Int4GemmWeight, false>;
+                part(qinput.data(), weight.cpuData, group, groupCnt, scales, outputData, n, m, k, st, end);
+            } else {
+                auto part = weight.linearPacked ? GroupGemmPart <Int8GemmWeight <0>, true> : GroupGemmPart <Int8GemmWeight <0>, false>;
+                part(qinput.data(), weight.cpuData, group, groupCnt, scales, outputData, n, m, k, st, end);
+            }
+            for (int j = st; j < end; j++) {
+                float a = 0.0f, c = 0.0f;
+                for (int g = 0; g < group; g++) {
+                    uint64_t id = (uint64_t)j * group + g;
+                    a += scales[id] * weight.weightSum[id];
+                    c += mins[id] * (std::min(m, (g + 1) * groupCnt) - g * groupCnt);
+                }
+                for (int i = 0; i < n; i++) {
+                    float value = outputData[(uint64_t)i * k + j] + (128 - configs[i].zeroPoint) * (a + c);
+                    int *sums = inputSums.data() + (uint64_t)i * group;
+                    for (int g = 0; g < group; g++) {
+                        value += mins[(uint64_t)j * group + g] * sums[g];
+                    }
+                    outputData[(uint64_t)i * k + j] = configs[i].scale * value + (biasData ? biasData[j] : 0.0f);
+                }
+            }
+        }, GetLinearGrain(k, threadNum), threadNum);
+    }
+
+    void LinearGemmMultiThread(const Data &input, Data &weight, float *biasData, float *outputData,
+                               int n, int m, int k, int threadNum) {
+        if (weight.dataType == DataType::INT4_GROUP || weight.dataType == DataType::INT8_GROUP) {
+            GroupLinearGemmMultiThread(input, weight, biasData, outputData, n, m, k, threadNum);
+            return;
+        }
+#if defined(__AVX2__) || defined(__aarch64__)
+        float *inputData = (float *) input.cpuData;
+        uint8_t *weightData = weight.cpuData;
+        bool packed = weight.linearPacked;
+        int grain = GetLinearGrain(k, threadNum);
+        if (weight.dataType == DataType::FLOAT32) {
+            auto part = packed ? FloatGemmPart <Float32GemmWeight, true> : FloatGemmPart <Float32GemmWeight, false>;
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                part(inputData, weightData, biasData, outputData, n, m, k, st, end);
+            }, grain, threadNum);
+            return;
+        } else if (weight.dataType == DataType::FLOAT16) {
+            auto part = packed ? FloatGemmPart <Float16GemmWeight, true> : FloatGemmPart <Float16GemmWeight, false>;
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                part(inputData, weightData, biasData, outputData, n, m, k, st, end);
+            }, grain, threadNum);
+            return;
+        }
+
+        weight.CalcWeightSum();
+        LinearInputCache &cache = QuantizeGemmInput(input, n, m, threadNum);
+        std::vector <int16_t> &qinput = cache.qinput;
+        std::vector <LowBitConfig> &configs = cache.configs;
+        std::vector <int> &inputSums = cache.inputSums;
+        int *c = (int*)outputData;
+        // 设输入 q = Q + 128, 则 sum((q - zq) * (w - zw)) 可以由 D = sum(Q * w') 和两边的元素和还原
+        if (weight.dataType == DataType::INT8) {
+            auto part = packed ? QuantGemmPart <Int8GemmWeight <128>, true> : QuantGemmPart <Int8GemmWeight <128>, false>;
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                part(qinput.data(), weightData, c, n, m, k, st, end);
+                for (int i = 0; i < n; i++) {
+                    int64_t zq = configs[i].zeroPoint, sq = inputSums[i];
+                    for (int j = st; j < end; j++) {
+                        // 此时D = sum(Q * (w - 128))
+                        LowBitConfig &wc = weight.perChannelsConfigs[j];
+                        int64_t zw = wc.zeroPoint, sw = weight.weightSum[j] - 128LL * m;
+                        int64_t value = c[i * k + j] + (128 - zw) * sq + (128 - zq) * sw + (int64_t)m * (128 - zq) * (128 - zw);
+                        outputData[i * k + j] = wc.scale * configs[i].scale * value + (biasData ? biasData[j] : 0.0f);
+                    }
+                }
+            }, grain, threadNum);
+        } else if (weight.dataType == DataType::INT4) {
+            auto part = packed ? QuantGemmPart <Int4GemmWeight, true> : QuantGemmPart <Int4GemmWeight, false>;
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                part(qinput.data(), weightData, c, n, m, k, st, end);
+                for (int i = 0; i < n; i++) {
+                    int64_t zq = configs[i].zeroPoint, sq = inputSums[i];
+                    for (int j = st; j < end; j++) {
+                        int64_t zw = weight.zeros[j], sw = weight.weightSum[j];
+                        int64_t value = c[i * k + j] + (128 - zq) * sw - zw * sq - zw * (128 - zq) * m;
+                        outputData[i * k + j] = weight.scales[j] * configs[i].scale * value + (biasData ? biasData[j] : 0.0f);
+                    }
+                }
+            }, grain, threadNum);
+        } else if (weight.dataType == DataType::INT4_NOZERO) {
+            auto part = packed ? QuantGemmPart <Int4GemmWeight, true> : QuantGemmPart <Int4GemmWeight, false>;
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                part(qinput.data(), weightData, c, n, m, k, st, end);
+                for (int i = 0; i < n; i++) {
+                    int64_t zq = configs[i].zeroPoint, sq = inputSums[i];
+                    for (int j = st; j < end; j++) {
+                        int64_t value = c[i * k + j] + (128 - zq) * weight.weightSum[j];
+                        int64_t inputValue = sq + (128 - zq) * m;
+                        outputData[i * k + j] = configs[i].scale * (weight.scales[j] * value + weight.mins[j] * inputValue) +
+                                                (biasData ? biasData[j] : 0.0f);
+                    }
+                }
+            }, grain, threadNum);
+        } else {
+            ErrorInFastLLM("LinearGemm error: unsupport weight's dataType.\n");
+        }
+#else
+        ErrorInFastLLM("LinearGemm error: unsupport platform.\n");
+#endif
+    }
+}
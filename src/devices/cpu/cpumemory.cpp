@@ -0,0 +1,311 @@
+#include "devices/cpu/cpumemory.h"
+#include "utils.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(_WIN32) or defined(_WIN64)
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace fastllm {
+    static const uint64_t cpuMemoryAlign = 64;
+    static const int cpuMemorySizeClasses = 240;
+    static const uint64_t threadCacheMaxBlockBytes = 1 << 20; // 超过1M的块直接进全局缓存
+    static const int threadCacheMaxBlocks = 16; // 线程缓存中每个size class最多保留的块数
+    static const uint64_t globalCacheMaxBytes = 1ULL << 30; // 全局缓存最多保留1G空闲内存
+    static const uint32_t cpuMemoryMagic = 0xFA57C0DE;
+
+    // 每个块前面有一个64字节的头, 保证返回的地址仍然64字节对齐
+    struct CpuMemoryHeader {
+        uint64_t bytes; // 块的容量
+        int32_t sizeClass; // -1代表未经过缓存, 释放时直接还给系统; -2代表由FastllmCpuMallocPages申请
+        uint32_t magic;
+    };
+
+    static std::atomic <bool> cpuMemoryPoolEnabled(true);
+    static std::atomic <uint64_t> statMallocCalls(0), statFreeCalls(0), statSystemMallocs(0), statSystemFrees(0);
+    static std::atomic <uint64_t> statInUseBytes(0), statPeakInUseBytes(0), statCachedBytes(0);
+
+    // 大小按2的幂分段, 每段再四等分, 浪费不超过25%
+    static int GetSizeClass(uint64_t size, uint64_t &classBytes) {
+        if (size <= cpuMemoryAlign) {
+            classBytes = cpuMemoryAlign;
+            return 0;
+        }
+        int lg = 6;
+        while (lg < 62 && (1ULL << (lg + 1)) < size) {
+            lg++;
+        }
+        uint64_t step = 1ULL << (lg - 2);
+        uint64_t k = (size - 1 - (1ULL << lg)) / step;
+        classBytes = (1ULL << lg) + (k + 1) * step;
+        return (lg - 6) * 4 + (int)k + 1;
+    }
+
+    static uint8_t *SystemMalloc(uint64_t bytes, int sizeClass) {
+        void *ptr = nullptr;
+#if defined(_WIN32) or defined(_WIN64)
+        ptr = _aligned_malloc(bytes + cpuMemoryAlign, cpuMemoryAlign);
+#else
+        if (posix_memalign(&ptr, cpuMemoryAlign, bytes + cpuMemoryAlign) != 0) {
+            ptr = nullptr;
+        }
+#endif
+        if (ptr == nullptr) {
+            ErrorInFastLLM("FastllmCpuMalloc error: out of memory, size = " + std::to_string(bytes) + ".\n");
+        }
+        statSystemMallocs++;
+        CpuMemoryHeader *header = (CpuMemoryHeader*)ptr;
+        header->bytes = bytes;
+        header->sizeClass = sizeClass;
+        header->magic = cpuMemoryMagic;
+        return (uint8_t*)ptr + cpuMemoryAlign;
+    }
+
+    static const int32_t cpuMemoryPagesClass = -2;
+
+    static void SystemFreePages(uint8_t *ret) {
+        statSystemFrees++;
+        CpuMemoryHeader *header = (CpuMemoryHeader*)(ret - cpuMemoryAlign);
+#if defined(_WIN32) or defined(_WIN64)
+        VirtualFree(header, 0, MEM_RELEASE);
+#else
+        munmap(header, header->bytes + cpuMemoryAlign);
+#endif
+    }
+
+    static void SystemFree(uint8_t *ret) {
+        statSystemFrees++;
+#if defined(_WIN32) or defined(_WIN64)
+        _aligned_free(ret - cpuMemoryAlign);
+#else
+        free(ret - cpuMemoryAlign);
+#endif
+    }
+
+    static CpuMemoryHeader *GetHeader(void *ret) {
+        CpuMemoryHeader *header = (CpuMemoryHeader*)((uint8_t*)ret - cpuMemoryAlign);
+        AssertInFastLLM(header->magic == cpuMemoryMagic, "FastllmCpuFree error: pointer is not allocated by FastllmCpuMalloc.\n");
+        return header;
+    }
+
+    struct CpuMemoryCache {
+        std::vector <uint8_t*> blocks[cpuMemorySizeClasses];
+        uint64_t bytes = 0;
+
+        uint8_t *Pop(int sizeClass, uint64_t classBytes) {
+            auto &v = blocks[sizeClass];
+            if (v.empty()) {
+                return nullptr;
+            }
+            uint8_t *ret = v.back();
+            v.pop_back();
+            bytes -= classBytes;
+            statCachedBytes -= classBytes;
+            return ret;
+        }
+
+        void Push(int sizeClass, uint64_t classBytes, uint8_t *ret) {
+            blocks[sizeClass].push_back(ret);
+            bytes += classBytes;
+            statCachedBytes += classBytes;
+        }
+
+        void Release() {
+            for (int i = 0; i < cpuMemorySizeClasses; i++) {
+                for (uint8_t *ret : blocks[i]) {
+                    statCachedBytes -= GetHeader(ret)->bytes;
+                    SystemFree(ret);
+                }
+                blocks[i].clear();
+            }
+            bytes = 0;
+        }
+    };
+
+    // 全局缓存不析构, 避免静态对象析构顺序导致退出时访问已销毁的缓存
+    static std::mutex &GetGlobalCacheLocker() {
+        static std::mutex *locker = new std::mutex();
+        return *locker;
+    }
+
+    static CpuMemoryCache &GetGlobalCache() {
+        static CpuMemoryCache *cache = new CpuMemoryCache();
+        return *cache;
+    }
+
+    static void PushToGlobalCache(int sizeClass, uint64_t classBytes, uint8_t *ret) {
+        {
+            std::lock_guard <std::mutex> guard(GetGlobalCacheLocker());
+            CpuMemoryCache &cache = GetGlobalCache();
+            if (cache.bytes + classBytes <= globalCacheMaxBytes) {
+                cache.Push(sizeClass, classBytes, ret);
+                return;
+            }
+        }
+        SystemFree(ret);
+    }
+
+    static thread_local bool threadCacheDestroyed = false;
+
+    struct ThreadMemoryCache : CpuMemoryCache {
+        ~ThreadMemoryCache() {
+            // 线程退出时把缓存交给全局缓存
+            for (int i = 0; i < cpuMemorySizeClasses; i++) {
+                for (uint8_t *ret : blocks[i]) {
+                    uint64_t classBytes = GetHeader(ret)->bytes;
+                    statCachedBytes -= classBytes;
+                    PushToGlobalCache(i, classBytes, ret);
+                }
+                blocks[i].clear();
+            }
+            bytes = 0;
+            threadCacheDestroyed = true;
+        }
+    };
+
+    static CpuMemoryCache *GetThreadCache() {
+        if (threadCacheDestroyed) {
+            return nullptr;
+        }
+        static thread_local ThreadMemoryCache cache;
+        return &cache;
+    }
+
+    void *FastllmCpuMalloc(size_t size) {
+        statMallocCalls++;
+        if (!cpuMemoryPoolEnabled) {
+            CpuMemoryCache *threadCache = GetThreadCache();
+            if (threadCache != nullptr && threadCache->bytes > 0) {
+                threadCache->Release();
+            }
+            uint64_t bytes = (size + cpuMemoryAlign - 1) / cpuMemoryAlign * cpuMemoryAlign;
+            statInUseBytes += bytes;
+            return SystemMalloc(bytes, -1);
+        }
+
+        uint64_t classBytes;
+        int sizeClass = GetSizeClass(std::max((size_t)1, size), classBytes);
+        uint64_t inUse = (statInUseBytes += classBytes);
+        uint64_t peak = statPeakInUseBytes.load();
+        while (inUse > peak && !statPeakInUseBytes.compare_exchange_weak(peak, inUse));
+
+        uint8_t *ret = nullptr;
+        CpuMemoryCache *threadCache = GetThreadCache();
+        if (threadCache != nullptr && classBytes <= threadCacheMaxBlockBytes) {
+            ret = threadCache->Pop(sizeClass, classBytes);
+        }
+        if (ret == nullptr) {
+            std::lock_guard <std::mutex> guard(GetGlobalCacheLocker());
+            ret = GetGlobalCache().Pop(sizeClass, classBytes);
+        }
+        if (ret == nullptr) {
+            ret = SystemMalloc(classBytes, sizeClass);
+        }
+        return ret;
+    }
+
+    void FastllmCpuFree(void *ret) {
+        if (ret == nullptr) {
+            return;
+        }
+        statFreeCalls++;
+        CpuMemoryHeader *header = GetHeader(ret);
+        uint64_t classBytes = header->bytes;
+        int sizeClass = header->sizeClass;
+        statInUseBytes -= classBytes;
+        if (sizeClass == cpuMemoryPagesClass) {
+            SystemFreePages((uint8_t*)ret);
+            return;
+        }
+        if (sizeClass < 0 || !cpuMemoryPoolEnabled) {
+            SystemFree((uint8_t*)ret);
+            return;
+        }
+
+        CpuMemoryCache *threadCache = GetThreadCache();
+        if (threadCache != nullptr && classBytes <= threadCacheMaxBlockBytes &&
+            threadCache->blocks[sizeClass].size() < threadCacheMaxBlocks) {
+            threadCache->Push(sizeClass, classBytes, (uint8_t*)ret);
+            return;
+        }
+        PushToGlobalCache(sizeClass, classBytes, (uint8_t*)ret);
+    }
+
+    void *FastllmCpuMallocPages(size_t size) {
+        statMallocCalls++;
+        uint64_t bytes = (size + cpuMemoryAlign - 1) / cpuMemoryAlign * cpuMemoryAlign;
+        void *ptr = nullptr;
+#if defined(_WIN32) or defined(_WIN64)
+        ptr = VirtualAlloc(nullptr, bytes + cpuMemoryAlign, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+        ptr = mmap(nullptr, bytes + cpuMemoryAlign, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            ptr = nullptr;
+        }
+#endif
+        if (ptr == nullptr) {
+            ErrorInFastLLM("FastllmCpuMallocPages error: out of memory, size = " + std::to_string(bytes) + ".\n");
+        }
+        statSystemMallocs++;
+        uint64_t inUse = (statInUseBytes += bytes);
+        uint64_t peak = statPeakInUseBytes.load();
+        while (inUse > peak && !statPeakInUseBytes.compare_exchange_weak(peak, inUse));
+        // 头只占第一页, 第一页会被调用线程写入, 其余的页仍由第一次写入的线程决定位置
+        CpuMemoryHeader *header = (CpuMemoryHeader*)ptr;
+        header->bytes = bytes;
+        header->sizeClass = cpuMemoryPagesClass;
+        header->magic = cpuMemoryMagic;
+        return (uint8_t*)ptr + cpuMemoryAlign;
+    }
+
+    void FastllmCpuClearBuffer() {
+        CpuMemoryCache *threadCache = GetThreadCache();
+        if (threadCache != nullptr) {
+            threadCache->Release();
+        }
+        std::lock_guard <std::mutex> guard(GetGlobalCacheLocker());
+        GetGlobalCache().Release();
+    }
+
+    void SetCpuMemoryPool(bool enable) {
+        cpuMemoryPoolEnabled = enable;
+        if (!enable) {
+            FastllmCpuClearBuffer();
+        }
+    }
+
+    bool GetCpuMemoryPool() {
+        return cpuMemoryPoolEnabled;
+    }
+
+    CpuMemoryStats GetCpuMemoryStats() {
+        CpuMemoryStats stats;
+        stats.mallocCalls = statMallocCalls;
+        stats.freeCalls = statFreeCalls;
+        stats.systemMallocs = statSystemMallocs;
+        stats.systemFrees = statSystemFrees;
+        stats.inUseBytes = statInUseBytes;
+        stats.peakInUseBytes = statPeakInUseBytes;
+        stats.cachedBytes = statCachedBytes;
+        return stats;
+    }
+
+    void PrintCpuMemoryStats() {
+        CpuMemoryStats stats = GetCpuMemoryStats();
+        printf("CPU memory pool: %s\n", GetCpuMemoryPool() ? "on" : "off");
+        printf("malloc calls = %llu, free calls = %llu\n",
+               (unsigned long long)stats.mallocCalls, (unsigned long long)stats.freeCalls);
+        printf("system mallocs = %llu, system frees = %llu\n",
+               (unsigned long long)stats.systemMallocs, (unsigned long long)stats.systemFrees);
+        printf("in use = %.2f MB, peak = %.2f MB, cached = %.2f MB\n",
+               stats.inUseBytes / 1048576.0, stats.peakInUseBytes / 1048576.0, stats.cachedBytes / 1048576.0);
+    }
+}
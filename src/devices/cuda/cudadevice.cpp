@@ -16,6 +16,7 @@ namespace fastllm {
         this->ops["CopyKVCache"] = (BaseOperator*)(new CudaCopyKVCacheOp());
         this->ops["LayerNorm"] = (BaseOperator*)(new CudaLayerNormOp());
         this->ops["RMSNorm"] = (BaseOperator*)(new CudaRMSNormOp());
+        this->ops["AddToRMSNorm"] = (BaseOperator*)(new CudaAddToRMSNormOp());
         this->ops["Linear"] = (BaseOperator*)(new CudaLinearOp());
         this->ops["Split"] = (BaseOperator*)(new CudaSplitOp());
         this->ops["CatDirect"] = (BaseOperator*)(new CudaCatDirectOp());
@@ -90,6 +91,17 @@ namespace fastllm {
         output.Resize(dims);
     }
 
+    bool CudaAttention::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        // alibi和分页KV cache只在CPU的融合kernel中实现
+        auto alibi = datas.find("alibi");
+        if (alibi != datas.end() && alibi->second != nullptr && alibi->second->dims.size() > 0) {
+            return false;
+        }
+        Data &k = *(datas.find("k")->second);
+        return k.pagedKVCache == nullptr;
+    }
+
     void CudaAttention::Run(const std::string &opType, const fastllm::DataDict &datas,
                            const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data emptyData;
@@ -145,6 +157,32 @@ namespace fastllm {
         FastllmCudaRMSNorm(input, weight, output, eps);
     }
 
+    void CudaAddToRMSNormOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
+                                     const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input0 = *(datas.find("input0")->second);
+        Data &output = *(datas.find("output")->second);
+        if (&input0 == &output) {
+            return;
+        }
+        output.dataType = input0.dataType;
+        output.Resize(input0.dims);
+    }
+
+    void CudaAddToRMSNormOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                                 const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input0 = *(datas.find("input0")->second);
+        Data &input1 = *(datas.find("input1")->second);
+        Data &weight = *(datas.find("weight")->second);
+        Data &output = *(datas.find("output")->second);
+        output.Allocate();
+
+        float eps = floatParams.find("eps") != floatParams.end() ? floatParams.find("eps")->second : 1e-5;
+        float alpha = floatParams.find("alpha") != floatParams.end() ? floatParams.find("alpha")->second : 1.0;
+        AssertInFastLLM(input0.dims == input1.dims, "AddToRMSNorm error: input's shape should be same.\n");
+        FastllmCudaAddTo(input0, input1, alpha);
+        FastllmCudaRMSNorm(input0, weight, output, eps);
+    }
+
     bool CudaLayerNormOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
                                  const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
@@ -181,6 +219,9 @@ namespace fastllm {
         weight.weightType = WeightType::LINEAR;
         std::vector <int> dims = input.dims;
         dims.back() = weight.dims[0];
+        if (intParams.find("activation") != intParams.end() && intParams.find("activation")->second == LinearActivationSwiglu) {
+            dims.back() /= 2;
+        }
 
         output.dataType = DataType::FLOAT32;
         output.Resize(dims);
@@ -188,15 +229,30 @@ namespace fastllm {
 
     bool CudaLinearOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
-        return true;
+        Data &weight = *(datas.find("weight")->second);
+        // 分组量化的权重只有CPU实现
+        return weight.dataType != DataType::INT4_GROUP && weight.dataType != DataType::INT8_GROUP;
     }
 
     void CudaLinearOp::Run(const std::string &opType, const fastllm::DataDict &datas,
                            const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
-        Data &output = *(datas.find("output")->second);
+        Data &result = *(datas.find("output")->second);
         Data &weight = *(datas.find("weight")->second);
         Data &bias = *(datas.find("bias")->second);
+        Data *gate = datas.find("gate") != datas.end() ? datas.find("gate")->second : nullptr;
+        int activation = intParams.find("activation") != intParams.end() ? intParams.find("activation")->second : LinearActivationNone;
+
+        // Swiglu的输出宽度减半, 先算到临时的显存中
+        Data swigluBuffer(DataType::FLOAT32);
+        if (activation == LinearActivationSwiglu) {
+            std::vector <int> dims = result.dims;
+            dims.back() *= 2;
+            swigluBuffer.Resize(dims);
+            swigluBuffer.dataDevice = result.dataDevice;
+            swigluBuffer.dataDeviceIds = result.dataDeviceIds;
+        }
+        Data &output = activation == LinearActivationSwiglu ? swigluBuffer : result;
 
         output.Allocate();
         int n = input.Count(0) / input.dims.back();
@@ -216,6 +272,23 @@ namespace fastllm {
         } else {
             ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
         }
+
+        if (activation == LinearActivationSilu) {
+            FastllmCudaSilu(output, output);
+        } else if (activation == LinearActivationGeluNew) {
+            FastllmCudaGeluNew(output, output);
+        } else if (activation == LinearActivationSwiglu) {
+            result.Allocate();
+            FastllmCudaSwiglu(output, result);
+        }
+        if (gate != nullptr) {
+            Data siluGate(DataType::FLOAT32, gate->dims);
+            siluGate.dataDevice = gate->dataDevice;
+            siluGate.dataDeviceIds = gate->dataDeviceIds;
+            siluGate.Allocate();
+            FastllmCudaSilu(*gate, siluGate);
+            FastllmCudaMulTo(result, siluGate, 1.0f);
+        }
     }
 
     void CudaSplitOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
@@ -2032,7 +2032,7 @@ bool FastllmCudaAttention(const fastllm::Data &q, const fastllm::Data &k, const
             status = cublasSgemmStridedBatched(fastllmCublasHandle,
                                                CUBLAS_OP_T, CUBLAS_OP_N,
                                                k1, q1, q2, &scale,
-                                               kd + (i / group) * k.Count(1), k.strides[1], k.Count(1),
+                                               kd + (i / group) * k.strides[0], k.strides[1], k.strides[0],
                                                qd + i * q.Count(1), q.strides[1], q.Count(1),
                                                &beta,
                                                qk, k1, k1 * q1, 1);
@@ -2061,7 +2061,7 @@ bool FastllmCudaAttention(const fastllm::Data &q, const fastllm::Data &k, const
             status = cublasSgemmStridedBatched(fastllmCublasHandle,
                                                CUBLAS_OP_N, CUBLAS_OP_N,
                                                v2, q1, k1, &one,
-                                               vd + (i / group) * v.Count(1), v.strides[1], v.Count(1),
+                                               vd + (i / group) * v.strides[0], v.strides[1], v.strides[0],
                                                qk, k1, k1 * q1,
                                                &beta,
                                                od + i * v2 * q1, v2, v2 * q1, 1);
@@ -2088,7 +2088,7 @@ bool FastllmCudaAttention(const fastllm::Data &q, const fastllm::Data &k, const
         status = cublasSgemmStridedBatched(fastllmCublasHandle,
                                            CUBLAS_OP_T, CUBLAS_OP_N,
                                            k1, q1 * group, q2, &scale,
-                                           kd, k.strides[1], k.Count(1),
+                                           kd, k.strides[1], k.strides[0],
                                            qd, q.strides[1], q.Count(1) * group,
                                            &beta,
                                            qk, k1, k1 * q1 * group, q0 / group);
@@ -2118,7 +2118,7 @@ bool FastllmCudaAttention(const fastllm::Data &q, const fastllm::Data &k, const
         status = cublasSgemmStridedBatched(fastllmCublasHandle,
                                            CUBLAS_OP_N, CUBLAS_OP_N,
                                            v2, q1 * group, k1, &one,
-                                           vd, v.strides[1], v.Count(1),
+                                           vd, v.strides[1], v.strides[0],
                                            temp, k1, k1 * q1 * group,
                                            &beta,
                                            od, v2, v2 * q1 * group, q0 / group);
@@ -4,6 +4,7 @@
 
 #include "devices/tfacc/tfaccdevice.h"
 #include "devices/tfacc/fastllm-tfacc.h"
+#include "devices/cpu/cpudevice.h"
 
 #include <cstring>
 #include <thread>
@@ -88,6 +89,16 @@ namespace fastllm {
     bool TfaccLinearOp::CanRun(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
         Data &weight = *(datas.find("weight")->second);
+        if (weight.linearPacked) {
+            // 预排成CPU格式的权重只在CPU上计算
+            return false;
+        }
+        // 激活后处理在CPU上对float32的结果做
+        if ((datas.find("gate") != datas.end() ||
+             (intParams.find("activation") != intParams.end() && intParams.find("activation")->second != LinearActivationNone)) &&
+            input.dataType != DataType::FLOAT32) {
+            return false;
+        }
         int m = weight.dims[1];
         int k = weight.dims[0];
         return m >= 1024 && k >= 1024 && (
@@ -109,6 +120,9 @@ namespace fastllm {
         weight.weightType = WeightType::LINEAR;
         std::vector <int> dims = input.dims;
         dims.back() = weight.dims[0];
+        if (intParams.find("activation") != intParams.end() && intParams.find("activation")->second == LinearActivationSwiglu) {
+            dims.back() /= 2;
+        }
 
         output.dataType = input.dataType;
         output.Resize(dims);
@@ -116,9 +130,20 @@ namespace fastllm {
 
     void TfaccLinearOp::Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
-        Data &output = *(datas.find("output")->second);
+        Data &result = *(datas.find("output")->second);
         Data &weight = *(datas.find("weight")->second);
         Data &bias = *(datas.find("bias")->second);
+        Data *gate = datas.find("gate") != datas.end() ? datas.find("gate")->second : nullptr;
+        int activation = intParams.find("activation") != intParams.end() ? intParams.find("activation")->second : LinearActivationNone;
+
+        // Swiglu的输出宽度减半, 先算到临时的缓冲区中
+        Data swigluBuffer(result.dataType);
+        if (activation == LinearActivationSwiglu) {
+            std::vector <int> dims = result.dims;
+            dims.back() *= 2;
+            swigluBuffer.Resize(dims);
+        }
+        Data &output = activation == LinearActivationSwiglu ? swigluBuffer : result;
 
         output.Allocate(0.0f);
         int n = input.Count(0) / input.dims.back();
@@ -186,6 +211,12 @@ namespace fastllm {
         } else {
             ErrorInFastLLM("TFACC Linear error: unsupport data's dataType.\n");
         }
+        // TFACC使用CPU内存, 矩阵乘法之后直接在CPU上做激活后处理
+        if (activation != LinearActivationNone || gate != nullptr) {
+            result.Allocate();
+            LinearEpilogue((float *) output.cpuData, gate ? (float *) gate->cpuData : nullptr,
+                           (float *) result.cpuData, n, k, activation);
+        }
     }
 
     long long int TfaccLinearOp::Ops(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams) {
@@ -68,18 +68,43 @@ namespace fastllm {
         return {0};
     }
 
+    std::string Executor::GetFirstDeviceType() {
+        return this->devices.size() > 0 ? this->devices[0]->deviceType : "";
+    }
+
+    // op执行之后更新它写入的数据的版本号; Linear只会写output, 其余的op保守地认为所有参数都可能被写入
+    static void UpdateDataVersions(const std::string &opType, const fastllm::DataDict &datas, const fastllm::IntDict &intParams) {
+        for (auto &it: datas) {
+            if (opType == "Linear" && it.first != "output") {
+                continue;
+            }
+            if (intParams.find(it.first + "___batch") != intParams.end()) {
+                int batch = intParams.find(it.first + "___batch")->second;
+                for (int i = 0; i < batch; i++) {
+                    if (((Data**)it.second)[i]) {
+                        ((Data**)it.second)[i]->UpdateVersion();
+                    }
+                }
+            } else if (it.second) {
+                it.second->UpdateVersion();
+            }
+        }
+    }
+
     void Executor::Run(const std::string &opType, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
                        const fastllm::IntDict &intParams) {
         auto st = std::chrono::system_clock::now();
+        // 分页KV cache只有CPU实现, 用到它的op和lockInCPU的数据一样只能在CPU上执行
         bool lockInCPU = false;
         for (auto &it: datas) {
             if (intParams.find(it.first + "___batch") != intParams.end()) {
                 int batch = intParams.find(it.first + "___batch")->second;
                 for (int i = 0; i < batch; i++) {
-                    lockInCPU |= (((Data**)it.second)[i] && ((Data**)it.second)[i]->lockInCPU);
+                    Data *data = ((Data**)it.second)[i];
+                    lockInCPU |= (data && (data->lockInCPU || data->pagedKVCache != nullptr));
                 }
             } else {
-                lockInCPU |= (it.second && it.second->lockInCPU);
+                lockInCPU |= (it.second && (it.second->lockInCPU || it.second->pagedKVCache != nullptr));
             }
         }
         for (auto device: devices) {
@@ -108,6 +133,7 @@ namespace fastllm {
                 }
                 device->Reshape(opType, datas, floatParams, intParams);
                 device->Run(opType, datas, floatParams, intParams);
+                UpdateDataVersions(opType, datas, intParams);
 #ifdef DEBUG
                 long long int ops = device->Ops(opType, datas, floatParams, intParams);
                 float spend = GetSpan(st, std::chrono::system_clock::now());
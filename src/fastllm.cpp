@@ -8,13 +8,17 @@
 
 #include "executor.h"
 
+#include "devices/cpu/cpulinear.h"
+
 #include <cstring>
 #include <cmath>
 #include <cfloat>
 #include <thread>
 #include <algorithm>
+#include <fstream>
+#include <atomic>
 
-#ifdef USE_MMAP
+#if defined(USE_MMAP) || (!defined(_WIN32) && !defined(_WIN64))
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -41,9 +45,18 @@ namespace fastllm {
 
     static std::mutex globalLocker;
     static int threads = 4;
-    static ThreadPool *fastllmThreadPool = new ThreadPool(threads);
+    static bool threadAffinity = false;
+    static int numaNodes = 1;
+    static std::vector <std::vector <int> > numaCpus; // 每个NUMA节点上的核
+    static ThreadPool *fastllmThreadPool = new ThreadPool(threads, threadAffinity);
     static bool lowMemMode = false;
     static bool kvCacheInCPU = false;
+    static bool usePagedKVCache = true;
+    static int kvCacheBlockLen = 64;
+    static DataType kvCacheType = DataType::FLOAT32;
+    static bool mmapWeights = false;
+    static int mmapWarmUp = 0;
+    static bool linearWeightPrepack = true;
 
     void PrintInstructionInfo() {
         std::string avx = "OFF", avx2 = "OFF", aarch64 = "OFF", neonFp16 = "OFF", neonDot = "OFF", tfacc = "OFF";
@@ -84,10 +97,87 @@ namespace fastllm {
             fastllmThreadPool->Shutdown();
             delete fastllmThreadPool;
         }
-        fastllmThreadPool = new ThreadPool(t);
+        fastllmThreadPool = new ThreadPool(t, threadAffinity, numaCpus);
         globalLocker.unlock();
     }
 
+    void SetThreadAffinity(bool pin) {
+        threadAffinity = pin;
+        SetThreads(threads);
+    }
+
+    bool GetThreadAffinity() {
+        return threadAffinity;
+    }
+
+    // 解析"0-3,8-11"格式的cpulist
+    static std::vector <int> ParseCpuList(const std::string &s) {
+        std::vector <int> ret;
+        size_t pos = 0;
+        while (pos < s.size()) {
+            size_t next = s.find(',', pos);
+            std::string part = s.substr(pos, next == std::string::npos ? std::string::npos : next - pos);
+            size_t dash = part.find('-');
+            if (part.find_first_of("0123456789") != std::string::npos) {
+                int st = atoi(part.c_str()), end = (dash == std::string::npos ? st : atoi(part.c_str() + dash + 1));
+                for (int i = st; i <= end; i++) {
+                    ret.push_back(i);
+                }
+            }
+            if (next == std::string::npos) {
+                break;
+            }
+            pos = next + 1;
+        }
+        return ret;
+    }
+
+    // 读取系统的NUMA拓扑, 读不到或者节点数不够时把所有核平均分成nodes份
+    static std::vector <std::vector <int> > GetNumaTopology(int nodes) {
+        std::vector <std::vector <int> > ret;
+        for (int i = 0; ; i++) {
+            std::ifstream fin("/sys/devices/system/node/node" + std::to_string(i) + "/cpulist");
+            if (!fin.good()) {
+                break;
+            }
+            std::string line;
+            std::getline(fin, line);
+            std::vector <int> cpus = ParseCpuList(line);
+            if (cpus.size() > 0) {
+                ret.push_back(cpus);
+            }
+        }
+        if ((int)ret.size() >= nodes) {
+            ret.resize(nodes);
+            return ret;
+        }
+        int hw = std::max(1, (int)std::thread::hardware_concurrency());
+        ret.clear();
+        ret.resize(nodes);
+        for (int i = 0; i < hw; i++) {
+            ret[(long long)i * nodes / hw].push_back(i);
+        }
+        for (int i = 0; i < nodes; i++) {
+            if (ret[i].empty()) {
+                ret[i].push_back(i % hw);
+            }
+        }
+        return ret;
+    }
+
+    void SetNumaNodes(int nodes) {
+        numaNodes = std::max(1, nodes);
+        numaCpus.clear();
+        if (numaNodes > 1) {
+            numaCpus = GetNumaTopology(numaNodes);
+        }
+        SetThreads(threads);
+    }
+
+    int GetNumaNodes() {
+        return numaNodes;
+    }
+
     void SetLowMemMode(bool m) {
     	lowMemMode = m;
     }
@@ -100,14 +190,66 @@ namespace fastllm {
         return lowMemMode;
     }
 
+    void SetPagedKVCache(bool paged) {
+        usePagedKVCache = paged;
+    }
+
+    bool GetPagedKVCache() {
+        return usePagedKVCache;
+    }
+
+    void SetKVCacheBlockLen(int len) {
+        AssertInFastLLM(len > 0, "SetKVCacheBlockLen error: len should be > 0.\n");
+        kvCacheBlockLen = len;
+    }
+
+    int GetKVCacheBlockLen() {
+        return kvCacheBlockLen;
+    }
+
+    void SetKVCacheType(DataType type) {
+        AssertInFastLLM(type == DataType::FLOAT32 || type == DataType::FLOAT16 || type == DataType::INT8,
+                        "SetKVCacheType error: only support FLOAT32, FLOAT16 and INT8.\n");
+        kvCacheType = type;
+    }
+
+    DataType GetKVCacheType() {
+        return kvCacheType;
+    }
+
     int GetThreads() {
         return threads;
     }
 
+    void SetMmapWeights(bool m) {
+        mmapWeights = m;
+    }
+
+    bool GetMmapWeights() {
+        return mmapWeights;
+    }
+
+    void SetMmapWarmUp(int mode) {
+        AssertInFastLLM(mode >= 0 && mode <= 2, "SetMmapWarmUp error: mode should be 0, 1 or 2.\n");
+        mmapWarmUp = mode;
+    }
+
+    int GetMmapWarmUp() {
+        return mmapWarmUp;
+    }
+
+    void SetLinearWeightPrepack(bool prepack) {
+        linearWeightPrepack = prepack;
+    }
+
+    bool GetLinearWeightPrepack() {
+        return linearWeightPrepack;
+    }
+
     ThreadPool *GetPool() {
         return fastllmThreadPool;
     }
-#ifdef USE_MMAP
+#if defined(USE_MMAP) || (!defined(_WIN32) && !defined(_WIN64))
     FileMmap::FileMmap(const std::string &path) {
         int fd = open(path.c_str(), O_RDONLY);
         AssertInFastLLM(fd > 0, "cannot open file ");
@@ -123,6 +265,21 @@ namespace fastllm {
     }
 
     FileMmap::~FileMmap() { AssertInFastLLM(munmap(data, size) == 0, "munmap failed");}
+
+    void FileMmap::PreFault(uint64_t offset, uint64_t bytes) {
+        static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        volatile const char *p = data;
+        char sum = 0;
+        for (uint64_t i = offset; i < offset + bytes && i < size; i += pageSize) {
+            sum += p[i];
+        }
+        (void)sum;
+    }
+
+    bool FileMmap::Lock() {
+        locked = (mlock(data, size) == 0);
+        return locked;
+    }
 #endif
     void ModelLoader::seek(int64_t offset, int whence) {
         if (whence == SEEK_SET) {
@@ -151,6 +308,10 @@ namespace fastllm {
         return read_basic<float>();
     }
 
+    uint64_t ModelLoader::ReadUInt64(){
+        return read_basic<uint64_t>();
+    }
+
     uint8_t* ModelLoader::ReadBytes(uint64_t bytes){
         // memcpy(buffer, ptr, bytes);
         uint8_t* buffer = (uint8_t *) ptr;
@@ -181,6 +342,14 @@ namespace fastllm {
             return v;
         }
 
+        uint64_t ReadUInt64() {
+            uint64_t v;
+            if (fread(&v, 1, 8, f) != 8) {
+                ErrorInFastLLM("FileBuffer.ReadUInt64 error.\n");
+            };
+            return v;
+        }
+
         std::string ReadString() {
             int len = ReadInt();
             std::string ret = "";
@@ -198,6 +367,22 @@ namespace fastllm {
             }
         }
 
+        void seek(int64_t offset, int whence) {
+#if defined(_WIN32) or defined(_WIN64)
+            _fseeki64(f, offset, whence);
+#else
+            fseeko(f, offset, whence);
+#endif
+        }
+
+        int64_t tell() {
+#if defined(_WIN32) or defined(_WIN64)
+            return _ftelli64(f);
+#else
+            return ftello(f);
+#endif
+        }
+
         ~FileBuffer() {
             fclose(f);
         }
@@ -229,12 +414,45 @@ namespace fastllm {
             }
         }
 
-        void WriteBytes(uint8_t *buffer, uint64_t bytes) {
+        void WriteUInt64(uint64_t v) {
+            if (fwrite(&v, 1, 8, f) != 8) {
+                ErrorInFastLLM("FileWriter.WriteUInt64 error.\n");
+            };
+        }
+
+        void WriteBytes(const uint8_t *buffer, uint64_t bytes) {
             if (fwrite(buffer, 1, bytes, f) != bytes) {
                 ErrorInFastLLM("FileWriter.WriteBytes error.\n");
             }
         }
 
+        int64_t Tell() {
+#if defined(_WIN32) or defined(_WIN64)
+            return _ftelli64(f);
+#else
+            return ftello(f);
+#endif
+        }
+
+        void Seek(int64_t pos) {
+#if defined(_WIN32) or defined(_WIN64)
+            _fseeki64(f, pos, SEEK_SET);
+#else
+            fseeko(f, pos, SEEK_SET);
+#endif
+        }
+
+        // 用0补齐到align的整数倍
+        void Align(uint64_t align) {
+            static const uint8_t zeros[4096] = {0};
+            uint64_t pad = (align - (uint64_t)Tell() % align) % align;
+            while (pad > 0) {
+                uint64_t cur = std::min(pad, (uint64_t)sizeof(zeros));
+                WriteBytes(zeros, cur);
+                pad -= cur;
+            }
+        }
+
         ~FileWriter() {
             fclose(f);
         }
@@ -264,9 +482,21 @@ namespace fastllm {
 
     void Data::CopyFrom(const Data &ori) {
         // std::cout<<"调用拷贝构造"<<std::endl;
+        if (ori.pagedKVCache != nullptr) {
+            this->dataType = ori.dataType;
+            this->pagedKVCache = std::make_shared <PagedKVCache> (*ori.pagedKVCache);
+            this->Resize(ori.dims);
+            return;
+        }
+        this->pagedKVCache = nullptr;
+        this->linearPacked = ori.linearPacked;
+        if (this->m_file != nullptr) {
+            // 映射自模型文件的数据是只读的, 换成自己的内存
+            this->FreeSpace();
+        }
         if (ori.dims != this->dims || this->cpuData == nullptr) {
             if (ori.dims.size() == 0) {
-                delete[] this->cpuData;
+                this->ReleaseCpuData();
                 this->dataType = ori.dataType;
                 this->UpdateUnitSize();
                 this->dims.resize(0);
@@ -278,6 +508,7 @@ namespace fastllm {
             this->Allocate();
         }
         std::memcpy(this->cpuData, ori.cpuData, this->GetBytes());
+        this->UpdateVersion();
     }
 
     uint64_t Data::Count(int i) const {
@@ -299,10 +530,11 @@ namespace fastllm {
                 this->dataType == DataType::FLOAT16) {
             this->unitSize = 2;
             this->unitSizeDiv = 1;
-        } else if (this->dataType == DataType::INT8) {
+        } else if (this->dataType == DataType::INT8 || this->dataType == DataType::INT8_GROUP) {
             this->unitSize = 1;
             this->unitSizeDiv = 1;
-        } else if (this->dataType == DataType::INT4 || this->dataType == DataType::INT4_NOZERO) {
+        } else if (this->dataType == DataType::INT4 || this->dataType == DataType::INT4_NOZERO ||
+                this->dataType == DataType::INT4_GROUP) {
             this->unitSize = 1;
             this->unitSizeDiv = 2;
         } else if (this->dataType == DataType::INT2) {
@@ -367,11 +599,18 @@ namespace fastllm {
         return (this->strides[0] * this->dims[0] * this->unitSize - 1) / this->unitSizeDiv + 1;
     }
 
+    static std::atomic <uint64_t> dataVersionCounter(0);
+
+    void Data::UpdateVersion() {
+        this->version = ++dataVersionCounter;
+    }
+
     void Data::MallocSpace(uint64_t size) {
+        this->UpdateVersion();
         this->expansionSize = size;
         this->expansionBytes = (size * this->unitSize - 1) / this->unitSizeDiv + 1;
         if (this->dataDevice == DataDevice::CPU) {
-            this->cpuData = new uint8_t[this->expansionBytes];
+            this->cpuData = (uint8_t*)FastllmCpuMalloc(this->expansionBytes);
         } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
             if (this->directMemory) {
@@ -389,7 +628,7 @@ namespace fastllm {
         this->expansionSize = 0;
         this->expansionBytes = 0;
         if (this->dataDevice == DataDevice::CPU) {
-            delete[] this->cpuData;
+            this->ReleaseCpuData();
         } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
             if (this->directMemory) {
@@ -475,7 +714,7 @@ namespace fastllm {
                            old + o * input1Stride * unitSize,
                            this->dims[axis] * inner * unitSize);
                 }
-                delete[] old;
+                FastllmCpuFree(old);
             } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
                 uint8_t *old = (uint8_t*)this->cudaData;
@@ -497,9 +736,20 @@ namespace fastllm {
         }
     }
 
+    void Data::ReleaseCpuData() {
+        if (this->m_file != nullptr) {
+            this->m_file = nullptr;
+        } else {
+            FastllmCpuFree(this->cpuData);
+        }
+        this->cpuData = nullptr;
+    }
+
     Data::~Data() {
 #ifndef USE_MMAP
-        delete[] this->cpuData;
+        if (this->m_file == nullptr) {
+            FastllmCpuFree(this->cpuData);
+        }
 #endif
 #ifdef USE_CUDA
         if (this->cudaData != nullptr) {
@@ -581,7 +831,24 @@ namespace fastllm {
             return;
         }
         int n = this->dims[0], m = this->dims[1];
-        if (this->dataType == DataType::INT8) {
+        if (this->dataType == DataType::INT4_GROUP || this->dataType == DataType::INT8_GROUP) {
+            // 分组量化的权重按[通道, 组]求和
+            weightSum.resize((uint64_t)n * group);
+            for (int i = 0; i < n; i++) {
+                for (int g = 0; g < group; g++) {
+                    int st = g * groupCnt, end = std::min(m, st + groupCnt), sum = 0;
+                    for (int j = st; j < end; j++) {
+                        uint64_t id = (uint64_t)i * m + j;
+                        if (this->dataType == DataType::INT8_GROUP) {
+                            sum += cpuData[id];
+                        } else {
+                            sum += (id % 2) ? (cpuData[id / 2] & 0xF) : (cpuData[id / 2] >> 4);
+                        }
+                    }
+                    weightSum[(uint64_t)i * group + g] = sum;
+                }
+            }
+        } else if (this->dataType == DataType::INT8) {
             weightSum.resize(n);
             for (int i = 0; i < n; i++) {
                 int j = 0;
@@ -688,6 +955,10 @@ namespace fastllm {
         if (this->dataType == DataType::INT32PARAM) {
             return;
         }
+        if (this->pagedKVCache != nullptr) {
+            // 分页KV cache只存在于CPU的block池中
+            return;
+        }
 #ifndef USE_CUDA
         // TODO: 这里先直接跳过了
         return;
@@ -696,6 +967,10 @@ namespace fastllm {
             (this->dataDevice == DataDevice::CPU || deviceIds.size() == 0 || this->dataDeviceIds == deviceIds)) {
             return;
         }
+        if (this->linearPacked) {
+            // 其他设备使用逐行存放的权重
+            UnpackLinearWeight(*this);
+        }
 
         if (this->expansionBytes != 0) {
 #ifdef USE_CUDA
@@ -704,12 +979,11 @@ namespace fastllm {
                     FastllmCudaSetDevice(deviceIds.size() == 0 ? 0 : deviceIds[0]);
                     this->cudaData = FastllmCudaMalloc(expansionBytes);
                     FastllmCudaCopyFromHostToDevice(this->cudaData, this->cpuData, expansionBytes);
-                    delete[] this->cpuData;
-                    this->cpuData = nullptr;
+                    this->ReleaseCpuData();
                 }
             } else if (this->dataDevice == DataDevice::CUDA) {
                 if (device == DataDevice::CPU) {
-                    this->cpuData = new uint8_t[expansionBytes];
+                    this->cpuData = (uint8_t*)FastllmCpuMalloc(expansionBytes);
                     FastllmCudaCopyFromDeviceToHost(this->cpuData, this->cudaData, expansionBytes);
                     FastllmCudaFree(this->cudaData);
                     this->cudaData = nullptr;
@@ -796,6 +1070,8 @@ namespace fastllm {
         }
         root = new TrieNode();
         tokenToStringDict.clear();
+        flatTrieDirty = true;
+        tokenPiecesDirty = true;
     }
 
     void Tokenizer::Insert(const std::string &s, int tokenId, float score) {
@@ -809,7 +1085,10 @@ namespace fastllm {
         now->tokenId = tokenId;
         now->score = score;
         tokenToStringDict[tokenId] = s;
+        tokenToScoreDict[tokenId] = score;
         stringToTokenDict[s] = tokenId;
+        flatTrieDirty = true;
+        tokenPiecesDirty = true;
     }
 
     void Tokenizer::TryMergePairs(std::vector<Symbol> &symbols, int l, int r, std::priority_queue <SymbolPairs> &q) {
@@ -845,6 +1124,12 @@ namespace fastllm {
     }
 
     Data Tokenizer::Encode(const std::string &ori) {
+        if (useFlatTrie && (this->type == TokenizerType::BPE || this->type == Tokenizer::GPT2 ||
+                            this->type == Tokenizer::QWEN)) {
+            std::vector <float> v;
+            FlatEncode(ori, v);
+            return Data (DataType::FLOAT32, {1, (int)v.size()}, v);
+        }
         if (this->type == TokenizerType::BPE || this->type == Tokenizer::GPT2) {
             std::string blank = "", s = "";
             if (this->type == Tokenizer::BPE) {
@@ -1315,99 +1600,163 @@ namespace fastllm {
         return DecodeTokens(tokens);
     }
 
-    struct Random {
-        Random () {
-            srand(time(NULL));
+    // versionId >= 3的模型文件: 权重数据按flmDataAlign对齐依次存放, 形状, 类型, 偏移和量化参数集中存在数据之后的索引里
+    // 加载时先读索引, 再并行地映射/读取各个权重
+    static const int flmVersionId = 3;
+    static const uint64_t flmDataAlign = 4096;
+
+    struct FlmTensorInfo {
+        std::string name;
+        std::vector <int> dims;
+        DataType dataType = DataType::FLOAT32;
+        uint64_t offset = 0, bytes = 0; // 数据在文件中的位置和字节数
+        int perChannelAxis = -1, group = -1, groupCnt = -1;
+        std::vector <float> minMax; // 每个通道 (或组) 的min, max
+    };
+
+    static bool IsLowBitType(DataType type) {
+        return type == DataType::INT8 || type == DataType::INT4 || type == DataType::INT4_NOZERO ||
+               type == DataType::INT4_GROUP || type == DataType::INT8_GROUP;
+    }
+
+    // 量化参数的个数: 分组量化为[通道, 组], 否则每个通道一个
+    static int GetLowBitConfigCount(const Data &data) {
+        if (data.dataType == DataType::INT4_GROUP || data.dataType == DataType::INT8_GROUP) {
+            return data.dims[0] * data.group;
         }
+        return data.perChannelAxis == -1 ? 1 : data.dims[data.perChannelAxis];
+    }
 
-        float randP() {
-            return (float)(rand() % 10001) * 0.0001;
+    // 由每个通道 (或组) 的min, max初始化量化参数
+    static void InitLowBitConfigs(Data &data, const float *minMax) {
+        DataType dataType = data.dataType;
+        int k = GetLowBitConfigCount(data);
+        data.perChannelsConfigs.resize(k);
+        data.scales.resize(k);
+        if (dataType == DataType::INT8 || dataType == DataType::INT4) {
+            int bit = (dataType == DataType::INT4 ? 4 : 8);
+            data.zeros.resize(k);
+#ifdef USE_TFACC40T
+            data.tfWeightConfig = tfdl::PerChannelConfig();
+            data.tfWeightConfig.axis = data.perChannelAxis;
+            data.tfWeightConfig.configs.resize(k);
+#endif
+            for (int i = 0; i < k; i++) {
+                data.perChannelsConfigs[i] = LowBitConfig(minMax[i * 2], minMax[i * 2 + 1], bit, 0);
+                data.zeros[i] = data.perChannelsConfigs[i].zeroPoint;
+                data.scales[i] = data.perChannelsConfigs[i].scale;
+#ifdef USE_TFACC40T
+                data.tfWeightConfig.configs[i] = tfdl::QuantizationConfig(minMax[i * 2], minMax[i * 2 + 1]);
+#endif
+            }
+        } else if (dataType == DataType::INT4_NOZERO) {
+            data.mins.resize(k);
+            for (int i = 0; i < k; i++) {
+                data.perChannelsConfigs[i] = LowBitConfig(minMax[i * 2], minMax[i * 2 + 1], 4, 1);
+                data.mins[i] = data.perChannelsConfigs[i].min;
+                data.scales[i] = data.perChannelsConfigs[i].scale;
+            }
+        } else if (dataType == DataType::INT4_GROUP || dataType == DataType::INT8_GROUP) {
+            int bit = (dataType == DataType::INT4_GROUP ? 4 : 8);
+            data.mins.resize(k);
+            for (int i = 0; i < k; i++) {
+                data.perChannelsConfigs[i] = LowBitConfig(minMax[i * 2], minMax[i * 2 + 1], bit, 0);
+                data.mins[i] = -data.perChannelsConfigs[i].scale * data.perChannelsConfigs[i].zeroPoint;
+                data.scales[i] = data.perChannelsConfigs[i].scale;
+            }
         }
-    };
+    }
 
-    Random fastllmRandom;
-
-    int LLMSampling(Data &logits, int outerOffset,
-                    const GenerationConfig &config, const LastTokensUnit &tokens) {
-        logits.ToDevice(DataDevice::CPU);
-        int vocabSize = logits.dims.back();
-        float *base = ((float*)logits.cpuData) + outerOffset * vocabSize;
-
-        if (fabs(config.repeat_penalty - 1.0) > 1e-6) {
-            for (int id : tokens.tokenSet) {
-                base[id] = (base[id] < 0 ? base[id] * config.repeat_penalty : base[id] / config.repeat_penalty);
-            }
-        }
-        float invTemp = 1.0f / config.temperature;
-        std::vector <std::pair <float, int> > v;
-        for (int i = 0; i < vocabSize; i++) {
-            v.push_back(std::make_pair(-base[i] * invTemp, i));
-        }
-        int topk = std::min(vocabSize, config.top_k);
-        std::partial_sort(v.begin(), v.begin() + topk, v.end());
-        float psum = 0.0, maxValue = -v.begin()->first;
-        std::vector <float> ps;
-        for (int i = 0; i < topk; i++) {
-            ps.push_back(expf(-v[i].first - maxValue));
-            psum += ps.back();
-        }
-        float curSum = 0.0;
-        for (int i = 0; i < topk; i++) {
-            ps[i] /= psum;
-            curSum += ps[i];
-            if (curSum > config.top_p) {
-                topk = i + 1;
-                break;
+    static void WriteTensorInfo(FileWriter &buffer, const FlmTensorInfo &info) {
+        buffer.WriteString(info.name);
+        buffer.WriteInt((int)info.dims.size());
+        for (int i : info.dims) {
+            buffer.WriteInt(i);
+        }
+        buffer.WriteInt((int)info.dataType);
+        buffer.WriteUInt64(info.offset);
+        buffer.WriteUInt64(info.bytes);
+        if (IsLowBitType(info.dataType)) {
+            buffer.WriteInt(info.perChannelAxis);
+            buffer.WriteInt(info.group);
+            buffer.WriteInt(info.groupCnt);
+            buffer.WriteInt((int)info.minMax.size() / 2);
+            for (float x : info.minMax) {
+                buffer.WriteFloat(x);
             }
         }
-        float rnd = fastllmRandom.randP() * curSum;
-        curSum = 0.0;
-        for (int i = 0; i < topk; i++) {
-            curSum += ps[i];
-            if (curSum > rnd || i == topk - 1) {
-                return v[i].second;
+    }
+
+    template <typename T>
+    static void ReadTensorInfo(T &buffer, FlmTensorInfo &info) {
+        info.name = buffer.ReadString();
+        info.dims.resize(buffer.ReadInt());
+        for (int &i : info.dims) {
+            i = buffer.ReadInt();
+        }
+        info.dataType = (DataType)buffer.ReadInt();
+        info.offset = buffer.ReadUInt64();
+        info.bytes = buffer.ReadUInt64();
+        if (IsLowBitType(info.dataType)) {
+            info.perChannelAxis = buffer.ReadInt();
+            info.group = buffer.ReadInt();
+            info.groupCnt = buffer.ReadInt();
+            info.minMax.resize(buffer.ReadInt() * 2);
+            for (float &x : info.minMax) {
+                x = buffer.ReadFloat();
             }
         }
-        return -1;
     }
 
-    void WeightMap::LoadFromFile(const std::string &fileName) {
-    #ifdef USE_MMAP
-        std::shared_ptr<FileMmap> mapped_file = std::make_shared<FileMmap>(fileName);
-        ModelLoader buffer((char *)mapped_file->data, mapped_file->size);
-    #else
-        FileBuffer buffer(fileName);
-    #endif
-        this->versionId = buffer.ReadInt();
+#if !defined(_WIN32) && !defined(_WIN64)
+    // 读取文件的[offset, offset + bytes), 多个线程可以同时对同一个fd调用
+    static bool PreadFull(int fd, uint8_t *buffer, uint64_t bytes, uint64_t offset) {
+        while (bytes > 0) {
+            ssize_t ret = pread(fd, buffer, std::min(bytes, (uint64_t)1 << 30), offset);
+            if (ret <= 0) {
+                return false;
+            }
+            buffer += ret;
+            bytes -= ret;
+            offset += ret;
+        }
+        return true;
+    }
+#endif
+
+    // 读取模型文件头: 版本号, key-value表, peft配置和词表
+    template <typename T>
+    static void ReadFlmHeader(WeightMap &weights, T &buffer) {
+        weights.versionId = buffer.ReadInt();
 
-        if (this->versionId >= 1) {
+        if (weights.versionId >= 1) {
             // versionId >= 1, 前置了一个key-value表
             int keyValueLen = buffer.ReadInt();
             for (int i = 0; i < keyValueLen; i++) {
                 std::string key = buffer.ReadString();
                 std::string value = buffer.ReadString();
                 //printf("%s %s\n", key.c_str(), value.c_str());
-                this->dicts[key] = value;
+                weights.dicts[key] = value;
             }
         }
 
-        if (this->dicts.find("peft_size") != this->dicts.end()) {
-            int peftSize = atoi(this->dicts["peft_size"].c_str());
+        if (weights.dicts.find("peft_size") != weights.dicts.end()) {
+            int peftSize = atoi(weights.dicts["peft_size"].c_str());
             for (int i = 0; i < peftSize; i++) {
                 std::string adapter_name = buffer.ReadString();
-                this->peftDict[adapter_name] = {};
+                weights.peftDict[adapter_name] = {};
 
                 int adapter_size = buffer.ReadInt();
                 for (int j = 0; j < adapter_size; j++) {
                     std::string key = buffer.ReadString();
                     std::string value = buffer.ReadString();
                     //printf("%s %s\n", key.c_str(), value.c_str());
-                    this->peftDict[adapter_name][key] = value;
+                    weights.peftDict[adapter_name][key] = value;
                 }
             }
         }
 
-        bool useScore = this->dicts["tokenizer_use_score"] == "1";
+        bool useScore = weights.dicts["tokenizer_use_score"] == "1";
         int vocabLen = buffer.ReadInt();
         for (int i = 0; i < vocabLen; i++) {
             int len = buffer.ReadInt();
@@ -1417,10 +1766,173 @@ namespace fastllm {
             }
             int id = buffer.ReadInt();
             float score = useScore ? buffer.ReadFloat() : -i;
-            tokenizer.Insert(x, id, score);
+            weights.tokenizer.Insert(x, id, score);
+        }
+    }
+
+    // 写入模型文件头 (版本号为flmVersionId), 和ReadFlmHeader对应
+    static void WriteFlmHeader(WeightMap &weights, FileWriter &buffer) {
+        buffer.WriteInt(flmVersionId);
+        // versionId >= 1, 前置了一个key-value表
+        buffer.WriteInt((int)weights.dicts.size());
+        for (auto &it : weights.dicts) {
+            buffer.WriteString(it.first);
+            buffer.WriteString(it.second);
+        }
+        if (weights.dicts.find("peft_size") != weights.dicts.end()) {
+            for (auto &adapter : weights.peftDict) {
+                buffer.WriteString(adapter.first);
+                buffer.WriteInt((int)adapter.second.size());
+                for (auto &it : adapter.second) {
+                    buffer.WriteString(it.first);
+                    buffer.WriteString(it.second);
+                }
+            }
         }
 
+        // 写入词表
+        bool useScore = weights.dicts["tokenizer_use_score"] == "1";
+        buffer.WriteInt((int)weights.tokenizer.tokenToStringDict.size());
+        for (auto &it : weights.tokenizer.tokenToStringDict) {
+            buffer.WriteInt((int)it.second.size());
+            for (int i = 0; i < it.second.size(); i++) {
+                buffer.WriteInt((int)it.second[i]);
+            }
+            buffer.WriteInt(it.first);
+            if (useScore) {
+                buffer.WriteFloat(weights.tokenizer.tokenToScoreDict[it.first]);
+            }
+        }
+    }
+
+    // 加载versionId >= 3的权重: 先读出索引并创建好所有权重, 再在线程池上并行地读取数据, 计算量化参数
+    // mapped_file非空时 (USE_MMAP或SetMmapWeights) 数据直接指向只读共享映射的文件 (按页对齐), 不占用进程私有内存,
+    // 页面在第一次使用时才载入, 或者按mmapWarmUp在加载时并行预取 / mlock
+    template <typename T>
+    static void LoadTensors(WeightMap &weights, T &buffer, int len, const std::string &fileName,
+                            std::shared_ptr<FileMmap> mapped_file) {
+        buffer.seek(buffer.ReadUInt64(), SEEK_SET);
+        std::vector <FlmTensorInfo> infos(len);
+        for (auto &info : infos) {
+            ReadTensorInfo(buffer, info);
+        }
+
+        std::vector <std::pair <Data*, FlmTensorInfo*> > tasks;
+        for (auto &info : infos) {
+            weights.weight[info.name] = Data(info.dataType, info.dims);
+            Data &data = weights.weight[info.name];
+            data.perChannelAxis = info.perChannelAxis;
+            data.group = info.group;
+            data.groupCnt = info.groupCnt;
+            AssertInFastLLM(data.GetBytes() == info.bytes, "Load error: weight " + info.name + "'s size mismatch.\n");
+            if (lowMemMode && weights.embeddingNames.find(info.name) != weights.embeddingNames.end()) {
+                if (info.dataType == DataType::FLOAT32 || info.dataType == DataType::BFLOAT16 || info.dataType == DataType::FLOAT16) {
+                    data.fileName = fileName;
+                    data.filePos = info.offset;
+                    continue;
+                } else {
+                    ErrorInFastLLM("Error: embedding's type should be float32 or bfloat16.\n");
+                }
+            }
+            if (mapped_file != nullptr) {
+                AssertInFastLLM(info.offset + info.bytes <= mapped_file->size, "Load error: weight " + info.name + " is out of file.\n");
+                data.set_file(mapped_file);
+                data.cpuData = (uint8_t*)mapped_file->data + info.offset;
+                data.expansionSize = data.Count(0);
+                data.expansionBytes = info.bytes;
+            } else {
+                data.Allocate();
+#if defined(_WIN32) or defined(_WIN64)
+                buffer.seek(info.offset, SEEK_SET);
+                buffer.ReadBytes(data.cpuData, info.bytes);
+#endif
+            }
+            tasks.push_back(std::make_pair(&data, &info));
+        }
+
+        int fd = -1;
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (mapped_file != nullptr) {
+            madvise(mapped_file->data, mapped_file->size, MADV_WILLNEED);
+        } else {
+            fd = open(fileName.c_str(), O_RDONLY);
+            AssertInFastLLM(fd >= 0, "Load error: cannot open file " + fileName + ".\n");
+#ifdef __linux__
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        }
+#endif
+        std::atomic <bool> failed(false);
+        GetPool()->ParallelFor(tasks.size(), [&](int st, int end) {
+            for (int i = st; i < end; i++) {
+                Data &data = *tasks[i].first;
+                FlmTensorInfo &info = *tasks[i].second;
+                if (IsLowBitType(info.dataType)) {
+                    InitLowBitConfigs(data, info.minMax.data());
+                }
+#if !defined(_WIN32) && !defined(_WIN64)
+                if (mapped_file != nullptr) {
+                    if (mmapWarmUp > 0) {
+                        mapped_file->PreFault(info.offset, info.bytes);
+                    }
+                } else if (!PreadFull(fd, data.cpuData, info.bytes, info.offset)) {
+                    failed = true;
+                }
+#endif
+            }
+        }, 1);
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (mapped_file != nullptr && mmapWarmUp >= 2 && !mapped_file->Lock()) {
+            WarningInFastLLM("mlock model file failed (check RLIMIT_MEMLOCK), weights may be swapped out.\n");
+        }
+#endif
+        if (failed) {
+            ErrorInFastLLM("Load error: read file " + fileName + " failed.\n");
+        }
+        printf("Load (%d / %d) \n", len, len);
+        fflush(stdout);
+    }
+
+    void WeightMap::LoadHeaderFromFile(const std::string &fileName) {
+        FileBuffer buffer(fileName);
+        AssertInFastLLM(buffer.f != nullptr, "Error: cannot open file " + fileName + ".\n");
+        ReadFlmHeader(*this, buffer);
+    }
+
+    void WeightMap::LoadFromFile(const std::string &fileName) {
+    #ifdef USE_MMAP
+        std::shared_ptr<FileMmap> mapped_file = std::make_shared<FileMmap>(fileName);
+        ModelLoader buffer((char *)mapped_file->data, mapped_file->size);
+    #else
+        FileBuffer buffer(fileName);
+    #endif
+        ReadFlmHeader(*this, buffer);
+        tokenizer.BuildFlatTrie();
+        tokenizer.BuildTokenPieces();
+
         int len = buffer.ReadInt();
+        if (this->versionId >= flmVersionId) {
+#ifdef USE_MMAP
+            LoadTensors(*this, buffer, len, fileName, mapped_file);
+#elif !defined(_WIN32) && !defined(_WIN64)
+            LoadTensors(*this, buffer, len, fileName, mmapWeights ? std::make_shared<FileMmap>(fileName) : nullptr);
+#else
+            if (mmapWeights) {
+                WarningInFastLLM("mmap weights is not supported on windows, load weights into memory instead.\n");
+            }
+            LoadTensors(*this, buffer, len, fileName, nullptr);
+#endif
+            return;
+        }
+#ifndef USE_MMAP
+        if (mmapWeights) {
+            WarningInFastLLM("mmap weights needs a model file with versionId >= " + std::to_string(flmVersionId) +
+                             ", load weights into memory instead.\n");
+        }
+#endif
         for (int i = 0; i < len; i++) {
             std::string name = buffer.ReadString();
             //printf("%s\n", name.c_str());
@@ -1461,59 +1973,26 @@ namespace fastllm {
 #else
 	            weight[name].Allocate();
 #endif
-	            if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
-#ifdef USE_MMAP
-                    weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
-#else
-                    buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
-#endif
-	            } else if (dataType == DataType::INT8 || dataType == DataType::INT4) {
-		            int bit = (dataType == DataType::INT4 ? 4 : 8);
-		            weight[name].perChannelAxis = buffer.ReadInt();
-		            int k = weight[name].perChannelAxis == -1 ? 1 : dims[weight[name].perChannelAxis];
-		            weight[name].perChannelsConfigs.resize(k);
-		            weight[name].zeros.resize(k);
-		            weight[name].scales.resize(k);
-#ifdef USE_TFACC40T
-                    weight[name].tfWeightConfig = tfdl::PerChannelConfig();
-                    weight[name].tfWeightConfig.axis = weight[name].perChannelAxis;
-                    weight[name].tfWeightConfig.configs.resize(k);
-#endif
-		            for (int i = 0; i < k; i++) {
-			            float minValue = buffer.ReadFloat();
-			            float maxValue = buffer.ReadFloat();
-			            weight[name].perChannelsConfigs[i] = LowBitConfig(minValue, maxValue, bit, 0);
-			            weight[name].zeros[i] = weight[name].perChannelsConfigs[i].zeroPoint;
-			            weight[name].scales[i] = weight[name].perChannelsConfigs[i].scale;
-#ifdef USE_TFACC40T
-                        weight[name].tfWeightConfig.configs[i] = tfdl::QuantizationConfig(minValue, maxValue);
-#endif
-		            }
-#ifdef USE_MMAP
-                    weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
-#else
-                    buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
-#endif
-	            } else if (dataType == DataType::INT4_NOZERO) {
-                    int bit = 4;
-                    weight[name].perChannelAxis = buffer.ReadInt();
-                    int k = weight[name].perChannelAxis == -1 ? 1 : dims[weight[name].perChannelAxis];
-                    weight[name].perChannelsConfigs.resize(k);
-                    weight[name].mins.resize(k);
-                    weight[name].scales.resize(k);
-                    for (int i = 0; i < k; i++) {
-                        float minValue = buffer.ReadFloat();
-                        float maxValue = buffer.ReadFloat();
-                        weight[name].perChannelsConfigs[i] = LowBitConfig(minValue, maxValue, bit, 1);
-                        weight[name].mins[i] = weight[name].perChannelsConfigs[i].min;
-                        weight[name].scales[i] = weight[name].perChannelsConfigs[i].scale;
+	            if (IsLowBitType(dataType)) {
+                    Data &data = weight[name];
+                    data.perChannelAxis = buffer.ReadInt();
+                    if (dataType == DataType::INT4_GROUP || dataType == DataType::INT8_GROUP) {
+                        data.group = buffer.ReadInt();
+                        data.groupCnt = buffer.ReadInt();
+                    }
+                    std::vector <float> minMax(GetLowBitConfigCount(data) * 2);
+                    for (auto &x : minMax) {
+                        x = buffer.ReadFloat();
                     }
+                    InitLowBitConfigs(data, minMax.data());
+                } else if (dataType != DataType::FLOAT32 && dataType != DataType::BFLOAT16 && dataType != DataType::FLOAT16) {
+                    continue;
+                }
 #ifdef USE_MMAP
-                    weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
+                weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
 #else
-                    buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
+                buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
 #endif
-                }
             }
 
             printf("Load (%d / %d) \r", (i + 1), len);
@@ -1553,142 +2032,335 @@ namespace fastllm {
         }
     }
 
-    void WeightMap::SaveLowBitModel(const std::string &fileName, int bit) {
-        AssertInFastLLM(fileName != "", "Error: output's name shouldn't be empty.\n");
-        AssertInFastLLM(bit == 0 || bit == 4 || bit == 8 || bit == 16, "Error: only support 16 bit or 8 bit or 4 bit model.\n");
-        FileWriter buffer(fileName);
-        buffer.WriteInt(this->versionId);
-        if (this->versionId >= 1) {
-            // versionId >= 1, 前置了一个key-value表
-            buffer.WriteInt((int)dicts.size());
-            for (auto &it : dicts) {
-                buffer.WriteString(it.first);
-                buffer.WriteString(it.second);
+    // 分组量化: 每行沿输入维度每groupCnt个元素一组, configs按[通道, 组]存放
+    void GroupQuantizationMultiThread(int st, int end, int m, int groupCnt,
+                                      float *f, uint8_t *u8, LowBitConfig *configs, int bit) {
+        int group = (m - 1) / groupCnt + 1;
+        for (int i = st; i < end; i++) {
+            for (int g = 0; g < group; g++) {
+                int gst = g * groupCnt, gend = std::min(m, gst + groupCnt);
+                float minValue = 1e9, maxValue = -1e9;
+                for (int j = gst; j < gend; j++) {
+                    minValue = std::min(minValue, f[(uint64_t)i * m + j]);
+                    maxValue = std::max(maxValue, f[(uint64_t)i * m + j]);
+                }
+                LowBitConfig &config = configs[(uint64_t)i * group + g];
+                config = LowBitConfig(minValue, maxValue, bit, 0);
+                for (int j = gst; j < gend; j++) {
+                    uint64_t id = (uint64_t)i * m + j;
+                    uint8_t value = config.quantization(f[id]);
+                    if (bit == 8) {
+                        u8[id] = value;
+                    } else if (id % 2) {
+                        u8[id / 2] = (u8[id / 2] & 0xF0) | value;
+                    } else {
+                        u8[id / 2] = (u8[id / 2] & 0xF) | (value << 4);
+                    }
+                }
             }
         }
+    }
 
-        // 写入词表
-        bool useScore = this->dicts["tokenizer_use_score"] == "1";
-        buffer.WriteInt((int)tokenizer.tokenToStringDict.size());
-        for (auto &it : tokenizer.tokenToStringDict) {
-            buffer.WriteInt((int)it.second.size());
-            for (int i = 0; i < it.second.size(); i++) {
-                buffer.WriteInt((int)it.second[i]);
-            }
-            buffer.WriteInt(it.first);
-            if (useScore) {
-                buffer.WriteFloat(tokenizer.tokenToScoreDict[it.first]);
+    // 把float32权重f按weightType转换成要写入的格式 (bit = 4, 8, 16), 填好info中的类型和量化参数
+    // 转换后的数据存在uDatas中, uDatas为空代表直接写入float32数据
+    static void QuantizeTensor(const float *f, WeightType weightType, int bit, int groupCnt,
+                               FlmTensorInfo &info, std::vector <uint8_t> &uDatas) {
+        uDatas.clear();
+        uint64_t len = 1;
+        for (int i : info.dims) {
+            len *= i;
+        }
+        if (weightType == WeightType::NONE) {
+            // 普通权重，直接写入浮点数据
+            info.dataType = DataType::FLOAT32;
+            info.bytes = len * sizeof(float);
+            return;
+        } else if (weightType == WeightType::EMBEDDING) {
+            // Embedding权重，存储成BF16
+            info.dataType = DataType::BFLOAT16;
+            uDatas.resize(len * sizeof(uint16_t));
+            uint16_t *u16 = (uint16_t *) uDatas.data();
+            for (uint64_t i = 0; i < len; i++) {
+                u16[i] = ((uint16_t *) f)[i * 2 + 1];
+            }
+        } else if (weightType == WeightType::LINEAR) {
+            if (bit == 16) {
+                // fp16, 直接转换
+                info.dataType = DataType::FLOAT16;
+                uDatas.resize(len * sizeof(uint16_t));
+                uint16_t *u16 = (uint16_t *) uDatas.data();
+                uint64_t m = len / info.dims[0];
+                GetPool()->ParallelFor(info.dims[0], [&](int st, int end) {
+                    for (uint64_t i = st * m; i < end * m; i++) {
+                        u16[i] = float_to_half(f[i]);
+                    }
+                }, 16);
+            } else if (groupCnt > 0) {
+                // Linear层权重，分组量化之
+                int k = info.dims[0], m = info.dims[1], group = (m - 1) / groupCnt + 1;
+                std::vector<LowBitConfig> configs;
+                configs.resize((uint64_t)k * group);
+                uint64_t bytes = (uint64_t)k * m;
+                if (bit == 4) {
+                    bytes = (bytes + 1) / 2;
+                }
+                uDatas.resize(bytes);
+                GetPool()->ParallelFor(k, [&](int st, int end) {
+                    GroupQuantizationMultiThread(st, end, m, groupCnt, (float *) f, uDatas.data(), configs.data(), bit);
+                }, 16);
+
+                info.dataType = (bit == 8 ? DataType::INT8_GROUP : DataType::INT4_GROUP);
+                info.perChannelAxis = 0;
+                info.group = group;
+                info.groupCnt = groupCnt;
+                for (auto &config : configs) {
+                    info.minMax.push_back(config.min);
+                    info.minMax.push_back(config.max);
+                }
+            } else {
+                // Linear层权重，分通道量化之
+                int k = info.dims[0], m = info.dims[1];
+                std::vector<LowBitConfig> configs;
+                configs.resize(k);
+
+                uint64_t bytes = (uint64_t)k * m;
+                if (bit == 4) {
+                    bytes = (bytes + 1) / 2;
+                }
+                uDatas.resize(bytes);
+                // 每块16行 (偶数行保证int4打包时不会有两个线程写同一个字节)
+                GetPool()->ParallelFor(k, [&](int st, int end) {
+                    PerChannelQuantizationMultiThread(st, end, m, (float *) f, uDatas.data(), configs.data(), bit);
+                }, 16);
+
+                info.dataType = (bit == 8 ? DataType::INT8 : DataType::INT4_NOZERO);
+                info.perChannelAxis = 0; // 按通道0分通道量化
+                for (int i = 0; i < k; i++) {
+                    info.minMax.push_back(configs[i].min);
+                    info.minMax.push_back(configs[i].max);
+                }
             }
         }
+        info.bytes = uDatas.size();
+    }
 
-        // 写入权重
+    void WeightMap::SaveLowBitModel(const std::string &fileName, int bit, int groupCnt) {
+        AssertInFastLLM(fileName != "", "Error: output's name shouldn't be empty.\n");
+        AssertInFastLLM(bit == 0 || bit == 4 || bit == 8 || bit == 16, "Error: only support 16 bit or 8 bit or 4 bit model.\n");
+        FileWriter buffer(fileName);
+        WriteFlmHeader(*this, buffer);
+
+        // 写入权重: 数据按flmDataAlign对齐依次写入, 最后写索引并回填索引的位置
         int need = 0;
         for (auto &it : weight) {
             need += (it.second.dims.size() > 0);
         }
         buffer.WriteInt(need);
+        int64_t indexPosPos = buffer.Tell();
+        buffer.WriteUInt64(0);
+        std::vector <FlmTensorInfo> infos;
         int tot = 0;
         for (auto &it : weight) {
             if (it.second.dims.size() == 0) {
                 continue;
             }
-            buffer.WriteString(it.first);
             Data &data = it.second;
-            buffer.WriteInt((int)data.dims.size());
-            for (int i : data.dims) {
-                buffer.WriteInt(i);
-            }
             data.ToDevice(DataDevice::CPU);
-
-            if (bit == 0) {
+            if (data.linearPacked) {
+                // 模型文件中按行存放
+                UnpackLinearWeight(data);
+            }
+            FlmTensorInfo info;
+            info.name = it.first;
+            info.dims = data.dims;
+            const uint8_t *src = data.cpuData; // 要写入的数据
+            std::vector <uint8_t> uDatas; // 需要转换时存放转换后的数据
+
+            if (bit == 0 || data.dataType != DataType::FLOAT32) {
+                // 不需要转换, 或者已经不是float32的权重, 按原样写入
                 DataType dataType = data.dataType;
-                if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
-                    buffer.WriteInt((int) dataType);
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else if (dataType == DataType::INT8 || dataType == DataType::INT4 || dataType == DataType::INT4_NOZERO) {
-                    buffer.WriteInt((int) dataType);
-                    buffer.WriteInt(data.perChannelAxis);
-                    int k = data.perChannelAxis == -1 ? 1 : data.dims[data.perChannelAxis];
+                info.dataType = dataType;
+                info.bytes = data.GetBytes();
+                if (IsLowBitType(dataType)) {
+                    info.perChannelAxis = data.perChannelAxis;
+                    info.group = data.group;
+                    info.groupCnt = data.groupCnt;
+                    int k = GetLowBitConfigCount(data);
                     for (int i = 0; i < k; i++) {
-                        buffer.WriteFloat(data.perChannelsConfigs[i].min);
-                        buffer.WriteFloat(data.perChannelsConfigs[i].max);
+                        info.minMax.push_back(data.perChannelsConfigs[i].min);
+                        info.minMax.push_back(data.perChannelsConfigs[i].max);
                     }
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else {
+                } else if (dataType != DataType::FLOAT32 && dataType != DataType::BFLOAT16 && dataType != DataType::FLOAT16) {
                     ErrorInFastLLM("unknown datatype");
                 }
             } else {
-                if (data.weightType == WeightType::NONE) {
-                    // 普通权重，直接写入浮点数据
-                    buffer.WriteInt((int) DataType::FLOAT32);
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else if (data.weightType == WeightType::EMBEDDING) {
-                    // Embedding权重，存储成BF16
-                    buffer.WriteInt((int) DataType::BFLOAT16);
-                    int len = data.Count(0);
-                    std::vector<uint16_t> uDatas;
-                    uDatas.resize(len);
-                    for (int i = 0; i < len; i++) {
-                        uDatas[i] = ((uint16_t *) data.cpuData)[i * 2 + 1];
+                QuantizeTensor((float *) data.cpuData, data.weightType, bit, groupCnt, info, uDatas);
+                if (!uDatas.empty()) {
+                    src = uDatas.data();
+                }
+            }
+
+            buffer.Align(flmDataAlign);
+            info.offset = buffer.Tell();
+            buffer.WriteBytes(src, info.bytes);
+            infos.push_back(info);
+            printf("output (%d / %d)\r", ++tot, need);
+            fflush(stdout);
+        }
+
+        uint64_t indexPos = buffer.Tell();
+        for (auto &info : infos) {
+            WriteTensorInfo(buffer, info);
+        }
+        buffer.Seek(indexPosPos);
+        buffer.WriteUInt64(indexPos);
+        printf("\n");
+        return;
+    }
+
+    // 模型文件中不保存weightType, 由模型定义给出: embeddingNames中的是Embedding, linearNames中的是Linear层
+    // 其余的一维权重 (或有一维为1的权重) 不量化; 不认识的矩阵直接报错, 以免把Linear层权重当作float原样写出
+    static WeightType GetWeightType(const WeightMap &weights, const FlmTensorInfo &info) {
+        if (weights.embeddingNames.find(info.name) != weights.embeddingNames.end()) {
+            return WeightType::EMBEDDING;
+        }
+        if (weights.linearNames.find(info.name) != weights.linearNames.end()) {
+            return WeightType::LINEAR;
+        }
+        if (info.dims.size() != 2 || info.dims[0] == 1 || info.dims[1] == 1) {
+            return WeightType::NONE;
+        }
+        ErrorInFastLLM("ConvertLowBitModel error: weight \"" + info.name +
+                       "\" is neither a Linear nor an Embedding weight of the model.\n");
+        return WeightType::NONE;
+    }
+
+    // 从模型文件中读出的一个权重的原始数据
+    struct FlmTensorData {
+        FlmTensorInfo info;
+        std::vector <uint8_t> bytes;
+    };
+
+    void WeightMap::ConvertLowBitModel(const std::string &input, const std::string &output, int bit, int groupCnt) {
+        AssertInFastLLM(output != "", "Error: output's name shouldn't be empty.\n");
+        AssertInFastLLM(bit == 0 || bit == 4 || bit == 8 || bit == 16, "Error: only support 16 bit or 8 bit or 4 bit model.\n");
+        FileBuffer in(input);
+        AssertInFastLLM(in.f != nullptr, "Error: cannot open file " + input + ".\n");
+        ReadFlmHeader(*this, in);
+        int len = in.ReadInt();
+        std::vector <FlmTensorInfo> inInfos;
+        if (this->versionId >= flmVersionId) {
+            in.seek(in.ReadUInt64(), SEEK_SET);
+            inInfos.resize(len);
+            for (auto &info : inInfos) {
+                ReadTensorInfo(in, info);
+            }
+        }
+
+        // 读取第i个权重, 旧格式中权重头和数据交错存放, 所以必须按顺序调用
+        auto readTensor = [&](int i, FlmTensorData &cur) {
+            if (this->versionId >= flmVersionId) {
+                cur.info = inInfos[i];
+            } else {
+                FlmTensorInfo &info = cur.info;
+                info = FlmTensorInfo();
+                info.name = in.ReadString();
+                info.dims.resize(in.ReadInt());
+                for (int &x : info.dims) {
+                    x = in.ReadInt();
+                }
+                info.dataType = (DataType)in.ReadInt();
+                Data data(info.dataType, info.dims);
+                if (IsLowBitType(info.dataType)) {
+                    data.perChannelAxis = info.perChannelAxis = in.ReadInt();
+                    if (info.dataType == DataType::INT4_GROUP || info.dataType == DataType::INT8_GROUP) {
+                        data.group = info.group = in.ReadInt();
+                        data.groupCnt = info.groupCnt = in.ReadInt();
                     }
-                    buffer.WriteBytes((uint8_t *) uDatas.data(), len * sizeof(uint16_t));
-                } else if (data.weightType == WeightType::LINEAR) {
-                    if (bit == 16) {
-                        // fp16, 直接转换
-                        buffer.WriteInt((int) DataType::FLOAT16);
-                        int len = data.Count(0);
-                        std::vector<uint16_t> uDatas;
-                        uDatas.resize(len);
-                        for (int i = 0; i < len; i++) {
-                            uDatas[i] = float_to_half(((float *) data.cpuData)[i]);
-                        }
-                        buffer.WriteBytes((uint8_t *) uDatas.data(), len * sizeof(uint16_t));
-                    } else {
-                        // Linear层权重，分通道量化之
-                        int k = data.dims[0], m = data.dims[1];
-                        int threadNum = 8;
-                        int per = k / threadNum;
-                        int cur = 0;
-                        auto pool = GetPool();
-                        std::vector <std::future <void> > futures;
-                        std::vector<LowBitConfig> configs;
-                        std::vector<uint8_t> uDatas;
-                        configs.resize(k);
-
-                        int bytes = k * m;
-                        if (bit == 4) {
-                            bytes = (k * m + 1) / 2;
-                        }
-                        uDatas.resize(bytes);
-                        for (int i = 0; i < threadNum; i++) {
-                            int end = cur + per;
-                            if (i == threadNum - 1) {
-                                end = k;
-                            }
-                            futures.push_back(pool->Submit(PerChannelQuantizationMultiThread, cur, end, m,
-                                                              (float *) data.cpuData, uDatas.data(), configs.data(),
-                                                              bit));
-                            cur = end;
-                        }
-                        for (int i = 0; i < threadNum; i++) {
-                            futures[i].get();
-                        }
+                    info.minMax.resize(GetLowBitConfigCount(data) * 2);
+                    for (float &x : info.minMax) {
+                        x = in.ReadFloat();
+                    }
+                } else if (info.dataType != DataType::FLOAT32 && info.dataType != DataType::BFLOAT16 &&
+                           info.dataType != DataType::FLOAT16) {
+                    ErrorInFastLLM("unknown datatype");
+                }
+                info.bytes = data.GetBytes();
+                info.offset = in.tell();
+            }
+            cur.bytes.resize(cur.info.bytes);
+            in.seek(cur.info.offset, SEEK_SET);
+            in.ReadBytes(cur.bytes.data(), cur.info.bytes);
+        };
 
-                        buffer.WriteInt(bit == 8 ? (int) DataType::INT8 : (int) DataType::INT4_NOZERO);
-                        buffer.WriteInt(0); // 按通道0分通道量化
-                        for (int i = 0; i < k; i++) {
-                            buffer.WriteFloat(configs[i].min);
-                            buffer.WriteFloat(configs[i].max);
+        FileWriter buffer(output);
+        WriteFlmHeader(*this, buffer);
+        buffer.WriteInt(len);
+        int64_t indexPosPos = buffer.Tell();
+        buffer.WriteUInt64(0);
+
+        // 同时只保留两个原始权重: 当前正在转换的, 和后台线程预读的下一个
+        FlmTensorData tensors[2];
+        std::vector <FlmTensorInfo> infos;
+        std::vector <float> floats; // 原始数据不是float32时, 转换后的float32数据
+        std::vector <uint8_t> uDatas;
+        if (len > 0) {
+            readTensor(0, tensors[0]);
+        }
+        for (int i = 0; i < len; i++) {
+            std::thread reader;
+            if (i + 1 < len) {
+                reader = std::thread(readTensor, i + 1, std::ref(tensors[(i + 1) & 1]));
+            }
+            FlmTensorData &cur = tensors[i & 1];
+            DataType dataType = cur.info.dataType;
+            FlmTensorInfo info;
+            const uint8_t *src = cur.bytes.data();
+            if (bit == 0 || IsLowBitType(dataType)) {
+                // 不需要转换, 或者已经量化过的权重, 按原样写入
+                info = cur.info;
+            } else {
+                info.name = cur.info.name;
+                info.dims = cur.info.dims;
+                const float *f = (const float *) cur.bytes.data();
+                if (dataType != DataType::FLOAT32) {
+                    uint64_t count = cur.info.bytes / sizeof(uint16_t), k = info.dims.empty() ? 1 : info.dims[0], m = count / k;
+                    const uint16_t *u16 = (const uint16_t *) cur.bytes.data();
+                    floats.resize(count);
+                    GetPool()->ParallelFor(k, [&](int st, int end) {
+                        for (uint64_t j = st * m; j < end * m; j++) {
+                            if (dataType == DataType::FLOAT16) {
+                                floats[j] = half_to_float(u16[j]);
+                            } else {
+                                uint32_t x = (uint32_t)u16[j] << 16;
+                                memcpy(&floats[j], &x, sizeof(x));
+                            }
                         }
-                        buffer.WriteBytes(uDatas.data(), bytes);
-                    }
+                    }, 16);
+                    f = floats.data();
                 }
+                QuantizeTensor(f, GetWeightType(*this, info), bit, groupCnt, info, uDatas);
+                src = uDatas.empty() ? (const uint8_t *) f : uDatas.data();
             }
-            printf("output (%d / %d)\r", ++tot, need);
+
+            buffer.Align(flmDataAlign);
+            info.offset = buffer.Tell();
+            buffer.WriteBytes(src, info.bytes);
+            infos.push_back(info);
+            if (reader.joinable()) {
+                reader.join();
+            }
+            printf("output (%d / %d)\r", i + 1, len);
             fflush(stdout);
         }
+
+        uint64_t indexPos = buffer.Tell();
+        for (auto &info : infos) {
+            WriteTensorInfo(buffer, info);
+        }
+        buffer.Seek(indexPosPos);
+        buffer.WriteUInt64(indexPos);
         printf("\n");
-        return;
     }
 
     void WeightMap::AddTokenizerWord(const std::string &key, int value, float score) {
@@ -1769,11 +2441,6 @@ namespace fastllm {
             int bit = (dataType == DataType::INT4_NOZERO) ? 4 : 8;
             int type = (bit == 4) ? 1 : 0;
             int k = data.dims[0], m = data.dims[1];
-            int threadNum = 8;
-            int per = k / threadNum;
-            int cur = 0;
-            auto pool = GetPool();
-            std::vector <std::future <void> > futures;
             std::vector<LowBitConfig> configs;
             std::vector<uint8_t> uDatas;
             configs.resize(k);
@@ -1783,18 +2450,9 @@ namespace fastllm {
                 bytes = (k * m + 1) / 2;
             }
             uDatas.resize(bytes);
-            for (int i = 0; i < threadNum; i++) {
-                int end = cur + per;
-                if (i == threadNum - 1) {
-                    end = k;
-                }
-                futures.push_back(pool->Submit(PerChannelQuantizationMultiThread, cur, end, m,
-                                                  (float *) oriData, uDatas.data(), configs.data(), bit));
-                cur = end;
-            }
-            for (int i = 0; i < threadNum; i++) {
-                futures[i].get();
-            }
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                PerChannelQuantizationMultiThread(st, end, m, (float *) oriData, uDatas.data(), configs.data(), bit);
+            }, 16);
 
             data.perChannelAxis = 0;
             data.perChannelsConfigs.resize(k);
@@ -1808,6 +2466,25 @@ namespace fastllm {
                 data.scales[i] = data.perChannelsConfigs[i].scale;
             }
             memcpy((uint8_t*)data.cpuData, (uint8_t*)uDatas.data(), bytes);
+        } else if (oriDataType == DataType::FLOAT32 &&
+                (dataType == DataType::INT4_GROUP || dataType == DataType::INT8_GROUP)) {
+            // 从浮点权重转换时默认每128个元素一组
+            int bit = (dataType == DataType::INT4_GROUP) ? 4 : 8;
+            int k = data.dims[0], m = data.dims[1];
+            data.perChannelAxis = 0;
+            data.groupCnt = 128;
+            data.group = (m - 1) / data.groupCnt + 1;
+            data.perChannelsConfigs.resize((uint64_t)k * data.group);
+            GetPool()->ParallelFor(k, [&](int st, int end) {
+                GroupQuantizationMultiThread(st, end, m, data.groupCnt, (float *) oriData, data.cpuData,
+                                             data.perChannelsConfigs.data(), bit);
+            }, 16);
+            data.scales.resize(data.perChannelsConfigs.size());
+            data.mins.resize(data.perChannelsConfigs.size());
+            for (int i = 0; i < data.perChannelsConfigs.size(); i++) {
+                data.scales[i] = data.perChannelsConfigs[i].scale;
+                data.mins[i] = -data.perChannelsConfigs[i].scale * data.perChannelsConfigs[i].zeroPoint;
+            }
         } else {
             ErrorInFastLLM("wrong data type");
         }
@@ -1816,8 +2493,7 @@ namespace fastllm {
     void WeightMap::ReleaseWeight() {
         for (auto &w : this->weight) {
 #ifndef USE_MMAP
-            delete[] w.second.cpuData;
-            w.second.cpuData = nullptr;
+            w.second.ReleaseCpuData();
 #endif
 #ifdef USE_CUDA
             if (w.second.cudaData != nullptr) {
@@ -1826,6 +2502,33 @@ namespace fastllm {
             }
 #endif
         }
+        // 权重释放后不再缓存, 直接还给系统
+        FastllmCpuClearBuffer();
+    }
+
+    void WeightMap::PrepackLinearWeights() {
+        if (!linearWeightPrepack || !this->peftDict.empty()) {
+            // LoRA等adapter会转置原始权重, 保持逐行存放
+            return;
+        }
+        // 有层会在其他设备上计算时, 权重要按原始格式上传
+        if (defaultDeviceMap.size() > 0) {
+            for (auto &it : defaultDeviceMap) {
+                if (!StartWith(it.first, "cpu")) {
+                    return;
+                }
+            }
+        } else if (curExecutor->GetFirstDeviceType() != "cpu") {
+            return;
+        }
+        for (auto &name : this->linearNames) {
+            auto it = this->weight.find(name);
+            if (it == this->weight.end() || this->embeddingNames.find(name) != this->embeddingNames.end() ||
+                !CanPackLinearWeight(it->second)) {
+                continue;
+            }
+            PackLinearWeight(it->second);
+        }
     }
 
     Data &WeightMap::operator[](const std::string &key) {
@@ -1854,6 +2557,47 @@ namespace fastllm {
         });
     }
 
+    bool PreparePagedKVCache(Data &cache, const Data &input) {
+        if (cache.pagedKVCache != nullptr) {
+            return true;
+        }
+        // 分页cache只在CPU上实现; cache被锁在CPU上时 (GetKVCacheInCPU) 输入会在CatDirect时搬到CPU
+        if (!GetPagedKVCache() || cache.dims.size() > 0 || cache.expansionBytes > 0 ||
+            input.dims.size() != 3 || input.dataType != DataType::FLOAT32 ||
+            cache.dataDevice != DataDevice::CPU || (input.dataDevice != DataDevice::CPU && !cache.lockInCPU)) {
+            return false;
+        }
+        cache.dataType = input.dataType;
+        cache.UpdateUnitSize();
+        // cache的逻辑类型仍然是FLOAT32, 只有block中的存储格式不同
+        int storeType = (kvCacheType == DataType::FLOAT16) ? PAGED_KV_FLOAT16 :
+                        (kvCacheType == DataType::INT8) ? PAGED_KV_INT8 : PAGED_KV_FLOAT32;
+        cache.pagedKVCache = std::make_shared <PagedKVCache> (input.dims[0], input.dims[2], cache.unitSize, GetKVCacheBlockLen(), storeType);
+        return true;
+    }
+
+    void PrepareKVCache(Data &cache, const Data &input, bool allowPaged) {
+        if (allowPaged && PreparePagedKVCache(cache, input)) {
+            return;
+        }
+
+        int unitLen = 64;
+#ifdef USE_CUDA
+        unitLen = 128;
+#endif
+        while ((cache.dims.size() == 0 && (cache.expansionDims.size() == 0 || input.dims[1] > cache.expansionDims[1]))
+               || (cache.dims.size() > 0 && cache.dims[1] + input.dims[1] > cache.expansionDims[1])) {
+            std::vector <int> newDims;
+            if (cache.Count(0) == 0 || cache.dims.size() == 0) {
+                newDims = std::vector <int> {input.dims[0], ((input.dims[1] - 1) / unitLen + 1) * unitLen, input.dims[2]};
+            } else {
+                newDims = cache.dims;
+                newDims[1] += ((input.dims[1] - 1) / unitLen + 1) * unitLen;
+            }
+            cache.Expansion(newDims);
+        }
+    }
+
     void Attention(const Data &q, const Data &k, const Data &v, const Data &mask, Data &output,
                    int group, float scale, int attentionType) {
         curExecutor->Run("Attention", {
@@ -1862,6 +2606,14 @@ namespace fastllm {
         }, {{"scale", scale}}, {{"group", group}});
     }
 
+    void FusedAttention(const Data &q, const Data &k, const Data &v, const Data &mask, const Data &alibi, Data &output,
+                        int group, float scale) {
+        curExecutor->Run("Attention", {
+                {"q", (Data*)&q}, {"k", (Data*)&k}, {"v", (Data*)&v},
+                {"mask", (Data*)&mask}, {"alibi", (Data*)&alibi}, {"output", (Data*)&output}
+        }, {{"scale", scale}}, {{"group", group}});
+    }
+
     void Embedding(const Data &input, Data &weight, Data &output) {
         curExecutor->Run("Embedding", {
                 {"input", (Data*)&input}, {"weight", &weight}, {"output", &output}
@@ -1874,15 +2626,27 @@ namespace fastllm {
         }, {{"eps", eps}}, {});
     }
 
+    void AddToRMSNorm(Data &input0, const Data &input1, const Data &weight, float eps, Data &output, float alpha) {
+        curExecutor->Run("AddToRMSNorm", {
+                {"input0", &input0}, {"input1", (Data*)&input1}, {"weight", (Data*)&weight}, {"output", &output}
+        }, {{"eps", eps}, {"alpha", alpha}}, {});
+    }
+
     void LayerNorm(Data &input, Data &gamma, Data &beta, int axis, Data &output) {
         curExecutor->Run("LayerNorm", {
             {"input", &input}, {"gamma", &gamma}, {"beta", &beta}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
-    void Linear(Data &input, Data &weight, const Data &bias, Data &output) {
+    void Linear(Data &input, Data &weight, const Data &bias, Data &output, LinearActivation activation) {
         curExecutor->Run("Linear", {
                 {"input", &input}, {"weight", &weight}, {"bias", (Data*)&bias}, {"output", &output}
+        }, {}, {{"activation", (int)activation}});
+    }
+
+    void LinearSiluMul(Data &input, Data &weight, const Data &bias, const Data &gate, Data &output) {
+        curExecutor->Run("Linear", {
+                {"input", &input}, {"weight", &weight}, {"bias", (Data*)&bias}, {"gate", (Data*)&gate}, {"output", &output}
         }, {}, {});
     }
 
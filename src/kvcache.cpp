@@ -0,0 +1,231 @@
+#include "kvcache.h"
+#include "utils.h"
+
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+
+namespace fastllm {
+    KVCacheBlockPool::KVCacheBlockPool(uint64_t blockBytes, int blocksPerChunk) {
+        this->blockBytes = blockBytes;
+        this->blocksPerChunk = blocksPerChunk;
+    }
+
+    KVCacheBlockPool::~KVCacheBlockPool() {
+        for (uint8_t *chunk : chunks) {
+            delete[] chunk;
+        }
+    }
+
+    void KVCacheBlockPool::AddChunk() {
+        uint8_t *chunk = new uint8_t[blockBytes * blocksPerChunk];
+        chunks.push_back(chunk);
+        for (int i = blocksPerChunk - 1; i >= 0; i--) {
+            freeBlocks.push_back(chunk + i * blockBytes);
+        }
+        totalBlocks += blocksPerChunk;
+    }
+
+    uint8_t *KVCacheBlockPool::AllocBlock() {
+        std::lock_guard <std::mutex> guard(locker);
+        if (freeBlocks.empty()) {
+            AddChunk();
+        }
+        uint8_t *ret = freeBlocks.back();
+        freeBlocks.pop_back();
+        return ret;
+    }
+
+    void KVCacheBlockPool::FreeBlock(uint8_t *block) {
+        std::lock_guard <std::mutex> guard(locker);
+        auto it = sharedRefs.find(block);
+        if (it != sharedRefs.end()) {
+            if (--it->second == 0) {
+                sharedRefs.erase(it);
+            }
+            return;
+        }
+        freeBlocks.push_back(block);
+    }
+
+    void KVCacheBlockPool::ShareBlock(uint8_t *block) {
+        std::lock_guard <std::mutex> guard(locker);
+        sharedRefs[block]++;
+    }
+
+    bool KVCacheBlockPool::IsShared(uint8_t *block) {
+        std::lock_guard <std::mutex> guard(locker);
+        return sharedRefs.find(block) != sharedRefs.end();
+    }
+
+    void KVCacheBlockPool::Reserve(int blocks) {
+        std::lock_guard <std::mutex> guard(locker);
+        while (totalBlocks < blocks) {
+            AddChunk();
+        }
+    }
+
+    int KVCacheBlockPool::GetTotalBlocks() {
+        std::lock_guard <std::mutex> guard(locker);
+        return totalBlocks;
+    }
+
+    int KVCacheBlockPool::GetFreeBlocks() {
+        std::lock_guard <std::mutex> guard(locker);
+        return (int)freeBlocks.size();
+    }
+
+    static std::mutex kvCacheBlockPoolsLocker;
+    static std::map <uint64_t, KVCacheBlockPool*> kvCacheBlockPools;
+
+    KVCacheBlockPool *GetKVCacheBlockPool(uint64_t blockBytes) {
+        std::lock_guard <std::mutex> guard(kvCacheBlockPoolsLocker);
+        auto it = kvCacheBlockPools.find(blockBytes);
+        if (it != kvCacheBlockPools.end()) {
+            return it->second;
+        }
+        KVCacheBlockPool *pool = new KVCacheBlockPool(blockBytes);
+        kvCacheBlockPools[blockBytes] = pool;
+        return pool;
+    }
+
+    uint64_t PagedKVCache::GetRowBytes(int dim, int unitSize, int storeType) {
+        if (storeType == PAGED_KV_FLOAT16) {
+            return (uint64_t)dim * sizeof(uint16_t);
+        } else if (storeType == PAGED_KV_INT8) {
+            return (uint64_t)dim + sizeof(float);
+        }
+        return (uint64_t)dim * unitSize;
+    }
+
+    PagedKVCache::PagedKVCache(int heads, int dim, int unitSize, int blockLen, int storeType) {
+        AssertInFastLLM(blockLen > 0, "PagedKVCache error: blockLen should be > 0.\n");
+        AssertInFastLLM(storeType == PAGED_KV_FLOAT32 || unitSize == sizeof(float),
+                        "PagedKVCache error: quantized kv cache only supports float input.\n");
+        this->heads = heads;
+        this->dim = dim;
+        this->unitSize = unitSize;
+        this->blockLen = blockLen;
+        this->storeType = storeType;
+        this->rowBytes = GetRowBytes(dim, unitSize, storeType);
+        this->pool = GetKVCacheBlockPool((uint64_t)heads * blockLen * rowBytes);
+    }
+
+    PagedKVCache::PagedKVCache(const PagedKVCache &ori) :
+            heads(ori.heads), dim(ori.dim), unitSize(ori.unitSize), blockLen(ori.blockLen), storeType(ori.storeType),
+            rowBytes(ori.rowBytes), len(ori.len), pool(ori.pool) {
+        for (uint8_t *block : ori.blockTable) {
+            blockTable.push_back(pool->AllocBlock());
+            memcpy(blockTable.back(), block, pool->blockBytes);
+        }
+    }
+
+    PagedKVCache::~PagedKVCache() {
+        Clear();
+    }
+
+    void PagedKVCache::Clear() {
+        for (uint8_t *block : blockTable) {
+            pool->FreeBlock(block);
+        }
+        blockTable.clear();
+        len = 0;
+    }
+
+    void PagedKVCache::Truncate(int len) {
+        AssertInFastLLM(len >= 0 && len <= this->len, "PagedKVCache error: truncate length out of range.\n");
+        int blocks = (len + blockLen - 1) / blockLen;
+        while ((int)blockTable.size() > blocks) {
+            pool->FreeBlock(blockTable.back());
+            blockTable.pop_back();
+        }
+        int kept = len % blockLen;
+        if (kept != 0 && pool->IsShared(blockTable.back())) {
+            // 最后一个block只保留了一部分且被共享, 复制保留的行, 之后的追加写入副本
+            uint8_t *shared = blockTable.back(), *block = pool->AllocBlock();
+            for (int h = 0; h < heads; h++) {
+                memcpy(block + (uint64_t)h * blockLen * rowBytes, shared + (uint64_t)h * blockLen * rowBytes, kept * rowBytes);
+            }
+            blockTable.back() = block;
+            pool->FreeBlock(shared);
+        }
+        this->len = len;
+    }
+
+    void PagedKVCache::ShareBlocks(const std::vector <uint8_t*> &blocks) {
+        AssertInFastLLM(len == GetCapacity(), "PagedKVCache error: can only share blocks after full blocks.\n");
+        for (uint8_t *block : blocks) {
+            pool->ShareBlock(block);
+            blockTable.push_back(block);
+        }
+        len += (int)blocks.size() * blockLen;
+    }
+
+    // 把cnt个连续的float行转换成存储格式写入dst
+    static void StoreKVRows(const float *input, uint8_t *dst, int cnt, int dim, int storeType, uint64_t rowBytes) {
+        for (int t = 0; t < cnt; t++, input += dim, dst += rowBytes) {
+            if (storeType == PAGED_KV_FLOAT16) {
+                uint16_t *row = (uint16_t*)dst;
+                for (int i = 0; i < dim; i++) {
+                    row[i] = float_to_half(input[i]);
+                }
+            } else {
+                float maxAbs = 0.0f;
+                for (int i = 0; i < dim; i++) {
+                    maxAbs = std::max(maxAbs, fabsf(input[i]));
+                }
+                float scale = maxAbs / 127.0f;
+                float invScale = (scale > 0.0f) ? 1.0f / scale : 0.0f;
+                int8_t *row = (int8_t*)dst;
+                for (int i = 0; i < dim; i++) {
+                    row[i] = (int8_t)std::max(-127, std::min(127, (int)roundf(input[i] * invScale)));
+                }
+                memcpy(dst + dim, &scale, sizeof(float));
+            }
+        }
+    }
+
+    void PagedKVCache::Append(const uint8_t *input, int inputLen, uint64_t headStride) {
+        AssertInFastLLM(len % blockLen == 0 || !pool->IsShared(blockTable.back()),
+                        "PagedKVCache error: can't append into a shared block.\n");
+        while (GetCapacity() < len + inputLen) {
+            blockTable.push_back(pool->AllocBlock());
+        }
+        uint64_t inputRowBytes = (uint64_t)dim * unitSize;
+        int cur = 0;
+        while (cur < inputLen) {
+            int token = len + cur;
+            int inBlock = token % blockLen;
+            int cnt = std::min(blockLen - inBlock, inputLen - cur);
+            for (int h = 0; h < heads; h++) {
+                const uint8_t *src = input + (h * headStride + (uint64_t)cur * dim) * unitSize;
+                if (storeType == PAGED_KV_FLOAT32) {
+                    memcpy(GetToken(h, token), src, cnt * inputRowBytes);
+                } else {
+                    StoreKVRows((const float*)src, GetToken(h, token), cnt, dim, storeType, rowBytes);
+                }
+            }
+            cur += cnt;
+        }
+        len += inputLen;
+    }
+
+    void PagedKVCache::AppendRows(const uint8_t *rows, int inputLen) {
+        AssertInFastLLM(len % blockLen == 0 || !pool->IsShared(blockTable.back()),
+                        "PagedKVCache error: can't append into a shared block.\n");
+        while (GetCapacity() < len + inputLen) {
+            blockTable.push_back(pool->AllocBlock());
+        }
+        int cur = 0;
+        while (cur < inputLen) {
+            int token = len + cur;
+            int inBlock = token % blockLen;
+            int cnt = std::min(blockLen - inBlock, inputLen - cur);
+            for (int h = 0; h < heads; h++) {
+                memcpy(GetToken(h, token), rows + ((uint64_t)h * inputLen + cur) * rowBytes, cnt * rowBytes);
+            }
+            cur += cnt;
+        }
+        len += inputLen;
+    }
+}
@@ -0,0 +1,121 @@
+#include "kvswap.h"
+#include "utils.h"
+
+#include <cstring>
+#include <algorithm>
+
+namespace fastllm {
+    SwappedKVCache::~SwappedKVCache() {
+        Clear();
+    }
+
+    void SwappedKVCache::Clear() {
+        if (file != nullptr) {
+            fclose(file);
+            file = nullptr;
+        }
+        entries.clear();
+        bytes = 0;
+    }
+
+    void SwappedKVCache::Write(Data &data) {
+        Entry entry;
+        entry.dataType = data.dataType;
+        entry.paged = (data.pagedKVCache != nullptr);
+        if (data.dims.size() == 0) {
+            entry.heads = entry.len = entry.dim = entry.unitSize = 0;
+            entry.storeType = PAGED_KV_FLOAT32;
+            entry.rowBytes = 0;
+            entry.chunkLen = 1;
+            entries.push_back(entry);
+            return;
+        }
+        AssertInFastLLM(data.dims.size() == 3, "SwapOut error: kv cache should be [heads, len, dim].\n");
+        data.ToDevice(DataDevice::CPU);
+        entry.heads = data.dims[0];
+        entry.len = data.dims[1];
+        entry.dim = data.dims[2];
+        entry.unitSize = data.unitSize;
+        // 分页cache按block写出, 每个head在一个block内的token是连续的
+        entry.chunkLen = entry.paged ? data.pagedKVCache->blockLen : 64;
+        entry.storeType = entry.paged ? data.pagedKVCache->storeType : PAGED_KV_FLOAT32;
+        entry.rowBytes = entry.paged ? data.pagedKVCache->rowBytes : (uint64_t)entry.dim * entry.unitSize;
+        entries.push_back(entry);
+
+        uint64_t rowBytes = entry.rowBytes;
+        for (int st = 0; st < entry.len; st += entry.chunkLen) {
+            int cnt = std::min(entry.chunkLen, entry.len - st);
+            for (int h = 0; h < entry.heads; h++) {
+                uint8_t *row = entry.paged ? data.pagedKVCache->GetToken(h, st) :
+                               data.cpuData + ((uint64_t)h * data.strides[0] + (uint64_t)st * data.strides[1]) * entry.unitSize;
+                AssertInFastLLM(fwrite(row, 1, cnt * rowBytes, file) == cnt * rowBytes, "SwapOut error: write failed.\n");
+            }
+        }
+        bytes += (long long)entry.heads * entry.len * rowBytes;
+    }
+
+    void SwappedKVCache::SwapOut(std::vector <std::pair <Data, Data> > &pastKeyValues) {
+        AssertInFastLLM(file == nullptr, "SwapOut error: kv cache is already swapped.\n");
+        file = tmpfile();
+        AssertInFastLLM(file != nullptr, "SwapOut error: can't create swap file.\n");
+        entries.clear();
+        bytes = 0;
+        for (auto &it : pastKeyValues) {
+            Write(it.first);
+            Write(it.second);
+        }
+        fflush(file);
+
+        // Data的赋值是浅拷贝, 整体换成新的vector, 旧的Data析构时释放内存
+        std::vector <std::pair <Data, Data> > empty;
+        for (int i = 0; i < (int)pastKeyValues.size(); i++) {
+            empty.push_back(std::make_pair(Data(entries[i * 2].dataType), Data(entries[i * 2 + 1].dataType)));
+        }
+        pastKeyValues.swap(empty);
+    }
+
+    void SwappedKVCache::Read(const Entry &entry, Data &data) {
+        if (entry.len == 0) {
+            return;
+        }
+        uint64_t rowBytes = entry.rowBytes;
+        data.dataType = entry.dataType;
+        data.UpdateUnitSize();
+        if (entry.paged) {
+            data.pagedKVCache = std::make_shared <PagedKVCache> (entry.heads, entry.dim, entry.unitSize, GetKVCacheBlockLen(), entry.storeType);
+        } else {
+            int unitLen = 64;
+            data.Expansion({entry.heads, ((entry.len - 1) / unitLen + 1) * unitLen, entry.dim});
+            data.Resize({entry.heads, entry.len, entry.dim});
+        }
+
+        std::vector <uint8_t> buffer = std::vector <uint8_t> ((uint64_t)entry.heads * entry.chunkLen * rowBytes);
+        for (int st = 0; st < entry.len; st += entry.chunkLen) {
+            int cnt = std::min(entry.chunkLen, entry.len - st);
+            uint64_t chunkBytes = (uint64_t)entry.heads * cnt * rowBytes;
+            AssertInFastLLM(fread(buffer.data(), 1, chunkBytes, file) == chunkBytes, "SwapIn error: read failed.\n");
+            if (entry.paged) {
+                data.pagedKVCache->AppendRows(buffer.data(), cnt);
+            } else {
+                for (int h = 0; h < entry.heads; h++) {
+                    memcpy(data.cpuData + ((uint64_t)h * data.strides[0] + (uint64_t)st * data.strides[1]) * entry.unitSize,
+                           buffer.data() + (uint64_t)h * cnt * rowBytes, cnt * rowBytes);
+                }
+            }
+        }
+        if (entry.paged) {
+            data.Resize({entry.heads, entry.len, entry.dim});
+        }
+    }
+
+    void SwappedKVCache::SwapIn(std::vector <std::pair <Data, Data> > &pastKeyValues) {
+        AssertInFastLLM(file != nullptr, "SwapIn error: kv cache is not swapped.\n");
+        AssertInFastLLM(pastKeyValues.size() * 2 == entries.size(), "SwapIn error: layer count mismatch.\n");
+        rewind(file);
+        for (int i = 0; i < (int)pastKeyValues.size(); i++) {
+            Read(entries[i * 2], pastKeyValues[i].first);
+            Read(entries[i * 2 + 1], pastKeyValues[i].second);
+        }
+        Clear();
+    }
+}
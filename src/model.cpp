@@ -54,16 +54,25 @@ namespace fastllm {
         }
 
         this->deviceMap = GetDeviceMap();
+        this->InitLinearNames();
+        this->weight.PrepackLinearWeights();
     }
 
-    void basellm::SaveLowBitModel(const std::string &fileName, int bit) {
-        this->weight.SaveLowBitModel(fileName, bit);
+    void basellm::SaveLowBitModel(const std::string &fileName, int bit, int groupCnt) {
+        this->weight.SaveLowBitModel(fileName, bit, groupCnt);
     }
 
     void basellm::SaveModel(const std::string &fileName) {
         this->weight.SaveLowBitModel(fileName, 0);
     }
 
+    void basellm::ConvertLowBitModel(const std::string &input, const std::string &output, int bit, int groupCnt) {
+        // 先读文件头得到层数等参数, 才能列出所有Linear层的权重名
+        this->weight.LoadHeaderFromFile(input);
+        this->InitParams();
+        this->weight.ConvertLowBitModel(input, output, bit, groupCnt);
+    }
+
     fastllm::basellm *CreateModelWithType(const std::string &modelType) {
         basellm *model = nullptr;
         if (modelType == "chatglm") {
@@ -6,6 +6,8 @@
 #include "utils.h"
 #include <sstream>
 #include <cstring>
+#include <algorithm>
+#include <set>
 
 #ifdef USE_CUDA
 #include "fastllm-cuda.cuh"
@@ -52,10 +54,15 @@ namespace fastllm {
         }
         isEnding = false;
         preTokens = 0;
+        cachedTokens = 0;
+        allTokens.clear();
     }
     
     std::string basellm::Response(const std::string &input, RuntimeResult retCb,
                                   const fastllm::GenerationConfig &generationConfig) {
+        if (UseSpeculative(generationConfig)) {
+            return SpeculativeResponse(input, retCb, generationConfig);
+        }
 #ifdef USE_CUDA
         FastllmCudaClearBigBuffer();
 #endif
@@ -80,7 +87,7 @@ namespace fastllm {
         }
 
         std::string retString = "";
-        std::vector<float> results;
+        StreamDecoder decoder(&weight.tokenizer);
         LastTokensManager tokens(1, generationConfig.last_n);
         int promptLen = inputTokens[0].size(), index = 0;
         FillLLMInputs(inputTokens, {{"promptLen", promptLen}, {"index", index}}, inputIds, attentionMask, positionIds);
@@ -92,9 +99,7 @@ namespace fastllm {
                 break;
             }
 
-            results.push_back(ret);
-            std::string curString = weight.tokenizer.Decode(
-                    Data(DataType::FLOAT32, {(int) results.size()}, results)).c_str();
+            std::string curString = decoder.Push(ret);
             retString += curString;
             if (retCb)
 #ifdef PY_API
@@ -112,7 +117,6 @@ namespace fastllm {
 #endif
             index++;
             fflush(stdout);
-            results.clear();
 
             inputTokens[0] = std::vector<float> {(float)ret};
             FillLLMInputs(inputTokens, {{"promptLen", promptLen}, {"index", index}}, inputIds, attentionMask, positionIds);
@@ -121,6 +125,7 @@ namespace fastllm {
             }
             // printf("len = %d, spend %f s.\n", len, GetSpan(st, std::chrono::system_clock::now()));
         }
+        retString += decoder.Flush();
         if (retCb)
 #ifdef PY_API
             {
@@ -165,15 +170,8 @@ namespace fastllm {
         outputs.clear();
         outputs.resize(batch, "");
 
-        std::vector<std::vector<float> > inputTokens;
-        inputTokens.resize(batch);
-
-        for (int i = 0; i < batch; i++) {
-            Data now = this->weight.tokenizer.Encode(prompts[i]);
-            for (int j = 0; j < now.Count(0); j++) {
-                inputTokens[i].push_back(((float *) now.cpuData)[j]);
-            }
-        }
+        std::vector<std::vector<float> > inputTokens = this->weight.tokenizer.EncodeBatch(prompts);
+        std::vector <StreamDecoder> decoders(batch, StreamDecoder(&this->weight.tokenizer));
 
         std::vector <std::pair <Data, Data> > pastKeyValues;
         for (int i = 0; i < block_cnt; i++) {
@@ -200,7 +198,6 @@ namespace fastllm {
                 tokensManager.units[i].Push(ret[i]);
             }
             std::vector <float> fret;
-            std::vector <float> results;
             int endingCount = 0;
             std::vector <std::string> curStrings;
             for (int i = 0; i < batch; i++) {
@@ -215,16 +212,14 @@ namespace fastllm {
                     }
                 }
                 if (isEnding[i]) {
+                    outputs[i] += decoders[i].Flush();
                     curStrings.push_back("");
                     endingCount++;
                     continue;
                 }
-                results.push_back(ret[i]);
-                std::string curString = weight.tokenizer.Decode(
-                        Data(DataType::FLOAT32, {(int) results.size()}, results)).c_str();
+                std::string curString = decoders[i].Push(ret[i]);
                 outputs[i] += curString;
                 curStrings.push_back(curString);
-                results.clear();
             }
 
             if (endingCount == batch) {
@@ -299,6 +294,17 @@ namespace fastllm {
         exit(0);
     }
 
+    // 分页KV cache只共享block table, 不拷贝数据; 其余情况沿用Mul拷贝
+    static void ShareOrCopyKVCache(Data &src, Data &dst) {
+        if (src.pagedKVCache != nullptr) {
+            dst.dataType = src.dataType;
+            dst.pagedKVCache = src.pagedKVCache;
+            dst.Resize(src.dims);
+        } else if (src.dims.size() > 0) {
+            Mul(src, 1.0, dst);
+        }
+    }
+
     std::vector<int> basellm::ForwardBatch(int batch, const fastllm::Data &inputIds,
                                            const std::vector<Data *> &attentionMask,
                           const std::vector<Data *> &positionIds, const std::vector<int> &seqLens,
@@ -312,17 +318,21 @@ namespace fastllm {
             std::vector<std::pair<Data, Data> > curKV;
             curKV.resize(this->block_cnt);
             for (int j = 0; j < this->block_cnt; j++) {
-                Mul(*pastKeyValues[i * this->block_cnt + j].first, 1.0, curKV[j].first);
-                Mul(*pastKeyValues[i * this->block_cnt + j].second, 1.0, curKV[j].second);
+                ShareOrCopyKVCache(*pastKeyValues[i * this->block_cnt + j].first, curKV[j].first);
+                ShareOrCopyKVCache(*pastKeyValues[i * this->block_cnt + j].second, curKV[j].second);
             }
             Data curInput;
             Split(inputIds, 1, cur, cur + seqLens[i], curInput);
             LastTokensManager curTokens;
             curTokens.units.push_back(lastTokens.units[i]);
-            ret.push_back(this->Forward(curInput, *attentionMask[i], *positionIds[i], curKV, generationConfigs[i], curTokens));
+            ret.push_back(this->Forward(curInput, attentionMask[i] == nullptr ? Data() : *attentionMask[i],
+                                        positionIds[i] == nullptr ? Data() : *positionIds[i],
+                                        curKV, generationConfigs[i], curTokens,
+                                        logits == nullptr ? nullptr : (*logits)[i]));
+            cur += seqLens[i];
             for (int j = 0; j < this->block_cnt; j++) {
-                Mul(curKV[j].first, 1.0, *pastKeyValues[i * this->block_cnt + j].first);
-                Mul(curKV[j].second, 1.0, *pastKeyValues[i * this->block_cnt + j].second);
+                ShareOrCopyKVCache(curKV[j].first, *pastKeyValues[i * this->block_cnt + j].first);
+                ShareOrCopyKVCache(curKV[j].second, *pastKeyValues[i * this->block_cnt + j].second);
             }
         }
         return ret;
@@ -525,160 +535,206 @@ printf("%d / %d\n", endingCount, batch);
         }
         mainLoopLocker.unlock();
 */
+        StartMainLoop();
+
+        dictLocker.lock();
+        int handleId = responseContextDict.CreateHandle();
+        ResponseContext *context = responseContextDict.GetHandle(handleId);
+        context->Init(this->block_cnt);
+        context->currentTokens = inputTokens;
+        context->generationConfig = generationConfig;
+        context->tokens = LastTokensUnit(generationConfig.last_n);
+        context->arrivalId = requestCounter++;
+        context->allTokens = inputTokens;
+        if (UsePrefixCache()) {
+            // 复用已缓存的最长前缀, 至少留一个token用来计算输出
+            context->cachedTokens = prefixCache.Match(inputTokens, (int)inputTokens.size() - 1, context->pastKeyValues);
+            context->preTokens = context->cachedTokens;
+        }
+        dictLocker.unlock();
+        mainLoopCond.notify_one();
+        return handleId;
+    }
+
+    void basellm::StartMainLoop() {
         mainLoopLocker.lock();
         if (mainLoop == nullptr) {
             if (mainLoop == nullptr) {
                 mainLoop = new std::thread([](basellm *model) {
-                    while (true) {
+                    std::unique_lock <std::mutex> dictLock(model->dictLocker);
+                    while (!model->mainLoopStop) {
+                        bool isPrompt = false;
+                        std::vector <std::pair <int, int> > handles = model->PickScheduleBatch(isPrompt, dictLock);
+                        if (handles.empty()) {
+                            // 没有可以计算的请求, 等待新请求到来或者旧请求释放
+                            if (!model->mainLoopStop) {
+                                model->mainLoopCond.wait(dictLock);
+                            }
+                            continue;
+                        }
+
+                        // 投机解码的请求单独做一次batch验证, 一步可以生成多个token
+                        std::vector <std::pair <int, int> > normalHandles;
+                        std::vector <ResponseContext*> speculativeHandles;
+                        for (auto &handle : handles) {
+                            ResponseContext *context = model->responseContextDict.dicts[handle.first];
+                            if (!context->IsPrompt() && model->UseSpeculative(context->generationConfig)) {
+                                speculativeHandles.push_back(context);
+                            } else {
+                                normalHandles.push_back(handle);
+                            }
+                        }
+                        if (!speculativeHandles.empty()) {
+                            bool outputLogits = false;
+                            for (ResponseContext *context : speculativeHandles) {
+                                outputLogits |= context->generationConfig.output_logits;
+                            }
+                            std::vector <std::vector <std::vector <float> > > stepLogits;
+                            dictLock.unlock();
+                            std::vector <std::vector <int> > stepTokens = model->SpeculativeStep(speculativeHandles, outputLogits ? &stepLogits : nullptr);
+                            dictLock.lock();
+                            ScheduleMetrics &metrics = model->scheduleMetrics;
+                            metrics.steps++;
+                            metrics.decodeSteps++;
+                            metrics.batchSum += speculativeHandles.size();
+                            for (int b = 0; b < (int)speculativeHandles.size(); b++) {
+                                ResponseContext *context = speculativeHandles[b];
+                                metrics.decodeTokens += stepTokens[b].size();
+                                context->lastStep = metrics.steps;
+                                for (int i = 0; i < (int)stepTokens[b].size() && !context->isEnding; i++) {
+                                    if (context->generationConfig.output_logits) {
+                                        context->resultLogits.push(new std::vector <float> (stepLogits[b][i]));
+                                    }
+                                    model->PushResponseToken(context, stepTokens[b][i]);
+                                }
+                                context->cond.notify_all();
+                            }
+                        }
+                        if (!speculativeHandles.empty()) {
+                            model->lastStepPrefill = false;
+                            handles.swap(normalHandles);
+                            if (handles.empty()) {
+                                continue;
+                            }
+                        }
+
                         std::vector <Data*> attentionMasks;
                         std::vector <Data*> positionIds;
                         std::vector <std::pair <Data*, Data*> > pastKeyValues;
                         std::vector <float> ids;
                         std::vector <int> seqLens;
-                        std::vector <int> handles;
                         std::vector <GenerationConfig> generationConfigs;
                         LastTokensManager tokensManager;
                         std::vector <std::vector <float>* > logits;
-                        model->dictLocker.lock();
+                        std::vector <bool> finished; // 本步之后是否会产生输出 (分块prefill的中间段没有输出)
+                        std::vector <bool> prompting; // 本步是否在计算prompt
+                        int prefillTokens = 0;
+                        for (auto &handle : handles) {
+                            ResponseContext *context = model->responseContextDict.dicts[handle.first];
+                            std::vector<std::vector<float> > tokens;
+                            tokens.resize(1);
+                            if (context->IsPrompt()) {
+                                int chunkStart = context->preTokens, chunkLen = handle.second;
+                                context->intParams["promptLen"] = context->currentTokens.size();
+                                context->intParams["index"] = 0;
+                                context->intParams["chunkStart"] = chunkStart;
+                                for (int i = chunkStart; i < chunkStart + chunkLen; i++) {
+                                    tokens[0].push_back(context->currentTokens[i]);
+                                }
+                                finished.push_back(chunkStart + chunkLen == (int)context->currentTokens.size());
+                                prefillTokens += chunkLen;
+                                prompting.push_back(true);
+                            } else {
+                                context->intParams["index"]++;
+                                for (int i: context->currentTokens) {
+                                    tokens[0].push_back(i);
+                                }
+                                finished.push_back(true);
+                                prompting.push_back(false);
+                            }
 
-                        int limit = model->tokensLimit > 0 ? model->tokensLimit : 1e9;
-                        int lenSum = 0;
-                        for (auto &it: model->responseContextDict.dicts) {
-                            if (it.second->pastKeyValues[0].first.expansionDims.size() > 0 && !it.second->isEnding) {
-                                lenSum += it.second->pastKeyValues[0].first.expansionDims[1];
+                            generationConfigs.push_back(context->generationConfig);
+                            if (context->generationConfig.output_logits && finished.back()) {
+                                context->resultLogits.push(new std::vector<float>());
+                                logits.push_back(context->resultLogits.back());
+                            } else {
+                                logits.push_back(nullptr);
                             }
-                        }
+                            tokensManager.units.push_back(context->tokens);
 
-                        for (int isPrompt = 1; isPrompt >= 0; isPrompt--) {
-                            int cnt = 0;
-                            if (isPrompt == 0 && seqLens.size() > 0) {
-                                continue;
+                            Data inputIds, attentionMask, curPositionIds;
+                            model->FillLLMInputs(tokens, context->intParams, inputIds, attentionMask,
+                                                 curPositionIds);
+                            if (prompting.back() && finished.back()) {
+                                // prompt已经算完, 之后的解码不再带chunkStart
+                                context->intParams.erase("chunkStart");
                             }
-                            if (lenSum > limit && isPrompt) {
-                                continue;
+                            seqLens.push_back(inputIds.Count(0));
+                            for (int i = 0; i < inputIds.Count(0); i++) {
+                                ids.push_back(((float *) inputIds.cpuData)[i]);
                             }
-
-                            for (auto &it: model->responseContextDict.dicts) {
-                                if (it.second->isEnding) {
-                                    continue;
-                                }
-                                if (isPrompt && it.second->preTokens != 0) {
-                                    continue;
-                                }
-                                if (!isPrompt && it.second->preTokens == 0) {
-                                    continue;
-                                }
-
-                                int outputLimit = it.second->generationConfig.output_token_limit;
-                                outputLimit = (outputLimit < 0 ? 128 : outputLimit);
-                                if (isPrompt && lenSum + it.second->currentTokens.size() + outputLimit > limit) {
-                                    continue;
-                                }
-
-                                generationConfigs.push_back(it.second->generationConfig);
-                                if (it.second->generationConfig.output_logits) {
-                                    it.second->resultLogits.push(new std::vector<float>());
-                                    logits.push_back(it.second->resultLogits.back());
-                                } else {
-                                    logits.push_back(nullptr);
-                                }
-
-                                tokensManager.units.push_back(it.second->tokens);
-                                handles.push_back(it.first);
-
-                                if (it.second->preTokens == 0) {
-                                    it.second->intParams["promptLen"] = it.second->currentTokens.size();
-                                    it.second->intParams["index"] = 0;
-                                } else {
-                                    it.second->intParams["index"]++;
-                                }
-                                Data inputIds, attentionMask, curPositionIds;
-                                std::vector<std::vector<float> > tokens;
-                                tokens.resize(1);
-                                for (int i: it.second->currentTokens) {
-                                    tokens[0].push_back(i);
-                                }
-                                model->FillLLMInputs(tokens, it.second->intParams, inputIds, attentionMask,
-                                                     curPositionIds);
-                                seqLens.push_back(inputIds.Count(0));
-                                for (int i = 0; i < inputIds.Count(0); i++) {
-                                    ids.push_back(((float *) inputIds.cpuData)[i]);
-                                }
-                                if (attentionMask.dims.size() == 0) {
-                                    attentionMasks.push_back(nullptr);
-                                } else {
-                                    attentionMasks.push_back(new Data());
-                                    attentionMasks.back()->CopyFrom(attentionMask);
-                                }
-                                if (curPositionIds.dims.size() == 0) {
-                                    positionIds.push_back(nullptr);
-                                } else {
-                                    positionIds.push_back(new Data());
-                                    positionIds.back()->CopyFrom(curPositionIds);
-                                }
-                                it.second->preTokens += seqLens.back();
-                                for (int i = 0; i < model->block_cnt; i++) {
-                                    pastKeyValues.push_back(std::make_pair(&it.second->pastKeyValues[i].first,
-                                                                           &it.second->pastKeyValues[i].second));
-                                }
-                                if (isPrompt) {
-                                    cnt += it.second->currentTokens.size();
-                                    break;
-                                }
+                            if (attentionMask.dims.size() == 0) {
+                                attentionMasks.push_back(nullptr);
+                            } else {
+                                attentionMasks.push_back(new Data());
+                                attentionMasks.back()->CopyFrom(attentionMask);
                             }
-                        }
-                        if (seqLens.size() > 0) {
-                            std::vector <std::pair <Data, Data> > *pastKeyValue1;
-                            if (seqLens.size() == 1) {
-                                pastKeyValue1 = &model->responseContextDict.dicts[handles[0]]->pastKeyValues;
+                            if (curPositionIds.dims.size() == 0) {
+                                positionIds.push_back(nullptr);
+                            } else {
+                                positionIds.push_back(new Data());
+                                positionIds.back()->CopyFrom(curPositionIds);
                             }
-                            model->dictLocker.unlock();
+                            context->preTokens += seqLens.back();
+                            for (int i = 0; i < model->block_cnt; i++) {
+                                pastKeyValues.push_back(std::make_pair(&context->pastKeyValues[i].first,
+                                                                       &context->pastKeyValues[i].second));
+                            }
+                        }
+
+                        std::vector <std::pair <Data, Data> > *pastKeyValue1 =
+                                &model->responseContextDict.dicts[handles[0].first]->pastKeyValues;
+                        dictLock.unlock();
 #ifdef USE_CUDA
-                            FastllmCudaClearBigBuffer();
+                        FastllmCudaClearBigBuffer();
 #endif
-                            Data inputIds = Data(DataType::FLOAT32, {1, (int) ids.size()}, ids);
-                            std::vector<int> ret;
-auto st = std::chrono::system_clock::now();
-//ClearProfiler();
-                            if (seqLens.size() > 1) {
-                                ret = model->ForwardBatch(seqLens.size(), inputIds, attentionMasks,
-                                                          positionIds, seqLens, pastKeyValues, generationConfigs,
-                                                          tokensManager, &logits);
-                            } else {
-                                ret = std::vector <int> {model->Forward(inputIds,
-                                                                        attentionMasks[0] == nullptr ? Data() : *attentionMasks[0],
-                                                                        *positionIds[0],
-                                                                        *pastKeyValue1, generationConfigs[0], tokensManager, logits[0])};
+                        Data inputIds = Data(DataType::FLOAT32, {1, (int) ids.size()}, ids);
+                        std::vector<int> ret;
+                        if (seqLens.size() > 1) {
+                            ret = model->ForwardBatch(seqLens.size(), inputIds, attentionMasks,
+                                                      positionIds, seqLens, pastKeyValues, generationConfigs,
+                                                      tokensManager, &logits);
+                        } else {
+                            ret = std::vector <int> {model->Forward(inputIds,
+                                                                    attentionMasks[0] == nullptr ? Data() : *attentionMasks[0],
+                                                                    positionIds[0] == nullptr ? Data() : *positionIds[0],
+                                                                    *pastKeyValue1, generationConfigs[0], tokensManager, logits[0])};
+                        }
+                        dictLock.lock();
+
+                        ScheduleMetrics &metrics = model->scheduleMetrics;
+                        metrics.steps++;
+                        metrics.batchSum += handles.size();
+                        if (isPrompt) {
+                            metrics.prefillSteps++;
+                        } else {
+                            metrics.decodeSteps++;
+                        }
+                        metrics.prefillTokens += prefillTokens;
+                        metrics.decodeTokens += (int)ids.size() - prefillTokens;
+                        model->lastStepPrefill = isPrompt;
+                        for (int i = 0; i < handles.size(); i++) {
+                            ResponseContext *context = model->responseContextDict.dicts[handles[i].first];
+                            context->lastStep = metrics.steps;
+                            if (!finished[i]) {
+                                continue;
                             }
-//PrintProfiler();
-/*
-static int tot = 0;
-printf("len = %d, spend = %f s.\n", (int)seqLens.size(), GetSpan(st, std::chrono::system_clock::now()));
-tot += (int)seqLens.size();
-printf("tot = %d\n", tot);
-*/
-                            model->dictLocker.lock();
-                            for (int i = 0; i < handles.size(); i++) {
-                                auto &it = *model->responseContextDict.dicts.find(handles[i]);
-                                int curRet = ret[i];
-                                if (curRet == model->eos_token_id) {
-                                    it.second->isEnding = true;
-                                } else {
-                                    auto itStopTk = it.second->generationConfig.stop_token_ids.find(curRet);
-                                    if (itStopTk != it.second->generationConfig.stop_token_ids.end()) {
-                                            it.second->isEnding = true;
-                                    }
-                                }
-                                if (it.second->isEnding == false) {
-                                    it.second->currentTokens = std::vector<int>{curRet};
-                                    it.second->resultTokenQueue.push(curRet);
-                                    it.second->tokens.Push(curRet);
-                                    it.second->curTokens++;
-                                    if (it.second->curTokens == it.second->generationConfig.output_token_limit) {
-                                        it.second->isEnding = true;
-                                    }
-                                }
+                            if (model->UsePrefixCache() && prompting[i]) {
+                                // prompt算完时缓存prompt的kv
+                                model->prefixCache.Insert(context->allTokens, context->preTokens, context->pastKeyValues);
                             }
+                            model->PushResponseToken(context, ret[i]);
+                            context->cond.notify_all();
                         }
 
                         for (int i = 0; i < attentionMasks.size(); i++) {
@@ -687,83 +743,798 @@ printf("tot = %d\n", tot);
                         for (int i = 0; i < positionIds.size(); i++) {
                             delete positionIds[i];
                         }
-
-                        model->dictLocker.unlock();
-                        MySleep(0);
                     }
                 }, this);
             }
         }
         mainLoopLocker.unlock();
+    }
 
+    void basellm::StopMainLoop() {
+        std::lock_guard <std::mutex> mainLoopGuard(mainLoopLocker);
+        if (mainLoop == nullptr) {
+            return;
+        }
         dictLocker.lock();
+        mainLoopStop = true;
+        dictLocker.unlock();
+        mainLoopCond.notify_one();
+        mainLoop->join();
+        delete mainLoop;
+        mainLoop = nullptr;
+        mainLoopStop = false;
+    }
+
+    // 请求的kv cache占用的token数
+    static int GetKVCacheLen(ResponseContext *context) {
+        Data &pastKey = context->pastKeyValues[0].first;
+        if (pastKey.pagedKVCache != nullptr) {
+            return pastKey.pagedKVCache->GetCapacity();
+        } else if (pastKey.expansionDims.size() > 0) {
+            return pastKey.expansionDims[1];
+        }
+        return 0;
+    }
+
+    // 释放draft模型的kv cache, 下次投机解码时重新prefill
+    static void ReleaseDraftKVCache(ResponseContext *context) {
+        std::vector <std::pair <Data, Data> > empty;
+        context->draftKeyValues.swap(empty);
+        context->draftLen = 0;
+    }
+
+    // 请求还需要的kv cache的token数
+    static int GetOutputReserve(ResponseContext *context) {
+        int outputLimit = context->generationConfig.output_token_limit;
+        return outputLimit < 0 ? 128 : std::max(0, outputLimit - context->curTokens);
+    }
+
+    bool basellm::PreemptForPrompt(ResponseContext *prompt, int need, int limit, int &lenSum,
+                                   std::vector <std::pair <std::pair <long long, long long>, int> > &decodes) {
+        std::vector <std::pair <std::pair <int, long long>, int> > victims;
+        for (auto &it : decodes) {
+            ResponseContext *context = responseContextDict.dicts[it.second];
+            if (context->generationConfig.priority <= prompt->generationConfig.priority) {
+                victims.push_back(std::make_pair(std::make_pair(context->generationConfig.priority, -context->arrivalId), it.second));
+            }
+        }
+        std::sort(victims.begin(), victims.end());
+        int freed = 0, cnt = 0;
+        while (cnt < (int)victims.size() && lenSum - freed + need > limit) {
+            freed += GetKVCacheLen(responseContextDict.dicts[victims[cnt++].second]);
+        }
+        if (lenSum - freed + need > limit) {
+            return false;
+        }
+        std::set <int> swappedIds;
+        for (int i = 0; i < cnt; i++) {
+            ResponseContext *context = responseContextDict.dicts[victims[i].second];
+            lenSum -= GetKVCacheLen(context);
+            context->swappedKV.SwapOut(context->pastKeyValues);
+            ReleaseDraftKVCache(context);
+            scheduleMetrics.swapOuts++;
+            scheduleMetrics.swapBytes += context->swappedKV.GetBytes();
+            swappedIds.insert(victims[i].second);
+        }
+        std::vector <std::pair <std::pair <long long, long long>, int> > rest;
+        for (auto &it : decodes) {
+            if (swappedIds.find(it.second) == swappedIds.end()) {
+                rest.push_back(it);
+            }
+        }
+        decodes.swap(rest);
+        return true;
+    }
+
+    std::vector <std::pair <int, int> > basellm::PickScheduleBatch(bool &isPrompt, std::unique_lock <std::mutex> &dictLock) {
+        int limit = tokensLimit > 0 ? tokensLimit : 1e9;
+        int maxBatch = scheduleConfig.maxBatch > 0 ? scheduleConfig.maxBatch : 1e9;
+        int maxPrefillTokens = scheduleConfig.maxPrefillTokens > 0 ? scheduleConfig.maxPrefillTokens : 1e9;
+        int chunkSize = (scheduleConfig.prefillChunkSize > 0 && SupportChunkedPrefill()) ?
+                        std::min(scheduleConfig.prefillChunkSize, maxPrefillTokens) : 0;
+
+        // <排序关键字, handleId>
+        std::vector <std::pair <std::pair <long long, long long>, int> > prompts, decodes, swapped;
+        int lenSum = 0;
+        for (auto &it: responseContextDict.dicts) {
+            ResponseContext *context = it.second;
+            if (context->isEnding || context->swappingIn) {
+                continue;
+            }
+            if (context->swappedKV.IsSwapped()) {
+                // 被换出的请求按优先级和到达顺序换回
+                swapped.push_back(std::make_pair(std::make_pair(-context->generationConfig.priority, context->arrivalId), it.first));
+                continue;
+            }
+            if (context->IsPrompt()) {
+                // 已经算了一部分的prompt优先算完
+                long long key = scheduleConfig.policy == ScheduleShortestPromptFirst ? (long long)context->currentTokens.size() : 0;
+                prompts.push_back(std::make_pair(std::make_pair(context->preTokens > context->cachedTokens ? -1 : key, context->arrivalId), it.first));
+            } else {
+                // 解码中的请求按上次被调度的时间排序, batch有上限时轮流计算
+                decodes.push_back(std::make_pair(std::make_pair(context->lastStep, context->arrivalId), it.first));
+            }
+            if (context->preTokens > 0) {
+                lenSum += GetKVCacheLen(context);
+            }
+        }
+        std::sort(prompts.begin(), prompts.end());
+        std::sort(decodes.begin(), decodes.end());
+        std::sort(swapped.begin(), swapped.end());
+
+        // 空间足够时换回被抢占的请求; 没换回之前, 不接纳优先级不高于它的新请求
+        long long blockedPriority = -(1LL << 40);
+        std::vector <ResponseContext*> swapIns;
+        int swapInLen = 0;
+        for (auto &it : swapped) {
+            ResponseContext *context = responseContextDict.dicts[it.second];
+            int need = context->swappedKV.GetLen() + GetOutputReserve(context);
+            if (lenSum + swapInLen + need > limit && lenSum + swapInLen > 0) {
+                blockedPriority = std::max(blockedPriority, (long long)context->generationConfig.priority);
+                continue;
+            }
+            context->swappingIn = true;
+            swapIns.push_back(context);
+            swapInLen += need;
+        }
+        if (!swapIns.empty()) {
+            // 读磁盘时不持有锁, 其他线程可以继续Fetch / Launch; 换入中的请求只由调度线程访问
+            std::vector <std::vector <std::pair <Data, Data> > > kvs;
+            for (ResponseContext *context : swapIns) {
+                kvs.push_back(std::vector <std::pair <Data, Data> > (context->pastKeyValues.size()));
+            }
+            dictLock.unlock();
+            for (int i = 0; i < (int)swapIns.size(); i++) {
+                swapIns[i]->swappedKV.SwapIn(kvs[i]);
+            }
+            dictLock.lock();
+            for (int i = 0; i < (int)swapIns.size(); i++) {
+                ResponseContext *context = swapIns[i];
+                context->pastKeyValues.swap(kvs[i]);
+                context->swappingIn = false;
+                scheduleMetrics.swapIns++;
+                lenSum += GetKVCacheLen(context);
+            }
+            for (auto &it : swapped) {
+                ResponseContext *context = responseContextDict.dicts[it.second];
+                if (!context->swappedKV.IsSwapped()) {
+                    decodes.insert(decodes.begin(), std::make_pair(std::make_pair(-1LL, context->arrivalId), it.second));
+                }
+            }
+        }
+        scheduleMetrics.swapped = 0;
+        for (auto &it : swapped) {
+            scheduleMetrics.swapped += responseContextDict.dicts[it.second]->swappedKV.IsSwapped();
+        }
+        scheduleMetrics.queueDepth = prompts.size();
+        scheduleMetrics.running = decodes.size();
+
+        std::vector <std::pair <int, int> > handles;
+        if (chunkSize > 0) {
+            // 分块prefill: 所有解码中的请求和一段prompt一起计算, 长prompt不会长时间阻塞解码
+            std::pair <int, int> prompt = std::make_pair(-1, 0);
+            for (auto &it : prompts) {
+                ResponseContext *context = responseContextDict.dicts[it.second];
+                int len = context->currentTokens.size();
+                if (context->preTokens == context->cachedTokens) {
+                    if (context->generationConfig.priority <= blockedPriority) {
+                        break;
+                    }
+                    int need = len + GetOutputReserve(context);
+                    if (lenSum + need > limit && !decodes.empty() &&
+                        !(scheduleConfig.preempt && PreemptForPrompt(context, need, limit, lenSum, decodes))) {
+                        break;
+                    }
+                }
+                prompt = std::make_pair(it.second, std::min(chunkSize, len - context->preTokens));
+                break;
+            }
+            for (int i = 0; i < (int)decodes.size() && i < maxBatch - (prompt.first != -1 ? 1 : 0); i++) {
+                handles.push_back(std::make_pair(decodes[i].second, 1));
+            }
+            isPrompt = (prompt.first != -1);
+            if (isPrompt) {
+                handles.push_back(prompt);
+            }
+            return handles;
+        }
+
+        // 上一步是prefill并且有解码中的请求时先解码一步, 避免新请求不断到来时解码被饿死
+        if (prompts.size() > 0 && (!lastStepPrefill || decodes.empty())) {
+            int tokens = 0;
+            for (auto &it : prompts) {
+                ResponseContext *context = responseContextDict.dicts[it.second];
+                int len = (int)context->currentTokens.size() - context->preTokens;
+                int need = len + GetOutputReserve(context);
+                if ((int)handles.size() >= maxBatch) {
+                    break;
+                }
+                if (handles.size() > 0 && tokens + len > maxPrefillTokens) {
+                    break;
+                }
+                if (context->preTokens == context->cachedTokens && context->generationConfig.priority <= blockedPriority) {
+                    break;
+                }
+                // 没有其他请求时总是接纳, 否则超过kv cache的限制就等待 (或者抢占)
+                if (lenSum + need > limit && (handles.size() > 0 || decodes.size() > 0) &&
+                    !(scheduleConfig.preempt && PreemptForPrompt(context, need, limit, lenSum, decodes))) {
+                    break;
+                }
+                handles.push_back(std::make_pair(it.second, len));
+                tokens += len;
+                lenSum += need;
+            }
+        }
+        isPrompt = (handles.size() > 0);
+        if (!isPrompt) {
+            for (int i = 0; i < (int)decodes.size() && i < maxBatch; i++) {
+                handles.push_back(std::make_pair(decodes[i].second, 1));
+            }
+        }
+        return handles;
+    }
+
+    void basellm::PushResponseToken(ResponseContext *context, int token) {
+        if (token == eos_token_id ||
+            context->generationConfig.stop_token_ids.find(token) != context->generationConfig.stop_token_ids.end()) {
+            context->isEnding = true;
+        }
+        if (!context->isEnding) {
+            context->currentTokens = std::vector <int> {token};
+            context->allTokens.push_back(token);
+            context->resultTokenQueue.push(token);
+            context->tokens.Push(token);
+            context->curTokens++;
+            if (context->curTokens == context->generationConfig.output_token_limit) {
+                context->isEnding = true;
+            }
+        }
+        if (context->isEnding) {
+            FinishResponseContext(context);
+        }
+    }
+
+    void basellm::ForwardBatchAllLogits(int batch, const Data &inputIds, const std::vector <Data*> &attentionMask,
+                                        const std::vector <Data*> &positionIds, const std::vector <int> &seqLens,
+                                        std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                        std::vector <std::vector <std::vector <float> > > &logits) {
+        ErrorInFastLLM("ForwardBatchAllLogits: model " + model_type + " doesn't support speculative decoding.\n");
+    }
+
+    void basellm::SetDraftModel(basellm *model) {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        draftModel = model;
+    }
+
+    bool basellm::UseSpeculative(const GenerationConfig &generationConfig) {
+        if (generationConfig.speculative_tokens <= 0 || !SupportSpeculative()) {
+            return false;
+        }
+        return generationConfig.prompt_lookup_ngram > 0 || (draftModel != nullptr && draftModel->SupportChunkedPrefill());
+    }
+
+    // kv cache只保留前len个token
+    static void TruncateKVCache(std::vector <std::pair <Data, Data> > &pastKeyValues, int len) {
+        for (auto &it : pastKeyValues) {
+            for (Data *data : {&it.first, &it.second}) {
+                if (data->dims.size() == 0 || data->dims[1] <= len) {
+                    continue;
+                }
+                if (data->pagedKVCache != nullptr) {
+                    data->pagedKVCache->Truncate(len);
+                }
+                data->Resize({data->dims[0], len, data->dims[2]});
+            }
+        }
+    }
+
+    static int ArgMax(const std::vector <float> &logits) {
+        return std::max_element(logits.begin(), logits.end()) - logits.begin();
+    }
+
+    // 在tokens中找最后ngram个token上一次出现的位置, 返回之后的至多k个token; 匹配不到时逐步缩短ngram
+    static std::vector <int> PromptLookup(const std::vector <int> &tokens, int ngram, int k) {
+        int len = tokens.size();
+        for (int n = std::min(ngram, len - 1); n > 0; n--) {
+            const int *suffix = tokens.data() + len - n;
+            for (int i = len - n - 1; i >= 0; i--) {
+                if (std::equal(suffix, suffix + n, tokens.data() + i)) {
+                    return std::vector <int> (tokens.begin() + i + n, tokens.begin() + std::min(i + n + k, len));
+                }
+            }
+        }
+        return {};
+    }
+
+    // 一个请求的draft token: draft补上还没有计算的token, 然后逐个提出k个token; prompt lookup时直接从已有的token中复制
+    // 非贪婪采样时draftProbs返回每个draft token的分布
+    static void ProposeDraftTokens(basellm *draft, ResponseContext *context, int k, std::vector <int> &drafts,
+                                   std::vector <std::vector <std::pair <int, float> > > &draftProbs) {
+        const GenerationConfig &config = context->generationConfig;
+        if (k <= 0) {
+            return;
+        }
+        if (config.prompt_lookup_ngram > 0) {
+            drafts = PromptLookup(context->allTokens, config.prompt_lookup_ngram, k);
+            for (int token : drafts) {
+                draftProbs.push_back(std::vector <std::pair <int, float> > {std::make_pair(token, 1.0f)});
+            }
+            return;
+        }
+        if ((int)context->draftKeyValues.size() != draft->block_cnt) {
+            context->draftKeyValues.clear();
+            for (int i = 0; i < draft->block_cnt; i++) {
+                context->draftKeyValues.push_back(std::make_pair(Data(DataType::FLOAT32), Data(DataType::FLOAT32)));
+            }
+            context->draftLen = 0;
+        }
+        GenerationConfig draftConfig;
+        draftConfig.output_logits = true;
+        LastTokensUnit draftTokens = context->tokens;
+        std::vector <float> feed = std::vector <float> (context->allTokens.begin() + context->draftLen, context->allTokens.end());
+        std::vector <float> draftLogits;
+        std::vector <std::pair <int, float> > probs;
+        for (int i = 0; i < k; i++) {
+            Data inputIds, attentionMask, positionIds;
+            std::vector <std::vector <float> > inputTokens = {feed};
+            int start = context->draftLen;
+            draft->FillLLMInputs(inputTokens, {{"promptLen", start + (int)feed.size()}, {"index", 0}, {"chunkStart", start}},
+                                 inputIds, attentionMask, positionIds);
+            LastTokensManager tokensManager(1, draftConfig.last_n);
+            draft->Forward(inputIds, attentionMask, positionIds, context->draftKeyValues, draftConfig, tokensManager, &draftLogits);
+            context->draftLen += feed.size();
+            int token;
+            if (config.IsSimpleGreedy()) {
+                token = ArgMax(draftLogits);
+            } else {
+                // 和目标模型的采样用不同的stream, 避免draft和验证使用同一个随机数
+                LLMSamplingProbs(draftLogits.data(), draftLogits.size(), config, draftTokens, probs);
+                token = LLMSamplingFromProbs(probs, config, draftTokens.count, 3);
+                draftProbs.push_back(probs);
+            }
+            drafts.push_back(token);
+            draftTokens.Push(token);
+            feed = std::vector <float> {(float)token};
+        }
+    }
+
+    std::vector <std::vector <int> > basellm::SpeculativeStep(const std::vector <ResponseContext*> &contexts,
+                                                              std::vector <std::vector <std::vector <float> > > *logits) {
+        int batch = contexts.size();
+        // 1. 每个请求各自提出draft token
+        std::vector <std::vector <int> > drafts(batch);
+        std::vector <std::vector <std::vector <std::pair <int, float> > > > draftProbs(batch);
+        for (int b = 0; b < batch; b++) {
+            ResponseContext *context = contexts[b];
+            const GenerationConfig &config = context->generationConfig;
+            int k = config.speculative_tokens;
+            if (config.output_token_limit > 0) {
+                k = std::max(0, std::min(k, config.output_token_limit - context->curTokens - 1));
+            }
+            ProposeDraftTokens(draftModel, context, k, drafts[b], draftProbs[b]);
+        }
+
+        // 2. 目标模型一次计算所有请求的最后一个token和draft token的logits
+        std::vector <float> ids;
+        std::vector <int> seqLens, kvLens;
+        std::vector <Data> masks(batch), positions(batch);
+        std::vector <Data*> attentionMasks, positionIds;
+        std::vector <std::pair <Data*, Data*> > pastKeyValues;
+        for (int b = 0; b < batch; b++) {
+            ResponseContext *context = contexts[b];
+            int kvLen = context->preTokens; // allTokens的最后一个token还没有计算kv
+            std::vector <std::vector <float> > inputTokens = {std::vector <float> {(float)context->allTokens.back()}};
+            for (int token : drafts[b]) {
+                inputTokens[0].push_back(token);
+            }
+            Data inputIds;
+            FillLLMInputs(inputTokens, {{"promptLen", kvLen + (int)inputTokens[0].size()}, {"index", 0}, {"chunkStart", kvLen}},
+                          inputIds, masks[b], positions[b]);
+            for (int i = 0; i < inputIds.Count(0); i++) {
+                ids.push_back(((float *) inputIds.cpuData)[i]);
+            }
+            kvLens.push_back(kvLen);
+            seqLens.push_back(inputIds.Count(0));
+            attentionMasks.push_back(masks[b].dims.size() == 0 ? nullptr : &masks[b]);
+            positionIds.push_back(positions[b].dims.size() == 0 ? nullptr : &positions[b]);
+            for (int i = 0; i < block_cnt; i++) {
+                pastKeyValues.push_back(std::make_pair(&context->pastKeyValues[i].first, &context->pastKeyValues[i].second));
+            }
+        }
+        Data inputIds = Data(DataType::FLOAT32, {1, (int) ids.size()}, ids);
+        std::vector <std::vector <std::vector <float> > > targetLogits;
+        ForwardBatchAllLogits(batch, inputIds, attentionMasks, positionIds, seqLens, pastKeyValues, targetLogits);
+
+        // 3. 依次验证draft token, 第一个不被接受的位置换成目标模型的token; 全部接受时再加上最后一个位置的token
+        // 4. 回滚未被接受的kv: 目标模型保留最后一个token和被接受的draft token, draft最多保留到同样的位置
+        std::vector <std::vector <int> > ret(batch);
+        if (logits != nullptr) {
+            logits->resize(batch);
+        }
+        int draftSum = 0, acceptedSum = 0;
+        for (int b = 0; b < batch; b++) {
+            ResponseContext *context = contexts[b];
+            const GenerationConfig &config = context->generationConfig;
+            LastTokensUnit tokens = context->tokens;
+            std::vector <std::pair <int, float> > probs;
+            int accepted = 0, draftLen = drafts[b].size();
+            for (int i = 0; i <= draftLen; i++) {
+                int token;
+                if (config.IsSimpleGreedy()) {
+                    token = ArgMax(targetLogits[b][i]);
+                } else {
+                    LLMSamplingProbs(targetLogits[b][i].data(), targetLogits[b][i].size(), config, tokens, probs);
+                    token = (i < draftLen) ? SpeculativeSampling(probs, draftProbs[b][i], drafts[b][i], config, tokens.count) :
+                            LLMSamplingFromProbs(probs, config, tokens.count);
+                }
+                ret[b].push_back(token);
+                if (logits != nullptr) {
+                    (*logits)[b].push_back(targetLogits[b][i]);
+                }
+                if (i == draftLen || token != drafts[b][i]) {
+                    break;
+                }
+                tokens.Push(token);
+                accepted++;
+            }
+
+            int kvLen = kvLens[b];
+            TruncateKVCache(context->pastKeyValues, kvLen + 1 + accepted);
+            context->preTokens = kvLen + 1 + accepted;
+            context->intParams["index"] += 1 + accepted;
+            if (!context->draftKeyValues.empty()) {
+                context->draftLen = std::min(context->draftLen, kvLen + 1 + accepted);
+                TruncateKVCache(context->draftKeyValues, context->draftLen);
+            }
+            draftSum += draftLen;
+            acceptedSum += accepted;
+        }
+
+        std::lock_guard <std::mutex> guard(dictLocker);
+        scheduleMetrics.draftTokens += draftSum;
+        scheduleMetrics.acceptedTokens += acceptedSum;
+        return ret;
+    }
+
+    std::string basellm::SpeculativeResponse(const std::string &input, RuntimeResult retCb,
+                                             const GenerationConfig &generationConfig) {
+        std::string prompt = input;
+#ifdef PY_API
+        size_t pos = input.rfind("time_stamp:");
+        prompt = (generationConfig.enable_hash_id && pos != -1) ? input.substr(0, pos) : input;
+#endif
+        Data inputTokenData = this->weight.tokenizer.Encode(prompt);
+        std::vector <int> inputTokens;
+        for (int i = 0; i < inputTokenData.Count(0); i++) {
+            inputTokens.push_back((int)((float *) inputTokenData.cpuData)[i]);
+        }
+        return StreamResponse(LaunchResponseTokens(inputTokens, generationConfig), retCb);
+    }
+
+    void basellm::SetScheduleConfig(const ScheduleConfig &config) {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        scheduleConfig = config;
+        mainLoopCond.notify_one();
+    }
+
+    ScheduleConfig basellm::GetScheduleConfig() {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        return scheduleConfig;
+    }
+
+    ScheduleMetrics basellm::GetScheduleMetrics() {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        return scheduleMetrics;
+    }
+
+    bool basellm::UsePrefixCache() {
+        return SupportChunkedPrefill() && prefixCache.Enabled();
+    }
+
+    void basellm::FinishResponseContext(ResponseContext *context) {
+        ReleaseDraftKVCache(context);
+        if (UsePrefixCache()) {
+            // 连同生成的内容一起缓存, 下一轮对话可以复用
+            prefixCache.Insert(context->allTokens, context->preTokens, context->pastKeyValues);
+        }
+        auto it = sessions.find(context->sessionId);
+        if (it == sessions.end()) {
+            return;
+        }
+        // kv cache交还给会话
+        LLMSession *session = it->second;
+        std::swap(session->pastKeyValues, context->pastKeyValues);
+        session->tokens = context->allTokens;
+        session->kvLen = context->preTokens;
+        session->handleId = -1;
+        session->lastActive = std::chrono::steady_clock::now();
+        if (session->input != "") {
+            std::string output = weight.tokenizer.DecodeTokens(std::vector <int> (
+                    session->tokens.begin() + session->outputStart, session->tokens.end()));
+            session->history = MakeHistory(session->history, session->round++, session->input, output);
+            session->input = "";
+        }
+        if (session->closed) {
+            delete session;
+            sessions.erase(it);
+        }
+        EvictSessions();
+    }
+
+    static long long GetKVCacheBytes(const Data &data) {
+        if (data.pagedKVCache != nullptr) {
+            return (long long)data.pagedKVCache->blockTable.size() * data.pagedKVCache->pool->blockBytes;
+        }
+        return data.expansionBytes;
+    }
+
+    static void ReleaseSessionKVCache(LLMSession *session) {
+        session->pastKeyValues.clear();
+        session->swappedKV.Clear();
+        session->kvLen = 0;
+    }
+
+    // 空闲会话的kv cache换出到磁盘, 或者直接释放
+    static void ParkSessionKVCache(LLMSession *session, bool swapToDisk) {
+        if (swapToDisk) {
+            session->swappedKV.SwapOut(session->pastKeyValues);
+        } else {
+            ReleaseSessionKVCache(session);
+        }
+    }
+
+    void basellm::EvictSessions() {
+        auto now = std::chrono::steady_clock::now();
+        std::vector <std::pair <std::chrono::steady_clock::time_point, LLMSession*> > idles;
+        long long total = 0;
+        for (auto &it : sessions) {
+            LLMSession *session = it.second;
+            if (session->handleId != -1 || session->swappingIn || session->kvLen == 0 || session->swappedKV.IsSwapped()) {
+                continue;
+            }
+            if (sessionConfig.idleTimeout > 0 &&
+                now - session->lastActive > std::chrono::seconds(sessionConfig.idleTimeout)) {
+                ParkSessionKVCache(session, sessionConfig.swapToDisk);
+                continue;
+            }
+            for (auto &kv : session->pastKeyValues) {
+                total += GetKVCacheBytes(kv.first) + GetKVCacheBytes(kv.second);
+            }
+            idles.push_back(std::make_pair(session->lastActive, session));
+        }
+        if (sessionConfig.maxBytes <= 0 || total <= sessionConfig.maxBytes) {
+            return;
+        }
+        // 换出或释放最久没用的会话
+        std::sort(idles.begin(), idles.end());
+        for (auto &it : idles) {
+            if (total <= sessionConfig.maxBytes) {
+                break;
+            }
+            for (auto &kv : it.second->pastKeyValues) {
+                total -= GetKVCacheBytes(kv.first) + GetKVCacheBytes(kv.second);
+            }
+            ParkSessionKVCache(it.second, sessionConfig.swapToDisk);
+        }
+    }
+
+    int basellm::CreateSession() {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        int sessionId = sessionCounter++;
+        LLMSession *session = new LLMSession();
+        session->lastActive = std::chrono::steady_clock::now();
+        sessions[sessionId] = session;
+        EvictSessions();
+        return sessionId;
+    }
+
+    void basellm::CloseSession(int sessionId) {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        auto it = sessions.find(sessionId);
+        if (it == sessions.end()) {
+            return;
+        }
+        if (it->second->handleId != -1 || it->second->swappingIn) {
+            it->second->closed = true;
+        } else {
+            delete it->second;
+            sessions.erase(it);
+        }
+    }
+
+    static LLMSession *GetIdleSession(std::map <int, LLMSession*> &sessions, int sessionId) {
+        auto it = sessions.find(sessionId);
+        if (it == sessions.end() || it->second->closed) {
+            ErrorInFastLLM("Can`t find session: " + std::to_string(sessionId) + ".\n");
+        }
+        AssertInFastLLM(it->second->handleId == -1 && !it->second->swappingIn,
+                        "Session " + std::to_string(sessionId) + " is generating.\n");
+        return it->second;
+    }
+
+    void basellm::AppendSessionTokens(int sessionId, const std::vector <int> &tokens) {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        LLMSession *session = GetIdleSession(sessions, sessionId);
+        session->tokens.insert(session->tokens.end(), tokens.begin(), tokens.end());
+        session->lastActive = std::chrono::steady_clock::now();
+    }
+
+    void basellm::AppendSessionInput(int sessionId, const std::string &input) {
+        std::unique_lock <std::mutex> dictLock(dictLocker);
+        LLMSession *session = GetIdleSession(sessions, sessionId);
+        int round = session->round;
+        std::string prompt = MakeInput(session->history, round, input);
+        // 编码整段prompt (只编码新增部分时, 开头的空白和跨越边界的合并都会和整段编码不一致), 编码时不持有锁
+        dictLock.unlock();
+        Data inputTokens = weight.tokenizer.Encode(prompt);
+        std::vector <int> tokens(inputTokens.Count(0));
+        for (int i = 0; i < (int)tokens.size(); i++) {
+            tokens[i] = (int)((float*)inputTokens.cpuData)[i];
+        }
+        dictLock.lock();
+
+        session = GetIdleSession(sessions, sessionId);
+        AssertInFastLLM(session->round == round, "Session " + std::to_string(sessionId) + " changed while encoding input.\n");
+        // 保留和之前的token相同的最长前缀的kv, 至少留最后一个token给prefill
+        int keep = 0;
+        while (keep < (int)tokens.size() && keep < (int)session->tokens.size() && tokens[keep] == session->tokens[keep]) {
+            keep++;
+        }
+        keep = std::min(keep, (int)tokens.size() - 1);
+        if (session->kvLen > keep) {
+            session->kvLen = std::max(keep, 0);
+            if (session->kvLen == 0) {
+                ReleaseSessionKVCache(session);
+            } else if (!session->swappedKV.IsSwapped()) {
+                TruncateKVCache(session->pastKeyValues, session->kvLen);
+            }
+        }
+        session->tokens = tokens;
+        session->input = input;
+        session->lastActive = std::chrono::steady_clock::now();
+    }
+
+    int basellm::LaunchSessionResponse(int sessionId, const GenerationConfig &generationConfig) {
+        StartMainLoop();
+
+        std::unique_lock <std::mutex> dictLock(dictLocker);
+        LLMSession *session = GetIdleSession(sessions, sessionId);
+        AssertInFastLLM((int)session->tokens.size() > session->kvLen,
+                        "LaunchSessionResponse error: no new tokens in session " + std::to_string(sessionId) + ".\n");
+        bool reuseKV = session->kvLen > 0 && SupportChunkedPrefill();
+        if (reuseKV && session->swappedKV.IsSwapped()) {
+            // 读磁盘时不持有锁, 期间会话标记为换入中, 不会被使用, 换出或释放
+            std::vector <std::pair <Data, Data> > kv(session->pastKeyValues.size());
+            session->swappingIn = true;
+            dictLock.unlock();
+            session->swappedKV.SwapIn(kv);
+            dictLock.lock();
+            session->swappingIn = false;
+            session->pastKeyValues.swap(kv);
+            if (session->closed) {
+                delete session;
+                sessions.erase(sessionId);
+                ErrorInFastLLM("Session " + std::to_string(sessionId) + " is closed.\n");
+            }
+        }
         int handleId = responseContextDict.CreateHandle();
         ResponseContext *context = responseContextDict.GetHandle(handleId);
         context->Init(this->block_cnt);
-        context->currentTokens = inputTokens;
+        context->sessionId = sessionId;
+        context->currentTokens = session->tokens;
+        context->allTokens = session->tokens;
         context->generationConfig = generationConfig;
         context->tokens = LastTokensUnit(generationConfig.last_n);
-        dictLocker.unlock();
+        context->arrivalId = requestCounter++;
+        if (reuseKV) {
+            // 已有的kv作为算完的chunk, 只prefill新追加的token
+            // 换出到磁盘时没有截断, 这里按kvLen截断
+            TruncateKVCache(session->pastKeyValues, session->kvLen);
+            std::swap(session->pastKeyValues, context->pastKeyValues);
+            context->cachedTokens = session->kvLen;
+            context->preTokens = session->kvLen;
+        } else {
+            ReleaseSessionKVCache(session);
+            if (UsePrefixCache()) {
+                context->cachedTokens = prefixCache.Match(session->tokens, (int)session->tokens.size() - 1, context->pastKeyValues);
+                context->preTokens = context->cachedTokens;
+            }
+        }
+        session->outputStart = (int)session->tokens.size();
+        session->handleId = handleId;
+        EvictSessions();
+        dictLock.unlock();
+        mainLoopCond.notify_one();
         return handleId;
     }
 
+    std::string basellm::SessionResponse(int sessionId, const std::string &input, RuntimeResult retCb,
+                                         const GenerationConfig &generationConfig) {
+        AppendSessionInput(sessionId, input);
+        return StreamResponse(LaunchSessionResponse(sessionId, generationConfig), retCb);
+    }
+
+    std::string basellm::StreamResponse(int handleId, RuntimeResult retCb) {
+        std::string retString = "";
+        StreamDecoder decoder(&weight.tokenizer);
+        int index = 0;
+        while (true) {
+            int ret = FetchResponseTokens(handleId);
+            if (ret == -1) {
+                break;
+            }
+            std::string curString = decoder.Push(ret);
+            retString += curString;
+            if (retCb)
+#ifdef PY_API
+                retCb(index, pybind11::bytes(retString));
+#else
+                retCb(index, curString.c_str());
+#endif
+            index++;
+        }
+        retString += decoder.Flush();
+        if (retCb)
+#ifdef PY_API
+            retCb(-1, pybind11::bytes(retString));
+#else
+            retCb(-1, retString.c_str());
+#endif
+        return retString;
+    }
+
+    void basellm::SetSessionConfig(const SessionConfig &config) {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        sessionConfig = config;
+        EvictSessions();
+    }
+
+    SessionConfig basellm::GetSessionConfig() {
+        std::lock_guard <std::mutex> guard(dictLocker);
+        return sessionConfig;
+    }
+
     int basellm::FetchResponseTokens(int handleId) {
-        dictLocker.lock();
+        std::unique_lock <std::mutex> dictLock(dictLocker);
         ResponseContext *context = responseContextDict.GetHandle(handleId);
         if (context == nullptr) {
-            dictLocker.unlock();
             return -1;
-        } else {
-            while (true) {
-                if (context->resultTokenQueue.size() > 0) {
-                    int ret = context->resultTokenQueue.front();
-                    context->resultTokenQueue.pop();
-                    dictLocker.unlock();
-                    return ret;
-                } else {
-                    if (context->isEnding) {
-                        responseContextDict.RemoveHandle(handleId);
-                        dictLocker.unlock();
-                        return -1;
-                    }
-                }
-                dictLocker.unlock();
-                MySleep(0);
-                dictLocker.lock();
-            }
         }
+        context->cond.wait(dictLock, [context] {
+            return context->resultTokenQueue.size() > 0 || context->isEnding;
+        });
+        if (context->resultTokenQueue.size() > 0) {
+            int ret = context->resultTokenQueue.front();
+            context->resultTokenQueue.pop();
+            return ret;
+        }
+        responseContextDict.RemoveHandle(handleId);
+        mainLoopCond.notify_one();
+        return -1;
     }
 
     int basellm::FetchResponseLogits(int handleId, std::vector<float> &logits) {
-        dictLocker.lock();
+        std::unique_lock <std::mutex> dictLock(dictLocker);
         ResponseContext *context = responseContextDict.GetHandle(handleId);
         if (context == nullptr) {
-            dictLocker.unlock();
             return -1;
-        } else {
-            while (true) {
-                if (context->resultTokenQueue.size() > 0) {
-                    int ret = context->resultTokenQueue.front();
-                    context->resultTokenQueue.pop();
-                    if (!context->resultLogits.empty()) {
-                        logits = *context->resultLogits.front();
-                        delete context->resultLogits.front();
-                        context->resultLogits.pop();
-                    }
-                    dictLocker.unlock();
-                    return ret;
-                } else {
-                    if (context->isEnding) {
-                        responseContextDict.RemoveHandle(handleId);
-                        dictLocker.unlock();
-                        return -1;
-                    }
-                }
-                dictLocker.unlock();
-                MySleep(0);
-                dictLocker.lock();
+        }
+        context->cond.wait(dictLock, [context] {
+            return context->resultTokenQueue.size() > 0 || context->isEnding;
+        });
+        if (context->resultTokenQueue.size() > 0) {
+            int ret = context->resultTokenQueue.front();
+            context->resultTokenQueue.pop();
+            if (!context->resultLogits.empty()) {
+                logits = *context->resultLogits.front();
+                delete context->resultLogits.front();
+                context->resultLogits.pop();
             }
+            return ret;
         }
+        responseContextDict.RemoveHandle(handleId);
+        mainLoopCond.notify_one();
+        return -1;
     }
 
     // 根据输入的tokens生成LLM推理的输入
@@ -783,9 +1554,11 @@ printf("tot = %d\n", tot);
             ErrorInFastLLM("Can`t find adapter name: " + name);
         }
         adapterName = name;
+        prefixCache.Clear(); // 换adapter后kv不同, 缓存失效
     }
 
     void basellm::DisableAdapter() {
         adapterName = "";
+        prefixCache.Clear();
     }
 }
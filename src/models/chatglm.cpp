@@ -199,38 +199,42 @@ namespace fastllm {
 #ifdef USE_CUDA
             unitLen = 128;
 #endif
-            while ((pastKey.dims.size() == 0 &&
-                    (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && (pastKey.expansionDims.size() == 0 ||
-                                                   pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1]))) {
-                std::vector<int> newDims;
-                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                    newDims = std::vector<int>{k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                    if (generationConfig.output_token_limit > 0) {
-                        newDims[1] = k.dims[1] + generationConfig.output_token_limit;
+            if (!PreparePagedKVCache(pastKey, k)) {
+                while ((pastKey.dims.size() == 0 &&
+                        (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
+                       || (pastKey.dims.size() > 0 && (pastKey.expansionDims.size() == 0 ||
+                                                       pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1]))) {
+                    std::vector<int> newDims;
+                    if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
+                        newDims = std::vector<int>{k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
+                        if (generationConfig.output_token_limit > 0) {
+                            newDims[1] = k.dims[1] + generationConfig.output_token_limit;
+                        }
+                    } else {
+                        newDims = pastKey.dims;
+                        newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
                     }
-                } else {
-                    newDims = pastKey.dims;
-                    newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
+                    pastKey.Expansion(newDims);
                 }
-                pastKey.Expansion(newDims);
             }
 
-            while ((pastValue.dims.size() == 0 &&
-                    (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && (pastValue.expansionDims.size() == 0 ||
-                                                     pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1]))) {
-                std::vector<int> newDims;
-                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector<int>{v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                    if (generationConfig.output_token_limit > 0) {
-                        newDims[1] = k.dims[1] + generationConfig.output_token_limit;
+            if (!PreparePagedKVCache(pastValue, v)) {
+                while ((pastValue.dims.size() == 0 &&
+                        (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
+                       || (pastValue.dims.size() > 0 && (pastValue.expansionDims.size() == 0 ||
+                                                         pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1]))) {
+                    std::vector<int> newDims;
+                    if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
+                        newDims = std::vector<int>{v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
+                        if (generationConfig.output_token_limit > 0) {
+                            newDims[1] = k.dims[1] + generationConfig.output_token_limit;
+                        }
+                    } else {
+                        newDims = pastValue.dims;
+                        newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
                     }
-                } else {
-                    newDims = pastValue.dims;
-                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
+                    pastValue.Expansion(newDims);
                 }
-                pastValue.Expansion(newDims);
             }
             CatDirect(pastKey, k, 1);
             CatDirect(pastValue, v, 1);
@@ -282,21 +286,18 @@ namespace fastllm {
                 // 1.4 MLP
                 std::string fcInKeyName = "transformer.layers." + std::to_string(i) + ".mlp.dense_h_to_4h";
                 std::string fcOutKeyName = "transformer.layers." + std::to_string(i) + ".mlp.dense_4h_to_h";
-                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle);
-                GeluNew(middle, middle);
+                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle, LinearActivationGeluNew);
                 Linear(middle, weight[fcOutKeyName + ".weight"], weight[fcOutKeyName + ".bias"], hiddenStates);
                 AddTo(hiddenStates, mlpInput, alpha);
             } else {
-                AddTo(hiddenStates, attnOutput);
                 std::string postRMSWeightName =
                         "transformer.encoder.layers." + std::to_string(i) + ".post_attention_layernorm.weight";
+                AddToRMSNorm(hiddenStates, attnOutput, weight[postRMSWeightName], 1e-5, mlpInput);
                 Mul(hiddenStates, 1.0, temp);
-                RMSNorm(hiddenStates, weight[postRMSWeightName], 1e-5, mlpInput);
                 // 1.4 MLP
                 std::string fcInKeyName = "transformer.encoder.layers." + std::to_string(i) + ".mlp.dense_h_to_4h";
                 std::string fcOutKeyName = "transformer.encoder.layers." + std::to_string(i) + ".mlp.dense_4h_to_h";
-                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle);
-                Swiglu(middle, middle2);
+                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle2, LinearActivationSwiglu);
                 Linear(middle2, weight[fcOutKeyName + ".weight"], weight[fcOutKeyName + ".bias"], hiddenStates);
                 AddTo(hiddenStates, temp);
             }
@@ -509,6 +510,9 @@ namespace fastllm {
                 auto &q = curQs[b], &k = curKs[b], &v = curVs[b];
                 Data &pastKey = *pastKeyValues[b * block_cnt + i].first, &pastValue = *pastKeyValues[b * block_cnt +
                                                                                                      i].second;
+                if (PreparePagedKVCache(pastKey, k) && PreparePagedKVCache(pastValue, v)) {
+                    continue;
+                }
                 if (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] <= pastKey.expansionDims[1]) {
                     continue;
                 }
@@ -571,6 +575,14 @@ namespace fastllm {
                     outputSizes[b] = {1, qs[b]->dims[0], qs[b]->dims[1], keys[b]->dims[1]};
                 }
                 AttentionBatch(qs, keys, values, masks, contexts, qs[0]->dims[0] / values[0]->dims[0], 1.0 / scale_attn, 1);
+            } else if (pastKeyValues[i].first->pagedKVCache != nullptr) {
+                // 分页KV cache, 逐条通过block table计算attention
+                for (int b = 0; b < batch; b++) {
+                    Data &pastKey = *pastKeyValues[b * block_cnt + i].first, &pastValue = *pastKeyValues[b * block_cnt + i].second;
+                    outputSizes[b] = {1, num_attention_heads, -1, pastValue.dims[2]};
+                    Attention(curQs[b], pastKey, pastValue, attentionMask[b] == nullptr ? Data() : *attentionMask[b],
+                              curContextLayer[b], curQs[b].dims[0] / pastKey.dims[0], 1.0 / scale_attn, 1);
+                }
             } else {
                 for (int b = 0; b < batch; b++) {
                     auto &q = curQs[b];
@@ -681,22 +693,19 @@ namespace fastllm {
                 // 1.4 MLP
                 std::string fcInKeyName = "transformer.layers." + std::to_string(i) + ".mlp.dense_h_to_4h";
                 std::string fcOutKeyName = "transformer.layers." + std::to_string(i) + ".mlp.dense_4h_to_h";
-                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle);
-                GeluNew(middle, middle);
+                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle, LinearActivationGeluNew);
                 Linear(middle, weight[fcOutKeyName + ".weight"], weight[fcOutKeyName + ".bias"], hiddenStates);
                 AddTo(hiddenStates, mlpInput, alpha);
             } else {
-                AddTo(hiddenStates, attnOutput);
                 std::string postRMSWeightName =
                         "transformer.encoder.layers." + std::to_string(i) + ".post_attention_layernorm.weight";
+                AddToRMSNorm(hiddenStates, attnOutput, weight[postRMSWeightName], 1e-5, mlpInput);
                 Data temp;
                 Mul(hiddenStates, 1.0, temp);
-                RMSNorm(hiddenStates, weight[postRMSWeightName], 1e-5, mlpInput);
                 // 1.4 MLP
                 std::string fcInKeyName = "transformer.encoder.layers." + std::to_string(i) + ".mlp.dense_h_to_4h";
                 std::string fcOutKeyName = "transformer.encoder.layers." + std::to_string(i) + ".mlp.dense_4h_to_h";
-                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle);
-                Swiglu(middle, middle2);
+                Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle2, LinearActivationSwiglu);
                 Linear(middle2, weight[fcOutKeyName + ".weight"], weight[fcOutKeyName + ".bias"], hiddenStates);
                 AddTo(hiddenStates, temp);
             }
@@ -710,7 +719,11 @@ namespace fastllm {
             RMSNorm(hiddenStates, weight["transformer.encoder.final_layernorm.weight"], 1e-5, hiddenStates);
             Linear(hiddenStates, weight["transformer.output_layer.weight"], Data(), logits);
         }
-        std::vector <int> lastRet;
+        std::vector <int> lastRet(batch);
+        // 需要采样的请求放在一起, 在线程池上并行采样
+        std::vector <int> sampleIds, sampleOffsets;
+        std::vector <GenerationConfig> sampleConfigs;
+        std::vector <const LastTokensUnit*> sampleUnits;
         int total = 0;
         Data curLogit;
         for (int b = 0; b < batch; b++) {
@@ -724,12 +737,21 @@ namespace fastllm {
                 Data topk;
                 TopK(curLogit, topk, 1);
                 topk.ToDevice(DataDevice::CPU);
-                lastRet.push_back((int) (((float *) topk.cpuData)[0] + 1e-3));
+                lastRet[b] = (int) (((float *) topk.cpuData)[0] + 1e-3);
             } else {
-                lastRet.push_back(LLMSampling(curLogit, 0, generationConfigs[b], lastTokens.units[b]));
+                sampleIds.push_back(b);
+                sampleOffsets.push_back(total + seqLens[b] - 1);
+                sampleConfigs.push_back(generationConfigs[b]);
+                sampleUnits.push_back(&lastTokens.units[b]);
             }
             total += seqLens[b];
         }
+        if (!sampleIds.empty()) {
+            std::vector <int> sampled = LLMSamplingBatch(logits, sampleOffsets, sampleConfigs, sampleUnits);
+            for (int i = 0; i < (int)sampleIds.size(); i++) {
+                lastRet[sampleIds[i]] = sampled[i];
+            }
+        }
         return lastRet;
     }
 
@@ -897,6 +919,28 @@ namespace fastllm {
         }
     }
 
+    void ChatGLMModel::InitLinearNames() {
+        // 只读了文件头时无法用GetVersion判断版本, 两个版本的权重名都加入
+        for (int i = 0; i < block_cnt; i++) {
+            for (std::string pre : {"transformer.layers." + std::to_string(i) + ".attention",
+                                    "transformer.encoder.layers." + std::to_string(i) + ".self_attention"}) {
+                weight.linearNames.insert(pre + ".query_key_value.weight");
+                weight.linearNames.insert(pre + ".dense.weight");
+                for (auto &it : weight.peftDict) {
+                    weight.linearNames.insert(pre + ".query_key_value.lora_A." + it.first + ".weight");
+                    weight.linearNames.insert(pre + ".query_key_value.lora_B." + it.first + ".weight");
+                }
+            }
+            for (std::string pre : {"transformer.layers." + std::to_string(i) + ".mlp",
+                                    "transformer.encoder.layers." + std::to_string(i) + ".mlp"}) {
+                weight.linearNames.insert(pre + ".dense_h_to_4h.weight");
+                weight.linearNames.insert(pre + ".dense_4h_to_h.weight");
+            }
+        }
+        weight.linearNames.insert("lm_head.weight");
+        weight.linearNames.insert("transformer.output_layer.weight");
+    }
+
     void ChatGLMModel::WarmUp() {
     	printf("Warmup...\n");
 	    Data inputIds = Data(DataType::FLOAT32, {1, 1}, {(float)bos_token_id});
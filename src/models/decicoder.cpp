@@ -86,18 +86,12 @@ namespace fastllm {
         return ForwardBatch(1, inputIds, attentionMask, positionIds, pastKeyValues, generationConfig, lastTokens, &batchLogits)[0];
     }
 
-    std::vector <int> DeciCoderModel::ForwardBatch(int batch,
-                                                   const Data &inputIds,
-                                                   const Data &attentionMask,
-                                                   const Data &positionIds,
-                                                   std::vector <std::pair <Data, Data> > &pastKeyValues,
-                                                   const GenerationConfig &generationConfig,
-                                                   const LastTokensManager &lastTokens,
-                                                   std::vector <std::vector <float>*> *retLogits) {
+    void DeciCoderModel::ForwardLogits(const Data &inputIds, const Data &attentionMask, const Data &positionIds,
+                                       std::vector <std::pair <Data, Data> > &pastKeyValues, Data &logits) {
         Data hiddenStates;
         Data attenInput;
         Data q, k, v;
-        Data attenWeights, attenOutput;
+        Data attenOutput;
         Data attenLastOutput;
         Data w1, w2, w3;
 
@@ -132,56 +126,22 @@ namespace fastllm {
             PermuteSelf(k, {0, 2, 1, 3});
             PermuteSelf(v, {0, 2, 1, 3});
 
-            RepeatKV(k, num_key_value_groups);
-            RepeatKV(v, num_key_value_groups);
-
+            // k, v只保留num_key_value_heads个head, attention内部按group广播
             qSize = {bsz * num_attention_heads, seqlen, -1};
+            kSize = {bsz * num_key_value_heads, seqlen, -1};
             q.Reshape(qSize);
-            k.Reshape(qSize);
-            v.Reshape(qSize);
+            k.Reshape(kSize);
+            v.Reshape(kSize);
 
             Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
-            int unitLen = 64;
-#ifdef USE_CUDA
-            unitLen = 128;
-#endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                    newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                } else {
-                    newDims = pastKey.dims;
-                    newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastKey.Expansion(newDims);
-            }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                } else {
-                    newDims = pastValue.dims;
-                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastValue.Expansion(newDims);
-            }
+            PrepareKVCache(pastKey, k);
+            PrepareKVCache(pastValue, v);
 
             CatDirect(pastKey, k, 1);
             CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
-            // 1.2.0 q * k^T
-            MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-            attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-            if (!attentionMask.dims.empty()) {
-                AttentionMask(attenWeights, attentionMask, -10000);
-            }
-            Softmax(attenWeights, attenWeights, -1);
-            MatMul(attenWeights, pastValue, attenOutput);
-
-            attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
+            FusedAttention(q, pastKey, pastValue, attentionMask, Data(), attenOutput, q.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
             PermuteSelf(attenOutput, {1, 0, 2});
             attenOutput.Reshape({seqlen, bsz, -1});
             PermuteSelf(attenOutput, {1, 0, 2});
@@ -199,9 +159,28 @@ namespace fastllm {
         }
 
         RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-6, hiddenStates);
-        Data logits;
         Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
         logits.ToDevice(DataDevice::CPU);
+    }
+
+    bool DeciCoderModel::SupportChunkedPrefill() {
+        return true;
+    }
+
+    bool DeciCoderModel::SupportSpeculative() {
+        return true;
+    }
+
+    std::vector <int> DeciCoderModel::ForwardBatch(int batch,
+                                                   const Data &inputIds,
+                                                   const Data &attentionMask,
+                                                   const Data &positionIds,
+                                                   std::vector <std::pair <Data, Data> > &pastKeyValues,
+                                                   const GenerationConfig &generationConfig,
+                                                   const LastTokensManager &lastTokens,
+                                                   std::vector <std::vector <float>*> *retLogits) {
+        Data logits;
+        ForwardLogits(inputIds, attentionMask, positionIds, pastKeyValues, logits);
 
         std::vector <int> lastRet;
         if (generationConfig.IsSimpleGreedy()) {
@@ -223,19 +202,18 @@ namespace fastllm {
         return lastRet;
     }
     
-    std::vector <int> DeciCoderModel::ForwardBatch(int batch,
-                                                   const Data &inputIds,
-                                                   const std::vector <Data*> &attentionMask,
-                                                   const std::vector <Data*> &positionIds,
-                                                   const std::vector <int> &seqLens,
-                                                   std::vector <std::pair <Data*, Data*> > &pastKeyValues,
-                                                   const std::vector <GenerationConfig> &generationConfigs,
-                                                   const LastTokensManager &lastTokens,
-                                                   std::vector <std::vector <float>*> *retLogits) {
+    void DeciCoderModel::ForwardBatchLogits(int batch,
+                                            const Data &inputIds,
+                                            const std::vector <Data*> &attentionMask,
+                                            const std::vector <Data*> &positionIds,
+                                            const std::vector <int> &seqLens,
+                                            std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                            Data &logits) {
         Data hiddenStates;
         Data attenInput;
         Data q, k, v, qkv;
-        Data attenWeights, curAttenOutput;
+        Data curAttenOutput;
+        Data emptyMask;
         Data attenLastOutput;
         Data w1, w2, w3;
 
@@ -272,9 +250,9 @@ namespace fastllm {
             for (int b = 0; b < batch; b++) {
                 auto &q = curQs[b], &k = curKs[b], &v = curVs[b];
 
-                std::vector <int> qSize = {bsz, seqlen, num_attention_heads, -1};
-                std::vector <int> kSize = {bsz, seqlen, num_key_value_heads, -1};
-                std::vector <int> vSize = {bsz, seqlen, num_key_value_heads, -1};
+                std::vector <int> qSize = {bsz, seqLens[b], num_attention_heads, -1};
+                std::vector <int> kSize = {bsz, seqLens[b], num_key_value_heads, -1};
+                std::vector <int> vSize = {bsz, seqLens[b], num_key_value_heads, -1};
                 q.Reshape(qSize);
                 k.Reshape(kSize);
                 v.Reshape(vSize);
@@ -286,56 +264,22 @@ namespace fastllm {
                 PermuteSelf(k, {0, 2, 1, 3});
                 PermuteSelf(v, {0, 2, 1, 3});
 
-                RepeatKV(k, num_key_value_groups);
-                RepeatKV(v, num_key_value_groups);
-
+                // k, v只保留num_key_value_heads个head, attention内部按group广播
                 qSize = {bsz * num_attention_heads, seqLens[b], -1};
+                kSize = {bsz * num_key_value_heads, seqLens[b], -1};
                 q.Reshape(qSize);
-                k.Reshape(qSize);
-                v.Reshape(qSize);
+                k.Reshape(kSize);
+                v.Reshape(kSize);
 
                 Data &pastKey = *pastKeyValues[b * block_cnt + i].first, &pastValue = *pastKeyValues[b * block_cnt + i].second;
-                int unitLen = 64;
-#ifdef USE_CUDA
-                unitLen = 128;
-#endif
-                while ((pastKey.dims.size() == 0 &&
-                        (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                       || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
-                    std::vector<int> newDims;
-                    if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                        newDims = std::vector<int>{k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                    } else {
-                        newDims = pastKey.dims;
-                        newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
-                    }
-                    pastKey.Expansion(newDims);
-                }
-                while ((pastValue.dims.size() == 0 &&
-                        (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                       || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
-                    std::vector<int> newDims;
-                    if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                        newDims = std::vector<int>{v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                    } else {
-                        newDims = pastValue.dims;
-                        newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
-                    }
-                    pastValue.Expansion(newDims);
-                }
+                PrepareKVCache(pastKey, k);
+                PrepareKVCache(pastValue, v);
 
                 CatDirect(pastKey, k, 1);
                 CatDirect(pastValue, v, 1);
 
                 // 1.2 Attention
-                // 1.2.0 q * k^T
-                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-                attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-                AttentionMask(attenWeights, *attentionMask[b], -10000);
-
-                Softmax(attenWeights, attenWeights, -1);
-                MatMul(attenWeights, pastValue, curAttenOutput);
-                curAttenOutput.Reshape({curAttenOutput.dims[1], curAttenOutput.dims[2], curAttenOutput.dims[3]});
+                FusedAttention(q, pastKey, pastValue, attentionMask[b] == nullptr ? emptyMask : *attentionMask[b], Data(), curAttenOutput, q.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
                 PermuteSelf(curAttenOutput, {1, 0, 2});
                 curAttenOutput.Reshape({seqLens[b], bsz, -1});
                 PermuteSelf(curAttenOutput, {1, 0, 2});
@@ -360,9 +304,42 @@ namespace fastllm {
         }
 
         RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-6, hiddenStates);
-        Data logits;
         Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
         logits.ToDevice(DataDevice::CPU);
+    }
+
+    void DeciCoderModel::ForwardBatchAllLogits(int batch,
+                                               const Data &inputIds,
+                                               const std::vector <Data*> &attentionMask,
+                                               const std::vector <Data*> &positionIds,
+                                               const std::vector <int> &seqLens,
+                                               std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                               std::vector <std::vector <std::vector <float> > > &logits) {
+        Data allLogits;
+        ForwardBatchLogits(batch, inputIds, attentionMask, positionIds, seqLens, pastKeyValues, allLogits);
+        int size = allLogits.dims.back(), total = 0;
+        logits.resize(batch);
+        for (int b = 0; b < batch; b++) {
+            logits[b].resize(seqLens[b]);
+            for (int i = 0; i < seqLens[b]; i++) {
+                float *base = ((float*)allLogits.cpuData) + (uint64_t)(total + i) * size;
+                logits[b][i] = std::vector <float> (base, base + size);
+            }
+            total += seqLens[b];
+        }
+    }
+
+    std::vector <int> DeciCoderModel::ForwardBatch(int batch,
+                                                   const Data &inputIds,
+                                                   const std::vector <Data*> &attentionMask,
+                                                   const std::vector <Data*> &positionIds,
+                                                   const std::vector <int> &seqLens,
+                                                   std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                                   const std::vector <GenerationConfig> &generationConfigs,
+                                                   const LastTokensManager &lastTokens,
+                                                   std::vector <std::vector <float>*> *retLogits) {
+        Data logits;
+        ForwardBatchLogits(batch, inputIds, attentionMask, positionIds, seqLens, pastKeyValues, logits);
         std::vector <int> lastRet;
         int total = 0;
         for (int b = 0; b < batch; b++) {
@@ -402,21 +379,23 @@ namespace fastllm {
                                        Data &inputIds, Data &attentionMask, Data &positionIds) {
         int index = params.find("index")->second;
         int promptLen = params.find("promptLen")->second;
+        int chunkStart = params.find("chunkStart") != params.end() ? params.find("chunkStart")->second : 0;
         inputIds.ToDevice(DataDevice::CPU);
         attentionMask.ToDevice(DataDevice::CPU);
         positionIds.ToDevice(DataDevice::CPU);
         if (index == 0) {
-            int seqLen = inputTokens[0].size();
-            std::vector <float> vmask = std::vector <float> (seqLen * seqLen, 0);
+            // 分块prefill (或投机解码验证) 时这一段接在前chunkStart个token后面
+            int seqLen = inputTokens[0].size(), total = chunkStart + seqLen;
+            std::vector <float> vmask = std::vector <float> (seqLen * total, 0);
             std::vector<float> vpids = std::vector<float>(seqLen, 0);
             for (int i = 0; i < seqLen; i++) {
-                vpids[i] = i;
-                for (int j = i + 1; j < seqLen; j++) {
-                    vmask[i * seqLen + j] = 1;
+                vpids[i] = chunkStart + i;
+                for (int j = chunkStart + i + 1; j < total; j++) {
+                    vmask[i * total + j] = 1;
                 }
             }
             inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, inputTokens[0]));
-            attentionMask.CopyFrom(Data(DataType::FLOAT32, {seqLen, seqLen}, vmask));
+            attentionMask.CopyFrom(Data(DataType::FLOAT32, {seqLen, total}, vmask));
             positionIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, vpids));
         } else {
             inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, inputTokens[0]));
@@ -472,6 +451,17 @@ namespace fastllm {
         }
     }
 
+    void DeciCoderModel::InitLinearNames() {
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            for (std::string name : {".self_attn.q_proj", ".self_attn.k_proj", ".self_attn.v_proj", ".self_attn.o_proj",
+                                     ".mlp.gate_proj", ".mlp.up_proj", ".mlp.down_proj"}) {
+                weight.linearNames.insert(pre + name + ".weight");
+            }
+        }
+        weight.linearNames.insert("lm_head.weight");
+    }
+
     void DeciCoderModel::WarmUp() {
         printf("Warmup...\n");
         Data inputIds = Data(DataType::FLOAT32, {1, 1}, {1});
@@ -303,6 +303,16 @@ namespace fastllm {
 #endif
     }
 
+    void GLMModel::InitLinearNames() {
+        // 输出层和word_embeddings共享权重, 按Embedding处理
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "transformer.layers." + std::to_string(i);
+            for (std::string name : {".attention.query_key_value", ".attention.dense", ".mlp.dense_h_to_4h", ".mlp.dense_4h_to_h"}) {
+                weight.linearNames.insert(pre + name + ".weight");
+            }
+        }
+    }
+
     void GLMModel::WarmUp() {
 //      printf("Warmup...\n");
 //	    Data inputIds = Data(DataType::FLOAT32, {1, 1}, {(float)bos_token_id});
@@ -85,6 +85,10 @@ namespace fastllm {
         weight.embeddingNames.insert("model.embed_tokens.weight");
     }
 
+    bool LlamaModel::SupportSpeculative() {
+        return SupportChunkedPrefill();
+    }
+
     int LlamaModel::Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask,
                             const fastllm::Data &positionIds, std::vector<std::pair<Data, Data>> &pastKeyValues,
                             const GenerationConfig &generationConfig, const LastTokensManager &lastTokens,
@@ -118,10 +122,11 @@ namespace fastllm {
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
             if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
                 Linear(attenInput, weight[qkvWeightName], Data(), qkv);
-                int per = qkv.dims.back() / 3;
-                Split(qkv, -1, 0, per, q);
-                Split(qkv, -1, per, per * 2, k);
-                Split(qkv, -1, per * 2, per * 3, v);
+                int per = qkv.dims.back() / (num_attention_heads + num_key_value_heads * 2);
+                int qLen = per * num_attention_heads, kvLen = per * num_key_value_heads;
+                Split(qkv, -1, 0, qLen, q);
+                Split(qkv, -1, qLen, qLen + kvLen, k);
+                Split(qkv, -1, qLen + kvLen, qLen + kvLen * 2, v);
             } else {
                 Linear(attenInput, weight[qWeightName], Data(), q);
                 Linear(attenInput, weight[kWeightName], Data(), k);
@@ -129,9 +134,10 @@ namespace fastllm {
             }
 
             std::vector <int> qkvSize = {bsz, seqlen, num_attention_heads, -1};
+            std::vector <int> kvSize = {bsz, seqlen, num_key_value_heads, -1};
             q.Reshape(qkvSize);
-            k.Reshape(qkvSize);
-            v.Reshape(qkvSize);
+            k.Reshape(kvSize);
+            v.Reshape(kvSize);
 
             if (alibiData.dims.size() == 0) {
                 fastllm::LlamaRotatePosition2D(q, positionIds, sinData, cosData, rotary_dim);
@@ -139,9 +145,10 @@ namespace fastllm {
             }
 
             qkvSize = {bsz * seqlen, num_attention_heads, -1};
+            kvSize = {bsz * seqlen, num_key_value_heads, -1};
             q.Reshape(qkvSize);
-            k.Reshape(qkvSize);
-            v.Reshape(qkvSize);
+            k.Reshape(kvSize);
+            v.Reshape(kvSize);
 
             PermuteSelf(q, {1, 0, 2});
             PermuteSelf(k, {1, 0, 2});
@@ -156,61 +163,40 @@ namespace fastllm {
                 pastValue.ToDevice(DataDevice::CUDA);
             }
 
-            int unitLen = 64;
-#ifdef USE_CUDA
-            unitLen = 128;
-#endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                    newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                } else {
-                    newDims = pastKey.dims;
-                    newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastKey.Expansion(newDims);
-            }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                } else {
-                    newDims = pastValue.dims;
-                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastValue.Expansion(newDims);
-            }
+            PrepareKVCache(pastKey, k);
+            PrepareKVCache(pastValue, v);
             CatDirect(pastKey, k, 1);
             CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
             // 1.2.0 q * k^T
-            MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-            attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-            if (alibiData.dims.size() != 0) {
-                AlibiMask(attenWeights, alibiData, -10000);
-            } else if (attentionMask.dims.size() != 0) {
-                AttentionMask(attenWeights, attentionMask, -10000);
-            }
+            if (alibiData.dims.size() == 0 || pastKey.dataDevice == DataDevice::CPU) {
+                // 融合attention; CUDA上的alibi模型仍然走MatMul + AlibiMask
+                FusedAttention(q, pastKey, pastValue, attentionMask, alibiData, attenOutput, q.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
+                attenOutput.Reshape({1, attenOutput.dims[0], attenOutput.dims[1], attenOutput.dims[2]});
+            } else {
+                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
+                attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
+                if (alibiData.dims.size() != 0) {
+                    AlibiMask(attenWeights, alibiData, -10000);
+                } else if (attentionMask.dims.size() != 0) {
+                    AttentionMask(attenWeights, attentionMask, -10000);
+                }
 
-            Softmax(attenWeights, attenWeights, -1);
-            MatMul(attenWeights, pastValue, attenOutput);
+                Softmax(attenWeights, attenWeights, -1);
+                MatMul(attenWeights, pastValue, attenOutput);
+            }
 
             attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
             PermuteSelf(attenOutput, {1, 0, 2});
             attenOutput.Reshape({bsz, seqlen, -1});
 
             Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
-            AddTo(hiddenStates, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
+            AddToRMSNorm(hiddenStates, attenLastOutput, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
             Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            LinearSiluMul(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w1, w3);
+            Linear(w3, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
             AddTo(hiddenStates, w2);
         }
         Data logits, topk;
@@ -280,10 +266,11 @@ namespace fastllm {
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
             if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
                 Linear(attenInput, weight[qkvWeightName], Data(), qkv);
-                int per = qkv.dims.back() / 3;
-                Split(qkv, -1, 0, per, q);
-                Split(qkv, -1, per, per * 2, k);
-                Split(qkv, -1, per * 2, per * 3, v);
+                int per = qkv.dims.back() / (num_attention_heads + num_key_value_heads * 2);
+                int qLen = per * num_attention_heads, kvLen = per * num_key_value_heads;
+                Split(qkv, -1, 0, qLen, q);
+                Split(qkv, -1, qLen, qLen + kvLen, k);
+                Split(qkv, -1, qLen + kvLen, qLen + kvLen * 2, v);
             } else {
                 Linear(attenInput, weight[qWeightName], Data(), q);
                 Linear(attenInput, weight[kWeightName], Data(), k);
@@ -291,9 +278,10 @@ namespace fastllm {
             }
 
             std::vector <int> qkvSize = {bsz, seqlen, num_attention_heads, -1};
+            std::vector <int> kvSize = {bsz, seqlen, num_key_value_heads, -1};
             q.Reshape(qkvSize);
-            k.Reshape(qkvSize);
-            v.Reshape(qkvSize);
+            k.Reshape(kvSize);
+            v.Reshape(kvSize);
 
             if (alibiData.dims.size() == 0) {
                 fastllm::LlamaRotatePosition2D(q, positionIds, sinData, cosData, rotary_dim);
@@ -305,9 +293,10 @@ namespace fastllm {
             PermuteSelf(v, {0, 2, 1, 3});
 
             qkvSize = {bsz * num_attention_heads, seqlen, -1};
+            kvSize = {bsz * num_key_value_heads, seqlen, -1};
             q.Reshape(qkvSize);
-            k.Reshape(qkvSize);
-            v.Reshape(qkvSize);
+            k.Reshape(kvSize);
+            v.Reshape(kvSize);
 
             Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
             if (GetKVCacheInCPU()) {
@@ -318,49 +307,31 @@ namespace fastllm {
                 pastValue.ToDevice(DataDevice::CUDA);
             }
 
-            int unitLen = 64;
-#ifdef USE_CUDA
-            unitLen = 128;
-#endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                    newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                } else {
-                    newDims = pastKey.dims;
-                    newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastKey.Expansion(newDims);
-            }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                } else {
-                    newDims = pastValue.dims;
-                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastValue.Expansion(newDims);
-            }
+            PrepareKVCache(pastKey, k);
+            PrepareKVCache(pastValue, v);
 
             CatDirect(pastKey, k, 1);
             CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
             // 1.2.0 q * k^T
-            MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-            attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-            if (alibiData.dims.size() != 0) {
-                attenWeights.Reshape({-1, num_attention_heads, attenWeights.dims[2], attenWeights.dims[3]});
-                AlibiMask(attenWeights, alibiData, -10000);
-                attenWeights.Reshape({1, -1, attenWeights.dims[2], attenWeights.dims[3]});
-            } else if (attentionMask.dims.size() != 0) {
-                AttentionMask(attenWeights, attentionMask, -10000);
+            if (alibiData.dims.size() == 0 || pastKey.dataDevice == DataDevice::CPU) {
+                // 融合attention; CUDA上的alibi模型仍然走MatMul + AlibiMask
+                FusedAttention(q, pastKey, pastValue, attentionMask, alibiData, attenOutput, q.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
+                attenOutput.Reshape({1, attenOutput.dims[0], attenOutput.dims[1], attenOutput.dims[2]});
+            } else {
+                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
+                attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
+                if (alibiData.dims.size() != 0) {
+                    attenWeights.Reshape({-1, num_attention_heads, attenWeights.dims[2], attenWeights.dims[3]});
+                    AlibiMask(attenWeights, alibiData, -10000);
+                    attenWeights.Reshape({1, -1, attenWeights.dims[2], attenWeights.dims[3]});
+                } else if (attentionMask.dims.size() != 0) {
+                    AttentionMask(attenWeights, attentionMask, -10000);
+                }
+                Softmax(attenWeights, attenWeights, -1);
+                MatMul(attenWeights, pastValue, attenOutput);
             }
-            Softmax(attenWeights, attenWeights, -1);
-            MatMul(attenWeights, pastValue, attenOutput);
 
             attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
             PermuteSelf(attenOutput, {1, 0, 2});
@@ -368,14 +339,11 @@ namespace fastllm {
             PermuteSelf(attenOutput, {1, 0, 2});
 
             Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
-            AddTo(hiddenStates, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
+            AddToRMSNorm(hiddenStates, attenLastOutput, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
             Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            LinearSiluMul(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w1, w3);
+            Linear(w3, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
             AddTo(hiddenStates, w2);
         }
 
@@ -402,25 +370,26 @@ namespace fastllm {
                     lastRet.push_back((int) (((float *) topk.cpuData)[base * 2] + 1e-3));
                 }
             } else {
+                std::vector <int> offsets;
+                std::vector <const LastTokensUnit*> units;
                 for (int b = 0; b < batch; b++) {
-                    int base = b * logits.dims[1] + logits.dims[1] - 1;
-                    lastRet.push_back(LLMSampling(logits, base, generationConfig, lastTokens.units[b]));
+                    offsets.push_back(b * logits.dims[1] + logits.dims[1] - 1);
+                    units.push_back(&lastTokens.units[b]);
                 }
+                lastRet = LLMSamplingBatch(logits, offsets, std::vector <GenerationConfig> (batch, generationConfig), units);
             }
         }
 
         return lastRet;
     }
 
-    std::vector <int> LlamaModel::ForwardBatch(int batch,
-                                               const Data &inputIds,
-                                               const std::vector <Data*> &attentionMask,
-                                               const std::vector <Data*> &positionIds,
-                                               const std::vector <int> &seqLens,
-                                               std::vector <std::pair <Data*, Data*> > &pastKeyValues,
-                                               const std::vector <GenerationConfig> &generationConfigs,
-                                               const LastTokensManager &lastTokens,
-                                               std::vector <std::vector <float>*> *retLogits) {
+    void LlamaModel::ForwardBatchLogits(int batch,
+                                        const Data &inputIds,
+                                        const std::vector <Data*> &attentionMask,
+                                        const std::vector <Data*> &positionIds,
+                                        const std::vector <int> &seqLens,
+                                        std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                        Data &logits) {
         Data alibiData;
         if (this->weight.dicts["use_alibi"] == "1") {
             std::vector<float> alibi = GetInterleave(num_attention_heads);
@@ -431,6 +400,7 @@ namespace fastllm {
         Data attenInput;
         Data q, k, v, qkv;
         Data attenWeights, curAttenOutput;
+        Data emptyMask;
         Data attenLastOutput;
         Data w1, w2, w3;
 
@@ -450,10 +420,11 @@ namespace fastllm {
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
             if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
                 Linear(attenInput, weight[qkvWeightName], Data(), qkv);
-                int per = qkv.dims.back() / 3;
-                Split(qkv, -1, 0, per, q);
-                Split(qkv, -1, per, per * 2, k);
-                Split(qkv, -1, per * 2, per * 3, v);
+                int per = qkv.dims.back() / (num_attention_heads + num_key_value_heads * 2);
+                int qLen = per * num_attention_heads, kvLen = per * num_key_value_heads;
+                Split(qkv, -1, 0, qLen, q);
+                Split(qkv, -1, qLen, qLen + kvLen, k);
+                Split(qkv, -1, qLen + kvLen, qLen + kvLen * 2, v);
             } else {
                 Linear(attenInput, weight[qWeightName], Data(), q);
                 Linear(attenInput, weight[kWeightName], Data(), k);
@@ -477,9 +448,10 @@ namespace fastllm {
                 auto &q = curQs[b], &k = curKs[b], &v = curVs[b];
 
                 std::vector<int> qkvSize = {bsz, seqLens[b], num_attention_heads, -1};
+                std::vector<int> kvSize = {bsz, seqLens[b], num_key_value_heads, -1};
                 q.Reshape(qkvSize);
-                k.Reshape(qkvSize);
-                v.Reshape(qkvSize);
+                k.Reshape(kvSize);
+                v.Reshape(kvSize);
 
                 if (alibiData.dims.size() == 0) {
                     fastllm::LlamaRotatePosition2D(q, *positionIds[b], sinData, cosData, rotary_dim);
@@ -491,9 +463,10 @@ namespace fastllm {
                 PermuteSelf(v, {0, 2, 1, 3});
 
                 qkvSize = {bsz * num_attention_heads, seqLens[b], -1};
+                kvSize = {bsz * num_key_value_heads, seqLens[b], -1};
                 q.Reshape(qkvSize);
-                k.Reshape(qkvSize);
-                v.Reshape(qkvSize);
+                k.Reshape(kvSize);
+                v.Reshape(kvSize);
 
                 Data &pastKey = *pastKeyValues[b * block_cnt + i].first, &pastValue = *pastKeyValues[b * block_cnt + i].second;
                 if (GetKVCacheInCPU()) {
@@ -504,51 +477,30 @@ namespace fastllm {
                     pastValue.ToDevice(DataDevice::CUDA);
                 }
                 
-                int unitLen = 64;
-#ifdef USE_CUDA
-                unitLen = 128;
-#endif
-                while ((pastKey.dims.size() == 0 &&
-                        (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                       || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
-                    std::vector<int> newDims;
-                    if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                        newDims = std::vector<int>{k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                    } else {
-                        newDims = pastKey.dims;
-                        newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
-                    }
-                    pastKey.Expansion(newDims);
-                }
-                while ((pastValue.dims.size() == 0 &&
-                        (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                       || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
-                    std::vector<int> newDims;
-                    if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                        newDims = std::vector<int>{v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                    } else {
-                        newDims = pastValue.dims;
-                        newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
-                    }
-                    pastValue.Expansion(newDims);
-                }
+                PrepareKVCache(pastKey, k);
+                PrepareKVCache(pastValue, v);
 
                 CatDirect(pastKey, k, 1);
                 CatDirect(pastValue, v, 1);
 
                 // 1.2 Attention
                 // 1.2.0 q * k^T
-                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-                attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-                if (alibiData.dims.size() != 0) {
-                    AlibiMask(attenWeights, alibiData, -10000);
-                } else if (attentionMask[b] != nullptr) {
-                    AttentionMask(attenWeights, *attentionMask[b], -10000);
-                }
+                if (alibiData.dims.size() == 0 || pastKey.dataDevice == DataDevice::CPU) {
+                    // 融合attention; CUDA上的alibi模型仍然走MatMul + AlibiMask
+                    FusedAttention(q, pastKey, pastValue, attentionMask[b] == nullptr ? emptyMask : *attentionMask[b], alibiData, curAttenOutput, q.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
+                } else {
+                    MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
+                    attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
+                    if (alibiData.dims.size() != 0) {
+                        AlibiMask(attenWeights, alibiData, -10000);
+                    } else if (attentionMask[b] != nullptr) {
+                        AttentionMask(attenWeights, *attentionMask[b], -10000);
+                    }
 
-                Softmax(attenWeights, attenWeights, -1);
-                MatMul(attenWeights, pastValue, curAttenOutput);
-                curAttenOutput.Reshape({curAttenOutput.dims[1], curAttenOutput.dims[2], curAttenOutput.dims[3]});
+                    Softmax(attenWeights, attenWeights, -1);
+                    MatMul(attenWeights, pastValue, curAttenOutput);
+                    curAttenOutput.Reshape({curAttenOutput.dims[1], curAttenOutput.dims[2], curAttenOutput.dims[3]});
+                }
                 PermuteSelf(curAttenOutput, {1, 0, 2});
                 curAttenOutput.Reshape({seqLens[b], bsz, -1});
                 PermuteSelf(curAttenOutput, {1, 0, 2});
@@ -561,21 +513,56 @@ namespace fastllm {
             }
 
             Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
-            AddTo(hiddenStates, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
+            AddToRMSNorm(hiddenStates, attenLastOutput, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
             Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            LinearSiluMul(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w1, w3);
+            Linear(w3, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
             AddTo(hiddenStates, w2);
         }
 
-        Data logits, curLogit;
         RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-6, hiddenStates);
         Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
-        std::vector <int> lastRet;
+    }
+
+    void LlamaModel::ForwardBatchAllLogits(int batch,
+                                           const Data &inputIds,
+                                           const std::vector <Data*> &attentionMask,
+                                           const std::vector <Data*> &positionIds,
+                                           const std::vector <int> &seqLens,
+                                           std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                           std::vector <std::vector <std::vector <float> > > &logits) {
+        Data allLogits;
+        ForwardBatchLogits(batch, inputIds, attentionMask, positionIds, seqLens, pastKeyValues, allLogits);
+        allLogits.ToDevice(DataDevice::CPU);
+        int size = allLogits.dims.back(), total = 0;
+        logits.resize(batch);
+        for (int b = 0; b < batch; b++) {
+            logits[b].resize(seqLens[b]);
+            for (int i = 0; i < seqLens[b]; i++) {
+                float *base = ((float*)allLogits.cpuData) + (uint64_t)(total + i) * size;
+                logits[b][i] = std::vector <float> (base, base + size);
+            }
+            total += seqLens[b];
+        }
+    }
+
+    std::vector <int> LlamaModel::ForwardBatch(int batch,
+                                               const Data &inputIds,
+                                               const std::vector <Data*> &attentionMask,
+                                               const std::vector <Data*> &positionIds,
+                                               const std::vector <int> &seqLens,
+                                               std::vector <std::pair <Data*, Data*> > &pastKeyValues,
+                                               const std::vector <GenerationConfig> &generationConfigs,
+                                               const LastTokensManager &lastTokens,
+                                               std::vector <std::vector <float>*> *retLogits) {
+        Data logits, curLogit;
+        ForwardBatchLogits(batch, inputIds, attentionMask, positionIds, seqLens, pastKeyValues, logits);
+        std::vector <int> lastRet(batch);
+        // 需要采样的请求放在一起, 在线程池上并行采样
+        std::vector <int> sampleIds, sampleOffsets;
+        std::vector <GenerationConfig> sampleConfigs;
+        std::vector <const LastTokensUnit*> sampleUnits;
         int total = 0;
         for (int b = 0; b < batch; b++) {
             Split(logits, 1, total + seqLens[b] - 1, total + seqLens[b], curLogit);
@@ -588,17 +575,29 @@ namespace fastllm {
                 Data topk;
                 TopK(curLogit, topk, 1);
                 topk.ToDevice(DataDevice::CPU);
-                lastRet.push_back((int) (((float *) topk.cpuData)[0] + 1e-3));
+                lastRet[b] = (int) (((float *) topk.cpuData)[0] + 1e-3);
             } else {
-                lastRet.push_back(LLMSampling(curLogit, 0, generationConfigs[b], lastTokens.units[b]));
+                sampleIds.push_back(b);
+                sampleOffsets.push_back(total + seqLens[b] - 1);
+                sampleConfigs.push_back(generationConfigs[b]);
+                sampleUnits.push_back(&lastTokens.units[b]);
             }
             total += seqLens[b];
         }
+        if (!sampleIds.empty()) {
+            std::vector <int> sampled = LLMSamplingBatch(logits, sampleOffsets, sampleConfigs, sampleUnits);
+            for (int i = 0; i < (int)sampleIds.size(); i++) {
+                lastRet[sampleIds[i]] = sampled[i];
+            }
+        }
         return lastRet;
     }
 
     std::string LlamaModel::Response(const std::string& input, RuntimeResult retCb,
                                      const GenerationConfig &generationConfig) {
+        if (UseSpeculative(generationConfig)) {
+            return SpeculativeResponse(input, retCb, generationConfig);
+        }
 #ifdef USE_CUDA
         FastllmCudaClearBigBuffer();
 #endif
@@ -616,19 +615,6 @@ namespace fastllm {
             ids.push_back(((float*)inputIds.cpuData)[i]);
         }
         int seqLen = ids.size();
-        inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, ids));
-
-        std::vector <float> vmask = std::vector <float> (seqLen * seqLen, 0);
-        std::vector <float> vpids = std::vector <float> (seqLen, 0);
-        for (int i = 0; i < seqLen; i++) {
-            vpids[i] = i;
-            for (int j = i + 1; j < seqLen; j++) {
-                vmask[i * seqLen + j] = 1;
-            }
-        }
-
-        Data attentionMask = Data(DataType::FLOAT32, {seqLen, seqLen}, vmask);
-        Data positionIds = Data(DataType::FLOAT32, {1, seqLen}, vpids);
 
         std::vector <std::pair <Data, Data> > pastKeyValues;
         for (int i = 0; i < block_cnt; i++) {
@@ -636,9 +622,17 @@ namespace fastllm {
                                                    Data(DataType::FLOAT32)));
         }
 
+        // 命中前缀缓存时只计算剩余的token
+        std::vector <int> allTokens = std::vector <int> (ids.begin(), ids.end());
+        int cachedLen = UsePrefixCache() ? prefixCache.Match(allTokens, seqLen - 1, pastKeyValues) : 0, kvLen = cachedLen;
+        Data attentionMask, positionIds;
+        std::vector <std::vector <float> > inputTokens = {std::vector <float> (ids.begin() + cachedLen, ids.end())};
+        FillLLMInputs(inputTokens, {{"promptLen", seqLen}, {"index", 0}, {"chunkStart", cachedLen}},
+                      inputIds, attentionMask, positionIds);
+
         std::string retString = "";
         int len = seqLen;
-        std::vector <float> results;
+        StreamDecoder decoder(&this->weight.tokenizer);
         int index = 0;
 
         LastTokensManager tokens (1, generationConfig.last_n);
@@ -646,13 +640,17 @@ namespace fastllm {
             auto st = std::chrono::system_clock::now();
 
             int ret = Forward(inputIds, attentionMask, positionIds, pastKeyValues, generationConfig, tokens);
+            kvLen += inputIds.Count(0);
+            if (index == 0 && UsePrefixCache()) {
+                prefixCache.Insert(allTokens, kvLen, pastKeyValues);
+            }
             tokens.units[0].Push(ret);
             if (ret == eos_token_id) {
                 break;
             }
 
-            results.push_back(ret);
-            std::string curString = weight.tokenizer.Decode(Data(DataType::FLOAT32, {(int)results.size()}, results)).c_str();
+            allTokens.push_back(ret);
+            std::string curString = decoder.Push(ret);
             retString += curString;
             if (retCb)
 #ifdef PY_API
@@ -673,7 +671,6 @@ namespace fastllm {
             if (index == generationConfig.output_token_limit) {
                 break;
             }
-            results.clear();
 
             attentionMask.ToDevice(DataDevice::CPU);
             positionIds.ToDevice(DataDevice::CPU);
@@ -690,6 +687,11 @@ namespace fastllm {
 
             //printf("spend %f s.\n", GetSpan(st, std::chrono::system_clock::now()));
         }
+        if (UsePrefixCache()) {
+            // 连同生成的内容一起缓存, 下一轮对话可以复用
+            prefixCache.Insert(allTokens, kvLen, pastKeyValues);
+        }
+        retString += decoder.Flush();
         if (retCb)
 #ifdef PY_API
 		{
@@ -737,8 +739,9 @@ namespace fastllm {
         inputTokens.resize(batch);
         seqLens.resize(batch);
         int maxLen = 0;
+        std::vector <std::vector <float> > encoded = this->weight.tokenizer.EncodeBatch(prompts);
         for (int i = 0; i < batch; i++) {
-            inputTokens[i].CopyFrom(this->weight.tokenizer.Encode(prompts[i]));
+            inputTokens[i].CopyFrom(Data(DataType::FLOAT32, {1, (int)encoded[i].size()}, encoded[i]));
             maxLen = std::max(maxLen, (int)inputTokens[i].Count(0));
             seqLens[i] = (int)inputTokens[i].Count(0);
         }
@@ -782,7 +785,7 @@ namespace fastllm {
         std::string retString = "";
         std::vector <int> lens = seqLens;
         std::vector <bool> isEnding = std::vector <bool> (batch, false);
-        std::vector <float> results;
+        std::vector <StreamDecoder> decoders(batch, StreamDecoder(&this->weight.tokenizer));
         int index = 0;
 
         LastTokensManager tokensManager (batch, generationConfig.last_n);
@@ -796,7 +799,6 @@ namespace fastllm {
                 tokensManager.units[i].Push(ret[i]);
             }
             std::vector <float> fret;
-            std::vector <float> results;
             int endingCount = 0;
             std::vector <std::string> curStrings;
             for (int i = 0; i < batch; i++) {
@@ -805,16 +807,14 @@ namespace fastllm {
                     isEnding[i] = true;
                 }
                 if (isEnding[i]) {
+                    outputs[i] += decoders[i].Flush();
                     curStrings.push_back("");
                     endingCount++;
                     continue;
                 }
-                results.push_back(ret[i]);
-                std::string curString = weight.tokenizer.Decode(
-                        Data(DataType::FLOAT32, {(int) results.size()}, results)).c_str();
+                std::string curString = decoders[i].Push(ret[i]);
                 outputs[i] += curString;
                 curStrings.push_back(curString);
-                results.clear();
             }
 
             if (endingCount == batch) {
@@ -901,6 +901,17 @@ namespace fastllm {
         return (round == 0 ? pre_prompt : history) + user_role + input + bot_role + output + history_sep;
     }
 
+    void LlamaModel::InitLinearNames() {
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            for (std::string name : {".self_attn.q_proj", ".self_attn.k_proj", ".self_attn.v_proj", ".self_attn.W_pack",
+                                     ".self_attn.o_proj", ".mlp.gate_proj", ".mlp.up_proj", ".mlp.down_proj"}) {
+                weight.linearNames.insert(pre + name + ".weight");
+            }
+        }
+        weight.linearNames.insert("lm_head.weight");
+    }
+
     void LlamaModel::WarmUp() {
         printf("Warmup...\n");
         Data inputIds = Data(DataType::FLOAT32, {1, 1}, {1});
@@ -919,153 +930,48 @@ namespace fastllm {
         printf("finish.\n");
     }
 
-    int LlamaModel::LaunchResponseTokens(const std::vector<int> &inputTokens,
-                                         const GenerationConfig &generationConfig) {
-        mainLoopLocker.lock();
-        if (mainLoop == nullptr) {
-            if (mainLoop == nullptr) {
-                mainLoop = new std::thread([](LlamaModel *model) {
-                    while (true) {
-                        std::vector <Data*> attentionMasks;
-                        std::vector <Data*> positionIds;
-                        std::vector <std::pair <Data*, Data*> > pastKeyValues;
-                        std::vector <float> ids;
-                        std::vector <int> seqLens;
-                        std::vector <GenerationConfig> generationConfigs;
-                        LastTokensManager tokensManager;
-                        std::vector <std::vector <float>* > logits;
-                        model->dictLocker.lock();
-                        for (auto &it: model->responseContextDict.dicts) {
-                            if (it.second->isEnding) {
-                                continue;
-                            }
-                            generationConfigs.push_back(it.second->generationConfig);
-                            if (it.second->generationConfig.output_logits) {
-                                it.second->resultLogits.push(new std::vector <float> ());
-                                logits.push_back(it.second->resultLogits.back());
-                            } else {
-                                logits.push_back(nullptr);
-                            }
-                            tokensManager.units.push_back(it.second->tokens);
-                            if (it.second->preTokens == 0) {
-                                int seqLen = it.second->currentTokens.size();
-                                for (int i = 0; i < it.second->currentTokens.size(); i++) {
-                                    ids.push_back(it.second->currentTokens[i]);
-                                }
-
-                                seqLens.push_back(seqLen);
-
-                                std::vector <float> vmask = std::vector <float> (seqLen * seqLen, 0);
-                                std::vector <float> vpids = std::vector <float> (seqLen, 0);
-                                for (int i = 0; i < seqLen; i++) {
-                                    vpids[i] = i;
-                                    for (int j = i + 1; j < seqLen; j++) {
-                                        vmask[i * seqLen + j] = 1;
-                                    }
-                                }
-                                it.second->intParams["len"] = seqLen;
-
-                                attentionMasks.push_back(new Data(DataType::FLOAT32, {seqLen, seqLen}, vmask));
-                                positionIds.push_back(new Data(DataType::FLOAT32, {2, seqLen}, vpids));
-                            } else {
-                                int ret = it.second->currentTokens[0];
-                                seqLens.push_back(1);
-                                ids.push_back(ret);
-                                attentionMasks.push_back(nullptr);
-                                positionIds.push_back(new Data(DataType::FLOAT32, {1, 1}, {(float)it.second->intParams["len"]}));
-                                it.second->intParams["len"]++;
-                            }
-
-                            it.second->preTokens += seqLens.back();
-                            for (int i = 0; i < model->block_cnt; i++) {
-                                pastKeyValues.push_back(std::make_pair(&it.second->pastKeyValues[i].first,
-                                                                       &it.second->pastKeyValues[i].second));
-                            }
-                        }
-
-                        if (seqLens.size() > 0) {
-#ifdef USE_CUDA
-                            FastllmCudaClearBigBuffer();
-#endif
-                            Data inputIds = Data(DataType::FLOAT32, {1, (int) ids.size()}, ids);
-                            std::vector<int> ret = model->ForwardBatch(seqLens.size(), inputIds, attentionMasks,
-                                                                       positionIds, seqLens, pastKeyValues, generationConfigs, tokensManager, &logits);
-                            int idx = 0;
-                            for (auto &it: model->responseContextDict.dicts) {
-                                if (it.second->isEnding) {
-                                    continue;
-                                }
-                                int curRet = ret[idx++];
-                                if (curRet == model->eos_token_id) {
-                                    it.second->isEnding = true;
-                                } else {
-                                    auto itStopTk = it.second->generationConfig.stop_token_ids.find(curRet);
-                                    if (itStopTk != it.second->generationConfig.stop_token_ids.end()) {
-                                            it.second->isEnding = true;
-                                    }
-                                }
-                                if (it.second->isEnding == false) {
-                                    it.second->currentTokens = std::vector<int>{curRet};
-                                    it.second->resultTokenQueue.push(curRet);
-                                    it.second->tokens.Push(curRet);
-                                    it.second->curTokens++;
-                                    if (it.second->curTokens == it.second->generationConfig.output_token_limit) {
-                                        it.second->isEnding = true;
-                                    }
-                                }
-                            }
-                        }
-
-                        for (int i = 0; i < attentionMasks.size(); i++) {
-                            delete attentionMasks[i];
-                        }
-                        for (int i = 0; i < positionIds.size(); i++) {
-                            delete positionIds[i];
-                        }
-
-                        model->dictLocker.unlock();
-                        MySleep(0);
-                    }
-                }, this);
-            }
+    void LlamaModel::InitParams() {
+        basellm::InitParams();
+        head_dim = embed_dim / num_attention_heads;
+        num_key_value_heads = num_attention_heads;
+        if (this->weight.dicts.find("num_key_value_heads") != this->weight.dicts.end()) {
+            num_key_value_heads = atoi(this->weight.dicts["num_key_value_heads"].c_str());
         }
-        mainLoopLocker.unlock();
-
-        dictLocker.lock();
-        int handleId = responseContextDict.CreateHandle();
-        ResponseContext *context = responseContextDict.GetHandle(handleId);
-        context->Init(this->block_cnt);
-        context->currentTokens = inputTokens;
-        context->generationConfig = generationConfig;
-        context->tokens = LastTokensUnit(generationConfig.last_n);
-        dictLocker.unlock();
-        return handleId;
+        AssertInFastLLM(num_key_value_heads > 0 && num_attention_heads % num_key_value_heads == 0,
+                        "LlamaModel error: num_attention_heads should be a multiple of num_key_value_heads.\n");
     }
 
-    int LlamaModel::FetchResponseTokens(int handleId) {
-        dictLocker.lock();
-        ResponseContext *context = responseContextDict.GetHandle(handleId);
-        if (context == nullptr) {
-            dictLocker.unlock();
-            return -1;
-        } else {
-            while (true) {
-                if (context->resultTokenQueue.size() > 0) {
-                    int ret = context->resultTokenQueue.front();
-                    context->resultTokenQueue.pop();
-                    dictLocker.unlock();
-                    return ret;
-                } else {
-                    if (context->isEnding) {
-                        responseContextDict.RemoveHandle(handleId);
-                        dictLocker.unlock();
-                        return -1;
-                    }
+    bool LlamaModel::SupportChunkedPrefill() {
+        return this->weight.dicts["use_alibi"] != "1";
+    }
+
+    void LlamaModel::FillLLMInputs(std::vector <std::vector <float> > &inputTokens,
+                                   const std::map <std::string, int> &params,
+                                   Data &inputIds, Data &attentionMask, Data &positionIds) {
+        int index = params.find("index")->second;
+        int promptLen = params.find("promptLen")->second;
+        int chunkStart = params.find("chunkStart") != params.end() ? params.find("chunkStart")->second : 0;
+        inputIds.ToDevice(DataDevice::CPU);
+        attentionMask.ToDevice(DataDevice::CPU);
+        positionIds.ToDevice(DataDevice::CPU);
+        if (index == 0) {
+            // 分块prefill时这一段接在前chunkStart个token后面
+            int seqLen = inputTokens[0].size(), total = chunkStart + seqLen;
+            std::vector <float> vmask = std::vector <float> (seqLen * total, 0);
+            std::vector <float> vpids = std::vector <float> (seqLen, 0);
+            for (int i = 0; i < seqLen; i++) {
+                vpids[i] = chunkStart + i;
+                for (int j = chunkStart + i + 1; j < total; j++) {
+                    vmask[i * total + j] = 1;
                 }
-                dictLocker.unlock();
-                MySleep(0);
-                dictLocker.lock();
             }
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, inputTokens[0]));
+            attentionMask.CopyFrom(Data(DataType::FLOAT32, {seqLen, total}, vmask));
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, vpids));
+        } else {
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, inputTokens[0]));
+            attentionMask.CopyFrom(Data());
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float) (promptLen + index - 1)}));
         }
     }
 }
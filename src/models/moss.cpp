@@ -227,7 +227,7 @@ namespace fastllm {
             ((float *) positionIds.cpuData)[i] = i;
         }
 
-        std::vector<float> results;
+        StreamDecoder decoder(&weight.tokenizer);
         std::string retString = "";
 		int index = 0;
         LastTokensManager tokens (1, generationConfig.last_n);
@@ -238,9 +238,7 @@ namespace fastllm {
                 break;
             }
 
-            results.push_back(ret);
-            std::string current = weight.tokenizer.Decode(
-                    Data(DataType::FLOAT32, {(int) results.size()}, results)).c_str();
+            std::string current = decoder.Push(ret);
             retString += current;
 			if (retCb)
 #ifdef PY_API
@@ -258,7 +256,6 @@ namespace fastllm {
 #endif
             index++;
             fflush(stdout);
-            results.clear();
 
             len++;
 
@@ -273,6 +270,7 @@ namespace fastllm {
                 break;
             }
         }
+        retString += decoder.Flush();
 
 		if (retCb)
 #ifdef PY_API
@@ -299,6 +297,16 @@ namespace fastllm {
         return (round == 0 ? pre_prompt : history) + user_role + input + bot_role + output + history_sep;
     }
 
+    void MOSSModel::InitLinearNames() {
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "transformer.h." + std::to_string(i);
+            for (std::string name : {".attn.qkv_proj", ".attn.out_proj", ".mlp.fc_in", ".mlp.fc_out"}) {
+                weight.linearNames.insert(pre + name + ".weight");
+            }
+        }
+        weight.linearNames.insert("lm_head.weight");
+    }
+
     void MOSSModel::WarmUp() {
         printf("Warmup...\n");
         Data inputIds = Data(DataType::FLOAT32, {1, 1}, {(float)bos_token_id});
@@ -86,7 +86,7 @@ namespace fastllm {
         Data hiddenStates;
         Data attnInput, attnOutput;
         Data query, key, value;
-        Data attnWeights, attnLastOutput;
+        Data attnLastOutput;
         Data a1, a2, mlpOutput;
 
         // printf("input id: ");
@@ -139,64 +139,27 @@ namespace fastllm {
             key.Reshape(qkvSize);
             value.Reshape(qkvSize);
 
-            int unitLen = 64;
-#ifdef USE_CUDA
-            unitLen = 128;
-#endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || key.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + key.dims[1] > pastKey.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                    newDims = std::vector <int> {key.dims[0], ((key.dims[1] - 1) / unitLen + 1) * unitLen, key.dims[2]};
-                } else {
-                    newDims = pastKey.dims;
-                    newDims[1] += ((key.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastKey.Expansion(newDims);
-            }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || value.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + value.dims[1] > pastValue.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {value.dims[0], ((value.dims[1] - 1) / unitLen + 1) * unitLen, value.dims[2]};
-                } else {
-                    newDims = pastValue.dims;
-                    newDims[1] += ((value.dims[1] - 1) / unitLen + 1) * unitLen;
-                }
-                pastValue.Expansion(newDims);
-            }
+            PrepareKVCache(pastKey, key);
+            PrepareKVCache(pastValue, value);
             CatDirect(pastKey, key, 1);
             CatDirect(pastValue, value, 1);
 
             // Attention
-            MatMulTransB(query, pastKey, attnWeights, 1.0 / sqrt(head_dim));
-            attnWeights.Reshape({1, attnWeights.dims[0], attnWeights.dims[1], attnWeights.dims[2]});
-            if (!attentionMask.dims.empty()) {
-                AttentionMask(attnWeights, attentionMask, -10000);
-            }
-
-            Softmax(attnWeights, attnWeights, -1);
-            MatMul(attnWeights, pastValue, attnOutput);
-
-            attnOutput.Reshape({attnOutput.dims[1], attnOutput.dims[2], attnOutput.dims[3]});
+            FusedAttention(query, pastKey, pastValue, attentionMask, Data(), attnOutput, query.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
             PermuteSelf(attnOutput, {1, 0, 2});
             attnOutput.Reshape({seqlen, batch, -1});
             PermuteSelf(attnOutput, {1, 0, 2});
 
             std::string proj_weight_name = "transformer.h." + std::to_string(i) + ".attn.c_proj.weight";
             Linear(attnOutput, weight[proj_weight_name], Data(), attnLastOutput);
-            AddTo(hiddenStates, attnLastOutput);
-
             std::string ln_2_name = "transformer.h." + std::to_string(i) + ".ln_2.weight";
-            RMSNorm(hiddenStates, weight[ln_2_name], 1e-6, attnInput);
+            AddToRMSNorm(hiddenStates, attnLastOutput, weight[ln_2_name], 1e-6, attnInput);
 
             std::string mlp_w1_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w1.weight";
             std::string mlp_w2_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w2.weight";
             std::string mlp_proj_weight_name = "transformer.h." + std::to_string(i) + ".mlp.c_proj.weight";
-            Linear(attnInput, weight[mlp_w1_weight_name], Data(), a1);
             Linear(attnInput, weight[mlp_w2_weight_name], Data(), a2);
-            Silu(a2, a2);
-            MulTo(a1, a2);
+            LinearSiluMul(attnInput, weight[mlp_w1_weight_name], Data(), a2, a1);
             Linear(a1, weight[mlp_proj_weight_name], Data(), mlpOutput);
             AddTo(hiddenStates, mlpOutput);
         }
@@ -242,7 +205,8 @@ namespace fastllm {
         Data hiddenStates;
         Data attnInput, attnOutput;
         Data query, key, value;
-        Data attnWeights, attnLastOutput;
+        Data attnLastOutput;
+        Data emptyMask;
         Data a1, a2, mlpOutput;
 
         Embedding(inputIds, this->weight["transformer.wte.weight"], hiddenStates);
@@ -308,46 +272,13 @@ namespace fastllm {
                 key.Reshape(qkvSize);
                 value.Reshape(qkvSize);
 
-                int unitLen = 64;
-    #ifdef USE_CUDA
-                unitLen = 128;
-    #endif
-                while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || key.dims[1] > pastKey.expansionDims[1]))
-                    || (pastKey.dims.size() > 0 && pastKey.dims[1] + key.dims[1] > pastKey.expansionDims[1])) {
-                    std::vector <int> newDims;
-                    if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                        newDims = std::vector <int> {key.dims[0], ((key.dims[1] - 1) / unitLen + 1) * unitLen, key.dims[2]};
-                    } else {
-                        newDims = pastKey.dims;
-                        newDims[1] += ((key.dims[1] - 1) / unitLen + 1) * unitLen;
-                    }
-                    pastKey.Expansion(newDims);
-                }
-                while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || value.dims[1] > pastValue.expansionDims[1]))
-                    || (pastValue.dims.size() > 0 && pastValue.dims[1] + value.dims[1] > pastValue.expansionDims[1])) {
-                    std::vector <int> newDims;
-                    if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                        newDims = std::vector <int> {value.dims[0], ((value.dims[1] - 1) / unitLen + 1) * unitLen, value.dims[2]};
-                    } else {
-                        newDims = pastValue.dims;
-                        newDims[1] += ((value.dims[1] - 1) / unitLen + 1) * unitLen;
-                    }
-                    pastValue.Expansion(newDims);
-                }
+                PrepareKVCache(pastKey, key);
+                PrepareKVCache(pastValue, value);
                 CatDirect(pastKey, key, 1);
                 CatDirect(pastValue, value, 1);
 
-
-                MatMulTransB(query, pastKey, attnWeights, 1.0 / sqrt(head_dim));
-                attnWeights.Reshape({1, attnWeights.dims[0], attnWeights.dims[1], attnWeights.dims[2]});
-                if (attentionMask[b]) {
-                    AttentionMask(attnWeights, *attentionMask[b], -10000);
-                }
-
-                Softmax(attnWeights, attnWeights, -1);
-                MatMul(attnWeights, pastValue, attnOutput);
-
-                attnOutput.Reshape({attnOutput.dims[1], attnOutput.dims[2], attnOutput.dims[3]});
+                // Attention
+                FusedAttention(query, pastKey, pastValue, attentionMask[b] == nullptr ? emptyMask : *attentionMask[b], Data(), attnOutput, query.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim));
                 PermuteSelf(attnOutput, {1, 0, 2});
                 attnOutput.Reshape({seqLens[b], 1, -1});
                 PermuteSelf(attnOutput, {1, 0, 2});
@@ -363,18 +294,14 @@ namespace fastllm {
 
             std::string proj_weight_name = "transformer.h." + std::to_string(i) + ".attn.c_proj.weight";
             Linear(attnOutputAll, weight[proj_weight_name], Data(), attnLastOutput);
-            AddTo(hiddenStates, attnLastOutput);
-
             std::string ln_2_name = "transformer.h." + std::to_string(i) + ".ln_2.weight";
-            RMSNorm(hiddenStates, weight[ln_2_name], 1e-6, attnInput);
+            AddToRMSNorm(hiddenStates, attnLastOutput, weight[ln_2_name], 1e-6, attnInput);
 
             std::string mlp_w1_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w1.weight";
             std::string mlp_w2_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w2.weight";
             std::string mlp_proj_weight_name = "transformer.h." + std::to_string(i) + ".mlp.c_proj.weight";
-            Linear(attnInput, weight[mlp_w1_weight_name], Data(), a1);
             Linear(attnInput, weight[mlp_w2_weight_name], Data(), a2);
-            Silu(a2, a2);
-            MulTo(a1, a2);
+            LinearSiluMul(attnInput, weight[mlp_w1_weight_name], Data(), a2, a1);
             Linear(a1, weight[mlp_proj_weight_name], Data(), mlpOutput);
             AddTo(hiddenStates, mlpOutput);
         }
@@ -383,7 +310,11 @@ namespace fastllm {
         Data logits;
         Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
 
-        std::vector <int> lastRet;
+        std::vector <int> lastRet(batch);
+        // 需要采样的请求放在一起, 在线程池上并行采样
+        std::vector <int> sampleIds, sampleOffsets;
+        std::vector <GenerationConfig> sampleConfigs;
+        std::vector <const LastTokensUnit*> sampleUnits;
         int total = 0;
         Data curLogit;
         for (int b = 0; b < batch; b++) {
@@ -397,12 +328,21 @@ namespace fastllm {
                 Data topk;
                 TopK(curLogit, topk, 1);
                 topk.ToDevice(DataDevice::CPU);
-                lastRet.push_back((int) (((float *) topk.cpuData)[0] + 1e-3));
+                lastRet[b] = (int) (((float *) topk.cpuData)[0] + 1e-3);
             } else {
-                lastRet.push_back(LLMSampling(curLogit, 0, generationConfigs[b], lastTokens.units[b]));
+                sampleIds.push_back(b);
+                sampleOffsets.push_back(total + seqLens[b] - 1);
+                sampleConfigs.push_back(generationConfigs[b]);
+                sampleUnits.push_back(&lastTokens.units[b]);
             }
             total += seqLens[b];
         }
+        if (!sampleIds.empty()) {
+            std::vector <int> sampled = LLMSamplingBatch(logits, sampleOffsets, sampleConfigs, sampleUnits);
+            for (int i = 0; i < (int)sampleIds.size(); i++) {
+                lastRet[sampleIds[i]] = sampled[i];
+            }
+        }
         return lastRet;
     }
 
@@ -506,6 +446,16 @@ namespace fastllm {
         }
     }
 
+    void QWenModel::InitLinearNames() {
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "transformer.h." + std::to_string(i);
+            for (std::string name : {".attn.c_attn", ".attn.c_proj", ".mlp.w1", ".mlp.w2", ".mlp.c_proj"}) {
+                weight.linearNames.insert(pre + name + ".weight");
+            }
+        }
+        weight.linearNames.insert("lm_head.weight");
+    }
+
     void QWenModel::WarmUp() {
         printf("Warmup...\n");
         Data inputIds = Data(DataType::FLOAT32, {1, 1}, {1});
@@ -0,0 +1,191 @@
+#include "prefixcache.h"
+#include "utils.h"
+
+namespace fastllm {
+    PrefixCache::PrefixCache() {
+        metrics.budgetBytes = 1LL << 30;
+    }
+
+    PrefixCache::~PrefixCache() {
+        Clear();
+    }
+
+    void PrefixCache::Touch(PrefixCacheNode *node) {
+        lru.erase(std::make_pair(std::make_pair(node->lastAccess, -node->depth), node));
+        node->lastAccess = clock;
+        lru.insert(std::make_pair(std::make_pair(node->lastAccess, -node->depth), node));
+    }
+
+    void PrefixCache::RemoveNode(PrefixCacheNode *node) {
+        AssertInFastLLM(node->children.empty(), "PrefixCache error: only leaf can be removed.\n");
+        lru.erase(std::make_pair(std::make_pair(node->lastAccess, -node->depth), node));
+        for (int i = 0; i < (int)node->blocks.size(); i++) {
+            layouts[i].pool->FreeBlock(node->blocks[i]);
+        }
+        node->parent->children.erase(node->tokens);
+        delete node;
+        metrics.nodes--;
+        metrics.usedBytes -= nodeBytes;
+    }
+
+    void PrefixCache::Evict() {
+        // 访问一个节点时会同时更新它的所有祖先, 所以lastAccess最小(相同时最深)的节点一定是叶子
+        while (metrics.usedBytes > metrics.budgetBytes && !lru.empty()) {
+            RemoveNode(lru.begin()->second);
+            metrics.evictedBlocks++;
+        }
+    }
+
+    int PrefixCache::Match(const std::vector <int> &tokens, int maxLen,
+                           std::vector <std::pair <Data, Data> > &pastKeyValues) {
+        std::lock_guard <std::mutex> guard(locker);
+        metrics.lookups++;
+        metrics.lookupTokens += tokens.size();
+        if (metrics.budgetBytes <= 0 || layouts.empty() || layouts.size() != pastKeyValues.size() * 2) {
+            return 0;
+        }
+        for (auto &it : pastKeyValues) {
+            if (it.first.dims.size() > 0 || it.first.pagedKVCache != nullptr ||
+                it.second.dims.size() > 0 || it.second.pagedKVCache != nullptr) {
+                return 0;
+            }
+        }
+
+        std::vector <PrefixCacheNode*> path;
+        PrefixCacheNode *node = &root;
+        maxLen = std::min(maxLen, (int)tokens.size());
+        for (int st = 0; st + blockLen <= maxLen; st += blockLen) {
+            auto it = node->children.find(std::vector <int> (tokens.begin() + st, tokens.begin() + st + blockLen));
+            if (it == node->children.end()) {
+                break;
+            }
+            node = it->second;
+            path.push_back(node);
+        }
+        if (path.empty()) {
+            return 0;
+        }
+
+        int len = (int)path.size() * blockLen;
+        for (int i = 0; i < (int)layouts.size(); i++) {
+            Layout &layout = layouts[i];
+            Data &cache = (i % 2 == 0) ? pastKeyValues[i / 2].first : pastKeyValues[i / 2].second;
+            std::vector <uint8_t*> blocks;
+            for (PrefixCacheNode *cur : path) {
+                blocks.push_back(cur->blocks[i]);
+            }
+            cache.dataType = layout.dataType;
+            cache.UpdateUnitSize();
+            cache.pagedKVCache = std::make_shared <PagedKVCache> (layout.heads, layout.dim, layout.unitSize, blockLen, layout.storeType);
+            cache.pagedKVCache->ShareBlocks(blocks);
+            cache.Resize({layout.heads, len, layout.dim});
+        }
+
+        clock++;
+        for (PrefixCacheNode *cur : path) {
+            Touch(cur);
+        }
+        metrics.hits++;
+        metrics.hitTokens += len;
+        return len;
+    }
+
+    void PrefixCache::Insert(const std::vector <int> &tokens, int len,
+                             std::vector <std::pair <Data, Data> > &pastKeyValues) {
+        std::lock_guard <std::mutex> guard(locker);
+        if (metrics.budgetBytes <= 0 || pastKeyValues.empty()) {
+            return;
+        }
+        std::vector <Layout> curLayouts;
+        int curBlockLen = -1;
+        len = std::min(len, (int)tokens.size());
+        for (int i = 0; i < (int)pastKeyValues.size() * 2; i++) {
+            Data &cache = (i % 2 == 0) ? pastKeyValues[i / 2].first : pastKeyValues[i / 2].second;
+            if (cache.pagedKVCache == nullptr || cache.pagedKVCache->len < len ||
+                (curBlockLen != -1 && cache.pagedKVCache->blockLen != curBlockLen)) {
+                return;
+            }
+            PagedKVCache &paged = *cache.pagedKVCache;
+            curBlockLen = paged.blockLen;
+            curLayouts.push_back(Layout {paged.heads, paged.dim, paged.unitSize, paged.storeType, cache.dataType, paged.pool});
+        }
+
+        bool sameLayout = (curBlockLen == blockLen && curLayouts.size() == layouts.size());
+        for (int i = 0; sameLayout && i < (int)layouts.size(); i++) {
+            sameLayout = (layouts[i].heads == curLayouts[i].heads && layouts[i].dim == curLayouts[i].dim &&
+                          layouts[i].dataType == curLayouts[i].dataType && layouts[i].storeType == curLayouts[i].storeType &&
+                          layouts[i].pool == curLayouts[i].pool);
+        }
+        if (!sameLayout) {
+            if (!root.children.empty()) {
+                // block大小或者模型结构变了, 旧的缓存仍然有效时不替换
+                return;
+            }
+            layouts = curLayouts;
+            blockLen = curBlockLen;
+            nodeBytes = 0;
+            for (auto &layout : layouts) {
+                nodeBytes += layout.pool->blockBytes;
+            }
+        }
+
+        clock++;
+        PrefixCacheNode *node = &root;
+        for (int b = 0; (b + 1) * blockLen <= len; b++) {
+            std::vector <int> key = std::vector <int> (tokens.begin() + b * blockLen, tokens.begin() + (b + 1) * blockLen);
+            auto it = node->children.find(key);
+            if (it != node->children.end()) {
+                node = it->second;
+            } else {
+                PrefixCacheNode *child = new PrefixCacheNode();
+                child->tokens = key;
+                child->parent = node;
+                child->depth = node->depth + 1;
+                for (int i = 0; i < (int)layouts.size(); i++) {
+                    Data &cache = (i % 2 == 0) ? pastKeyValues[i / 2].first : pastKeyValues[i / 2].second;
+                    uint8_t *block = cache.pagedKVCache->blockTable[b];
+                    layouts[i].pool->ShareBlock(block);
+                    child->blocks.push_back(block);
+                }
+                node->children[key] = child;
+                node = child;
+                metrics.nodes++;
+                metrics.usedBytes += nodeBytes;
+                metrics.insertedBlocks++;
+            }
+            Touch(node);
+        }
+        Evict();
+    }
+
+    void PrefixCache::SetBudget(long long bytes) {
+        std::lock_guard <std::mutex> guard(locker);
+        metrics.budgetBytes = bytes;
+        Evict();
+    }
+
+    long long PrefixCache::GetBudget() {
+        std::lock_guard <std::mutex> guard(locker);
+        return metrics.budgetBytes;
+    }
+
+    bool PrefixCache::Enabled() {
+        std::lock_guard <std::mutex> guard(locker);
+        return metrics.budgetBytes > 0;
+    }
+
+    void PrefixCache::Clear() {
+        std::lock_guard <std::mutex> guard(locker);
+        while (!lru.empty()) {
+            RemoveNode(lru.begin()->second);
+        }
+        layouts.clear();
+        blockLen = 0;
+        nodeBytes = 0;
+    }
+
+    PrefixCacheMetrics PrefixCache::GetMetrics() {
+        std::lock_guard <std::mutex> guard(locker);
+        return metrics;
+    }
+}
@@ -129,15 +129,40 @@ PYBIND11_MODULE(pyfastllm, m) {
 	  .def_readwrite("top_p", &fastllm::GenerationConfig::top_p) 
 	  .def_readwrite("temperature", &fastllm::GenerationConfig::temperature)
 	  .def_readwrite("enable_hash_id", &fastllm::GenerationConfig::enable_hash_id)
+	  .def_readwrite("priority", &fastllm::GenerationConfig::priority)
+	  .def_readwrite("speculative_tokens", &fastllm::GenerationConfig::speculative_tokens)
+	  .def_readwrite("prompt_lookup_ngram", &fastllm::GenerationConfig::prompt_lookup_ngram)
+	  .def_readwrite("min_p", &fastllm::GenerationConfig::min_p)
+	  .def_readwrite("typical_p", &fastllm::GenerationConfig::typical_p)
+	  .def_readwrite("frequency_penalty", &fastllm::GenerationConfig::frequency_penalty)
+	  .def_readwrite("presence_penalty", &fastllm::GenerationConfig::presence_penalty)
+	  .def_readwrite("seed", &fastllm::GenerationConfig::seed)
 	  .def("is_simple_greedy", &fastllm::GenerationConfig::IsSimpleGreedy); 
 
   // high level
   m.def("set_threads", &fastllm::SetThreads)
+    .def("set_thread_affinity", &fastllm::SetThreadAffinity)
+    .def("set_numa_nodes", &fastllm::SetNumaNodes)
+    .def("get_numa_nodes", &fastllm::GetNumaNodes)
     .def("get_threads", &fastllm::GetThreads)
     .def("set_low_memory", &fastllm::SetLowMemMode)
     .def("get_low_memory", &fastllm::GetLowMemMode)
+    .def("set_mmap_weights", &fastllm::SetMmapWeights)
+    .def("get_mmap_weights", &fastllm::GetMmapWeights)
+    .def("set_mmap_warm_up", &fastllm::SetMmapWarmUp)
+    .def("get_mmap_warm_up", &fastllm::GetMmapWarmUp)
+    .def("set_linear_weight_prepack", &fastllm::SetLinearWeightPrepack)
+    .def("get_linear_weight_prepack", &fastllm::GetLinearWeightPrepack)
     .def("set_kv_cache", &fastllm::SetKVCacheInCPU)
     .def("get_kv_cache", &fastllm::GetKVCacheInCPU)
+    .def("set_paged_kv_cache", &fastllm::SetPagedKVCache)
+    .def("get_paged_kv_cache", &fastllm::GetPagedKVCache)
+    .def("set_kv_cache_block_len", &fastllm::SetKVCacheBlockLen)
+    .def("set_kv_cache_type", &fastllm::SetKVCacheType)
+    .def("get_kv_cache_type", &fastllm::GetKVCacheType)
+    .def("set_cpu_memory_pool", &fastllm::SetCpuMemoryPool)
+    .def("get_cpu_memory_pool", &fastllm::GetCpuMemoryPool)
+    .def("print_cpu_memory_stats", &fastllm::PrintCpuMemoryStats)
     .def("set_device_map", &fastllm::SetDeviceMap)
     .def("create_llm", &fastllm::CreateLLMModelFromFile);
   m.def("std_hash", [](std::string input) -> size_t {
@@ -261,6 +286,7 @@ PYBIND11_MODULE(pyfastllm, m) {
 
   py::class_<fastllm::Tokenizer>(m, "Tokenizer")
     .def("encode", &fastllm::Tokenizer::Encode)
+    .def("encode_batch", &fastllm::Tokenizer::EncodeBatch)
     // .def("decode", &fastllm::Tokenizer::Decode)
     .def("decode", &fastllm::Tokenizer::Decode, "Decode from Tensor")
     .def("decode", &fastllm::Tokenizer::DecodeTokens, "Decode from Vector")
@@ -273,11 +299,12 @@ PYBIND11_MODULE(pyfastllm, m) {
       return py::bytes(ret);
     })
     .def("clear", &fastllm::Tokenizer::Clear)
-    .def("insert", &fastllm::Tokenizer::Insert);
+    .def("insert", &fastllm::Tokenizer::Insert)
+    .def_readwrite("use_flat_trie", &fastllm::Tokenizer::useFlatTrie);
   
   py::class_<fastllm::WeightMap>(m, "WeightMap")
     .def_readonly("tokenizer", &fastllm::WeightMap::tokenizer)
-    .def("save_lowbit", &fastllm::WeightMap::SaveLowBitModel)
+    .def("save_lowbit", &fastllm::WeightMap::SaveLowBitModel, py::arg("fileName"), py::arg("bit"), py::arg("groupCnt") = -1)
     .def("set_kv", &fastllm::WeightMap::AddDict)
     .def("set_weight", &fastllm::WeightMap::AddWeight)
     .def("__getitem__", [](fastllm::WeightMap &weight, std::string key){
@@ -285,7 +312,23 @@ PYBIND11_MODULE(pyfastllm, m) {
 
 
   // model classes
-  py::class_<fastllm::basellm>(m, "basellm");
+  py::class_<fastllm::basellm>(m, "basellm")
+    .def("create_session", &fastllm::basellm::CreateSession)
+    .def("close_session", &fastllm::basellm::CloseSession)
+    .def("append_session_tokens", &fastllm::basellm::AppendSessionTokens)
+    .def("append_session_input", &fastllm::basellm::AppendSessionInput)
+    .def("launch_session_response", &fastllm::basellm::LaunchSessionResponse,
+         py::arg("sessionId"), py::arg("config") = fastllm::GenerationConfig())
+    .def("session_response", &fastllm::basellm::SessionResponse)
+    .def("set_draft_model", &fastllm::basellm::SetDraftModel)
+    .def("convert_lowbit", &fastllm::basellm::ConvertLowBitModel, py::arg("input"), py::arg("output"), py::arg("bit"), py::arg("groupCnt") = -1)
+    .def("set_session_config", [](fastllm::basellm &model, int idleTimeout, long long maxBytes, bool swapToDisk) {
+      fastllm::SessionConfig config;
+      config.idleTimeout = idleTimeout;
+      config.maxBytes = maxBytes;
+      config.swapToDisk = swapToDisk;
+      model.SetSessionConfig(config);
+    }, py::arg("idleTimeout") = 600, py::arg("maxBytes") = 4LL << 30, py::arg("swapToDisk") = true);
 
   py::class_<fastllm::ChatGLMModel, fastllm::basellm>(m, "ChatGLMModel")
     .def(py::init<>())
@@ -319,7 +362,7 @@ PYBIND11_MODULE(pyfastllm, m) {
     })
     .def("launch_response", &fastllm::ChatGLMModel::LaunchResponseTokens)
     .def("fetch_response", &fastllm::ChatGLMModel::FetchResponseTokens)
-    .def("save_lowbit_model", &fastllm::ChatGLMModel::SaveLowBitModel)
+    .def("save_lowbit_model", &fastllm::ChatGLMModel::SaveLowBitModel, py::arg("fileName"), py::arg("bit"), py::arg("groupCnt") = -1)
     .def("make_input", &fastllm::ChatGLMModel::MakeInput);
 
   py::class_<fastllm::MOSSModel, fastllm::basellm>(m, "MOSSModel")
@@ -352,7 +395,7 @@ PYBIND11_MODULE(pyfastllm, m) {
     })
     .def("launch_response", &fastllm::MOSSModel::LaunchResponseTokens)
     .def("fetch_response", &fastllm::MOSSModel::FetchResponseTokens)
-    .def("save_lowbit_model", &fastllm::MOSSModel::SaveLowBitModel)
+    .def("save_lowbit_model", &fastllm::MOSSModel::SaveLowBitModel, py::arg("fileName"), py::arg("bit"), py::arg("groupCnt") = -1)
     .def("make_input", &fastllm::MOSSModel::MakeInput);
 
   py::class_<fastllm::LlamaModel, fastllm::basellm>(m, "LlamaModel")
@@ -386,7 +429,7 @@ PYBIND11_MODULE(pyfastllm, m) {
     })
     .def("launch_response", &fastllm::LlamaModel::LaunchResponseTokens)
     .def("fetch_response", &fastllm::LlamaModel::FetchResponseTokens)
-    .def("save_lowbit_model", &fastllm::LlamaModel::SaveLowBitModel)
+    .def("save_lowbit_model", &fastllm::LlamaModel::SaveLowBitModel, py::arg("fileName"), py::arg("bit"), py::arg("groupCnt") = -1)
     .def("make_input", &fastllm::LlamaModel::MakeInput);
 
   py::class_<fastllm::QWenModel, fastllm::basellm>(m, "QWenModel")
@@ -421,7 +464,7 @@ PYBIND11_MODULE(pyfastllm, m) {
     })
     .def("launch_response", &fastllm::QWenModel::LaunchResponseTokens)
     .def("fetch_response", &fastllm::QWenModel::FetchResponseTokens)
-    .def("save_lowbit_model", &fastllm::QWenModel::SaveLowBitModel)
+    .def("save_lowbit_model", &fastllm::QWenModel::SaveLowBitModel, py::arg("fileName"), py::arg("bit"), py::arg("groupCnt") = -1)
     .def("make_input", &fastllm::QWenModel::MakeInput);
 
 #ifdef VERSION_INFO
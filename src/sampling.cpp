@@ -0,0 +1,307 @@
+#include "utils.h"
+
+#include "fastllm.h"
+
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <atomic>
+#include <chrono>
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
+
+#ifdef __AVX2__
+#include "immintrin.h"
+#endif
+
+namespace fastllm {
+    static uint64_t SplitMix64(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    static float ToUniform(uint64_t x) {
+        return (float)(x >> 40) * (1.0f / 16777216.0f); // [0, 1)
+    }
+
+    // 全局随机数, 多线程安全
+    static std::atomic <uint64_t> randomState((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count());
+
+    static float RandP() {
+        return ToUniform(SplitMix64(randomState.fetch_add(0x9E3779B97F4A7C15ULL, std::memory_order_relaxed)));
+    }
+
+    // 生成第step个token时使用的随机数: 设置了seed时只由(seed, step, stream)决定, 同样的请求可以复现
+    // 同一个token需要多个独立的随机数时 (投机解码的接受判断, 重新采样) 使用不同的stream
+    static float SamplingRandom(const GenerationConfig &config, int step, int stream = 0) {
+        if (config.seed < 0) {
+            return RandP();
+        }
+        uint64_t x = ((uint64_t)(uint32_t)config.seed << 32) ^ (uint64_t)(uint32_t)step;
+        return ToUniform(SplitMix64(x + (uint64_t)stream * 0xD1B54A32D192ED03ULL));
+    }
+
+    // 把float映射成保持大小顺序的uint32, 用于基数选择
+    static inline uint32_t FloatKey(float x) {
+        uint32_t u;
+        memcpy(&u, &x, sizeof(u));
+        return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+    }
+
+    // output[i] = input[i] * scale
+    static void ScaleLogits(const float *input, float *output, int len, float scale) {
+        int i = 0;
+#ifdef __AVX2__
+        __m256 vs = _mm256_set1_ps(scale);
+        for (; i + 7 < len; i += 8) {
+            _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_loadu_ps(input + i), vs));
+        }
+#elif defined(__aarch64__)
+        for (; i + 3 < len; i += 4) {
+            vst1q_f32(output + i, vmulq_n_f32(vld1q_f32(input + i), scale));
+        }
+#endif
+        for (; i < len; i++) {
+            output[i] = input[i] * scale;
+        }
+    }
+
+    // 选出values中最大的k个下标 (无序), 存在ids中
+    // 先按key的高11位做直方图找到第k大所在的桶, 比它大的桶全部选中, 只对这个桶里的元素做nth_element
+    static void TopKSelect(const float *values, int len, int k, std::vector <int> &ids) {
+        ids.clear();
+        if (k >= len) {
+            ids.resize(len);
+            for (int i = 0; i < len; i++) {
+                ids[i] = i;
+            }
+            return;
+        }
+        const int bits = 11, shift = 32 - bits;
+        int hist[1 << bits];
+        memset(hist, 0, sizeof(hist));
+        for (int i = 0; i < len; i++) {
+            hist[FloatKey(values[i]) >> shift]++;
+        }
+        int bucket = (1 << bits) - 1, above = 0;
+        while (above + hist[bucket] < k) {
+            above += hist[bucket--];
+        }
+        static thread_local std::vector <int> ties;
+        ties.clear();
+        ids.reserve(k);
+        for (int i = 0; i < len; i++) {
+            int b = FloatKey(values[i]) >> shift;
+            if (b > bucket) {
+                ids.push_back(i);
+            } else if (b == bucket) {
+                ties.push_back(i);
+            }
+        }
+        int need = k - above;
+        if ((int)ties.size() > need) {
+            std::nth_element(ties.begin(), ties.begin() + need - 1, ties.end(), [values](int a, int b) {
+                return values[a] > values[b];
+            });
+        }
+        ids.insert(ids.end(), ties.begin(), ties.begin() + need);
+    }
+
+    void LLMSamplingProbs(const float *logits, int vocabSize, const GenerationConfig &config,
+                          const LastTokensUnit &tokens, std::vector <std::pair <int, float> > &probs) {
+        // 1. 温度和惩罚
+        float invTemp = 1.0f / config.temperature;
+        static thread_local std::vector <float> values; // 复用缓冲区, 避免每个token都重新申请整个词表大小的内存
+        values.resize(vocabSize);
+        ScaleLogits(logits, values.data(), vocabSize, invTemp);
+        bool repeat = fabs(config.repeat_penalty - 1.0) > 1e-6;
+        if (repeat || config.frequency_penalty != 0.0f || config.presence_penalty != 0.0f) {
+            for (auto &it : tokens.tokenCounts) {
+                float x = logits[it.first];
+                if (repeat) {
+                    x = (x < 0 ? x * config.repeat_penalty : x / config.repeat_penalty);
+                }
+                x -= config.frequency_penalty * it.second + config.presence_penalty;
+                values[it.first] = x * invTemp;
+            }
+        }
+
+        // 2. top_k
+        std::vector <int> ids;
+        TopKSelect(values.data(), vocabSize, std::max(1, std::min(vocabSize, config.top_k)), ids);
+        float maxValue = -FLT_MAX;
+        for (int id : ids) {
+            maxValue = std::max(maxValue, values[id]);
+        }
+        std::vector <std::pair <float, int> > cand(ids.size()); // <logit, token>, 按logit排序
+        float psum = 0.0f;
+        for (int i = 0; i < (int)ids.size(); i++) {
+            cand[i] = std::make_pair(values[ids[i]], ids[i]);
+            psum += expf(cand[i].first - maxValue);
+        }
+        auto greater = [](const std::pair <float, int> &a, const std::pair <float, int> &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        };
+
+        // 3. typical_p: 保留信息量最接近熵的token, 直到累计概率达到typical_p
+        if (config.typical_p < 1.0f && cand.size() > 1) {
+            float logSum = logf(psum), entropy = 0.0f;
+            for (auto &it : cand) {
+                float logp = it.first - maxValue - logSum;
+                entropy -= expf(logp) * logp;
+            }
+            std::vector <std::pair <float, int> > order(cand.size());
+            for (int i = 0; i < (int)cand.size(); i++) {
+                order[i] = std::make_pair(fabs(-(cand[i].first - maxValue - logSum) - entropy), i);
+            }
+            std::sort(order.begin(), order.end());
+            std::vector <std::pair <float, int> > kept;
+            float cur = 0.0f;
+            for (auto &it : order) {
+                kept.push_back(cand[it.second]);
+                cur += expf(cand[it.second].first - maxValue) / psum;
+                if (cur >= config.typical_p) {
+                    break;
+                }
+            }
+            cand.swap(kept);
+            psum = 0.0f;
+            for (auto &it : cand) {
+                psum += expf(it.first - maxValue);
+            }
+        }
+
+        // 4. top_p: 只对需要的前缀排序, 不够时扩大前缀
+        int keep = cand.size();
+        if (config.top_p < 1.0f) {
+            float limit = config.top_p * psum, cur = 0.0f;
+            int sorted = 0;
+            for (int m = std::min(keep, 64); ; m = std::min(keep, m * 4)) {
+                std::partial_sort(cand.begin() + sorted, cand.begin() + m, cand.end(), greater);
+                for (; sorted < m; sorted++) {
+                    cur += expf(cand[sorted].first - maxValue);
+                    if (cur > limit) {
+                        break;
+                    }
+                }
+                if (sorted < m) {
+                    keep = sorted + 1;
+                    break;
+                }
+                if (m == keep) {
+                    break;
+                }
+            }
+            cand.resize(keep);
+        } else {
+            std::sort(cand.begin(), cand.end(), greater);
+        }
+
+        // 5. min_p: 去掉概率低于min_p * 最大概率的token
+        if (config.min_p > 0.0f) {
+            float limit = cand[0].first + logf(config.min_p);
+            while (keep > 1 && cand[keep - 1].first < limit) {
+                keep--;
+            }
+            cand.resize(keep);
+        }
+
+        probs.resize(cand.size());
+        float sum = 0.0f;
+        for (int i = 0; i < (int)cand.size(); i++) {
+            probs[i] = std::make_pair(cand[i].second, expf(cand[i].first - maxValue));
+            sum += probs[i].second;
+        }
+        for (auto &it : probs) {
+            it.second /= sum;
+        }
+    }
+
+    static int SampleFromProbs(const std::vector <std::pair <int, float> > &probs, float rnd) {
+        float curSum = 0.0;
+        for (int i = 0; i < (int)probs.size(); i++) {
+            curSum += probs[i].second;
+            if (curSum > rnd || i == (int)probs.size() - 1) {
+                return probs[i].first;
+            }
+        }
+        return -1;
+    }
+
+    int LLMSamplingFromProbs(const std::vector <std::pair <int, float> > &probs, const GenerationConfig &config,
+                             int step, int stream) {
+        return SampleFromProbs(probs, SamplingRandom(config, step, stream));
+    }
+
+    int LLMSampling(Data &logits, int outerOffset,
+                    const GenerationConfig &config, const LastTokensUnit &tokens) {
+        logits.ToDevice(DataDevice::CPU);
+        int vocabSize = logits.dims.back();
+        std::vector <std::pair <int, float> > probs;
+        LLMSamplingProbs(((float*)logits.cpuData) + (uint64_t)outerOffset * vocabSize, vocabSize, config, tokens, probs);
+        return SampleFromProbs(probs, SamplingRandom(config, tokens.count));
+    }
+
+    std::vector <int> LLMSamplingBatch(Data &logits, const std::vector <int> &outerOffsets,
+                                       const std::vector <GenerationConfig> &configs,
+                                       const std::vector <const LastTokensUnit*> &tokens) {
+        logits.ToDevice(DataDevice::CPU);
+        int vocabSize = logits.dims.back(), n = outerOffsets.size();
+        // 随机数在调用线程上按顺序取, 结果和逐个调用LLMSampling一致
+        std::vector <float> rnds(n);
+        for (int i = 0; i < n; i++) {
+            rnds[i] = SamplingRandom(configs[i], tokens[i]->count);
+        }
+        std::vector <int> ret(n);
+        GetPool()->ParallelFor(n, [&](int st, int end) {
+            std::vector <std::pair <int, float> > probs;
+            for (int i = st; i < end; i++) {
+                LLMSamplingProbs(((float*)logits.cpuData) + (uint64_t)outerOffsets[i] * vocabSize, vocabSize,
+                                 configs[i], *tokens[i], probs);
+                ret[i] = SampleFromProbs(probs, rnds[i]);
+            }
+        }, 1);
+        return ret;
+    }
+
+    int SpeculativeSampling(const std::vector <std::pair <int, float> > &p, const std::vector <std::pair <int, float> > &q,
+                            int draftToken, const GenerationConfig &config, int step) {
+        std::map <int, float> residual;
+        float pd = 0.0f, qd = 0.0f;
+        for (auto &it : p) {
+            residual[it.first] += it.second;
+            if (it.first == draftToken) {
+                pd = it.second;
+            }
+        }
+        for (auto &it : q) {
+            residual[it.first] -= it.second;
+            if (it.first == draftToken) {
+                qd = it.second;
+            }
+        }
+        if (qd > 0.0f && SamplingRandom(config, step, 1) * qd <= pd) {
+            return draftToken;
+        }
+
+        std::vector <std::pair <int, float> > probs;
+        float sum = 0.0f;
+        for (auto &it : residual) {
+            if (it.second > 0.0f) {
+                probs.push_back(it);
+                sum += it.second;
+            }
+        }
+        if (sum <= 0.0f) {
+            return LLMSamplingFromProbs(p, config, step, 2);
+        }
+        for (auto &it : probs) {
+            it.second /= sum;
+        }
+        return LLMSamplingFromProbs(probs, config, step, 2);
+    }
+}
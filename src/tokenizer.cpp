@@ -0,0 +1,413 @@
+#include "utils.h"
+
+#include "fastllm.h"
+
+#include <cstring>
+#include <limits>
+#include <mutex>
+
+namespace fastllm {
+    static std::mutex flatTrieLocker; // 保护flatTrie和tokenPieces的延迟构建
+
+    void Tokenizer::BuildFlatTrie() {
+        FlatTrie &trie = this->flatTrie;
+        trie.tokenIds.clear();
+        trie.scores.clear();
+        trie.edgeStart.clear();
+        trie.edgeLabels.clear();
+        trie.edgeNext.clear();
+
+        // 按层次遍历给节点编号, 根节点为0, 每个节点的边按字节排序
+        std::vector <TrieNode*> nodes;
+        nodes.push_back(this->root);
+        std::vector <std::pair <uint8_t, TrieNode*> > edges;
+        for (int i = 0; i < (int)nodes.size(); i++) {
+            TrieNode *now = nodes[i];
+            trie.tokenIds.push_back(now->tokenId);
+            trie.scores.push_back(now->score);
+            trie.edgeStart.push_back(trie.edgeLabels.size());
+            edges.clear();
+            for (auto &it : now->next) {
+                edges.push_back(std::make_pair((uint8_t)it.first, it.second));
+            }
+            std::sort(edges.begin(), edges.end());
+            for (auto &it : edges) {
+                trie.edgeLabels.push_back(it.first);
+                trie.edgeNext.push_back(nodes.size());
+                nodes.push_back(it.second);
+            }
+        }
+        trie.edgeStart.push_back(trie.edgeLabels.size());
+
+        for (int c = 0; c < 256; c++) {
+            trie.rootNext[c] = -1;
+        }
+        for (int i = trie.edgeStart[0]; i < trie.edgeStart[1]; i++) {
+            trie.rootNext[trie.edgeLabels[i]] = trie.edgeNext[i];
+        }
+        for (int c = 0; c < 256; c++) {
+            std::string now = "<0x00>";
+            now[3] = (c / 16 > 9 ? ('A' + c / 16 - 10) : ('0' + c / 16));
+            now[4] = (c % 16 > 9 ? ('A' + c % 16 - 10) : ('0' + c % 16));
+            auto it = stringToTokenDict.find(now);
+            trie.byteFallback[c] = (it == stringToTokenDict.end() ? -1 : it->second);
+        }
+        flatTrieDirty = false;
+    }
+
+    // 编码时复用的缓冲区, 每个线程一份
+    struct FlatSymbol {
+        int node; // flatTrie中的节点, -1代表没有匹配的token
+        int pos, len;
+        int prev, next;
+        int fixId;
+    };
+
+    static thread_local std::vector <FlatSymbol> flatSymbols;
+    static thread_local std::vector <Tokenizer::SymbolPairs> flatPairs;
+    static thread_local std::vector <std::pair <int, int> > flatRanks; // <rank, 位置>
+    static thread_local std::vector <int> flatPartNext, flatPartPrev, flatPartRank;
+
+    // 从根节点开始匹配s[i..], 返回第一个 (最短的) token对应的节点, pos为它的最后一个字节, 匹配不到时返回-1
+    static int MatchShortest(const Tokenizer::FlatTrie &trie, const char *s, int len, int i, int &pos) {
+        int now = 0;
+        pos = i - 1;
+        for (int j = i; j < len; j++) {
+            now = trie.Next(now, (uint8_t)s[j]);
+            if (now < 0) {
+                return -1;
+            }
+            if (trie.tokenIds[now] != -999999) {
+                pos = j;
+                return now;
+            }
+        }
+        return -1;
+    }
+
+    // 节点node沿着s[pos, pos + len)走下去, 走不通时返回-1
+    static int Walk(const Tokenizer::FlatTrie &trie, int node, const char *s, int pos, int len) {
+        for (int i = pos; i < pos + len && node >= 0; i++) {
+            node = trie.Next(node, (uint8_t)s[i]);
+        }
+        return node;
+    }
+
+    static void FlatTryMergePairs(const Tokenizer::FlatTrie &trie, const char *s, int l, int r) {
+        auto &symbols = flatSymbols;
+        if (l == -1 || r == -1 || symbols[l].len == 0 || symbols[r].len == 0) {
+            return;
+        }
+        int now = Walk(trie, symbols[l].node, s, symbols[r].pos, symbols[r].len);
+        if (now < 0 || trie.tokenIds[now] == -999999) {
+            return;
+        }
+        flatPairs.push_back(Tokenizer::SymbolPairs(trie.scores[now], l, r, symbols[l].len + symbols[r].len));
+        std::push_heap(flatPairs.begin(), flatPairs.end());
+    }
+
+    // 按score合并相邻的symbol (BPE, GPT2), 和Encode中逐节点查找的实现一一对应
+    static void FlatEncodeBPE(const Tokenizer::FlatTrie &trie, const std::string &s, std::vector <float> &v) {
+        auto &symbols = flatSymbols;
+        symbols.clear();
+        const char *data = s.data();
+        int len = s.size();
+        for (int i = 0; i < len; i++) {
+            if (i + 3 < len && s[i] == '<' && s[i + 1] == 'F' && s[i + 2] == 'L' && s[i + 3] == 'M') {
+                if (i + 15 < len && s.compare(i, 15, "<FLM_FIX_TOKEN_") == 0) {
+                    i += 15;
+                    int now = 0;
+                    while (s[i] >= '0' && s[i] <= '9') {
+                        now = now * 10 + s[i] - '0';
+                        i++;
+                    }
+                    symbols.push_back(FlatSymbol {-1, i, 0, (int) symbols.size() - 1, (int) symbols.size() + 1, now});
+                    continue;
+                }
+            }
+
+            int pos;
+            int node = MatchShortest(trie, data, len, i, pos);
+            if (node >= 0) {
+                symbols.push_back(FlatSymbol {node, i, pos - i + 1, (int) symbols.size() - 1, (int) symbols.size() + 1, -999999});
+                i = pos;
+            } else {
+                symbols.push_back(FlatSymbol {-1, i, 0, (int) symbols.size() - 1, (int) symbols.size() + 1, -999999});
+            }
+        }
+        if (symbols.empty()) {
+            return;
+        }
+        symbols.back().next = -1;
+
+        flatPairs.clear();
+        for (int i = 1; i < (int)symbols.size(); i++) {
+            FlatTryMergePairs(trie, data, i - 1, i);
+        }
+        while (!flatPairs.empty()) {
+            std::pop_heap(flatPairs.begin(), flatPairs.end());
+            auto top = flatPairs.back();
+            flatPairs.pop_back();
+            FlatSymbol &l = symbols[top.l], &r = symbols[top.r];
+            if (l.len == 0 || r.len == 0 || l.len + r.len != top.size) {
+                continue;
+            }
+
+            l.node = Walk(trie, l.node, data, r.pos, r.len);
+            l.len += r.len;
+            r.len = 0;
+            l.next = r.next;
+            if (r.next >= 0) {
+                symbols[r.next].prev = top.l;
+            }
+
+            FlatTryMergePairs(trie, data, symbols[top.l].prev, top.l);
+            FlatTryMergePairs(trie, data, top.l, symbols[top.l].next);
+        }
+
+        for (auto &symbol : symbols) {
+            if (symbol.len > 0) {
+                v.push_back(trie.tokenIds[symbol.node]);
+            } else if (symbol.node == -1) {
+                if (symbol.fixId != -999999) {
+                    v.push_back(symbol.fixId);
+                } else if (trie.byteFallback[(uint8_t) data[symbol.pos]] != -1) {
+                    // 未识别的字符
+                    v.push_back(trie.byteFallback[(uint8_t) data[symbol.pos]]);
+                }
+            }
+        }
+    }
+
+    // s[l, r)对应的token, 不存在时返回-1
+    static int FindToken(const Tokenizer::FlatTrie &trie, const char *s, int l, int r) {
+        int node = Walk(trie, 0, s, l, r - l);
+        return (node < 0 || trie.tokenIds[node] == -999999) ? -1 : trie.tokenIds[node];
+    }
+
+    // 按token id (rank) 从小到大合并相邻的片段 (QWEN), 每个片段的起点作为链表节点, 用堆代替每次扫描全部片段
+    // 和Encode中的实现一样: rank相同时先合并靠左的片段, 合并时在s中查找, 输出时在out中查找, 不在词表中的片段输出0
+    static void FlatEncodeRank(const Tokenizer::FlatTrie &trie, const char *s, const char *out, int n, std::vector <float> &v) {
+        auto &next = flatPartNext, &prev = flatPartPrev, &rank = flatPartRank;
+        auto &heap = flatRanks;
+        const int maxRank = std::numeric_limits<int>::max();
+        next.resize(n + 1);
+        prev.resize(n + 1);
+        rank.resize(n + 1);
+        for (int i = 0; i <= n; i++) {
+            next[i] = i + 1;
+            prev[i] = i - 1;
+        }
+        // 片段i和它后面的片段合并后的rank
+        auto getRank = [&](int i) {
+            if (next[i] >= n) {
+                return maxRank;
+            }
+            int token = FindToken(trie, s, i, next[next[i]]);
+            return token == -1 ? maxRank : token;
+        };
+        heap.clear();
+        for (int i = 0; i < n; i++) {
+            rank[i] = getRank(i);
+            if (rank[i] != maxRank) {
+                heap.push_back(std::make_pair(rank[i], i));
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), std::greater <std::pair <int, int> >());
+        auto push = [&](int i) {
+            rank[i] = getRank(i);
+            if (rank[i] != maxRank) {
+                heap.push_back(std::make_pair(rank[i], i));
+                std::push_heap(heap.begin(), heap.end(), std::greater <std::pair <int, int> >());
+            }
+        };
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater <std::pair <int, int> >());
+            auto top = heap.back();
+            heap.pop_back();
+            int i = top.second;
+            if (rank[i] != top.first) {
+                continue;
+            }
+            int r = next[i];
+            rank[r] = maxRank;
+            next[i] = next[r];
+            prev[next[r]] = i;
+            push(i);
+            if (prev[i] >= 0) {
+                push(prev[i]);
+            }
+        }
+        for (int i = 0; i < n; i = next[i]) {
+            int token = FindToken(trie, out, i, next[i]);
+            v.push_back(token == -1 ? 0 : token);
+        }
+    }
+
+    static void FlatEncodeQWen(const Tokenizer::FlatTrie &trie, const std::string &ori, std::vector <float> &v) {
+        std::map<std::string, int> specialTokens = {{"<|im_start|>", 151644}, {"<|im_end|>", 151645}, {"<|endoftext|>", 151643}};
+        std::vector<std::pair<int, int>> sep;
+        for (auto &token : specialTokens) {
+            int pos = 0;
+            while ((pos = ori.find(token.first, pos)) != std::string::npos) {
+                sep.push_back({pos, token.first.size()});
+                pos += token.first.size();
+            }
+        }
+        sep.push_back({ori.size(), 1});
+        std::sort(sep.begin(), sep.end(), std::greater<std::pair<int, int>>());
+
+        // 和Encode中一样, 每个symbol按一个字节计算: 合并从第一个symbol开始, 输出取当前位置之前的symbols个字节
+        int symbols = 0, start = 0;
+        for (int i = 0; i <= (int)ori.size(); i++) {
+            if (i == sep.back().first) {
+                if (symbols > 0) {
+                    FlatEncodeRank(trie, ori.data() + start, ori.data() + i - symbols, symbols, v);
+                    symbols = 0;
+                }
+                std::string special = ori.substr(sep.back().first, sep.back().second);
+                if (specialTokens.find(special) != specialTokens.end()) {
+                    v.push_back(specialTokens[special]);
+                }
+                i += sep.back().second - 1;
+                sep.pop_back();
+                continue;
+            }
+
+            if (symbols == 0) {
+                start = i;
+            }
+            int pos;
+            if (MatchShortest(trie, ori.data(), ori.size(), i, pos) >= 0) {
+                i = pos;
+            }
+            symbols++;
+        }
+    }
+
+    void Tokenizer::FlatEncode(const std::string &ori, std::vector <float> &v) {
+        {
+            std::lock_guard <std::mutex> guard(flatTrieLocker);
+            if (flatTrieDirty) {
+                BuildFlatTrie();
+            }
+            if (tokenPiecesDirty) {
+                BuildTokenPieces();
+            }
+        }
+        if (this->type == QWEN) {
+            FlatEncodeQWen(flatTrie, ori, v);
+            return;
+        }
+
+        std::string blank = "", s = "";
+        if (this->type == Tokenizer::BPE) {
+            blank += 226, blank += 150, blank += 129;
+            s = blank;
+        } else if (this->type == Tokenizer::GPT2) {
+            blank += 196, blank += 160;
+        }
+        if (15 < ori.size() && ori.compare(0, 15, "<FLM_FIX_TOKEN_") == 0) {
+            s = "";
+        }
+        s.reserve(s.size() + ori.size() * 2);
+        for (int i = 0; i < (int)ori.size(); i++) {
+            if (ori[i] == ' ') {
+                if (i != 0 && ori[i - 1] != ' ') {
+                    s += blank;
+                }
+            } else {
+                s += ori[i];
+            }
+        }
+        FlatEncodeBPE(flatTrie, s, v);
+    }
+
+    std::vector <std::vector <float> > Tokenizer::EncodeBatch(const std::vector <std::string> &s) {
+        std::vector <std::vector <float> > ret(s.size());
+        auto encode = [&](int st, int end) {
+            for (int i = st; i < end; i++) {
+                Data now = Encode(s[i]);
+                ret[i].assign((float*)now.cpuData, (float*)now.cpuData + now.Count(0));
+            }
+        };
+        if (!useFlatTrie && this->type == QWEN) {
+            // 逐节点查找的QWEN编码会修改stringToTokenDict, 只能串行
+            encode(0, s.size());
+            return ret;
+        }
+        {
+            std::lock_guard <std::mutex> guard(flatTrieLocker);
+            if (flatTrieDirty) {
+                BuildFlatTrie();
+            }
+            if (tokenPiecesDirty) {
+                BuildTokenPieces();
+            }
+        }
+        // 每个输入一块, 长短不一的输入由线程池窃取平衡
+        GetPool()->ParallelFor(s.size(), encode, 1);
+        return ret;
+    }
+
+    void Tokenizer::BuildTokenPieces() {
+        std::vector <int> ids;
+        int maxId = -1;
+        for (auto &it : tokenToStringDict) {
+            if (it.first >= 0) {
+                ids.push_back(it.first);
+                maxId = std::max(maxId, it.first);
+            }
+        }
+        tokenPieces.clear();
+        tokenPieces.resize(maxId + 1);
+        for (int id : ids) {
+            tokenPieces[id] = DecodeTokens(std::vector <int> {id});
+        }
+        tokenPiecesDirty = false;
+    }
+
+    std::string Tokenizer::DecodePiece(int tokenId) {
+        if (tokenPiecesDirty) {
+            // Insert之后还没有重新构建tokenPieces, 直接解码
+            if (tokenToStringDict.find(tokenId) == tokenToStringDict.end()) {
+                return "";
+            }
+            return DecodeTokens(std::vector <int> {tokenId});
+        }
+        if (tokenId < 0 || tokenId >= (int)tokenPieces.size()) {
+            return "";
+        }
+        return tokenPieces[tokenId];
+    }
+
+    StreamDecoder::StreamDecoder(Tokenizer *tokenizer) {
+        this->tokenizer = tokenizer;
+    }
+
+    std::string StreamDecoder::Push(int tokenId) {
+        pending += tokenizer->DecodePiece(tokenId);
+        // 只需要检查末尾最多4个字节: 找到最后一个字符的首字节, 如果它后面的字节还不够就先留着
+        int n = pending.size(), cut = n;
+        for (int i = n - 1; i >= 0 && i >= n - 4; i--) {
+            uint8_t c = (uint8_t)pending[i];
+            if ((c & 0xC0) == 0x80) {
+                continue;
+            }
+            int need = (c < 0xC0 ? 1 : (c < 0xE0 ? 2 : (c < 0xF0 ? 3 : (c < 0xF8 ? 4 : 1))));
+            if (i + need > n) {
+                cut = i;
+            }
+            break;
+        }
+        std::string ret = pending.substr(0, cut);
+        pending.erase(0, cut);
+        return ret;
+    }
+
+    std::string StreamDecoder::Flush() {
+        std::string ret;
+        ret.swap(pending);
+        return ret;
+    }
+}
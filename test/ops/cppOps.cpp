@@ -1,4 +1,46 @@
 #include "fastllm.h"
+#include "model.h"
+#include "llama.h"
+#include "utils.h"
+#include "devices/cpu/cpulinear.h"
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+static int failedChecks = 0;
+
+std::vector <float> randomFloats(int n, int seed, float scale = 1.0f) {
+    std::mt19937 rng(seed);
+    std::normal_distribution <float> dist(0.0f, scale);
+    std::vector <float> ret(n);
+    for (auto &x : ret) {
+        x = dist(rng);
+    }
+    return ret;
+}
+
+// 比较两个结果的最大误差, 超过eps时记为失败
+void checkClose(const std::string &name, const float *a, const float *b, int n, float eps) {
+    float maxDiff = 0.0f;
+    for (int i = 0; i < n; i++) {
+        maxDiff = std::max(maxDiff, fabsf(a[i] - b[i]));
+    }
+    bool ok = maxDiff <= eps;
+    failedChecks += !ok;
+    printf("%s: max diff %g %s\n", name.c_str(), maxDiff, ok ? "ok" : "FAILED");
+}
+
+void checkClose(const std::string &name, fastllm::Data &a, fastllm::Data &b, float eps) {
+    a.ToDevice(fastllm::DataDevice::CPU);
+    b.ToDevice(fastllm::DataDevice::CPU);
+    if (a.Count(0) != b.Count(0)) {
+        failedChecks++;
+        printf("%s: size mismatch FAILED\n", name.c_str());
+        return;
+    }
+    checkClose(name, (float*)a.cpuData, (float*)b.cpuData, a.Count(0), eps);
+}
 
 void callBaseOp(int optype=0){
     fastllm::Data inputs = fastllm::Data(fastllm::DataType::FLOAT32, {1, 2}, {1, 5});
@@ -97,6 +139,1379 @@ void callAttentionOp(int group=1, int attentionType=0){
     fastllm::Attention(q, k, v, mask, output, group, scale, attentionType);
 }
 
+// 原来的attention: 被mask的score置为-10000后softmax, 整行被mask时为所有v的平均值
+// alibi非空时同AlibiMask, score加上alibi[h] * j并按位置做因果mask
+void referenceAttention(const std::vector <float> &q, const std::vector <float> &k, const std::vector <float> &v,
+                        const std::vector <float> &mask, const std::vector <float> &alibi,
+                        int heads, int group, int q1, int k1, int dim, float scale, std::vector <float> &output) {
+    output.assign(heads * q1 * dim, 0.0f);
+    std::vector <float> scores(k1);
+    for (int h = 0; h < heads; h++) {
+        const float *kh = k.data() + (h / group) * k1 * dim, *vh = v.data() + (h / group) * k1 * dim;
+        for (int i = 0; i < q1; i++) {
+            const float *qi = q.data() + (h * q1 + i) * dim;
+            float maxValue = -1e30f, sum = 0.0f;
+            for (int j = 0; j < k1; j++) {
+                bool masked = alibi.empty() ? (!mask.empty() && mask[i * k1 + j] > 0.99) : (j > k1 - q1 + i);
+                float dot = 0.0f;
+                for (int l = 0; l < dim; l++) {
+                    dot += qi[l] * kh[j * dim + l];
+                }
+                scores[j] = masked ? -10000.0f : dot * scale + (alibi.empty() ? 0.0f : alibi[h] * j);
+                maxValue = std::max(maxValue, scores[j]);
+            }
+            for (int j = 0; j < k1; j++) {
+                scores[j] = expf(scores[j] - maxValue);
+                sum += scores[j];
+            }
+            for (int j = 0; j < k1; j++) {
+                for (int l = 0; l < dim; l++) {
+                    output[(h * q1 + i) * dim + l] += scores[j] / sum * vh[j * dim + l];
+                }
+            }
+        }
+    }
+}
+
+// 融合attention和原来的实现对比: 因果mask, 整行被mask, alibi (alibi时传入的mask不生效)
+void callFusedAttentionOp(bool useAlibi, bool maskFullRow){
+    int heads = 4, q1 = 5, k1 = 9, dim = 16;
+    std::vector <float> vq = randomFloats(heads * q1 * dim, 1), vk = randomFloats(heads * k1 * dim, 2), vv = randomFloats(heads * k1 * dim, 3);
+    std::vector <float> vmask(q1 * k1, 0.0f), valibi;
+    for (int i = 0; i < q1; i++) {
+        for (int j = k1 - q1 + i + 1; j < k1; j++) {
+            vmask[i * k1 + j] = 1.0f;
+        }
+    }
+    if (maskFullRow) {
+        std::fill(vmask.begin(), vmask.begin() + k1, 1.0f);
+    }
+    fastllm::Data alibi;
+    if (useAlibi) {
+        valibi = {-0.5f, -0.25f, -0.125f, -0.0625f};
+        alibi.CopyFrom(fastllm::Data(fastllm::DataType::FLOAT32, {heads}, valibi));
+    }
+    fastllm::Data q = fastllm::Data(fastllm::DataType::FLOAT32, {heads, q1, dim}, vq);
+    fastllm::Data k = fastllm::Data(fastllm::DataType::FLOAT32, {heads, k1, dim}, vk);
+    fastllm::Data v = fastllm::Data(fastllm::DataType::FLOAT32, {heads, k1, dim}, vv);
+    fastllm::Data mask = fastllm::Data(fastllm::DataType::FLOAT32, {q1, k1}, vmask);
+    float scale = 1.0f / sqrt(dim);
+    fastllm::Data output;
+    std::vector <float> expected;
+    fastllm::FusedAttention(q, k, v, mask, alibi, output, 1, scale);
+    referenceAttention(vq, vk, vv, vmask, valibi, heads, 1, q1, k1, dim, scale, expected);
+    output.ToDevice(fastllm::DataDevice::CPU);
+    checkClose(std::string("FusedAttention") + (useAlibi ? " alibi" : "") + (maskFullRow ? " fully masked row" : ""),
+               (float*)output.cpuData, expected.data(), expected.size(), 1e-4);
+}
+
+// 把[heads, len, dim]的kv分两次追加到cache中 (前firstLen个token, 然后是剩下的)
+void appendKVCache(fastllm::Data &cache, const std::vector <float> &values, int heads, int len, int dim, int firstLen){
+    for (int st = 0; st < len; ) {
+        int cnt = (st == 0 ? std::min(firstLen, len) : len - st);
+        std::vector <float> part;
+        for (int h = 0; h < heads; h++) {
+            part.insert(part.end(), values.begin() + (h * len + st) * dim, values.begin() + (h * len + st + cnt) * dim);
+        }
+        fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {heads, cnt, dim}, part);
+        fastllm::PrepareKVCache(cache, input);
+        fastllm::CatDirect(cache, input, 1);
+        st += cnt;
+    }
+}
+
+// 分页KV cache (跨越多个block) 上的Attention / FusedAttention和连续存放的cache对比
+void callPagedAttentionOp(bool fused){
+    int heads = 2, q1 = 3, k1 = 37, dim = 16;
+    std::vector <float> vq = randomFloats(heads * q1 * dim, 4), vk = randomFloats(heads * k1 * dim, 5), vv = randomFloats(heads * k1 * dim, 6);
+    std::vector <float> vmask(q1 * k1, 0.0f), expected;
+    for (int i = 0; i < q1; i++) {
+        for (int j = k1 - q1 + i + 1; j < k1; j++) {
+            vmask[i * k1 + j] = 1.0f;
+        }
+    }
+    fastllm::Data q = fastllm::Data(fastllm::DataType::FLOAT32, {heads, q1, dim}, vq);
+    fastllm::Data mask = fastllm::Data(fastllm::DataType::FLOAT32, {q1, k1}, vmask);
+    float scale = 1.0f / sqrt(dim);
+    referenceAttention(vq, vk, vv, vmask, {}, heads, 1, q1, k1, dim, scale, expected);
+
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetKVCacheBlockLen(16);
+    fastllm::Data outputs[2];
+    for (int paged = 0; paged < 2; paged++) {
+        fastllm::SetPagedKVCache(paged);
+        fastllm::Data k = fastllm::Data(fastllm::DataType::FLOAT32), v = fastllm::Data(fastllm::DataType::FLOAT32);
+        appendKVCache(k, vk, heads, k1, dim, k1 - q1);
+        appendKVCache(v, vv, heads, k1, dim, k1 - q1);
+        if ((k.pagedKVCache != nullptr) != (paged == 1)) {
+            failedChecks++;
+            printf("paged kv cache was not created as requested FAILED\n");
+        }
+        if (fused) {
+            fastllm::FusedAttention(q, k, v, mask, fastllm::Data(), outputs[paged], 1, scale);
+        } else {
+            fastllm::Attention(q, k, v, mask, outputs[paged], 1, scale, 1);
+        }
+        outputs[paged].ToDevice(fastllm::DataDevice::CPU);
+    }
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+    std::string name = fused ? "FusedAttention" : "Attention";
+    checkClose(name + " contiguous kv cache", (float*)outputs[0].cpuData, expected.data(), expected.size(), 1e-4);
+    checkClose(name + " paged kv cache", outputs[1], outputs[0], 1e-5);
+}
+
+// 重复执行同样的一组op (每次都新建中间结果), 预热之后不应该再向系统申请内存
+void callMemoryPoolOp(){
+    int n = 4, m = 64, k = 96;
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, randomFloats(n * m, 7));
+    fastllm::Data weight = fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, randomFloats(k * m, 8));
+    fastllm::Data bias = fastllm::Data(fastllm::DataType::FLOAT32, {k}, randomFloats(k, 9));
+    auto step = [&]() {
+        fastllm::Data hidden, activated;
+        fastllm::Linear(input, weight, bias, hidden);
+        fastllm::Silu(hidden, activated);
+        fastllm::AddTo(activated, hidden);
+    };
+    for (int i = 0; i < 3; i++) {
+        step();
+    }
+    fastllm::CpuMemoryStats before = fastllm::GetCpuMemoryStats();
+    for (int i = 0; i < 10; i++) {
+        step();
+    }
+    fastllm::CpuMemoryStats after = fastllm::GetCpuMemoryStats();
+    uint64_t systemMallocs = after.systemMallocs - before.systemMallocs;
+    bool ok = !fastllm::GetCpuMemoryPool() || (systemMallocs == 0 && after.mallocCalls > before.mallocCalls);
+    failedChecks += !ok;
+    printf("CpuMemoryPool steady state: %llu system mallocs in %llu mallocs %s\n", (unsigned long long)systemMallocs,
+           (unsigned long long)(after.mallocCalls - before.mallocCalls), ok ? "ok" : "FAILED");
+}
+
+// float权重的Linear (多行输入时走分块的矩阵乘法) 和逐元素计算的结果对比
+void callFloatLinearOp(int n){
+    int m = 320, k = 48;
+    std::vector <float> weights = randomFloats(k * m, 13), inputs = randomFloats(n * m, 14), biases = randomFloats(k, 15);
+    std::vector <float> expected(n * k);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < k; j++) {
+            float sum = biases[j];
+            for (int l = 0; l < m; l++) {
+                sum += inputs[i * m + l] * weights[j * m + l];
+            }
+            expected[i * k + j] = sum;
+        }
+    }
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, inputs);
+    fastllm::Data weight = fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, weights);
+    fastllm::Data bias = fastllm::Data(fastllm::DataType::FLOAT32, {k}, biases);
+    fastllm::Data output;
+    fastllm::Linear(input, weight, bias, output);
+    output.ToDevice(fastllm::DataDevice::CPU);
+    checkClose("Linear FLOAT32 n = " + std::to_string(n), (float*)output.cpuData, expected.data(), expected.size(), 1e-3);
+}
+
+// 把量化后的Linear权重还原成float, 作为量化Linear的参考
+std::vector <float> dequantizeWeight(fastllm::Data &weight){
+    int k = weight.dims[0], m = weight.dims[1];
+    bool isGroup = (weight.dataType == fastllm::DataType::INT4_GROUP || weight.dataType == fastllm::DataType::INT8_GROUP);
+    bool isInt4 = (weight.dataType == fastllm::DataType::INT4_NOZERO || weight.dataType == fastllm::DataType::INT4_GROUP);
+    std::vector <float> ret(k * m);
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < m; j++) {
+            int p = i * m + j;
+            uint8_t value = isInt4 ? ((p % 2 == 0) ? (weight.cpuData[p / 2] >> 4) : (weight.cpuData[p / 2] & 0xF)) : weight.cpuData[p];
+            auto &config = weight.perChannelsConfigs[isGroup ? i * weight.group + j / weight.groupCnt : i];
+            ret[p] = config.invQuantization(value);
+        }
+    }
+    return ret;
+}
+
+// 量化权重的Linear (逐通道 / 分组, 单行和多行输入) 和还原后的float权重对比, 误差只来自输入的量化
+void callQuantLinearOp(fastllm::DataType dataType, int n){
+    int m = 320, k = 48;
+    std::vector <float> weights = randomFloats(k * m, 10), inputs = randomFloats(n * m, 11);
+    fastllm::WeightMap weightMap;
+    weightMap.AddWeight("weight", {k, m}, dataType, fastllm::WeightType::LINEAR, fastllm::DataType::FLOAT32, (uint8_t*)weights.data());
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, inputs);
+    fastllm::Data bias = fastllm::Data(fastllm::DataType::FLOAT32, {k}, randomFloats(k, 12));
+    fastllm::Data floatWeight = fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, dequantizeWeight(weightMap["weight"]));
+    fastllm::Data output, expected;
+    fastllm::Linear(input, weightMap["weight"], bias, output);
+    fastllm::Linear(input, floatWeight, bias, expected);
+    float maxAbs = 0.0f;
+    for (int i = 0; i < expected.Count(0); i++) {
+        maxAbs = std::max(maxAbs, fabsf(((float*)expected.cpuData)[i]));
+    }
+    static const std::map <fastllm::DataType, std::string> names = {
+        {fastllm::DataType::INT8, "INT8"}, {fastllm::DataType::INT4_NOZERO, "INT4_NOZERO"},
+        {fastllm::DataType::INT8_GROUP, "INT8_GROUP"}, {fastllm::DataType::INT4_GROUP, "INT4_GROUP"}
+    };
+    checkClose("Linear " + names.at(dataType) + " n = " + std::to_string(n), output, expected, maxAbs * 0.02f);
+}
+
+// 预排成panel格式的Linear权重和逐行存放的同一个权重结果一致, 还原之后字节完全相同
+// k为奇数, m不是段长的整数倍: 覆盖凑不满panel的最后一个输出通道和每行末尾不足一段的部分
+void callPackedLinearOp(fastllm::DataType dataType, int n){
+    int m = 340, k = 47;
+    std::vector <float> weights = randomFloats(k * m, 21), inputs = randomFloats(n * m, 22);
+    std::vector <uint16_t> halfWeights(k * m);
+    for (int i = 0; i < k * m; i++) {
+        halfWeights[i] = fastllm::float_to_half(weights[i]);
+    }
+    fastllm::WeightMap weightMap;
+    for (std::string name : {"packed", "plain"}) {
+        if (dataType == fastllm::DataType::FLOAT16) {
+            weightMap.AddWeight(name, {k, m}, dataType, fastllm::WeightType::LINEAR, dataType, (uint8_t*)halfWeights.data());
+        } else {
+            weightMap.AddWeight(name, {k, m}, dataType, fastllm::WeightType::LINEAR, fastllm::DataType::FLOAT32, (uint8_t*)weights.data());
+        }
+    }
+    weightMap.linearNames.insert("packed");
+    weightMap.PrepackLinearWeights();
+    fastllm::Data &packed = weightMap["packed"], &plain = weightMap["plain"];
+    static const std::map <fastllm::DataType, std::string> names = {
+        {fastllm::DataType::FLOAT32, "FLOAT32"}, {fastllm::DataType::FLOAT16, "FLOAT16"},
+        {fastllm::DataType::INT8, "INT8"}, {fastllm::DataType::INT4_NOZERO, "INT4_NOZERO"},
+        {fastllm::DataType::INT8_GROUP, "INT8_GROUP"}, {fastllm::DataType::INT4_GROUP, "INT4_GROUP"}
+    };
+    std::string name = "Linear packed " + names.at(dataType) + " n = " + std::to_string(n);
+    bool ok = packed.linearPacked && !plain.linearPacked && memcmp(packed.cpuData, plain.cpuData, plain.GetBytes()) != 0;
+    failedChecks += !ok;
+    printf("%s: packed %s\n", name.c_str(), ok ? "ok" : "FAILED");
+
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, inputs);
+    fastllm::Data bias = fastllm::Data(fastllm::DataType::FLOAT32, {k}, randomFloats(k, 23));
+    fastllm::Data output, expected;
+    fastllm::Linear(input, packed, bias, output);
+    fastllm::Linear(input, plain, bias, expected);
+    float maxAbs = 0.0f;
+    for (int i = 0; i < expected.Count(0); i++) {
+        maxAbs = std::max(maxAbs, fabsf(((float*)expected.cpuData)[i]));
+    }
+    // 单行输入时逐行存放的权重走逐通道计算, 量化权重的输入量化方式不同
+    bool isFloat = (dataType == fastllm::DataType::FLOAT32 || dataType == fastllm::DataType::FLOAT16);
+    checkClose(name, output, expected, (n > 1 || isFloat) ? maxAbs * 1e-5f : maxAbs * 0.02f);
+
+    fastllm::UnpackLinearWeight(packed);
+    ok = !packed.linearPacked && memcmp(packed.cpuData, plain.cpuData, plain.GetBytes()) == 0;
+    failedChecks += !ok;
+    printf("%s: unpacked %s\n", name.c_str(), ok ? "ok" : "FAILED");
+}
+
+// 同一个输入连续做多个量化Linear时复用量化后的输入: 结果要和每次重新量化完全一致, 输入被op改写后缓存失效
+void callLinearInputCacheOp(){
+    int n = 3, m = 256, k = 32;
+    fastllm::WeightMap weightMap;
+    std::vector <float> w0 = randomFloats(k * m, 16), w1 = randomFloats(k * m, 17), w2 = randomFloats(k * m, 18);
+    weightMap.AddWeight("w0", {k, m}, fastllm::DataType::INT8, fastllm::WeightType::LINEAR, fastllm::DataType::FLOAT32, (uint8_t*)w0.data());
+    weightMap.AddWeight("w1", {k, m}, fastllm::DataType::INT8, fastllm::WeightType::LINEAR, fastllm::DataType::FLOAT32, (uint8_t*)w1.data());
+    weightMap.AddWeight("w2", {k, m}, fastllm::DataType::INT4_GROUP, fastllm::WeightType::LINEAR, fastllm::DataType::FLOAT32, (uint8_t*)w2.data());
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, randomFloats(n * m, 19));
+    fastllm::Data delta = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, randomFloats(n * m, 20));
+
+    fastllm::Data outputs[3], expected[3], fresh;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 3; i++) {
+            fastllm::Linear(input, weightMap["w" + std::to_string(i)], fastllm::Data(), outputs[i]);
+        }
+        fresh.CopyFrom(input);
+        for (int i = 0; i < 3; i++) {
+            fastllm::Data copy;
+            copy.CopyFrom(fresh);
+            fastllm::Linear(copy, weightMap["w" + std::to_string(i)], fastllm::Data(), expected[i]);
+            checkClose("Linear cached input w" + std::to_string(i) + (round ? " after AddTo" : ""), outputs[i], expected[i], 0.0f);
+        }
+        fastllm::AddTo(input, delta);
+    }
+}
+
+// 融合的op和拆开调用的结果对比: AddToRMSNorm, LinearSiluMul, Linear的激活函数
+void callFusedOp(int n){
+    int m = 64, k = 96;
+    std::vector <float> residual = randomFloats(n * m, 21);
+    fastllm::Data input0 = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, residual);
+    fastllm::Data input1 = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, randomFloats(n * m, 22));
+    fastllm::Data normWeight = fastllm::Data(fastllm::DataType::FLOAT32, {m}, randomFloats(m, 23));
+    fastllm::Data normOutput, expectedNorm;
+    fastllm::Data expectedSum = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, residual);
+    fastllm::AddToRMSNorm(input0, input1, normWeight, 1e-5, normOutput, 0.5f);
+    fastllm::AddTo(expectedSum, input1, 0.5f);
+    fastllm::RMSNorm(expectedSum, normWeight, 1e-5, expectedNorm);
+    std::string suffix = " n = " + std::to_string(n);
+    checkClose("AddToRMSNorm residual" + suffix, input0, expectedSum, 1e-5);
+    checkClose("AddToRMSNorm" + suffix, normOutput, expectedNorm, 1e-4);
+
+    fastllm::Data weight = fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, randomFloats(k * m, 24));
+    fastllm::Data bias = fastllm::Data(fastllm::DataType::FLOAT32, {k}, randomFloats(k, 25));
+    fastllm::Data gate = fastllm::Data(fastllm::DataType::FLOAT32, {n, k}, randomFloats(n * k, 26));
+    fastllm::Data output, expected, activated;
+    fastllm::LinearSiluMul(normOutput, weight, bias, gate, output);
+    fastllm::Linear(normOutput, weight, bias, expected);
+    fastllm::Silu(gate, activated);
+    fastllm::MulTo(expected, activated);
+    checkClose("LinearSiluMul" + suffix, output, expected, 1e-4);
+
+    std::vector <std::pair <fastllm::LinearActivation, std::string> > activations = {
+        {fastllm::LinearActivationSilu, "Silu"}, {fastllm::LinearActivationGeluNew, "GeluNew"},
+        {fastllm::LinearActivationSwiglu, "Swiglu"}
+    };
+    for (auto &it : activations) {
+        fastllm::Data fused, linear, unfused;
+        fastllm::Linear(normOutput, weight, bias, fused, it.first);
+        fastllm::Linear(normOutput, weight, bias, linear);
+        if (it.first == fastllm::LinearActivationSilu) {
+            fastllm::Silu(linear, unfused);
+        } else if (it.first == fastllm::LinearActivationGeluNew) {
+            fastllm::GeluNew(linear, unfused);
+        } else {
+            fastllm::Swiglu(linear, unfused);
+        }
+        checkClose("Linear + " + it.second + suffix, fused, unfused, 1e-4);
+    }
+}
+
+// GQA: kv只有heads / group个head, 不复制kv直接计算, 和按组共享kv的参考实现对比
+void callGroupAttentionOp(int group, bool paged){
+    int heads = 4, kvHeads = heads / group, q1 = 3, k1 = 21, dim = 16;
+    std::vector <float> vq = randomFloats(heads * q1 * dim, 30), vk = randomFloats(kvHeads * k1 * dim, 31), vv = randomFloats(kvHeads * k1 * dim, 32);
+    std::vector <float> vmask(q1 * k1, 0.0f), expected;
+    for (int i = 0; i < q1; i++) {
+        for (int j = k1 - q1 + i + 1; j < k1; j++) {
+            vmask[i * k1 + j] = 1.0f;
+        }
+    }
+    float scale = 1.0f / sqrt(dim);
+    referenceAttention(vq, vk, vv, vmask, {}, heads, group, q1, k1, dim, scale, expected);
+
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetPagedKVCache(paged);
+    fastllm::SetKVCacheBlockLen(16);
+    fastllm::Data k = fastllm::Data(fastllm::DataType::FLOAT32), v = fastllm::Data(fastllm::DataType::FLOAT32);
+    appendKVCache(k, vk, kvHeads, k1, dim, k1 - q1);
+    appendKVCache(v, vv, kvHeads, k1, dim, k1 - q1);
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+
+    fastllm::Data q = fastllm::Data(fastllm::DataType::FLOAT32, {heads, q1, dim}, vq);
+    fastllm::Data mask = fastllm::Data(fastllm::DataType::FLOAT32, {q1, k1}, vmask);
+    fastllm::Data output, fusedOutput;
+    fastllm::Attention(q, k, v, mask, output, group, scale, 1);
+    fastllm::FusedAttention(q, k, v, mask, fastllm::Data(), fusedOutput, group, scale);
+    std::string name = " group = " + std::to_string(group) + (paged ? " paged" : "");
+    output.ToDevice(fastllm::DataDevice::CPU);
+    fusedOutput.ToDevice(fastllm::DataDevice::CPU);
+    checkClose("Attention" + name, (float*)output.cpuData, expected.data(), expected.size(), 1e-4);
+    checkClose("FusedAttention" + name, (float*)fusedOutput.cpuData, expected.data(), expected.size(), 1e-4);
+}
+
+// FP16 / INT8存储的分页KV cache: 读回的每个token和写入的值一致 (在量化误差内), attention结果和float的接近
+void callQuantKVCacheOp(fastllm::DataType kvType){
+    int heads = 2, q1 = 3, k1 = 37, dim = 16;
+    std::vector <float> vq = randomFloats(heads * q1 * dim, 27), vk = randomFloats(heads * k1 * dim, 28), vv = randomFloats(heads * k1 * dim, 29);
+    std::vector <float> vmask(q1 * k1, 0.0f), expected;
+    for (int i = 0; i < q1; i++) {
+        for (int j = k1 - q1 + i + 1; j < k1; j++) {
+            vmask[i * k1 + j] = 1.0f;
+        }
+    }
+    float scale = 1.0f / sqrt(dim);
+    referenceAttention(vq, vk, vv, vmask, {}, heads, 1, q1, k1, dim, scale, expected);
+
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::DataType oldType = fastllm::GetKVCacheType();
+    fastllm::SetPagedKVCache(true);
+    fastllm::SetKVCacheBlockLen(16);
+    fastllm::SetKVCacheType(kvType);
+    fastllm::Data k = fastllm::Data(fastllm::DataType::FLOAT32), v = fastllm::Data(fastllm::DataType::FLOAT32);
+    appendKVCache(k, vk, heads, k1, dim, k1 - q1);
+    appendKVCache(v, vv, heads, k1, dim, k1 - q1);
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+    fastllm::SetKVCacheType(oldType);
+
+    bool isInt8 = (kvType == fastllm::DataType::INT8);
+    std::string name = isInt8 ? "INT8" : "FLOAT16";
+    if (k.pagedKVCache == nullptr) {
+        failedChecks++;
+        printf("%s kv cache is not paged FAILED\n", name.c_str());
+        return;
+    }
+    std::vector <float> stored(vk.size());
+    for (int h = 0; h < heads; h++) {
+        for (int t = 0; t < k1; t++) {
+            uint8_t *row = k.pagedKVCache->GetToken(h, t);
+            float *dst = stored.data() + (h * k1 + t) * dim;
+            for (int i = 0; i < dim; i++) {
+                if (isInt8) {
+                    float rowScale;
+                    memcpy(&rowScale, row + dim, sizeof(float));
+                    dst[i] = ((int8_t*)row)[i] * rowScale;
+                } else {
+                    dst[i] = fastllm::half_to_float(((uint16_t*)row)[i]);
+                }
+            }
+        }
+    }
+    checkClose(name + " kv cache round trip", stored.data(), vk.data(), vk.size(), isInt8 ? 2e-2 : 2e-3);
+
+    fastllm::Data q = fastllm::Data(fastllm::DataType::FLOAT32, {heads, q1, dim}, vq);
+    fastllm::Data mask = fastllm::Data(fastllm::DataType::FLOAT32, {q1, k1}, vmask);
+    fastllm::Data output;
+    fastllm::FusedAttention(q, k, v, mask, fastllm::Data(), output, 1, scale);
+    output.ToDevice(fastllm::DataDevice::CPU);
+    checkClose("FusedAttention " + name + " kv cache", (float*)output.cpuData, expected.data(), expected.size(), isInt8 ? 5e-2 : 5e-3);
+}
+
+// 读出[heads, len, dim]的kv cache (分页或者连续存放)
+std::vector <float> readKVCache(fastllm::Data &cache){
+    int heads = cache.dims[0], len = cache.dims[1], dim = cache.dims[2];
+    std::vector <float> ret((uint64_t)heads * len * dim);
+    for (int h = 0; h < heads; h++) {
+        for (int t = 0; t < len; t++) {
+            const float *row = cache.pagedKVCache != nullptr ? (const float*)cache.pagedKVCache->GetToken(h, t) :
+                               (const float*)cache.cpuData + (uint64_t)h * cache.strides[0] + (uint64_t)t * cache.strides[1];
+            memcpy(ret.data() + ((uint64_t)h * len + t) * dim, row, dim * sizeof(float));
+        }
+    }
+    return ret;
+}
+
+// [heads, len, dim]的kv中每个head的前len个token
+std::vector <float> prefixKV(const std::vector <float> &values, int heads, int total, int len, int dim){
+    std::vector <float> ret;
+    for (int h = 0; h < heads; h++) {
+        ret.insert(ret.end(), values.begin() + (uint64_t)h * total * dim, values.begin() + ((uint64_t)h * total + len) * dim);
+    }
+    return ret;
+}
+
+// 两层的kv cache, 第i层的key, value为values[i * 2], values[i * 2 + 1]
+void buildPastKeyValues(std::vector <std::pair <fastllm::Data, fastllm::Data> > &pastKeyValues,
+                        const std::vector <std::vector <float> > &values, int heads, int len, int dim){
+    pastKeyValues.clear();
+    for (int i = 0; i < (int)values.size() / 2; i++) {
+        pastKeyValues.push_back(std::make_pair(fastllm::Data(fastllm::DataType::FLOAT32), fastllm::Data(fastllm::DataType::FLOAT32)));
+    }
+    for (int i = 0; i < (int)values.size(); i++) {
+        fastllm::Data &cache = (i % 2 == 0) ? pastKeyValues[i / 2].first : pastKeyValues[i / 2].second;
+        appendKVCache(cache, values[i], heads, len, dim, len);
+    }
+}
+
+// kv cache的每层都等于values的前len个token
+bool sameKVCache(std::vector <std::pair <fastllm::Data, fastllm::Data> > &pastKeyValues,
+                 const std::vector <std::vector <float> > &values, int heads, int total, int len, int dim){
+    for (int i = 0; i < (int)values.size(); i++) {
+        fastllm::Data &cache = (i % 2 == 0) ? pastKeyValues[i / 2].first : pastKeyValues[i / 2].second;
+        if (cache.dims.size() != 3 || cache.dims[1] != len || readKVCache(cache) != prefixKV(values[i], heads, total, len, dim)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void checkTrue(const std::string &name, bool ok){
+    failedChecks += !ok;
+    printf("%s: %s\n", name.c_str(), ok ? "ok" : "FAILED");
+}
+
+// 前缀缓存的插入, 按block匹配, 命中后截断和追加不影响缓存, 超出预算时按LRU淘汰叶子
+void callPrefixCacheOp(){
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetPagedKVCache(true);
+    fastllm::SetKVCacheBlockLen(16);
+    int heads = 2, len = 40, dim = 8, layers = 2;
+    std::vector <std::vector <float> > valuesA, valuesB, valuesC;
+    for (int i = 0; i < layers * 2; i++) {
+        valuesA.push_back(randomFloats(heads * len * dim, 70 + i));
+        valuesB.push_back(randomFloats(heads * len * dim, 80 + i));
+        valuesC.push_back(randomFloats(heads * len * dim, 90 + i));
+    }
+    std::vector <int> tokensA, tokensB, tokensC;
+    for (int i = 0; i < len; i++) {
+        tokensA.push_back(i);
+        tokensB.push_back(100 + i);
+        tokensC.push_back(200 + i);
+    }
+    fastllm::KVCacheBlockPool *pool = nullptr;
+    int usedBlocks = 0;
+    {
+        fastllm::PrefixCache cache;
+        std::vector <std::pair <fastllm::Data, fastllm::Data> > pkv, matched, held;
+        buildPastKeyValues(pkv, valuesA, heads, len, dim);
+        pool = pkv[0].first.pagedKVCache->pool;
+        usedBlocks = pool->GetTotalBlocks() - pool->GetFreeBlocks() - layers * 2 * 3;
+        long long nodeBytes = layers * 2 * pool->blockBytes;
+
+        cache.Insert(tokensA, len, pkv);
+        pkv.clear();
+        checkTrue("PrefixCache insert full blocks only", cache.GetMetrics().nodes == 2 && cache.GetMetrics().usedBytes == 2 * nodeBytes);
+
+        auto match = [&](std::vector <int> tokens, int diverge, int maxLen) {
+            for (int i = diverge; i < (int)tokens.size(); i++) {
+                tokens[i] = 1000 + i;
+            }
+            matched.assign(layers, std::make_pair(fastllm::Data(fastllm::DataType::FLOAT32), fastllm::Data(fastllm::DataType::FLOAT32)));
+            return cache.Match(tokens, maxLen, matched);
+        };
+        checkTrue("PrefixCache match two blocks", match(tokensA, 35, len) == 32 && sameKVCache(matched, valuesA, heads, len, 32, dim));
+        checkTrue("PrefixCache match diverging in second block", match(tokensA, 20, len) == 16 && sameKVCache(matched, valuesA, heads, len, 16, dim));
+        checkTrue("PrefixCache match limited by maxLen", match(tokensA, len, 20) == 16);
+        checkTrue("PrefixCache miss", match(tokensB, len, len) == 0 && matched[0].first.dims.size() == 0);
+        buildPastKeyValues(pkv, valuesB, heads, len, dim);
+        checkTrue("PrefixCache non-empty kv cache", cache.Match(tokensA, len, pkv) == 0 && readKVCache(pkv[0].first) == valuesB[0]);
+
+        // 命中的cache截断到block中间再追加, 缓存中的block不变
+        match(tokensA, len, len);
+        for (int i = 0; i < layers * 2; i++) {
+            fastllm::Data &data = (i % 2 == 0) ? matched[i / 2].first : matched[i / 2].second;
+            data.pagedKVCache->Truncate(20);
+            data.Resize({heads, 20, dim});
+            appendKVCache(data, valuesC[i], heads, 8, dim, 8);
+        }
+        match(tokensA, len, len);
+        checkTrue("PrefixCache blocks unchanged after truncate", sameKVCache(matched, valuesA, heads, len, 32, dim));
+
+        // 预算为3个block: 插入B时淘汰A的叶子, 之后匹配过的A比B新, 插入C时淘汰B的叶子
+        match(tokensA, len, len);
+        held.swap(matched);
+        cache.SetBudget(3 * nodeBytes);
+        cache.Insert(tokensB, 32, pkv);
+        pkv.clear();
+        fastllm::PrefixCacheMetrics metrics = cache.GetMetrics();
+        checkTrue("PrefixCache evicts least recently used leaf", metrics.nodes == 3 && metrics.evictedBlocks == 1 &&
+                  match(tokensA, len, len) == 16 && match(tokensB, len, len) == 32);
+        match(tokensA, len, len);
+        buildPastKeyValues(pkv, valuesC, heads, 16, dim);
+        cache.Insert(tokensC, 16, pkv);
+        pkv.clear();
+        checkTrue("PrefixCache evicts after access order", cache.GetMetrics().evictedBlocks == 2 &&
+                  match(tokensB, len, len) == 16 && match(tokensA, len, len) == 16 && match(tokensC, len, len) == 16);
+        checkTrue("PrefixCache evicted blocks still held", sameKVCache(held, valuesA, heads, len, 32, dim));
+
+        metrics = cache.GetMetrics();
+        checkTrue("PrefixCache metrics", metrics.insertedBlocks == 5 && metrics.hits > 0 && metrics.hitTokens > 0 &&
+                  metrics.lookups > metrics.hits);
+        cache.SetBudget(0);
+        metrics = cache.GetMetrics();
+        checkTrue("PrefixCache disabled", !cache.Enabled() && metrics.nodes == 0 && metrics.usedBytes == 0 &&
+                  match(tokensC, len, len) == 0);
+    }
+    checkTrue("PrefixCache releases all blocks", pool->GetTotalBlocks() - pool->GetFreeBlocks() == usedBlocks);
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+}
+
+// kv cache换出到磁盘再换回, 分页cache换回时使用新的block大小
+void callKVSwapOp(bool paged){
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetPagedKVCache(paged);
+    fastllm::SetKVCacheBlockLen(16);
+    int heads = 2, len = 40, dim = 8, layers = 2, more = 5;
+    std::vector <std::vector <float> > values, full;
+    for (int i = 0; i < layers * 2; i++) {
+        values.push_back(randomFloats(heads * len * dim, 100 + i));
+    }
+    std::vector <std::pair <fastllm::Data, fastllm::Data> > pkv;
+    buildPastKeyValues(pkv, values, heads, len, dim);
+
+    std::string name = std::string("KVSwap ") + (paged ? "paged" : "contiguous");
+    fastllm::SwappedKVCache swapped;
+    swapped.SwapOut(pkv);
+    bool released = true;
+    for (auto &it : pkv) {
+        released &= (it.first.dims.size() == 0 && it.first.pagedKVCache == nullptr && it.second.dims.size() == 0 &&
+                     it.second.pagedKVCache == nullptr && it.first.dataType == fastllm::DataType::FLOAT32);
+    }
+    checkTrue(name + " swap out", released && swapped.IsSwapped() && swapped.GetLen() == len &&
+              swapped.GetBytes() == (long long)layers * 2 * heads * len * dim * sizeof(float));
+
+    fastllm::SetKVCacheBlockLen(8);
+    swapped.SwapIn(pkv);
+    bool restored = !swapped.IsSwapped() && sameKVCache(pkv, values, heads, len, len, dim);
+    for (auto &it : pkv) {
+        restored &= ((it.first.pagedKVCache != nullptr) == paged && (!paged || it.first.pagedKVCache->blockLen == 8));
+    }
+    checkTrue(name + " swap in", restored);
+
+    // 换回之后还可以继续追加
+    for (int i = 0; i < layers * 2; i++) {
+        fastllm::Data &cache = (i % 2 == 0) ? pkv[i / 2].first : pkv[i / 2].second;
+        std::vector <float> extra = randomFloats(heads * more * dim, 110 + i), cur;
+        appendKVCache(cache, extra, heads, more, dim, more);
+        for (int h = 0; h < heads; h++) {
+            cur.insert(cur.end(), values[i].begin() + h * len * dim, values[i].begin() + (h + 1) * len * dim);
+            cur.insert(cur.end(), extra.begin() + h * more * dim, extra.begin() + (h + 1) * more * dim);
+        }
+        full.push_back(cur);
+    }
+    checkTrue(name + " append after swap in", sameKVCache(pkv, full, heads, len + more, len + more, dim));
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+}
+
+// 按定义逐步实现的采样分布: 惩罚和温度, top_k, typical_p, top_p, min_p, 每一步都完整排序
+void referenceSamplingProbs(const std::vector <float> &logits, const fastllm::GenerationConfig &config,
+                            const fastllm::LastTokensUnit &tokens, std::vector <std::pair <int, float> > &probs){
+    int vocab = logits.size();
+    std::vector <std::pair <double, int> > cand;
+    for (int i = 0; i < vocab; i++) {
+        double x = logits[i];
+        auto it = tokens.tokenCounts.find(i);
+        if (it != tokens.tokenCounts.end()) {
+            if (fabs(config.repeat_penalty - 1.0) > 1e-6) {
+                x = (x < 0 ? x * config.repeat_penalty : x / config.repeat_penalty);
+            }
+            x -= config.frequency_penalty * it->second + config.presence_penalty;
+        }
+        cand.push_back(std::make_pair(x / config.temperature, i));
+    }
+    auto greater = [](const std::pair <double, int> &a, const std::pair <double, int> &b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    auto normalize = [&]() {
+        std::vector <double> p;
+        double sum = 0.0;
+        for (auto &it : cand) {
+            p.push_back(exp(it.first - cand[0].first));
+            sum += p.back();
+        }
+        for (auto &x : p) {
+            x /= sum;
+        }
+        return p;
+    };
+    std::sort(cand.begin(), cand.end(), greater);
+    cand.resize(std::max(1, std::min(vocab, config.top_k)));
+
+    if (config.typical_p < 1.0f && cand.size() > 1) {
+        std::vector <double> p = normalize();
+        double entropy = 0.0;
+        for (double x : p) {
+            entropy -= x * log(x);
+        }
+        std::vector <std::pair <double, int> > order;
+        for (int i = 0; i < (int)cand.size(); i++) {
+            order.push_back(std::make_pair(fabs(-log(p[i]) - entropy), i));
+        }
+        std::sort(order.begin(), order.end());
+        std::vector <std::pair <double, int> > kept;
+        double cur = 0.0;
+        for (auto &it : order) {
+            kept.push_back(cand[it.second]);
+            cur += p[it.second];
+            if (cur >= config.typical_p) {
+                break;
+            }
+        }
+        std::sort(kept.begin(), kept.end(), greater);
+        cand.swap(kept);
+    }
+
+    if (config.top_p < 1.0f) {
+        std::vector <double> p = normalize();
+        double cur = 0.0;
+        int keep = 0;
+        while (keep < (int)cand.size()) {
+            cur += p[keep++];
+            if (cur > config.top_p) {
+                break;
+            }
+        }
+        cand.resize(keep);
+    }
+
+    if (config.min_p > 0.0f) {
+        int keep = cand.size();
+        while (keep > 1 && cand[keep - 1].first < cand[0].first + log(config.min_p)) {
+            keep--;
+        }
+        cand.resize(keep);
+    }
+
+    std::vector <double> p = normalize();
+    probs.clear();
+    for (int i = 0; i < (int)cand.size(); i++) {
+        probs.push_back(std::make_pair(cand[i].second, (float)p[i]));
+    }
+}
+
+// 按probs的分布统计samples次采样中每个token出现的频率, 返回和probs的最大偏差
+float samplingFrequencyDiff(const std::vector <std::pair <int, float> > &probs, const std::vector <int> &samples){
+    std::map <int, int> counts;
+    for (int token : samples) {
+        counts[token]++;
+    }
+    float maxDiff = 0.0f;
+    for (auto &it : probs) {
+        maxDiff = std::max(maxDiff, fabsf((float)counts[it.first] / samples.size() - it.second));
+        counts.erase(it.first);
+    }
+    for (auto &it : counts) {
+        maxDiff = std::max(maxDiff, (float)it.second / samples.size());
+    }
+    return maxDiff;
+}
+
+// LLMSamplingProbs和排序实现的参考分布对比, 固定seed的采样可以复现且符合分布
+void callSamplingProbsOp(){
+    int vocab = 1000;
+    std::vector <float> logits = randomFloats(vocab, 120, 3.0f);
+    fastllm::LastTokensUnit tokens(64);
+    for (int token : {3, 3, 7, 42, 42, 42, 500, 999}) {
+        tokens.Push(token);
+    }
+    // top_k, top_p, temperature, min_p, typical_p, repeat_penalty, frequency_penalty, presence_penalty
+    std::vector <std::vector <float> > configs = {
+        {1, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 0.0f},
+        {50, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 0.0f},
+        {1000, 0.8f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 0.0f},
+        {200, 0.9f, 0.7f, 0.05f, 1.0f, 1.0f, 0.0f, 0.0f},
+        {1000, 1.0f, 1.3f, 0.0f, 0.7f, 1.0f, 0.0f, 0.0f},
+        {100, 0.95f, 1.0f, 0.01f, 0.9f, 1.0f, 0.0f, 0.0f},
+        {300, 0.9f, 0.8f, 0.0f, 1.0f, 1.3f, 0.5f, 0.3f},
+        {5000, 1.0f, 1.5f, 0.2f, 1.0f, 1.1f, 0.2f, 0.0f}
+    };
+    for (auto &c : configs) {
+        fastllm::GenerationConfig config;
+        config.top_k = (int)c[0];
+        config.top_p = c[1];
+        config.temperature = c[2];
+        config.min_p = c[3];
+        config.typical_p = c[4];
+        config.repeat_penalty = c[5];
+        config.frequency_penalty = c[6];
+        config.presence_penalty = c[7];
+        config.seed = 11;
+        std::vector <std::pair <int, float> > probs, expected;
+        fastllm::LLMSamplingProbs(logits.data(), vocab, config, tokens, probs);
+        referenceSamplingProbs(logits, config, tokens, expected);
+        char name[200];
+        sprintf(name, "LLMSamplingProbs top_k %d top_p %g temperature %g min_p %g typical_p %g penalties %g %g %g (%d tokens)",
+                config.top_k, config.top_p, config.temperature, config.min_p, config.typical_p,
+                config.repeat_penalty, config.frequency_penalty, config.presence_penalty, (int)expected.size());
+        bool sameTokens = probs.size() == expected.size();
+        std::vector <float> a, b;
+        for (int i = 0; sameTokens && i < (int)probs.size(); i++) {
+            sameTokens = (probs[i].first == expected[i].first);
+            a.push_back(probs[i].second);
+            b.push_back(expected[i].second);
+        }
+        if (!sameTokens) {
+            failedChecks++;
+            printf("%s: %d tokens kept, token order FAILED\n", name, (int)probs.size());
+            continue;
+        }
+        checkClose(name, a.data(), b.data(), a.size(), 1e-5);
+
+        // 同样的(seed, step)得到同样的token, 多步采样的频率符合分布
+        std::vector <int> samples, again;
+        for (int step = 0; step < 20000; step++) {
+            samples.push_back(fastllm::LLMSamplingFromProbs(probs, config, step));
+        }
+        for (int step = 0; step < 100; step++) {
+            again.push_back(fastllm::LLMSamplingFromProbs(probs, config, step));
+        }
+        float diff = samplingFrequencyDiff(probs, samples);
+        checkTrue(std::string("LLMSamplingFromProbs seeded frequency diff ") + std::to_string(diff),
+                  diff < 0.02f && std::equal(again.begin(), again.end(), samples.begin()));
+    }
+}
+
+// 投机采样: draft按q提出token, 经过SpeculativeSampling之后的分布等于目标分布p
+void callSpeculativeSamplingOp(){
+    std::vector <std::pair <int, float> > p = {{0, 0.5f}, {1, 0.3f}, {2, 0.15f}, {3, 0.05f}};
+    std::vector <std::pair <int, float> > q = {{1, 0.6f}, {0, 0.2f}, {4, 0.2f}};
+    fastllm::GenerationConfig config;
+    config.seed = 5;
+    std::vector <int> samples, same, again;
+    int accepted = 0;
+    for (int step = 0; step < 20000; step++) {
+        int draft = fastllm::LLMSamplingFromProbs(q, config, step, 3);
+        int token = fastllm::SpeculativeSampling(p, q, draft, config, step);
+        samples.push_back(token);
+        accepted += (token == draft);
+        same.push_back(fastllm::SpeculativeSampling(p, p, fastllm::LLMSamplingFromProbs(p, config, step, 3), config, step));
+    }
+    for (int step = 0; step < 100; step++) {
+        again.push_back(fastllm::SpeculativeSampling(p, q, fastllm::LLMSamplingFromProbs(q, config, step, 3), config, step));
+    }
+    float diff = samplingFrequencyDiff(p, samples);
+    // 接受率为sum(min(p, q)) = 0.5
+    checkTrue(std::string("SpeculativeSampling frequency diff ") + std::to_string(diff) + ", accepted " + std::to_string(accepted),
+              diff < 0.02f && fabsf(accepted / 20000.0f - 0.5f) < 0.02f && std::equal(again.begin(), again.end(), samples.begin()));
+    bool allAccepted = true;
+    for (int step = 0; step < (int)same.size(); step++) {
+        allAccepted &= (same[step] == fastllm::LLMSamplingFromProbs(p, config, step, 3));
+    }
+    checkTrue("SpeculativeSampling accepts every draft token when p == q", allAccepted);
+    bool rejected = true;
+    for (int step = 0; step < 1000; step++) {
+        rejected &= (fastllm::SpeculativeSampling(p, q, 4, config, step) != 4);
+    }
+    checkTrue("SpeculativeSampling rejects tokens with p == 0", rejected);
+}
+
+// 由一小段语料构造词表: 单字节, 部分<0xXX>字节token和语料中的随机子串
+fastllm::Tokenizer *buildTestTokenizer(fastllm::Tokenizer::TokenizerType type, const std::vector <std::string> &corpus) {
+    std::mt19937 rng(type + 17);
+    fastllm::Tokenizer *tokenizer = new fastllm::Tokenizer();
+    tokenizer->type = type;
+    int id = 0;
+    auto add = [&](const std::string &s, float score) {
+        if (tokenizer->stringToTokenDict.find(s) == tokenizer->stringToTokenDict.end()) {
+            tokenizer->Insert(s, id++, score);
+        }
+    };
+    for (int c = 0; c < 256; c++) {
+        if (type == fastllm::Tokenizer::QWEN || c < 128 || rng() % 2) {
+            add(std::string(1, (char)c), -(float)(rng() % 50));
+        }
+    }
+    if (type != fastllm::Tokenizer::QWEN) {
+        for (int c = 0; c < 256; c += 3) {
+            char byteToken[8];
+            sprintf(byteToken, "<0x%02X>", c);
+            add(byteToken, 0.0f);
+        }
+    }
+    for (int i = 0; i < 2000; i++) {
+        const std::string &text = corpus[rng() % corpus.size()];
+        add(text.substr(rng() % text.size(), 2 + rng() % 6), (float)(rng() % 1000) / 10.0f);
+    }
+    return tokenizer;
+}
+
+std::string randomText(std::mt19937 &rng, const std::vector <std::string> &words, int len) {
+    const char *others[] = {" ", "  ", "中", "é", "😀", "\xff", "<FLM_FIX_TOKEN_12>"};
+    std::string ret;
+    while ((int)ret.size() < len) {
+        int r = rng() % 10;
+        ret += (r < 6 ? words[rng() % words.size()] : r < 8 ? std::string(1, (char)('a' + rng() % 26)) : others[rng() % 7]);
+    }
+    return ret;
+}
+
+// flatTrie编码和逐节点查找的旧实现逐token对比
+void callTokenizerEncodeOp(fastllm::Tokenizer::TokenizerType type){
+    std::mt19937 rng(type + 3);
+    std::vector <std::string> words = {"hello", "world", "the", "token", "izer", "ing", "中文", "abc", "ab", "bc",
+                                       "\xe2\x96\x81", "\xc4\xa0"};
+    std::vector <std::string> corpus;
+    for (int i = 0; i < 20; i++) {
+        corpus.push_back(randomText(rng, words, 200));
+    }
+    fastllm::Tokenizer *tokenizer = buildTestTokenizer(type, corpus);
+    int mismatches = 0, cases = 100;
+    for (int i = 0; i < cases; i++) {
+        std::string text = randomText(rng, words, 1 + rng() % 1000);
+        // 旧的QWEN实现会把新出现的子串写进stringToTokenDict, 对比后恢复
+        auto dictBackup = tokenizer->stringToTokenDict;
+        tokenizer->useFlatTrie = false;
+        fastllm::Data expected = tokenizer->Encode(text);
+        tokenizer->useFlatTrie = true;
+        fastllm::Data output = tokenizer->Encode(text);
+        tokenizer->stringToTokenDict = dictBackup;
+        if (expected.Count(0) != output.Count(0) ||
+            memcmp(expected.cpuData, output.cpuData, expected.Count(0) * sizeof(float)) != 0) {
+            mismatches++;
+        }
+    }
+    delete tokenizer;
+    failedChecks += (mismatches != 0);
+    printf("Tokenizer type %d FlatEncode: %d / %d mismatches %s\n", type, mismatches, cases, mismatches == 0 ? "ok" : "FAILED");
+}
+
+// 检查字符串中没有被截断的UTF-8字符
+bool isCompleteUtf8(const std::string &s) {
+    for (size_t i = 0; i < s.size(); ) {
+        uint8_t c = s[i];
+        size_t len = (c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4);
+        if (i + len > s.size()) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+// StreamDecoder每次输出的增量拼起来应该和整段DecodeTokens一致, 且每段增量都是完整的字符
+// 空格标记被<0xXX>拆开时DecodeTokens整段解码会替换它, 逐token解码不会, 这时和逐token解码的结果对比
+void callStreamDecoderOp(fastllm::Tokenizer::TokenizerType type){
+    std::mt19937 rng(type + 5);
+    fastllm::Tokenizer *tokenizer = new fastllm::Tokenizer();
+    tokenizer->type = type;
+    int id = 0;
+    for (int c = 0; c < 256; c++) {
+        char byteToken[8];
+        sprintf(byteToken, "<0x%02X>", c);
+        tokenizer->Insert(byteToken, id++);
+    }
+    std::vector <std::string> words = {"中文", "hello", "\xe2\x96\x81world", "\xc4\xa0x", "é", "😀", "<n>", "ab"};
+    for (auto &word : words) {
+        tokenizer->Insert(word, id++);
+    }
+    int mismatches = 0, brokenDeltas = 0, cases = 200;
+    for (int i = 0; i < cases; i++) {
+        if (i == cases / 2) {
+            // 前一半直接解码 (Insert之后没有构建tokenPieces), 后一半查表
+            tokenizer->BuildTokenPieces();
+        }
+        bool splitBlank = (i % 2 == 1);
+        std::vector <int> tokens;
+        for (int j = 0; j < 20; j++) {
+            const std::string &word = words[rng() % words.size()];
+            bool isBlank = (word[0] == '\xe2' || word[0] == '\xc4');
+            if (rng() % 2 == 0) {
+                tokens.push_back(rng() % 128);
+            } else if ((uint8_t)word[0] >= 0x80 && rng() % 2 && (splitBlank || !isBlank)) {
+                for (unsigned char c : word) {
+                    tokens.push_back(c);
+                }
+            } else {
+                tokens.push_back(tokenizer->stringToTokenDict[word]);
+            }
+        }
+        std::string expected;
+        if (splitBlank) {
+            for (int token : tokens) {
+                expected += tokenizer->DecodeTokens({token});
+            }
+        } else {
+            expected = tokenizer->DecodeTokens(tokens);
+        }
+        fastllm::StreamDecoder decoder(tokenizer);
+        std::string output;
+        for (int token : tokens) {
+            std::string delta = decoder.Push(token);
+            brokenDeltas += !isCompleteUtf8(delta);
+            output += delta;
+        }
+        output += decoder.Flush();
+        mismatches += (output != expected);
+    }
+    delete tokenizer;
+    bool ok = (mismatches == 0 && brokenDeltas == 0);
+    failedChecks += !ok;
+    printf("Tokenizer type %d StreamDecoder: %d / %d mismatches, %d broken deltas %s\n", type, mismatches, cases,
+           brokenDeltas, ok ? "ok" : "FAILED");
+}
+
+void writeInt(FILE *file, int v) {
+    fwrite(&v, sizeof(int), 1, file);
+}
+
+void writeString(FILE *file, const std::string &s) {
+    writeInt(file, (int)s.size());
+    fwrite(s.data(), 1, s.size(), file);
+}
+
+// 按旧格式 (versionId = 2, 权重头和数据交错存放, 没有对齐和索引) 写出模型文件
+void writeModelFileV2(fastllm::WeightMap &weightMap, const std::string &fileName) {
+    FILE *file = fopen(fileName.c_str(), "wb");
+    writeInt(file, 2);
+    writeInt(file, (int)weightMap.dicts.size());
+    for (auto &it : weightMap.dicts) {
+        writeString(file, it.first);
+        writeString(file, it.second);
+    }
+    writeInt(file, (int)weightMap.tokenizer.tokenToStringDict.size());
+    for (auto &it : weightMap.tokenizer.tokenToStringDict) {
+        writeInt(file, (int)it.second.size());
+        for (char c : it.second) {
+            writeInt(file, (int)c);
+        }
+        writeInt(file, it.first);
+        float score = weightMap.tokenizer.tokenToScoreDict[it.first];
+        fwrite(&score, sizeof(float), 1, file);
+    }
+    writeInt(file, (int)weightMap.weight.size());
+    for (auto &it : weightMap.weight) {
+        fastllm::Data &data = it.second;
+        writeString(file, it.first);
+        writeInt(file, (int)data.dims.size());
+        for (int dim : data.dims) {
+            writeInt(file, dim);
+        }
+        writeInt(file, (int)data.dataType);
+        if (!data.perChannelsConfigs.empty()) {
+            writeInt(file, data.perChannelAxis);
+            if (data.dataType == fastllm::DataType::INT4_GROUP || data.dataType == fastllm::DataType::INT8_GROUP) {
+                writeInt(file, data.group);
+                writeInt(file, data.groupCnt);
+            }
+            for (auto &config : data.perChannelsConfigs) {
+                fwrite(&config.min, sizeof(float), 1, file);
+                fwrite(&config.max, sizeof(float), 1, file);
+            }
+        }
+        fwrite(data.cpuData, 1, data.GetBytes(), file);
+    }
+    fclose(file);
+}
+
+// 两个模型的权重, 量化参数, 词表, 字典逐项对比
+// INT4_NOZERO的min在LowBitConfig中已经按zeroPoint取整过, 存储后再由min, max计算会有偏差, compareInt4Configs = false时不比较它的量化参数
+int compareWeightMap(fastllm::WeightMap &a, fastllm::WeightMap &b, bool compareInt4Configs) {
+    int mismatches = (a.dicts != b.dicts) + (a.tokenizer.tokenToStringDict != b.tokenizer.tokenToStringDict) +
+                     (a.tokenizer.tokenToScoreDict != b.tokenizer.tokenToScoreDict) + (a.weight.size() != b.weight.size());
+    for (auto &it : a.weight) {
+        fastllm::Data &x = it.second, &y = b[it.first];
+        if (x.dataType != y.dataType || x.dims != y.dims || x.perChannelsConfigs.size() != y.perChannelsConfigs.size() ||
+            memcmp(x.cpuData, y.cpuData, x.GetBytes()) != 0) {
+            mismatches++;
+            continue;
+        }
+        if (x.dataType == fastllm::DataType::INT4_NOZERO && !compareInt4Configs) {
+            continue;
+        }
+        for (int i = 0; i < (int)x.perChannelsConfigs.size(); i++) {
+            auto &cx = x.perChannelsConfigs[i], &cy = y.perChannelsConfigs[i];
+            mismatches += (cx.min != cy.min || cx.max != cy.max || cx.scale != cy.scale || cx.zeroPoint != cy.zeroPoint);
+        }
+    }
+    return mismatches;
+}
+
+// 各种类型的权重按旧格式 (versionId = 2) 和新格式 (versionId = 3) 存储再读出, 旧格式读出的要和内存中的权重一致,
+// 新格式读出的 (普通读取和mmap) 要和旧格式读出的完全一致
+void callModelFileOp(){
+    fastllm::WeightMap weightMap;
+    weightMap.AddDict("model_type", "llama");
+    weightMap.AddDict("tokenizer_use_score", "1");
+    for (int i = 0; i < 300; i++) {
+        weightMap.AddTokenizerWord("token" + std::to_string(i), i, i * 0.5f);
+    }
+    int k = 48, m = 320;
+    std::vector <float> values = randomFloats(k * m, 30);
+    std::vector <uint16_t> halfValues(k * m);
+    for (int i = 0; i < k * m; i++) {
+        halfValues[i] = fastllm::float_to_half(values[i]);
+    }
+    weightMap.AddWeight("embedding", {k, m}, fastllm::DataType::FLOAT32, fastllm::WeightType::EMBEDDING,
+                        fastllm::DataType::FLOAT32, (uint8_t*)values.data());
+    weightMap.AddWeight("norm", {m}, fastllm::DataType::FLOAT32, fastllm::WeightType::NONE,
+                        fastllm::DataType::FLOAT32, (uint8_t*)values.data());
+    weightMap.AddWeight("float16", {k, m}, fastllm::DataType::FLOAT16, fastllm::WeightType::LINEAR,
+                        fastllm::DataType::FLOAT16, (uint8_t*)halfValues.data());
+    std::vector <std::pair <std::string, fastllm::DataType> > quantTypes = {
+        {"int8", fastllm::DataType::INT8}, {"int4", fastllm::DataType::INT4_NOZERO},
+        {"int8_group", fastllm::DataType::INT8_GROUP}, {"int4_group", fastllm::DataType::INT4_GROUP}
+    };
+    for (auto &it : quantTypes) {
+        weightMap.AddWeight(it.first, {k, m}, it.second, fastllm::WeightType::LINEAR,
+                            fastllm::DataType::FLOAT32, (uint8_t*)values.data());
+    }
+
+    std::string v2File = "cppOps_model_v2.flm", v3File = "cppOps_model_v3.flm";
+    writeModelFileV2(weightMap, v2File);
+    weightMap.SaveLowBitModel(v3File, 0);
+    fastllm::WeightMap v2, v3, v3Mmap;
+    v2.LoadFromFile(v2File);
+    v3.LoadFromFile(v3File);
+    bool oldMmapWeights = fastllm::GetMmapWeights();
+    fastllm::SetMmapWeights(true);
+    v3Mmap.LoadFromFile(v3File);
+    fastllm::SetMmapWeights(oldMmapWeights);
+
+    std::vector <std::pair <std::string, int> > results = {
+        {"version 2", compareWeightMap(weightMap, v2, false)},
+        {"version 3", compareWeightMap(v2, v3, true)},
+        {"version 3 mmap", compareWeightMap(v2, v3Mmap, true)}
+    };
+    for (auto &it : results) {
+        int mismatches = it.second;
+        failedChecks += (mismatches != 0);
+        printf("Model file %s: %d mismatches %s\n", it.first.c_str(), mismatches, mismatches == 0 ? "ok" : "FAILED");
+    }
+    remove(v2File.c_str());
+    remove(v3File.c_str());
+}
+
+// 用模型定义流式转换float模型, 结果要和读入整个模型后SaveLowBitModel得到的一致; 模型中不认识的矩阵要报错
+void callConvertModelOp(){
+    fastllm::WeightMap weightMap;
+    weightMap.AddDict("model_type", "llama");
+    weightMap.AddDict("num_hidden_layers", "2");
+    weightMap.AddDict("tokenizer_use_score", "1");
+    for (int i = 0; i < 30; i++) {
+        weightMap.AddTokenizerWord("token" + std::to_string(i), i, i * 0.5f);
+    }
+    int seed = 40;
+    auto addWeight = [&](const std::string &name, const std::vector <int> &dims, fastllm::WeightType weightType) {
+        std::vector <float> values = randomFloats(dims[0] * (dims.size() > 1 ? dims[1] : 1), seed++);
+        weightMap.AddWeight(name, dims, fastllm::DataType::FLOAT32, weightType, fastllm::DataType::FLOAT32, (uint8_t*)values.data());
+    };
+    addWeight("model.embed_tokens.weight", {30, 64}, fastllm::WeightType::EMBEDDING);
+    for (int i = 0; i < 2; i++) {
+        std::string pre = "model.layers." + std::to_string(i);
+        addWeight(pre + ".self_attn.q_proj.weight", {64, 64}, fastllm::WeightType::LINEAR);
+        addWeight(pre + ".mlp.down_proj.weight", {64, 96}, fastllm::WeightType::LINEAR);
+        addWeight(pre + ".input_layernorm.weight", {64}, fastllm::WeightType::NONE);
+    }
+    addWeight("lm_head.weight", {30, 64}, fastllm::WeightType::LINEAR);
+
+    std::string floatFile = "cppOps_convert_float.flm", savedFile = "cppOps_convert_saved.flm",
+                convertedFile = "cppOps_convert_converted.flm";
+    weightMap.SaveLowBitModel(floatFile, 0);
+    for (auto &it : std::vector <std::pair <int, int> > {{16, -1}, {8, -1}, {4, -1}, {8, 32}, {4, 32}}) {
+        weightMap.SaveLowBitModel(savedFile, it.first, it.second);
+        auto model = fastllm::CreateEmptyLLMModel("llama");
+        model->ConvertLowBitModel(floatFile, convertedFile, it.first, it.second);
+        fastllm::WeightMap saved, converted;
+        saved.LoadFromFile(savedFile);
+        converted.LoadFromFile(convertedFile);
+        int mismatches = compareWeightMap(saved, converted, true);
+        failedChecks += (mismatches != 0);
+        printf("ConvertLowBitModel bit = %d, groupCnt = %d: %d mismatches %s\n", it.first, it.second, mismatches,
+               mismatches == 0 ? "ok" : "FAILED");
+    }
+
+    addWeight("model.unknown.weight", {8, 8}, fastllm::WeightType::LINEAR);
+    weightMap.SaveLowBitModel(floatFile, 0);
+    bool thrown = false;
+    try {
+        fastllm::CreateEmptyLLMModel("llama")->ConvertLowBitModel(floatFile, convertedFile, 4);
+    } catch (...) {
+        thrown = true;
+    }
+    failedChecks += !thrown;
+    printf("ConvertLowBitModel unknown weight: %s\n", thrown ? "ok" : "FAILED");
+    remove(floatFile.c_str());
+    remove(savedFile.c_str());
+    remove(convertedFile.c_str());
+}
+
+// 构造一个两层的小llama模型, 词表为单个字符
+void buildTestLlamaModel(fastllm::LlamaModel &model){
+    int hidden = 64, inter = 128, vocab = 100;
+    model.weight.dicts["num_hidden_layers"] = "2";
+    model.weight.dicts["hidden_size"] = std::to_string(hidden);
+    model.weight.dicts["num_attention_heads"] = "4";
+    model.weight.dicts["bos_token_id"] = "1";
+    model.weight.dicts["eos_token_id"] = "-5";
+    model.InitParams();
+    int seed = 60;
+    auto addWeight = [&](const std::string &name, const std::vector <int> &dims, float scale, float base) {
+        std::vector <float> values = randomFloats(dims[0] * (dims.size() > 1 ? dims[1] : 1), seed++, scale);
+        for (auto &x : values) {
+            x += base;
+        }
+        model.weight.AddWeight(name, dims, fastllm::DataType::FLOAT32, fastllm::WeightType::LINEAR,
+                               fastllm::DataType::FLOAT32, (uint8_t*)values.data());
+    };
+    addWeight("model.embed_tokens.weight", {vocab, hidden}, 1.0f, 0.0f);
+    for (int i = 0; i < 2; i++) {
+        std::string pre = "model.layers." + std::to_string(i);
+        addWeight(pre + ".input_layernorm.weight", {hidden}, 0.1f, 1.0f);
+        addWeight(pre + ".post_attention_layernorm.weight", {hidden}, 0.1f, 1.0f);
+        for (std::string name : {"q_proj", "k_proj", "v_proj", "o_proj"}) {
+            addWeight(pre + ".self_attn." + name + ".weight", {hidden, hidden}, 0.2f, 0.0f);
+        }
+        addWeight(pre + ".mlp.gate_proj.weight", {inter, hidden}, 0.2f, 0.0f);
+        addWeight(pre + ".mlp.up_proj.weight", {inter, hidden}, 0.2f, 0.0f);
+        addWeight(pre + ".mlp.down_proj.weight", {hidden, inter}, 0.2f, 0.0f);
+    }
+    addWeight("model.norm.weight", {hidden}, 0.1f, 1.0f);
+    addWeight("lm_head.weight", {vocab, hidden}, 0.5f, 0.0f);
+    fastllm::Tokenizer &tokenizer = model.weight.tokenizer;
+    tokenizer.type = fastllm::Tokenizer::BPE;
+    int id = 0;
+    for (int c = 32; c < 127 && id < 95; c++, id++) {
+        tokenizer.Insert(std::string(1, (char)c), id, -id);
+    }
+    tokenizer.Insert("\xe2\x96\x81", id++, 0.0f);
+    while (id < vocab) {
+        tokenizer.Insert("<unused" + std::to_string(id) + ">", id, 0.0f);
+        id++;
+    }
+}
+
+std::vector <int> fetchAllTokens(fastllm::basellm &model, int handleId){
+    std::vector <int> ret;
+    for (int token; (token = model.FetchResponseTokens(handleId)) != -1; ) {
+        ret.push_back(token);
+    }
+    return ret;
+}
+
+// 会话开启前缀缓存时, 第二轮prompt在已缓存的block中间和之前的token分叉: 截断kv时不能改写缓存中共享的block
+// 第二轮的输出要和不用缓存时一致, 再次请求第一轮的prompt时命中的缓存也要和第一轮的输出一致
+void callSessionPrefixCacheOp(){
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetPagedKVCache(true);
+    fastllm::SetKVCacheBlockLen(16);
+    fastllm::GenerationConfig config;
+    config.output_token_limit = 8;
+    std::string firstInput = "the quick brown fox jumps over the lazy dog and keeps running far away";
+    std::string secondInput = "tell me more";
+
+    std::vector <int> firstTokens, firstOutput, secondOutput, expectedSecondOutput, replayOutput;
+    int keptTokens = 0;
+    for (bool usePrefixCache : {true, false}) {
+        fastllm::LlamaModel model;
+        buildTestLlamaModel(model);
+        model.prefixCache.SetBudget(usePrefixCache ? (1LL << 30) : 0);
+        int sessionId = model.CreateSession();
+        model.AppendSessionInput(sessionId, firstInput);
+        firstTokens = model.sessions[sessionId]->tokens;
+        std::vector <int> output = fetchAllTokens(model, model.LaunchSessionResponse(sessionId, config));
+        // 在第一轮的历史中插入一段文字, 让第二轮的prompt从第三个block中间开始分叉
+        model.sessions[sessionId]->history.insert(40, "qqqqqqqqqqqqqqqq");
+        model.AppendSessionInput(sessionId, secondInput);
+        keptTokens = model.sessions[sessionId]->kvLen;
+        std::vector <int> second = fetchAllTokens(model, model.LaunchSessionResponse(sessionId, config));
+        if (usePrefixCache) {
+            firstOutput = output;
+            secondOutput = second;
+            replayOutput = fetchAllTokens(model, model.LaunchResponseTokens(firstTokens, config));
+        } else {
+            expectedSecondOutput = second;
+        }
+    }
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+
+    bool ok = (keptTokens % 16 != 0 && keptTokens > 16 && secondOutput == expectedSecondOutput && replayOutput == firstOutput);
+    failedChecks += !ok;
+    printf("Session with prefix cache: kept %d tokens, second turn %s, cached first turn %s %s\n", keptTokens,
+           secondOutput == expectedSecondOutput ? "same" : "different", replayOutput == firstOutput ? "same" : "different",
+           ok ? "ok" : "FAILED");
+}
+
+// 同时提交多个请求 (batch调度, 分块prefill, 停止后重新启动调度线程), 每个请求的输出和逐个生成时一致
+void callScheduleOp(){
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetPagedKVCache(true);
+    fastllm::SetKVCacheBlockLen(16);
+    fastllm::GenerationConfig config;
+    config.output_token_limit = 12;
+    std::vector <std::vector <int> > prompts = {{1, 40, 41, 42, 43, 44, 45}, {}, {}};
+    for (int i = 0; i < 23; i++) {
+        prompts[1].push_back((i * 7 + 3) % 95);
+    }
+    for (int i = 0; i < 40; i++) {
+        prompts[2].push_back((i * 13 + 5) % 95);
+    }
+
+    fastllm::LlamaModel model;
+    buildTestLlamaModel(model);
+    model.prefixCache.SetBudget(0);
+    std::vector <std::vector <int> > expected;
+    bool limited = true;
+    for (auto &prompt : prompts) {
+        expected.push_back(fetchAllTokens(model, model.LaunchResponseTokens(prompt, config)));
+        limited &= ((int)expected.back().size() == config.output_token_limit);
+    }
+    checkTrue("Schedule output_token_limit", limited);
+
+    auto runConcurrent = [&](const std::string &name) {
+        fastllm::ScheduleMetrics before = model.GetScheduleMetrics();
+        std::vector <int> handles;
+        for (auto &prompt : prompts) {
+            handles.push_back(model.LaunchResponseTokens(prompt, config));
+        }
+        bool same = true;
+        for (int i = 0; i < (int)handles.size(); i++) {
+            same &= (fetchAllTokens(model, handles[i]) == expected[i]);
+        }
+        fastllm::ScheduleMetrics after = model.GetScheduleMetrics();
+        long long steps = after.steps - before.steps, batchSum = after.batchSum - before.batchSum;
+        checkTrue("Schedule " + name + ": " + std::to_string(steps) + " steps, " + std::to_string(batchSum) + " requests",
+                  same && batchSum > steps && after.running == 0 && after.queueDepth == 0);
+    };
+    runConcurrent("batched requests");
+    fastllm::ScheduleConfig scheduleConfig = model.GetScheduleConfig();
+    scheduleConfig.prefillChunkSize = 8;
+    scheduleConfig.maxPrefillTokens = 8;
+    model.SetScheduleConfig(scheduleConfig);
+    runConcurrent("chunked prefill");
+    model.StopMainLoop();
+    runConcurrent("restarted main loop");
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+}
+
+// 投机解码 (prompt lookup和draft模型) 的贪心输出和普通解码一致, 未被接受的token回滚kv cache
+// 设置了seed的采样可以复现
+void callSpeculativeOp(){
+    bool oldPaged = fastllm::GetPagedKVCache();
+    int oldBlockLen = fastllm::GetKVCacheBlockLen();
+    fastllm::SetPagedKVCache(true);
+    fastllm::SetKVCacheBlockLen(16);
+    fastllm::GenerationConfig config;
+    config.output_token_limit = 20;
+    std::vector <std::vector <int> > prompts = {{}, {}};
+    for (int i = 0; i < 30; i++) {
+        prompts[0].push_back(10 + i % 5);
+        prompts[1].push_back(20 + (i * i) % 11);
+    }
+
+    fastllm::LlamaModel draft, model;
+    buildTestLlamaModel(draft);
+    buildTestLlamaModel(model);
+    draft.prefixCache.SetBudget(0);
+    model.prefixCache.SetBudget(0);
+    std::vector <std::vector <int> > expected;
+    for (auto &prompt : prompts) {
+        expected.push_back(fetchAllTokens(model, model.LaunchResponseTokens(prompt, config)));
+    }
+
+    auto run = [&](const fastllm::GenerationConfig &config) {
+        std::vector <int> handles;
+        for (auto &prompt : prompts) {
+            handles.push_back(model.LaunchResponseTokens(prompt, config));
+        }
+        std::vector <std::vector <int> > outputs;
+        for (int handle : handles) {
+            outputs.push_back(fetchAllTokens(model, handle));
+        }
+        return outputs;
+    };
+    fastllm::GenerationConfig lookupConfig = config;
+    lookupConfig.speculative_tokens = 4;
+    lookupConfig.prompt_lookup_ngram = 2;
+    fastllm::ScheduleMetrics before = model.GetScheduleMetrics();
+    bool same = (run(lookupConfig) == expected);
+    fastllm::ScheduleMetrics after = model.GetScheduleMetrics();
+    long long draftTokens = after.draftTokens - before.draftTokens, acceptedTokens = after.acceptedTokens - before.acceptedTokens;
+    checkTrue("Speculative prompt lookup: " + std::to_string(acceptedTokens) + " / " + std::to_string(draftTokens) + " accepted",
+              same && draftTokens > acceptedTokens);
+
+    model.SetDraftModel(&draft);
+    fastllm::GenerationConfig draftConfig = config;
+    draftConfig.speculative_tokens = 3;
+    before = model.GetScheduleMetrics();
+    same = (run(draftConfig) == expected);
+    after = model.GetScheduleMetrics();
+    draftTokens = after.draftTokens - before.draftTokens;
+    acceptedTokens = after.acceptedTokens - before.acceptedTokens;
+    checkTrue("Speculative draft model: " + std::to_string(acceptedTokens) + " / " + std::to_string(draftTokens) + " accepted",
+              same && acceptedTokens > 0);
+
+    // 采样时draft和目标模型的分布相同, 投机解码的输出只由seed决定
+    fastllm::GenerationConfig sampleConfig = draftConfig;
+    sampleConfig.top_k = 20;
+    sampleConfig.temperature = 1.5f;
+    sampleConfig.seed = 9;
+    std::vector <std::vector <int> > first = run(sampleConfig), second = run(sampleConfig);
+    model.SetDraftModel(nullptr);
+    sampleConfig.speculative_tokens = 0;
+    std::vector <std::vector <int> > plain = run(sampleConfig), plainAgain = run(sampleConfig);
+    checkTrue("Speculative seeded sampling", first == second && plain == plainAgain && first[0].size() == 20);
+    fastllm::SetPagedKVCache(oldPaged);
+    fastllm::SetKVCacheBlockLen(oldBlockLen);
+}
+
 void testBase(){
     printf("testing BaseOp...\n");
     for (int i=0;i<6;i++){
@@ -116,12 +1531,38 @@ void testActivation(){
 void testAttention(){
     printf("testing AttentionOp...\n");
     callAttentionOp();
+    callFusedAttentionOp(false, false);
+    callFusedAttentionOp(false, true);
+    callFusedAttentionOp(true, true);
+    callPagedAttentionOp(false);
+    callPagedAttentionOp(true);
+    for (int group : {2, 4}) {
+        callGroupAttentionOp(group, false);
+        callGroupAttentionOp(group, true);
+    }
+    callQuantKVCacheOp(fastllm::DataType::FLOAT16);
+    callQuantKVCacheOp(fastllm::DataType::INT8);
     printf("test AttentionOp finished!\n");
 }
 
 void testLinaer(){
     printf("testing LinearOp...\n");
     callLinearOp();
+    callFloatLinearOp(1);
+    callFloatLinearOp(9);
+    for (auto dataType : {fastllm::DataType::INT8, fastllm::DataType::INT4_NOZERO,
+                          fastllm::DataType::INT8_GROUP, fastllm::DataType::INT4_GROUP}) {
+        for (int n : {1, 9}) {
+            callQuantLinearOp(dataType, n);
+        }
+    }
+    for (auto dataType : {fastllm::DataType::FLOAT32, fastllm::DataType::FLOAT16, fastllm::DataType::INT8,
+                          fastllm::DataType::INT4_NOZERO, fastllm::DataType::INT8_GROUP, fastllm::DataType::INT4_GROUP}) {
+        for (int n : {1, 9}) {
+            callPackedLinearOp(dataType, n);
+        }
+    }
+    callLinearInputCacheOp();
     printf("test LinearOp finished!\n");
 }
 
@@ -133,15 +1574,81 @@ void testNorm(){
     printf("test NormOp finished!\n");
 }
 
+void testMemory(){
+    printf("testing CpuMemoryPool...\n");
+    callMemoryPoolOp();
+    printf("test CpuMemoryPool finished!\n");
+}
+
+void testFusion(){
+    printf("testing FusedOp...\n");
+    callFusedOp(1);
+    callFusedOp(5);
+    printf("test FusedOp finished!\n");
+}
+
+void testTokenizer(){
+    printf("testing Tokenizer...\n");
+    for (auto type : {fastllm::Tokenizer::BPE, fastllm::Tokenizer::GPT2, fastllm::Tokenizer::QWEN}) {
+        callTokenizerEncodeOp(type);
+        callStreamDecoderOp(type);
+    }
+    printf("test Tokenizer finished!\n");
+}
+
+void testModelFile(){
+    printf("testing ModelFile...\n");
+    callModelFileOp();
+    callConvertModelOp();
+    printf("test ModelFile finished!\n");
+}
+
+void testSession(){
+    printf("testing Session...\n");
+    callSessionPrefixCacheOp();
+    printf("test Session finished!\n");
+}
+
+void testKVCache(){
+    printf("testing KVCache...\n");
+    callPrefixCacheOp();
+    callKVSwapOp(false);
+    callKVSwapOp(true);
+    printf("test KVCache finished!\n");
+}
+
+void testSampling(){
+    printf("testing Sampling...\n");
+    callSamplingProbsOp();
+    callSpeculativeSamplingOp();
+    printf("test Sampling finished!\n");
+}
+
+void testSchedule(){
+    printf("testing Schedule...\n");
+    callScheduleOp();
+    callSpeculativeOp();
+    printf("test Schedule finished!\n");
+}
+
 void testAll(){
     testBase();
     testActivation();
     testAttention();
     testNorm();
     testLinaer();
+    testFusion();
+    testMemory();
+    testTokenizer();
+    testModelFile();
+    testKVCache();
+    testSampling();
+    testSession();
+    testSchedule();
 }
 
 
 int main(){
     testAll();
+    return failedChecks == 0 ? 0 : 1;
 }
\ No newline at end of file
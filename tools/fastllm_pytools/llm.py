@@ -57,12 +57,55 @@ fastllm_lib.add_tokenizer_word_llm_model.argtype = [ctypes.c_int, ctypes.c_char_
 
 fastllm_lib.set_device_map.argtype = [ctypes.c_int, ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
 
+fastllm_lib.set_schedule_config_llm_model.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_bool]
+
+fastllm_lib.get_schedule_metrics_llm_model.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_longlong)]
+
+fastllm_lib.set_draft_model_llm_model.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int]
+
+fastllm_lib.set_prompt_lookup_llm_model.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int]
+
+fastllm_lib.set_sampling_config_llm_model.argtypes = [ctypes.c_int, ctypes.c_float, ctypes.c_float,
+                                                      ctypes.c_float, ctypes.c_float, ctypes.c_int]
+
+fastllm_lib.create_session_llm_model.argtypes = [ctypes.c_int]
+fastllm_lib.create_session_llm_model.restype = ctypes.c_int
+
+fastllm_lib.close_session_llm_model.argtypes = [ctypes.c_int, ctypes.c_int]
+
+fastllm_lib.append_session_tokens_llm_model.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+
+fastllm_lib.append_session_input_llm_model.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_char_p]
+
+fastllm_lib.launch_session_response_llm_model.argtypes = [ctypes.c_int, ctypes.c_int,
+                                                          ctypes.c_int, ctypes.c_bool, ctypes.c_float, ctypes.c_int,
+                                                          ctypes.c_float, ctypes.c_float, ctypes.c_bool,
+                                                          ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+fastllm_lib.launch_session_response_llm_model.restype = ctypes.c_int
+
+fastllm_lib.set_session_config_llm_model.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_bool]
+
+fastllm_lib.set_prefix_cache_llm_model.argtypes = [ctypes.c_int, ctypes.c_int]
+
+fastllm_lib.clear_prefix_cache_llm_model.argtypes = [ctypes.c_int]
+
+fastllm_lib.get_prefix_cache_metrics_llm_model.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_longlong)]
+
 def set_cpu_threads(threads: int):
     fastllm_lib.set_cpu_threads(threads);
 
 def get_cpu_threads() -> int:
     return fastllm_lib.get_cpu_threads();
 
+def set_cpu_affinity(pin):
+    fastllm_lib.set_cpu_affinity(ctypes.c_bool(pin));
+
+def set_numa_nodes(nodes):
+    fastllm_lib.set_numa_nodes(ctypes.c_int(nodes));
+
+def get_numa_nodes():
+    return fastllm_lib.get_numa_nodes();
+
 def print_ins_info():
     fastllm_lib.print_cpu_ins();
 
@@ -72,12 +115,53 @@ def set_cpu_kvcache(cpu_kvcache):
 def get_cpu_kvcache():
     return fastllm_lib.get_kvcache_in_cpu();
 
+def set_paged_kvcache(paged, block_len = -1):
+    fastllm_lib.set_paged_kvcache(ctypes.c_bool(paged), ctypes.c_int(block_len));
+
+def get_paged_kvcache():
+    return fastllm_lib.get_paged_kvcache();
+
+kvcache_types = {"float32": 0, "int8": 3, "float16": 7};
+
+def set_kvcache_type(kvcache_type):
+    # 分页KV cache的存储类型: "float32", "float16" 或 "int8"
+    fastllm_lib.set_kvcache_type(ctypes.c_int(kvcache_types[kvcache_type]));
+
+def get_kvcache_type():
+    type = fastllm_lib.get_kvcache_type();
+    for name, value in kvcache_types.items():
+        if (value == type):
+            return name;
+    return "float32";
+
+def set_cpu_memory_pool(enable):
+    fastllm_lib.set_cpu_memory_pool(ctypes.c_bool(enable));
+
+def get_cpu_memory_pool():
+    return fastllm_lib.get_cpu_memory_pool();
+
+def print_cpu_memory_stats():
+    fastllm_lib.print_cpu_memory_stats();
+
 def set_cpu_low_mem(low_mem):
     fastllm_lib.set_cpu_low_mem(ctypes.c_bool(low_mem));
 
 def get_cpu_low_mem():
     return fastllm_lib.get_cpu_low_mem();
 
+def set_mmap_weights(mmap_weights, warm_up = 0):
+    fastllm_lib.set_mmap_weights(ctypes.c_bool(mmap_weights), ctypes.c_int(warm_up));
+
+def get_mmap_weights():
+    return fastllm_lib.get_mmap_weights();
+
+def set_linear_weight_prepack(prepack):
+    # 加载时把Linear权重预排成CPU分块矩阵乘法的格式, 只在所有层都在CPU上计算时生效
+    fastllm_lib.set_linear_weight_prepack(ctypes.c_bool(prepack));
+
+def get_linear_weight_prepack():
+    return fastllm_lib.get_linear_weight_prepack();
+
 def set_device_map(device_map):
     devices = [];
     values = [];
@@ -363,6 +447,61 @@ class model:
             else:
                 yield response, new_history;
 
+    def create_session(self) -> int:
+        # 多轮对话的会话, 两轮之间保留kv cache, 每一轮只prefill新的输入
+        return fastllm_lib.create_session_llm_model(self.model)
+
+    def close_session(self, session: int):
+        fastllm_lib.close_session_llm_model(self.model, session)
+
+    def session_append_tokens(self, session: int, tokens: List[int]):
+        fastllm_lib.append_session_tokens_llm_model(self.model, session, len(tokens), (ctypes.c_int * len(tokens))(*tokens))
+
+    def session_stream_response(self, session: int, query: str = None,
+                                max_length: int = 8192, do_sample = True, top_p = 0.8, top_k = 1, temperature = 1.0, repeat_penalty = 1.0,
+                                one_by_one = True, stop_token_ids: List[int] = None):
+        # query不为None时按对话模板追加一轮输入, 否则接着已经追加的token生成
+        if (query is not None):
+            fastllm_lib.append_session_input_llm_model(self.model, session, query.encode())
+        stop_token_len, stop_token_list = self.stop_token_ctypes(stop_token_ids)
+        handle = fastllm_lib.launch_session_response_llm_model(self.model, session,
+                                                               ctypes.c_int(max_length), ctypes.c_bool(do_sample), ctypes.c_float(top_p), ctypes.c_int(top_k),
+                                                               ctypes.c_float(temperature), ctypes.c_float(repeat_penalty), ctypes.c_bool(False),
+                                                               stop_token_len, stop_token_list)
+        res = ""
+        ret = b''
+        fail_cnt = 0
+        while True:
+            ret += fastllm_lib.fetch_response_str_llm_model(self.model, handle)
+            cur = ""
+            try:
+                cur = ret.decode()
+                ret = b''
+            except:
+                fail_cnt += 1
+                if (fail_cnt == 20):
+                    break
+                else:
+                    continue
+            fail_cnt = 0
+            if (cur == "<flmeos>"):
+                break
+            if one_by_one:
+                yield cur
+            else:
+                res += cur
+                yield res
+
+    def session_response(self, session: int, query: str = None, **kwargs) -> str:
+        ret = ""
+        for i in self.session_stream_response(session, query, **kwargs):
+            ret += i
+        return ret
+
+    def set_session_config(self, idle_timeout: int = 600, max_mb: int = 4096, swap_to_disk: bool = True):
+        # 空闲超过idle_timeout秒, 或者所有空闲会话超过max_mb时, 把会话的kv cache换出到磁盘 (swap_to_disk = False时直接释放, 之后重新prefill)
+        fastllm_lib.set_session_config_llm_model(self.model, idle_timeout, max_mb, swap_to_disk)
+
     def set_adapter(self, name: str):
         fastllm_lib.set_adapter(self.model, str(name).encode())
     
@@ -371,3 +510,51 @@ class model:
     
     def release_memory(self):
         fastllm_lib.release_memory(self.model)
+
+    def set_schedule_config(self, policy: str = "fcfs", max_batch: int = -1, max_prefill_tokens: int = 4096,
+                            prefill_chunk_size: int = 512, preempt: bool = False):
+        # policy: "fcfs" (按到达顺序) 或 "spf" (优先短prompt); prefill_chunk_size <= 0时不分块prefill
+        # preempt: kv cache不够时把解码中的请求换出到磁盘, 让新请求先开始
+        policies = {"fcfs": 0, "spf": 1}
+        fastllm_lib.set_schedule_config_llm_model(self.model, policies[policy], max_batch, max_prefill_tokens,
+                                                  prefill_chunk_size, preempt)
+
+    def get_schedule_metrics(self) -> Dict[str, int]:
+        names = ["queue_depth", "running", "steps", "prefill_steps", "decode_steps",
+                 "batch_sum", "prefill_tokens", "decode_tokens", "swapped", "swap_outs", "swap_ins", "swap_bytes",
+                 "draft_tokens", "accepted_tokens"]
+        values = (ctypes.c_longlong * len(names))()
+        fastllm_lib.get_schedule_metrics_llm_model(self.model, values)
+        return dict(zip(names, list(values)))
+
+    def set_draft_model(self, draft, speculative_tokens: int = 4):
+        # draft: 和当前模型同词表的小模型 (model对象), None代表关闭投机解码
+        # 每步draft提出speculative_tokens个token, 当前模型一次Forward验证
+        fastllm_lib.set_draft_model_llm_model(self.model, -1 if draft is None else draft.model, speculative_tokens)
+
+    def set_prompt_lookup(self, ngram: int = 3, speculative_tokens: int = 8):
+        # 不需要draft模型: 用最后ngram个token在prompt和已生成内容中匹配, 把后续token作为投机的token (适合代码补全, RAG)
+        # ngram <= 0时关闭
+        fastllm_lib.set_prompt_lookup_llm_model(self.model, ngram, speculative_tokens)
+
+    def set_sampling_config(self, min_p: float = 0.0, typical_p: float = 1.0,
+                            frequency_penalty: float = 0.0, presence_penalty: float = 0.0, seed: int = -1):
+        # 对之后的请求生效 (和response的top_p, top_k, temperature一起使用)
+        # seed >= 0时同样的输入得到同样的输出, < 0时使用全局随机数
+        fastllm_lib.set_sampling_config_llm_model(self.model, min_p, typical_p, frequency_penalty, presence_penalty, seed)
+
+    def set_prefix_cache(self, budget_mb: int = 1024):
+        # 请求之间共享的前缀KV cache的内存上限, budget_mb <= 0时关闭
+        fastllm_lib.set_prefix_cache_llm_model(self.model, budget_mb)
+
+    def clear_prefix_cache(self):
+        fastllm_lib.clear_prefix_cache_llm_model(self.model)
+
+    def get_prefix_cache_metrics(self) -> Dict[str, int]:
+        names = ["lookups", "hits", "lookup_tokens", "hit_tokens", "inserted_blocks", "evicted_blocks",
+                 "blocks", "used_bytes", "budget_bytes"]
+        values = (ctypes.c_longlong * len(names))()
+        fastllm_lib.get_prefix_cache_metrics_llm_model(self.model, values)
+        ret = dict(zip(names, list(values)))
+        ret["hit_rate"] = ret["hit_tokens"] / max(ret["lookup_tokens"], 1)
+        return ret
@@ -12,6 +12,7 @@ def writeKeyValue(fo, key, value):
 
 fastllm_data_type_dict = {
     "int4": 8,
+    "int4g": 9,
     "int8": 3,
     "float16": 7,
     "float32": 0,
@@ -61,6 +62,29 @@ def write_int4(fo, v):
         fo.write(struct.pack('f', c_max[i][0]));
     fo.write(v.data)
 
+def write_int4g(fo, v, group_cnt = 128):
+    # 分组量化: 每行每group_cnt个元素一组, 每组单独计算min, max
+    k, m = v.shape
+    group = (m - 1) // group_cnt + 1
+    pad = group * group_cnt - m
+    g = np.pad(v, ((0, 0), (0, pad)), mode = 'edge').reshape(k, group, group_cnt)
+    c_min = np.minimum(g.min(axis = -1), 0.0)
+    c_max = np.maximum(g.max(axis = -1), 0.0)
+    c_scale = ((c_max - c_min) / 15.0).clip(1e-10, 1e100)
+    c_zero = np.round(0.0 - c_min / c_scale).clip(0, 15)
+    q = (g / np.expand_dims(c_scale, -1) + np.expand_dims(c_zero, -1) + 0.5).clip(0, 15).astype(np.uint8)
+    q = q.reshape(k, group * group_cnt)[:, :m]
+    q = q[:, 0::2] * 16 + q[:, 1::2]
+    fo.write(struct.pack('i', 9))
+    fo.write(struct.pack('i', 0))
+    fo.write(struct.pack('i', group))
+    fo.write(struct.pack('i', group_cnt))
+    for i in range(k):
+        for j in range(group):
+            fo.write(struct.pack('f', c_min[i][j]))
+            fo.write(struct.pack('f', c_max[i][j]))
+    fo.write(np.ascontiguousarray(q).data)
+
 def tofile(exportPath,
            model,
            tokenizer = None,
@@ -216,6 +240,8 @@ def tofile(exportPath,
             write_int8(fo, cur)
         elif (to_data_type == 8):
             write_int4(fo, cur)
+        elif (to_data_type == 9):
+            write_int4g(fo, cur)
         else:
             fo.write(struct.pack('i', to_data_type))
             fo.write(cur.data)
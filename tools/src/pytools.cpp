@@ -33,6 +33,23 @@ extern "C" {
         return fastllm::GetLowMemMode();
     }
 
+    DLL_EXPORT void set_mmap_weights(bool m, int warm_up) {
+        fastllm::SetMmapWeights(m);
+        fastllm::SetMmapWarmUp(warm_up);
+    }
+
+    DLL_EXPORT bool get_mmap_weights() {
+        return fastllm::GetMmapWeights();
+    }
+
+    DLL_EXPORT void set_linear_weight_prepack(bool prepack) {
+        fastllm::SetLinearWeightPrepack(prepack);
+    }
+
+    DLL_EXPORT bool get_linear_weight_prepack() {
+        return fastllm::GetLinearWeightPrepack();
+    }
+
     DLL_EXPORT void set_kvcache_in_cpu(bool in) {
         fastllm::SetKVCacheInCPU(in);
     }
@@ -41,6 +58,49 @@ extern "C" {
         return fastllm::GetKVCacheInCPU();
     }
 
+    DLL_EXPORT void set_paged_kvcache(bool paged, int block_len) {
+        fastllm::SetPagedKVCache(paged);
+        if (block_len > 0) {
+            fastllm::SetKVCacheBlockLen(block_len);
+        }
+    }
+
+    DLL_EXPORT bool get_paged_kvcache() {
+        return fastllm::GetPagedKVCache();
+    }
+
+    DLL_EXPORT void set_kvcache_type(int type) {
+        fastllm::SetKVCacheType((fastllm::DataType)type);
+    }
+
+    DLL_EXPORT int get_kvcache_type() {
+        return (int)fastllm::GetKVCacheType();
+    }
+
+    DLL_EXPORT void set_cpu_memory_pool(bool enable) {
+        fastllm::SetCpuMemoryPool(enable);
+    }
+
+    DLL_EXPORT bool get_cpu_memory_pool() {
+        return fastllm::GetCpuMemoryPool();
+    }
+
+    DLL_EXPORT void print_cpu_memory_stats() {
+        fastllm::PrintCpuMemoryStats();
+    }
+
+    DLL_EXPORT void set_cpu_affinity(bool pin) {
+        fastllm::SetThreadAffinity(pin);
+    }
+
+    DLL_EXPORT void set_numa_nodes(int nodes) {
+        fastllm::SetNumaNodes(nodes);
+    }
+
+    DLL_EXPORT int get_numa_nodes() {
+        return fastllm::GetNumaNodes();
+    }
+
     DLL_EXPORT void set_device_map(int device_cnt, int *lens, char *devices, int *values) {
         std::map <std::string, int> deviceMap;
         int cur = 0;
@@ -57,6 +117,7 @@ extern "C" {
     DLL_EXPORT struct ModelManager {
         std::mutex locker;
         std::map <int, std::unique_ptr<fastllm::basellm> > models;
+        std::map <int, fastllm::GenerationConfig> extraConfigs; // make_config参数之外的设置 (投机解码, 采样), 对模型之后的请求生效
 
         fastllm::basellm *GetModel(int handle) {
             locker.lock();
@@ -64,6 +125,22 @@ extern "C" {
             locker.unlock();
             return ret;
         }
+
+        void ApplyExtraConfig(int handle, fastllm::GenerationConfig &config) {
+            locker.lock();
+            auto it = extraConfigs.find(handle);
+            if (it != extraConfigs.end()) {
+                auto &extra = it->second;
+                config.speculative_tokens = extra.speculative_tokens;
+                config.prompt_lookup_ngram = extra.prompt_lookup_ngram;
+                config.min_p = extra.min_p;
+                config.typical_p = extra.typical_p;
+                config.frequency_penalty = extra.frequency_penalty;
+                config.presence_penalty = extra.presence_penalty;
+                config.seed = extra.seed;
+            }
+            locker.unlock();
+        }
     };
 
     static ModelManager models;
@@ -235,6 +312,7 @@ extern "C" {
                                  float temperature, float repeat_penalty, bool output_logits) {
         auto model = models.GetModel(modelId);
         auto config = make_config(max_length, do_sample, top_p, top_k, temperature, repeat_penalty, output_logits);
+        models.ApplyExtraConfig(modelId, config);
         std::string s = model->Response(content, nullptr, config);
         return string_to_chars(s);
     }
@@ -250,6 +328,7 @@ extern "C" {
             tokens.push_back((int)((float*)v.cpuData)[i]);
         }
         auto config = make_config(max_length, do_sample, top_p, top_k, temperature, repeat_penalty, output_logits);
+        models.ApplyExtraConfig(modelId, config);
         for(int i = 0; i < stop_token_len; i++ )
         {
             config.stop_token_ids.insert(stop_token_ids[i]);
@@ -273,6 +352,7 @@ extern "C" {
             input.push_back(values[i]);
         }
         auto config = make_config(max_length, do_sample, top_p, top_k, temperature, repeat_penalty, output_logits);
+        models.ApplyExtraConfig(modelId, config);
         for(int i = 0; i < stop_token_len; i++ )
         {
             config.stop_token_ids.insert(stop_token_ids[i]);
@@ -286,6 +366,125 @@ extern "C" {
         return model->FetchResponseTokens(handleId);
     }
 
+    DLL_EXPORT void set_schedule_config_llm_model(int modelId, int policy, int maxBatch, int maxPrefillTokens,
+                                                  int prefillChunkSize, bool preempt) {
+        auto model = models.GetModel(modelId);
+        fastllm::ScheduleConfig config;
+        config.policy = policy;
+        config.maxBatch = maxBatch;
+        config.maxPrefillTokens = maxPrefillTokens;
+        config.prefillChunkSize = prefillChunkSize;
+        config.preempt = preempt;
+        model->SetScheduleConfig(config);
+    }
+
+    // values: queueDepth, running, steps, prefillSteps, decodeSteps, batchSum, prefillTokens, decodeTokens,
+    //         swapped, swapOuts, swapIns, swapBytes
+    // draftId = -1时不使用投机解码; speculativeTokens: 每步draft提出的token数
+    DLL_EXPORT void set_draft_model_llm_model(int modelId, int draftId, int speculativeTokens) {
+        auto model = models.GetModel(modelId);
+        model->SetDraftModel(draftId < 0 ? nullptr : models.GetModel(draftId));
+        models.locker.lock();
+        models.extraConfigs[modelId].speculative_tokens = (draftId < 0 ? 0 : speculativeTokens);
+        models.extraConfigs[modelId].prompt_lookup_ngram = 0;
+        models.locker.unlock();
+    }
+
+    // 不用draft模型, 用最后ngram个token在prompt和已生成内容中匹配出投机的token; ngram <= 0时关闭
+    DLL_EXPORT void set_prompt_lookup_llm_model(int modelId, int ngram, int speculativeTokens) {
+        models.locker.lock();
+        models.extraConfigs[modelId].speculative_tokens = (ngram > 0 ? speculativeTokens : 0);
+        models.extraConfigs[modelId].prompt_lookup_ngram = std::max(ngram, 0);
+        models.locker.unlock();
+    }
+
+    // 采样参数, 对之后的请求生效; seed >= 0时每个请求都用这个种子
+    DLL_EXPORT void set_sampling_config_llm_model(int modelId, float min_p, float typical_p,
+                                                  float frequency_penalty, float presence_penalty, int seed) {
+        models.locker.lock();
+        auto &config = models.extraConfigs[modelId];
+        config.min_p = min_p;
+        config.typical_p = typical_p;
+        config.frequency_penalty = frequency_penalty;
+        config.presence_penalty = presence_penalty;
+        config.seed = seed;
+        models.locker.unlock();
+    }
+
+    DLL_EXPORT void get_schedule_metrics_llm_model(int modelId, long long *values) {
+        auto model = models.GetModel(modelId);
+        fastllm::ScheduleMetrics metrics = model->GetScheduleMetrics();
+        long long ret[] = {metrics.queueDepth, metrics.running, metrics.steps, metrics.prefillSteps,
+                           metrics.decodeSteps, metrics.batchSum, metrics.prefillTokens, metrics.decodeTokens,
+                           metrics.swapped, metrics.swapOuts, metrics.swapIns, metrics.swapBytes,
+                           metrics.draftTokens, metrics.acceptedTokens};
+        memcpy(values, ret, sizeof(ret));
+    }
+
+    DLL_EXPORT int create_session_llm_model(int modelId) {
+        auto model = models.GetModel(modelId);
+        return model->CreateSession();
+    }
+
+    DLL_EXPORT void close_session_llm_model(int modelId, int sessionId) {
+        auto model = models.GetModel(modelId);
+        model->CloseSession(sessionId);
+    }
+
+    DLL_EXPORT void append_session_tokens_llm_model(int modelId, int sessionId, int len, int *values) {
+        auto model = models.GetModel(modelId);
+        model->AppendSessionTokens(sessionId, std::vector <int> (values, values + len));
+    }
+
+    DLL_EXPORT void append_session_input_llm_model(int modelId, int sessionId, char *input) {
+        auto model = models.GetModel(modelId);
+        model->AppendSessionInput(sessionId, input);
+    }
+
+    DLL_EXPORT int launch_session_response_llm_model(int modelId, int sessionId,
+                                          int max_length, bool do_sample, float top_p, int top_k,
+                                          float temperature, float repeat_penalty, bool output_logits,
+                                          int stop_token_len, int * stop_token_ids) {
+        auto model = models.GetModel(modelId);
+        auto config = make_config(max_length, do_sample, top_p, top_k, temperature, repeat_penalty, output_logits);
+        models.ApplyExtraConfig(modelId, config);
+        for (int i = 0; i < stop_token_len; i++) {
+            config.stop_token_ids.insert(stop_token_ids[i]);
+        }
+        return model->LaunchSessionResponse(sessionId, config);
+    }
+
+    // idleTimeout: 秒, maxMB: 空闲会话kv cache的内存上限, <= 0代表不限制; swapToDisk: 超出时换出到磁盘还是直接释放
+    DLL_EXPORT void set_session_config_llm_model(int modelId, int idleTimeout, int maxMB, bool swapToDisk) {
+        auto model = models.GetModel(modelId);
+        fastllm::SessionConfig config;
+        config.idleTimeout = idleTimeout;
+        config.maxBytes = (long long)maxMB << 20;
+        config.swapToDisk = swapToDisk;
+        model->SetSessionConfig(config);
+    }
+
+    // budgetMB <= 0时关闭前缀缓存
+    DLL_EXPORT void set_prefix_cache_llm_model(int modelId, int budgetMB) {
+        auto model = models.GetModel(modelId);
+        model->prefixCache.SetBudget((long long)budgetMB << 20);
+    }
+
+    DLL_EXPORT void clear_prefix_cache_llm_model(int modelId) {
+        auto model = models.GetModel(modelId);
+        model->prefixCache.Clear();
+    }
+
+    // values: lookups, hits, lookupTokens, hitTokens, insertedBlocks, evictedBlocks, nodes, usedBytes, budgetBytes
+    DLL_EXPORT void get_prefix_cache_metrics_llm_model(int modelId, long long *values) {
+        auto model = models.GetModel(modelId);
+        fastllm::PrefixCacheMetrics metrics = model->prefixCache.GetMetrics();
+        long long ret[] = {metrics.lookups, metrics.hits, metrics.lookupTokens, metrics.hitTokens,
+                           metrics.insertedBlocks, metrics.evictedBlocks, metrics.nodes, metrics.usedBytes,
+                           metrics.budgetBytes};
+        memcpy(values, ret, sizeof(ret));
+    }
+
     DLL_EXPORT int fetch_response_logits_llm_model(int modelId, int handleId, float *logits) {
         auto model = models.GetModel(modelId);
         std::vector <float> retLogits;
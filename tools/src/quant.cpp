@@ -9,6 +9,7 @@ struct QuantConfig {
     std::string path; // 模型文件路径
     std::string output; // 输出文件路径
     int bits; // 量化位数
+    int groupCnt = -1; // 分组量化时每组的元素个数, -1代表按通道量化
 };
 
 void Usage() {
@@ -17,6 +18,7 @@ void Usage() {
     std::cout << "<-p|--path> <args>:               模型文件的路径" << std::endl;
     std::cout << "<-b|--bits> <args>:               量化位数, 4 = int4, 8 = int8, 16 = fp16" << std::endl;
     std::cout << "<-o|--output> <args>:             输出文件路径" << std::endl;
+    std::cout << "<-g|--group> <args>:              分组量化时每组的元素个数 (例如32, 64, 128), 默认按通道量化" << std::endl;
 }
 
 void ParseArgs(int argc, char **argv, QuantConfig &config) {
@@ -34,6 +36,8 @@ void ParseArgs(int argc, char **argv, QuantConfig &config) {
 			config.bits = atoi(sargv[++i].c_str());
 		} else if (sargv[i] == "-o" || sargv[i] == "--output") {
 			config.output = sargv[++i];
+		} else if (sargv[i] == "-g" || sargv[i] == "--group") {
+			config.groupCnt = atoi(sargv[++i].c_str());
 		} else if (sargv[i] == "-m" || sargv[i] == "--model") {
             i++;
         } else {
@@ -46,7 +50,8 @@ void ParseArgs(int argc, char **argv, QuantConfig &config) {
 int main(int argc, char **argv) {
     QuantConfig config;
     ParseArgs(argc, argv, config);
-    auto model = fastllm::CreateLLMModelFromFile(config.path);
-    model->SaveLowBitModel(config.output, config.bits);
+    // 不加载整个模型, 逐个权重读取, 量化, 写入; 只需要模型定义来确定哪些是Linear和Embedding权重
+    auto model = fastllm::CreateEmptyLLMModel(fastllm::GetModelTypeFromFile(config.path));
+    model->ConvertLowBitModel(config.path, config.output, config.bits, config.groupCnt);
     return 0;
 }
\ No newline at end of file